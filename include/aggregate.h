@@ -0,0 +1,72 @@
+/*
+ * aggregate.h - What a scan found, without keeping every host
+ * 
+ * For big scans the question is usually "what runs in 10.20.0.0/16"
+ * or "which fingerprints are most common", not one host's details.
+ * An aggregate answers those in a fixed amount of memory (about
+ * 1.3 MB) however many hosts go in:
+ * 
+ *   - hosts and hosts that answered, and the distinct addresses
+ *     (HyperLogLog, so the same host seen twice counts once)
+ *   - for every /16, how many results had a best match in each
+ *     family (OS_UNKNOWN: no match)
+ *   - the most common best matches and option signatures (count-min
+ *     with heavy hitters), and the number of distinct signatures
+ * 
+ * An option signature is the SYN-ACK's option pattern, window, MSS
+ * and window scale, like "MNWST:64240:1460:7".
+ * 
+ * Aggregates are saved as snapshot files that add up: merging the
+ * snapshots of several runs or machines gives the aggregate of all
+ * their results together.
+ */
+
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "defs.h"
+#include "matcher.h"
+#include "sketch.h"
+
+#define AGG_MAGIC    "OSFPAGG1"
+#define AGG_VERSION  2      /* 1 had no key hashes */
+#define AGG_SUBNETS  65536      /* One row per /16 */
+
+typedef struct {
+    uint64_t results;
+    uint64_t responded;
+    Hll hosts;                  /* Distinct addresses */
+    Hll signatures;             /* Distinct option signatures */
+    FreqSketch fingerprints;    /* Best matches, by name */
+    FreqSketch options;         /* Option signatures */
+    uint32_t (*subnets)[OS_TYPES];  /* Results per /16 and family of the best match */
+} Aggregate;
+
+/* A new, empty aggregate. NULL if out of memory. */
+Aggregate *agg_new(void);
+
+void agg_free(Aggregate *agg);
+
+/* Add one host's result and its best matches */
+void agg_add(Aggregate *agg, in_addr_t addr, const ScanResult *scan,
+             const Match *matches, int count);
+
+/* Add another aggregate to this one */
+void agg_merge(Aggregate *dst, const Aggregate *src);
+
+/*
+ * Save a snapshot, atomically (written beside it and renamed).
+ * Returns 0, or -1 with errno set.
+ */
+int agg_save(const Aggregate *agg, const char *path);
+
+/* Add a snapshot to an aggregate. Returns 0, or -1 with errno set (EINVAL: not one). */
+int agg_load(Aggregate *agg, const char *path);
+
+/* Print the summary, with the 'top' biggest /16s and items */
+void agg_print(const Aggregate *agg, int top);
+
+#endif
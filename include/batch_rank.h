@@ -0,0 +1,33 @@
+/*
+ * batch_rank.h - Match many observations against the database at once
+ * 
+ * rank_matches() streams the whole compiled database through the
+ * cache for every host. When a lot of hosts are matched together
+ * (say, a day of results after a database update), rank_batch()
+ * scores them in tiles instead: a group of observations against a
+ * stretch of the database small enough to stay in cache, then the
+ * next stretch. Every fingerprint is loaded once per group instead
+ * of once per host.
+ */
+
+#ifndef BATCH_RANK_H
+#define BATCH_RANK_H
+
+#include "defs.h"
+#include "matcher.h"
+#include "score_model.h"
+
+/* Observations per group, and database entries per stretch (about 140 KB) */
+#define RANK_OBS_TILE  32
+#define RANK_FP_TILE   512
+
+/*
+ * Rank 'count' observations on 'threads' threads.
+ * The best matches of scan i go to out[i * top], best first, and
+ * counts[i] says how many there are; the same as rank_matches()
+ * gives for each one. Returns 0, or -1 if out of memory.
+ */
+int rank_batch(const ScoreModel *model, const ScanResult *scans, int count, int top,
+               int threads, Match *out, int *counts);
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * checkpoint.h - Save and resume the progress of a batch scan
+ * 
+ * A scan of a few million hosts runs for hours; one that dies
+ * partway through shouldn't have to start over. Every few seconds
+ * the emitter writes down how far it got:
+ * 
+ *   - where the target stream is (its permutation and file position)
+ *   - which of the targets handed out since the oldest unfinished
+ *     one are done, as a bitmap, and the addresses of the rest
+ *   - how big the output files were with exactly those hosts in them
+ * 
+ * Every target is numbered in the order it was handed out. Targets
+ * finish out of order, but never far out of it: all of them below
+ * 'base' are done, and no more than CHECKPOINT_WINDOW are handed out
+ * past it, so the bitmap stays small however big the scan is.
+ * 
+ * A resumed run cuts the outputs back to the saved sizes, probes the
+ * unfinished targets again from scratch (their replies went with the
+ * process that died) and carries on with the stream. Hosts finished
+ * after the last checkpoint are simply scanned again.
+ * 
+ * The file is written next to its final name, synced and renamed
+ * over it, so there is always one whole checkpoint on the disk.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "targets.h"
+
+#define CHECKPOINT_MAGIC   "OSFPCKP1"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_WINDOW  (1 << 18)    /* Targets handed out past the oldest unfinished one */
+#define CHECKPOINT_SECS    10           /* Default time between checkpoints */
+
+/* Output files whose sizes are saved */
+enum { CHECKPOINT_JSON, CHECKPOINT_LOG, CHECKPOINT_OUTPUTS };
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t scan_id;           /* checkpoint_id() of the scan */
+    uint64_t seed;              /* Of the target order */
+    TargetState targets;        /* Where the target stream was */
+    int64_t outputs[CHECKPOINT_OUTPUTS];    /* File sizes, -1 = not a file */
+    uint64_t base;              /* Targets numbered below this are done */
+    uint64_t next;              /* Targets handed out */
+    uint64_t pending;           /* Of base..next-1, how many aren't done */
+    uint64_t checksum;          /* FNV-1a of everything else */
+} CheckpointHeader;
+
+/*
+ * A checkpoint. In the file, the header is followed by the bitmap
+ * (bit i for target base + i, (next - base + 7) / 8 bytes) and the
+ * addresses of the targets whose bit is clear, in order.
+ */
+typedef struct {
+    CheckpointHeader head;
+    uint8_t *done;
+    in_addr_t *pending;
+} Checkpoint;
+
+/* Fingerprint of what a scan covers, so a checkpoint isn't resumed by a different one */
+uint64_t checkpoint_id(char **specs, int count, const char *file, int port,
+                       int shard, int shards);
+
+/* Write a checkpoint atomically. Returns 0, or -1 with errno set. */
+int checkpoint_write(const char *path, Checkpoint *cp);
+
+/*
+ * Read a checkpoint. Returns 0, or -1 with errno set: ENOENT if
+ * there is none, EINVAL if it isn't a whole checkpoint.
+ */
+int checkpoint_read(const char *path, Checkpoint *cp);
+
+void checkpoint_free(Checkpoint *cp);
+
+#endif
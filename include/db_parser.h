@@ -8,9 +8,12 @@
 #include "defs.h"
 
 /* Load fingerprints from nmap database file */
-FingerprintNode *load_database(const char *path);
+FingerprintDB *load_database(const char *path);
+
+/* The same without any messages: NULL with errno set on failure */
+FingerprintDB *read_database(const char *path);
 
 /* Free all memory */
-void free_database(FingerprintNode *head);
+void free_database(FingerprintDB *db);
 
 #endif
\ No newline at end of file
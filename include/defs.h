@@ -10,6 +10,8 @@
 #ifndef DEFS_H
 #define DEFS_H
 
+#include <stdint.h>
+#include <time.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 
@@ -41,6 +43,8 @@ typedef enum {
     OS_OTHER        /* Everything else */
 } OSType;
 
+#define OS_TYPES (OS_OTHER + 1)
+
 /*
  * TCP options tell us a lot about the OS.
  * Different systems use different combinations and values.
@@ -53,12 +57,131 @@ typedef struct {
     char pattern[32];   /* The order of options like "MSTNW" */
 } TCPOpts;
 
+/*
+ * Raw TCP options as they came off the wire.
+ * Filled in a single pass by decode_tcp_options().
+ */
+#define MAX_TCP_OPTS 40     /* 40 option bytes = at most 40 options */
+
+typedef struct {
+    uint8_t count;                  /* How many options we saw */
+    uint8_t kinds[MAX_TCP_OPTS];    /* Option kinds in wire order */
+    uint16_t mss;
+    uint8_t window_scale;
+    uint8_t has_mss;
+    uint8_t has_wscale;
+    uint8_t has_sack;
+    uint8_t has_timestamp;
+    uint32_t ts_val;
+    uint32_t ts_ecr;
+} TCPOptRecord;
+
+/*
+ * The probes we send during fingerprinting, in the order we send them.
+ */
+typedef enum {
+    PROBE_T1 = 0,   /* SYN to the open port */
+    PROBE_T2,       /* NULL (no flags) */
+    PROBE_T3,       /* SYN+FIN+PSH+URG */
+    PROBE_T4,       /* ACK */
+    PROBE_T5,       /* SYN to a closed port */
+    PROBE_T6,       /* ACK to a closed port */
+    PROBE_T7,       /* FIN+PSH+URG to a closed port */
+    PROBE_COUNT
+} ProbeType;
+
+/* What the database expects for one probe (T4-T7) */
+#define FLAG_CHOICES 4      /* Alternatives in one F= value, like "AR|R" */
+
+typedef struct {
+    char responds;      /* 'Y', 'N' or 0 if unknown */
+    uint8_t flag_count; /* How many in flags; 0 if unknown */
+    uint8_t flags[FLAG_CHOICES];    /* TH_* flags a reply may have */
+    char df_flag;       /* 'Y', 'N' or 0 if unknown */
+} ProbeExpect;
+
+/*
+ * The ICMP echo (IE) and closed UDP port (U1) probes.
+ * nmap-os-db describes the reply to U1 by how much of our packet
+ * it quotes and whether it comes back intact; each of these is a
+ * check that passes ("G" in the database) or doesn't.
+ */
+#define DFI_N   0x01    /* Neither echo reply has DF set */
+#define DFI_S   0x02    /* Both copy the DF bit of their request */
+#define DFI_Y   0x04    /* Both have DF set */
+#define DFI_O   0x08    /* Anything else */
+
+#define CD_Z    0x01    /* Both reply codes are zero */
+#define CD_S    0x02    /* Both copy the code of their request */
+#define CD_O    0x04    /* Anything else */
+
+#define QUOTE_RIPL   0x01   /* Quoted IP length is what we sent */
+#define QUOTE_RID    0x02   /* Quoted IP ID */
+#define QUOTE_RIPCK  0x04   /* Quoted IP checksum */
+#define QUOTE_RUCK   0x08   /* Quoted UDP checksum */
+#define QUOTE_RUD    0x10   /* Quoted UDP data */
+#define QUOTE_UN     0x20   /* The unused ICMP field is zero */
+#define QUOTE_CHECKS 6
+
+/* What the database expects for IE */
+typedef struct {
+    char responds;      /* 'Y', 'N' or 0 if unknown */
+    int dfi;            /* DFI_* values allowed, 0 if unknown */
+    int cd;             /* CD_* values allowed, 0 if unknown */
+} EchoExpect;
+
+/* What the database expects for U1 */
+typedef struct {
+    char responds;      /* 'Y', 'N' or 0 if unknown */
+    char df_flag;       /* 'Y', 'N' or 0 if unknown */
+    int ipl[2];         /* Allowed lengths of the reply, -1 if unused */
+    int quote_known;    /* QUOTE_* checks the entry has a single answer for */
+    int quote_good;     /* ...and which of those have to pass */
+} UnreachExpect;
+
+/* What came back for one probe */
+typedef struct {
+    int responded;
+    int flags;          /* TH_* flags */
+    int ttl;
+    int window;
+    char df_flag;
+} ProbeReply;
+
+/*
+ * When a probe left and when its reply arrived.
+ * Both come from the kernel when it supports it (CLOCK_REALTIME),
+ * so scheduling delays in our process don't end up in the RTT.
+ */
+typedef struct {
+    struct timespec sent;
+    struct timespec received;   /* Zero if there was no reply */
+    int rtt_us;                 /* -1 if there was no reply */
+} ProbeTiming;
+
+/*
+ * One "Class" line of a fingerprint, like
+ * "Class Microsoft | Windows | 10 | general purpose"
+ */
+typedef struct {
+    char vendor[32];
+    char family[32];
+    char generation[16];
+    char device_type[32];
+} OSClass;
+
 /*
  * One entry from the nmap fingerprint database.
  * Contains the expected values for a specific OS version.
  */
 typedef struct {
     char *name;         /* OS name like "Microsoft Windows 10" */
+    int index;          /* Position in the database file */
+    
+    /* What it is, from the Class lines */
+    OSType os;
+    OSClass *classes;
+    int class_count;
     
     /* TTL info */
     int ttl_min;
@@ -78,13 +201,44 @@ typedef struct {
     char t3_responds;   /* Does it respond to weird packets? */
     char t2_responds;   /* Does it respond to empty packets? */
     
+    /* ACK probe and the closed port probes (T4-T7) */
+    ProbeExpect expect[PROBE_COUNT];
+    
+    /* ICMP echo and closed UDP port */
+    EchoExpect echo;
+    UnreachExpect unreach;
+    
 } Fingerprint;
 
-/* Linked list of fingerprints */
-typedef struct FingerprintNode {
-    Fingerprint *fp;
-    struct FingerprintNode *next;
-} FingerprintNode;
+/*
+ * The loaded database: one array, grouped by OS family.
+ * Entries of family f are entries[part_start[f]] onwards, in
+ * database order.
+ */
+typedef struct {
+    Fingerprint *entries;
+    int count;
+    int part_start[OS_TYPES];
+    int part_count[OS_TYPES];
+    struct DBArena *arena;  /* Names, option strings and classes */
+} FingerprintDB;
+
+/* The replies to the two echo requests, taken together */
+typedef struct {
+    int responded;      /* Both requests were answered */
+    int ttl;
+    int dfi;            /* One of DFI_* */
+    int cd;             /* One of CD_* */
+} EchoReply;
+
+/* The port unreachable message U1 brought back */
+typedef struct {
+    int responded;
+    int ttl;
+    char df_flag;
+    int ipl;            /* Total length of the reply */
+    int quote;          /* QUOTE_* checks that passed */
+} UnreachReply;
 
 /*
  * What we actually observed when scanning the target.
@@ -106,6 +260,21 @@ typedef struct {
     int t3_responded;   /* Weird flags probe */
     int t4_responded;   /* ACK probe */
     
+    /* Every probe's reply, including the closed port ones (T5-T7) */
+    ProbeReply reply[PROBE_COUNT];
+    int closed_port;
+    
+    /* Send and receive times for every probe */
+    ProbeTiming timing[PROBE_COUNT];
+    
+    /* Stopped waiting once the rest couldn't change the answer */
+    int stopped_early;
+    
+    /* IE and U1, sent with the port discovery SYNs (not in batch scans) */
+    int icmp_sent;
+    EchoReply echo;
+    UnreachReply unreach;
+    
 } ScanResult;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,72 @@
+/*
+ * engine.h - How probes go out and replies come back
+ * 
+ * fingerprint_target() does all its network I/O through an engine,
+ * so the way packets are moved can be swapped without touching the
+ * probe logic:
+ * 
+ *   raw    - raw sockets, one sendto()/recvmsg() per packet
+ *   uring  - io_uring: batched sends and a multishot receive into
+ *            a registered buffer ring
+ *   xdp    - AF_XDP: whole frames through a UMEM shared with the
+ *            kernel, with an XDP program picking out our replies
+ *            (xdp-generic: the same in generic mode, for any interface)
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <netinet/in.h>
+#include <time.h>
+
+/* Packets that can be queued before a flush */
+#define ENGINE_QUEUE 16
+
+/* What a scan cost */
+typedef struct {
+    long syscalls;      /* Calls made while sending and receiving */
+    long sent;
+    long send_errors;   /* Probes the kernel wouldn't send */
+    long received;
+} EngineStats;
+
+typedef struct Engine Engine;
+
+typedef struct {
+    const char *name;
+    
+    /* Open the sockets; returns NULL on failure */
+    Engine *(*open)(void);
+    
+    /* Queue a TCP packet for dst. Returns 0, or -1 if the queue is full. */
+    int (*send)(Engine *e, in_addr_t dst, const char *packet, int len);
+    
+    /* Send everything queued; sent[i] (optional) gets when packet i left */
+    int (*flush)(Engine *e, struct timespec *sent);
+    
+    /*
+     * Wait for the next IP packet until 'deadline' (CLOCK_MONOTONIC).
+     * Returns its length, or -1 on timeout. 'received' gets the
+     * kernel's receive timestamp.
+     */
+    int (*recv)(Engine *e, const struct timespec *deadline, char *buffer,
+                int size, struct timespec *received);
+    
+    void (*close)(Engine *e);
+} EngineOps;
+
+/* Every engine starts with this */
+struct Engine {
+    const EngineOps *ops;
+    EngineStats stats;
+};
+
+extern const EngineOps raw_engine;
+extern const EngineOps uring_engine;
+extern const EngineOps xdp_engine;
+extern const EngineOps xdp_generic_engine;
+
+/* Look up an engine by name, NULL if there is none */
+const EngineOps *find_engine(const char *name);
+
+#endif
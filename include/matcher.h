@@ -6,8 +6,72 @@
 #define MATCH_H
 
 #include "defs.h"
+#include "score_model.h"
+
+/* A match candidate with its score */
+typedef struct {
+    Fingerprint *fp;
+    int score;
+} Match;
+
+/*
+ * Parts of the score, one per observed value.
+ * calculate_score() adds them up; score_model.c precompiles them.
+ */
+int score_ttl(const Fingerprint *fp, OSType fp_os, int ttl);
+int score_window(const Fingerprint *fp, OSType fp_os, int window);
+int score_df(const Fingerprint *fp, char df_flag);
+int score_pattern(const Fingerprint *fp, const char *pattern);
+int score_mss(const Fingerprint *fp, int mss);
+int score_wscale(const Fingerprint *fp, int window_scale);
+int score_sack_ts(const Fingerprint *fp, int has_sack, int has_timestamp);
+int score_behavior(const Fingerprint *fp, int t2_responded, int t3_responded);
+int score_probe(const Fingerprint *fp, int probe, int responded, int flags, char df_flag);
+int score_echo(const Fingerprint *fp, int responded, int dfi, int cd);
+int score_unreach(const Fingerprint *fp, int responded, char df_flag);
+int score_ipl(const Fingerprint *fp, int ipl);
+int score_quote(const Fingerprint *fp, int quote);
+
+/* Do the TCP options take part in scoring? */
+int scan_has_options(const ScanResult *scan);
+
+/* Did anything come back to match on (T1, or IE/U1 without it)? */
+int scan_has_replies(const ScanResult *scan);
+
+/* Score one fingerprint the slow way (reference implementation) */
+int calculate_score(const Fingerprint *fp, const ScanResult *scan);
+
+/*
+ * Put a candidate into a list of at most 'max' matches kept best
+ * first. Returns the new count.
+ */
+int add_match(Match *out, int count, int max, Fingerprint *fp, int score);
+
+/*
+ * Score the whole database and keep the best 'max' matches,
+ * highest score first. Returns how many were stored in 'out'.
+ */
+int rank_matches(const ScoreModel *model, ScanResult *scan, Match *out, int max);
+
+/* "HIGH", "MEDIUM" or "LOW" for a best match, NULL if not confident */
+const char *match_confidence(const Match *best, int count);
+
+/* The same as a number: 0 if not confident, then 1 (LOW) to 3 (HIGH) */
+int match_level(const Match *best, int count);
+
+/*
+ * Incremental matching while the replies come in.
+ * inc_matcher_settled() is called with the bitmask (1 << probe) of
+ * probes answered so far and says whether anything the other probes
+ * could still send back would change the best match.
+ */
+typedef struct IncMatcher IncMatcher;
+
+IncMatcher *inc_matcher_new(const ScoreModel *model);
+int inc_matcher_settled(IncMatcher *im, const ScanResult *scan, unsigned answered);
+void inc_matcher_free(IncMatcher *im);
 
 /* Find and display the best matching OS fingerprints */
-void find_matches(FingerprintNode *db, ScanResult *scan);
+void find_matches(const ScoreModel *model, ScanResult *scan);
 
-#endif
\ No newline at end of file
+#endif
@@ -7,21 +7,88 @@
 #ifndef NETWORK_H
 #define NETWORK_H
 
+#include <netinet/in.h>
+
 #include "defs.h"
+#include "engine.h"
+
+/* Default and minimum time to wait for a reply */
+#define PROBE_TIMEOUT_MS 2000
+#define MIN_TIMEOUT_MS   100
+
+/* Open a raw socket that receives TCP replies with kernel timestamps */
+int open_listener(void);
+
+/*
+ * Build a TCP packet with options for SYNs and a checksum over the
+ * pseudo header. Returns its length (at most 60 bytes).
+ */
+int build_tcp_packet(char *packet, in_addr_t src, in_addr_t dst,
+                     int sport, int dport, int flags, uint32_t seq);
 
-/* Send a TCP packet with specific flags */
-void send_packet(const char *target, int port, int flags);
+/* Send a TCP packet with specific flags, optionally reporting when it left */
+void send_packet(const char *target, int port, int flags, struct timespec *sent);
 
-/* Wait for a response from target */
-struct tcphdr *wait_for_response(const char *target, int timeout, struct iphdr **ip_out);
+/* Wait for a response from target's port on a listener socket, into buffer */
+struct tcphdr *wait_for_response(int sock, const char *target, int port,
+                                 int timeout_ms, char *buffer, int size,
+                                 struct iphdr **ip_out, struct timespec *received);
+
+/* The TCP header of a received IP packet, or NULL if it's too short */
+struct tcphdr *tcp_header(char *buffer, int len);
+
+/* Timeout for the remaining probes once the RTT is known */
+int adaptive_timeout(int rtt_us);
 
 /* Check if a port is open */
 int is_port_open(const char *target, int port);
 
-/* Run all fingerprinting probes and fill in results */
-void fingerprint_target(const char *target, int port, ScanResult *result);
+/* How long port discovery waits for replies */
+#define DISCOVERY_TIMEOUT_MS 1000
+
+/*
+ * Send SYNs to up to 32 ports, the two ICMP echo requests (IE) and a
+ * UDP packet to a closed port (U1), all in one burst, and wait for
+ * the replies. IE and U1 go into result->echo and result->unreach,
+ * and the SYN-ACK from the returned port is recorded as T1's reply
+ * (the rest of 'result' is left alone). '*answered' gets the number
+ * of ports that answered at all. Returns the first port in the list
+ * that is open, or -1.
+ */
+int discover_target(const char *target, const int *ports, int count,
+                    ScanResult *result, int *answered);
+
+/* TH_* flags of each probe, and whether it goes to the closed port */
+int probe_flags(int probe);
+int probe_to_closed_port(int probe);
+
+/* Store a probe's reply in the scan result */
+void record_reply(ScanResult *result, int probe, struct iphdr *ip,
+                  struct tcphdr *tcp);
+
+/*
+ * Called after every reply with the bitmask (1 << probe) of probes
+ * answered so far. Return non-zero to stop waiting for the rest.
+ */
+typedef int (*ReplyCheck)(const ScanResult *result, unsigned answered, void *arg);
+
+/*
+ * Run all fingerprinting probes through 'engine' and fill in results
+ * (check may be NULL). The IE and U1 fields of 'result' are kept, so
+ * it must be zeroed or filled in by discover_target() first.
+ */
+void fingerprint_target(Engine *engine, const char *target, int port,
+                        ScanResult *result, ReplyCheck check, void *arg);
+
+/*
+ * Decode raw TCP option bytes into a record and an nmap-style string
+ * like "M5B4ST11NW7", in one bounded pass. Returns the string length.
+ */
+int decode_tcp_options(const unsigned char *p, int len, TCPOptRecord *rec,
+                       char *out_str, size_t out_len);
 
 /* Parse TCP options from a received packet */
-void read_tcp_options(struct tcphdr *tcp, char *out_str, TCPOpts *opts);
+void read_tcp_options(const struct tcphdr *tcp, char *out_str, size_t out_len,
+                      TCPOpts *opts);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,95 @@
+/*
+ * osfp.h - libosfp: fingerprint hosts from inside your own event loop
+ * 
+ * The probe engine and the matcher as a library, for programs that
+ * would rather not run os_fingerprint and parse what it prints.
+ * Apart from osfp_open() reading the database, nothing in here
+ * blocks; nothing starts a thread that outlives a call, forks or
+ * prints. Errors come back as -1 (or NULL) with errno set.
+ * 
+ * A scanner has a single file descriptor to watch. Add it to your
+ * epoll (or poll/select) set for reading; whenever it's readable,
+ * call osfp_process() and then osfp_next_result() until it returns
+ * 0. Submit targets at any time, up to max_inflight at once.
+ * 
+ *   OsfpConfig config = {"data/nmap-os-db", 0};
+ *   OsfpScanner *s = osfp_open(&config);
+ *   osfp_submit(s, inet_addr("192.168.1.10"), 22, NULL);
+ *   ... when osfp_fd(s) is readable:
+ *   osfp_process(s);
+ *   while (osfp_next_result(s, &r) > 0)
+ *       use r.matches[0].fp->name ...
+ * 
+ * Sending raw packets needs root (or CAP_NET_RAW). Link with
+ * bin/libosfp.a or bin/libosfp.so and -lm -pthread.
+ */
+
+#ifndef OSFP_H
+#define OSFP_H
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "defs.h"
+#include "matcher.h"
+
+#define OSFP_DEFAULT_DB "data/nmap-os-db"
+#define OSFP_INFLIGHT   256         /* Default targets probed at once */
+
+typedef struct OsfpScanner OsfpScanner;
+
+typedef struct {
+    const char *db_path;            /* NULL = OSFP_DEFAULT_DB */
+    int max_inflight;               /* 0 = OSFP_INFLIGHT */
+} OsfpConfig;
+
+/* One finished host */
+typedef struct {
+    char target[INET_ADDRSTRLEN];
+    in_addr_t addr;
+    int port;
+    void *user;                     /* As given to osfp_submit() */
+    ScanResult result;              /* What the probes saw */
+    Match matches[TOP_MATCHES];     /* Best first; valid until osfp_close() */
+    int count;                      /* 0 if the host didn't answer */
+    const char *confidence;         /* NULL if no match is confident */
+} OsfpResult;
+
+/*
+ * Load the database and open the sockets. Returns NULL with errno
+ * set if the database can't be read (ENOENT, ...) or compiled
+ * (ERANGE), or the sockets can't be opened (EPERM without root).
+ */
+OsfpScanner *osfp_open(const OsfpConfig *config);
+
+/* Stop everything in flight and free the scanner */
+void osfp_close(OsfpScanner *s);
+
+/* The descriptor to wait on for reading */
+int osfp_fd(const OsfpScanner *s);
+
+/*
+ * Start fingerprinting addr (network order) on an open TCP port.
+ * 'user' comes back in the result. Returns 0, or -1 with errno
+ * EAGAIN if max_inflight targets are already in flight (wait for
+ * results and try again), or EINVAL for a bad port.
+ */
+int osfp_submit(OsfpScanner *s, in_addr_t addr, int port, void *user);
+
+/*
+ * Read replies, retry or give up on what's due and collect finished
+ * hosts. Call it when osfp_fd() is readable; calling it at other
+ * times is harmless. Returns the number of results waiting.
+ */
+int osfp_process(OsfpScanner *s);
+
+/*
+ * Take the next finished host and match it against the database.
+ * Returns 1, or 0 if there are none right now.
+ */
+int osfp_next_result(OsfpScanner *s, OsfpResult *out);
+
+/* Targets in flight plus results not taken yet */
+int osfp_pending(const OsfpScanner *s);
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * output.h - Machine-readable result output
+ * 
+ * Results are written as JSON Lines: one JSON object per host,
+ * one host per line. Everything goes through a single reusable
+ * buffer so we don't allocate or call printf per field.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+
+#include "defs.h"
+#include "matcher.h"
+#include "triage.h"
+
+/* Default buffer size for bulk output */
+#define OUTBUF_SIZE (1 << 20)
+
+/* Output buffer, flushed to a file descriptor when it fills up */
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+} OutBuf;
+
+/* How long each phase of a host scan took */
+typedef struct {
+    double probe_ms;
+    double match_ms;
+    double cpu_ms;          /* CPU time spent probing */
+    const char *engine;     /* Probe engine used */
+    long syscalls;          /* System calls it made */
+} ScanTiming;
+
+/* Set up a buffer writing to fd. Returns 0 on success, -1 on error. */
+int outbuf_init(OutBuf *ob, int fd, size_t cap);
+
+/* Write out everything buffered so far */
+int outbuf_flush(OutBuf *ob);
+
+/* Flush and release the buffer (the fd is left open) */
+void outbuf_free(OutBuf *ob);
+
+/* Append one JSON record for a scanned host */
+void write_json_result(OutBuf *ob, const char *target, int port,
+                       const ScanResult *scan, const Match *matches,
+                       int count, const ScanTiming *timing);
+
+/* Append one JSON record for a host classified with -q (triage NULL if it wasn't) */
+void write_json_triage(OutBuf *ob, const char *target, int port,
+                       const ScanResult *scan, const TriageResult *triage);
+
+#endif
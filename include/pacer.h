@@ -0,0 +1,85 @@
+/*
+ * pacer.h - Rate and fairness limits for batch scans
+ * 
+ * Shared by all the probe workers of a scan:
+ * 
+ *   - A global packets per second cap, as a GCRA token bucket: one
+ *     atomic "theoretical arrival time" in nanoseconds, moved on by
+ *     a packet interval for every packet sent. A burst may run up
+ *     to PACER_BURST_NS ahead of the clock, so a worker that wakes
+ *     up late can catch up, and the rate holds on average however
+ *     the workers' wakeups fall.
+ *   - A cap on the targets in flight in each /24, so one subnet's
+ *     firewall or rate limiter doesn't see the whole scan at once.
+ *     Counters are hashed on the /24; two subnets sharing one only
+ *     makes the cap stricter.
+ *   - Backing off when replies get lost: AIMD on the share of T1
+ *     replies that only came after T1 was sent again. Dead hosts
+ *     don't count, since they never answer at all. Above
+ *     PACER_LOSS_HIGH the rate is halved, below PACER_LOSS_LOW it
+ *     climbs back by a sixteenth of the cap per window.
+ */
+
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+#define PACER_BURST_NS    4000000   /* Most a burst may run ahead of the clock */
+#define PACER_BURST_PKTS  4096      /* ... and never more packets than this */
+#define PACER_SUBNETS     65536     /* /24 counters */
+#define PACER_RETRY_NS    1000000   /* Look again this soon when a /24 is full */
+
+/* Loss feedback */
+#define PACER_WINDOW_MS   500       /* How often the rate is reconsidered: a retry interval */
+#define PACER_SAMPLES     32        /* T1 replies needed to judge a window */
+#define PACER_LOSS_HIGH   50        /* Per mille: back off above this */
+#define PACER_LOSS_LOW    10        /* Per mille: speed up below this */
+
+typedef struct {
+    long max_rate;                  /* Packets per second, 0 = no limit */
+    int subnet_cap;                 /* Targets in flight per /24, 0 = no limit */
+    
+    atomic_ulong tat;               /* ns: when the bucket is next empty */
+    atomic_ulong interval;          /* ns per packet at the current rate */
+    atomic_long rate;               /* Current rate, after backing off */
+    atomic_int *subnets;            /* In flight per /24 (hashed) */
+    
+    atomic_long replies;            /* T1 replies this window */
+    atomic_long lost;               /* ... that needed T1 to be sent again */
+    atomic_ulong next_adjust;       /* ns */
+    
+    atomic_long min_rate;           /* Lowest it went */
+    atomic_int backoffs;
+} Pacer;
+
+/* Set up a pacer. Returns 0, or -1 if it's out of memory. */
+int pacer_init(Pacer *p, long rate, int subnet_cap);
+
+void pacer_free(Pacer *p);
+
+/* Is anything limited at all? */
+static inline int pacer_active(const Pacer *p)
+{
+    return p->max_rate > 0 || p->subnet_cap > 0;
+}
+
+/*
+ * Take the tokens for n packets. Returns 0 if they can go now, or
+ * the nanoseconds to wait before asking again.
+ */
+uint64_t pacer_take(Pacer *p, int n);
+
+/* Take the tokens for n packets that go out anyway (resends): a debt */
+void pacer_charge(Pacer *p, int n);
+
+/* A target in addr's /24 starts (0), or can't yet (-1); and is done */
+int pacer_enter(Pacer *p, in_addr_t addr);
+void pacer_leave(Pacer *p, in_addr_t addr);
+
+/* T1 was answered; 'lost' if it had to be sent again first */
+void pacer_feedback(Pacer *p, int lost);
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ * probe_table.h - Outstanding probes, by the packet that answers them
+ * 
+ * A reply is found by (target address, target port, our source port),
+ * the three things a reply carries back. The table is one flat array
+ * with linear probing, so a lookup is usually a single cache line,
+ * and its size is fixed when it is made: with at most 'max' entries
+ * it is never more than half full, whatever is added and removed.
+ * 
+ * Removing shifts the entries after it back instead of leaving
+ * tombstones, so lookups don't slow down as probes come and go.
+ */
+
+#ifndef PROBE_TABLE_H
+#define PROBE_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* 16 bytes, four to a cache line */
+typedef struct {
+    uint64_t key;               /* 0 = empty (source ports are never 0) */
+    uint32_t sent_us;           /* Low bits of the send time, for the RTT */
+    uint16_t flight;            /* Whatever the caller needs to find the target */
+    uint8_t probe;              /* Probe type (PROBE_T1, ...) */
+    uint8_t retries;            /* Times it has been sent again */
+} ProbeEntry;
+
+typedef struct {
+    ProbeEntry *entries;
+    size_t mask;                /* Slots - 1 */
+    size_t count;
+    size_t max;
+    int shift;                  /* 64 - log2(slots), for the hash */
+} ProbeTable;
+
+/* Returns 0, or -1 if out of memory. Holds up to 'max' probes. */
+int probe_table_init(ProbeTable *t, size_t max);
+
+void probe_table_free(ProbeTable *t);
+
+/*
+ * Add a probe. Returns its entry to fill in, or NULL if the key is
+ * already in use (pick another source port) or the table is full.
+ */
+ProbeEntry *probe_table_add(ProbeTable *t, in_addr_t addr, int dport, int sport);
+
+/* The probe a reply belongs to, or NULL */
+ProbeEntry *probe_table_find(const ProbeTable *t, in_addr_t addr, int dport, int sport);
+
+/* Remove an entry returned by add or find. Other entries may move. */
+void probe_table_remove(ProbeTable *t, ProbeEntry *e);
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * prober.h - Probe many targets from one thread, without blocking
+ * 
+ * This is the engine under a batch scan worker and under libosfp.
+ * It keeps up to 'capacity' targets in flight, sends each one the
+ * burst of seven probes, matches the replies that come in on its
+ * receive socket, retries and gives up on its timer wheel, and hands
+ * every finished target to a callback. It never waits: the caller
+ * polls recv_sock (and sleeps no longer than prober_timeout()), then
+ * calls prober_drain() and prober_expire().
+ * 
+ * The caller opens the sockets: send_sock is a raw IPPROTO_TCP
+ * socket, recv_sock an AF_PACKET SOCK_DGRAM socket (so packets start
+ * at the IP header). prober_free() closes them. With a pacer, new
+ * targets wait for its tokens and their /24's turn, and resends are
+ * charged to it.
+ */
+
+#ifndef PROBER_H
+#define PROBER_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "defs.h"
+#include "timer_wheel.h"
+#include "probe_table.h"
+#include "pacer.h"
+
+/*
+ * Retransmission: probes that haven't been answered are sent again
+ * every RETRY_MS until T1 gets a reply, at most MAX_RETRIES times.
+ */
+#define RETRY_MS        500
+#define MAX_RETRIES     2
+
+/* Flights are numbered in 16 bits in the probe table */
+#define PROBER_MAX_INFLIGHT 65535
+
+/* A target being probed */
+typedef struct {
+    Timer timer;                /* Next retry or give-up, on the wheel */
+    int used;
+    char target[INET_ADDRSTRLEN];
+    in_addr_t addr;
+    int port;
+    void *user;                 /* The caller's, untouched */
+    uint64_t seq;               /* Same */
+    ScanResult result;
+    unsigned answered;          /* Bitmask of probes that replied */
+    uint16_t sports[PROBE_COUNT];
+    int retries;
+    uint64_t give_up;           /* Wheel time (ms) to stop waiting */
+} Flight;
+
+/*
+ * A flight is finished. Take what you need from it and return 0, or
+ * return -1 if you can't take it yet; you'll be asked again on the
+ * next tick. The flight is reused once this returns 0.
+ */
+typedef int (*FlightDone)(Flight *f, void *arg);
+
+typedef struct {
+    int send_sock;
+    int recv_sock;
+    uint64_t rng;               /* xorshift64 state */
+    
+    Flight *flights;
+    int *free_slots;            /* Stack of unused flights */
+    int free_count;
+    int capacity;
+    int inflight;
+    
+    TimerWheel wheel;
+    ProbeTable probes;          /* Probes still waiting for a reply */
+    FlightDone done;
+    void *arg;
+    
+    Pacer *pacer;               /* NULL = send as fast as targets come */
+    uint64_t pace_wait;         /* ns until prober_start() may work again */
+    
+    long packets_sent;
+    long packets_seen;
+    
+    char packets[PROBE_COUNT][128];
+    char buffer[4096];
+} Prober;
+
+/*
+ * Set up a prober for 'capacity' targets at once. The sockets start
+ * out as -1. Returns 0, or -1 if it's out of memory.
+ */
+int prober_init(Prober *p, int capacity, uint64_t seed, FlightDone done, void *arg);
+
+/* Free the prober and close its sockets */
+void prober_free(Prober *p);
+
+/*
+ * Start probing a target. Returns its flight, or NULL if all are in
+ * use or the pacer says not yet; then pace_wait says how long to wait.
+ */
+Flight *prober_start(Prober *p, in_addr_t addr, int port);
+
+/* Read and match every reply waiting on recv_sock */
+void prober_drain(Prober *p);
+
+/* Retry, give up on and finish the flights whose timers are due */
+void prober_expire(Prober *p);
+
+/* Milliseconds until prober_expire() has work, -1 if nothing is in flight */
+long prober_timeout(const Prober *p);
+
+/* CLOCK_MONOTONIC milliseconds, the prober's wheel time */
+uint64_t prober_now(void);
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * probes.h - USDT tracepoints for bpftrace and perf
+ * 
+ * Each OSFP_PROBEn(name, ...) is a static tracepoint "osfp:name" in
+ * the binary. While nothing is attached it is a single nop; bpftrace
+ * or perf turn it into a breakpoint on a running process, so no
+ * rebuild is needed to look inside a scan:
+ * 
+ *   sudo bpftrace -l 'usdt:./bin/os_fingerprint:*'
+ *   sudo bpftrace -p $(pidof os_fingerprint) scripts/probe_rtt.bt
+ * 
+ * The arguments should be cheap (values already at hand), since they
+ * are worked out either way. Addresses are in network byte order.
+ * 
+ *   probe_send      (addr, port, probe)          probe -1 = discovery SYN,
+ *                                                -2 = ICMP echo, -3 = UDP
+ *   probe_reply     (addr, probe, rtt_us)
+ *   probe_timeout   (addr, unanswered, retries)  unanswered is a probe bitmask
+ *   db_load_start   (path)
+ *   db_load_end     (entries)
+ *   match_start     (ttl, window)
+ *   match_end       (matches, best_score)
+ *   result_emit     (addr, port, score, name)    name NULL if no match
+ * 
+ * With <sys/sdt.h> (systemtap-sdt-dev) its macros are used. Without
+ * it the same ELF notes are written here on x86-64; elsewhere, or
+ * when built with -DNO_PROBES, the probes compile to nothing.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define PROBES_SDT 1
+#endif
+#endif
+
+#if defined(PROBES_SDT)
+
+#include <sys/sdt.h>
+
+#define OSFP_PROBE1(name, a)          DTRACE_PROBE1(osfp, name, a)
+#define OSFP_PROBE2(name, a, b)       DTRACE_PROBE2(osfp, name, a, b)
+#define OSFP_PROBE3(name, a, b, c)    DTRACE_PROBE3(osfp, name, a, b, c)
+#define OSFP_PROBE4(name, a, b, c, d) DTRACE_PROBE4(osfp, name, a, b, c, d)
+
+#elif !defined(NO_PROBES) && defined(__x86_64__) && defined(__GNUC__)
+
+/*
+ * The layout of a .note.stapsdt entry: the nop's address, the base
+ * used to find it after relocation, no semaphore, then the provider,
+ * the name and the argument specs ("-8@%rax" = signed 8 bytes in rax).
+ * Every argument is passed as a long.
+ */
+#define PROBE_NOTE(name, args)                                          \
+    "990: nop\n"                                                        \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                       \
+    ".balign 4\n"                                                       \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                  \
+    "991: .asciz \"stapsdt\"\n"                                         \
+    "992: .balign 4\n"                                                  \
+    "993: .8byte 990b\n"                                                \
+    ".8byte _.stapsdt.base\n"                                           \
+    ".8byte 0\n"                                                        \
+    ".asciz \"osfp\"\n"                                                 \
+    ".asciz \"" #name "\"\n"                                            \
+    ".asciz \"" args "\"\n"                                             \
+    "994: .balign 4\n"                                                  \
+    ".popsection\n"                                                     \
+    ".ifndef _.stapsdt.base\n"                                          \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n"                                            \
+    ".hidden _.stapsdt.base\n"                                          \
+    "_.stapsdt.base: .space 1\n"                                        \
+    ".size _.stapsdt.base, 1\n"                                         \
+    ".popsection\n"                                                     \
+    ".endif\n"
+
+#define PROBE_ARG(x) "nor" ((long)(x))
+
+#define OSFP_PROBE1(name, a)                                            \
+    __asm__ __volatile__(PROBE_NOTE(name, "-8@%0") :: PROBE_ARG(a))
+#define OSFP_PROBE2(name, a, b)                                         \
+    __asm__ __volatile__(PROBE_NOTE(name, "-8@%0 -8@%1")                \
+                         :: PROBE_ARG(a), PROBE_ARG(b))
+#define OSFP_PROBE3(name, a, b, c)                                      \
+    __asm__ __volatile__(PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2")          \
+                         :: PROBE_ARG(a), PROBE_ARG(b), PROBE_ARG(c))
+#define OSFP_PROBE4(name, a, b, c, d)                                   \
+    __asm__ __volatile__(PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2 -8@%3")    \
+                         :: PROBE_ARG(a), PROBE_ARG(b), PROBE_ARG(c), PROBE_ARG(d))
+
+#else
+
+#define OSFP_PROBE1(name, a)          ((void)(a))
+#define OSFP_PROBE2(name, a, b)       ((void)(a), (void)(b))
+#define OSFP_PROBE3(name, a, b, c)    ((void)(a), (void)(b), (void)(c))
+#define OSFP_PROBE4(name, a, b, c, d) ((void)(a), (void)(b), (void)(c), (void)(d))
+
+#endif
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * result_log.h - Columnar binary log of scan results
+ * 
+ * For big scans, re-reading JSON to find "all Windows hosts with
+ * window 8192" is slower than the scan. The result log keeps each
+ * field as its own packed array, so a query only touches the
+ * columns it filters on, and the file can be mmap()ed and used in
+ * place.
+ * 
+ * Layout: a file header, then blocks. Each block starts with a
+ * LogBlockHeader and is a multiple of 8 bytes, so every column in
+ * it is aligned. Row blocks hold up to RESLOG_BLOCK_ROWS results as
+ * columns; name and pattern blocks add entries to the dictionaries
+ * the row blocks refer to by ID. Runs append more blocks to the
+ * same file.
+ */
+
+#ifndef RESULT_LOG_H
+#define RESULT_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "defs.h"
+#include "matcher.h"
+
+#define RESLOG_MAGIC      "OSFPLOG1"
+#define RESLOG_BLOCK_ROWS 4096
+#define RESLOG_TOP        3         /* Matches kept per host */
+#define RESLOG_NONE       0xffffffffu   /* No match in this rank */
+#define RESLOG_PATTERNS   255       /* Pattern IDs; 255 means "other" */
+
+/* Block types */
+#define RESLOG_ROWS       1
+#define RESLOG_NAMES      2
+#define RESLOG_PATTERN    3
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t top;           /* RESLOG_TOP */
+} LogFileHeader;
+
+typedef struct {
+    uint32_t type;
+    uint32_t count;         /* Rows or dictionary entries */
+    uint64_t size;          /* Bytes after this header */
+} LogBlockHeader;
+
+/* Bits of the 'probes' column, and of 'df' (the reply had DF set) */
+#define RESLOG_REPLIED(p)  (1u << (p))
+
+/* Bits of the 'opts' column */
+#define RESLOG_OPTIONS     0x01     /* The SYN-ACK had TCP options */
+#define RESLOG_SACK        0x02
+#define RESLOG_TIMESTAMP   0x04
+
+/* One row block, as arrays pointing into the mapped file */
+typedef struct {
+    uint32_t count;
+    const uint32_t *ip;             /* Network order */
+    const uint16_t *port;
+    const uint8_t *ttl;
+    const uint16_t *window;
+    const uint8_t *pattern;         /* Option pattern ID */
+    const uint8_t *probes;          /* Probes that got a reply */
+    const uint8_t *level;           /* 0 = no match, 1-3 = LOW-HIGH */
+    const uint32_t *fp[RESLOG_TOP]; /* Fingerprint IDs, best first */
+    const int16_t *score[RESLOG_TOP];
+    
+    /* The rest of what scoring looks at, so a log can be matched again */
+    const uint16_t *mss;
+    const uint8_t *wscale;
+    const uint8_t *opts;
+    const uint8_t *df;
+    const uint8_t *flags[PROBE_COUNT];  /* TH_* flags of each reply */
+} LogRows;
+
+/* A mapped log */
+typedef struct {
+    void *map;
+    size_t size;
+    size_t valid;               /* Bytes up to the last complete block */
+    
+    LogRows *blocks;
+    int block_count;
+    uint64_t rows;
+    
+    /* Fingerprint names and families, by ID */
+    char **names;
+    uint8_t *families;
+    uint32_t name_count;
+    
+    char patterns[RESLOG_PATTERNS][32];
+    int pattern_count;
+} LogReader;
+
+/* A log being written */
+typedef struct ResultLog ResultLog;
+
+/*
+ * Open a log for appending, creating it if needed. An incomplete
+ * block left by a crash is cut off. Returns NULL on error.
+ */
+ResultLog *result_log_open(const char *path);
+
+/*
+ * Add one host. Not thread-safe, and needs no lock: only one thread
+ * writes to a log (the emit stage of a batch scan, or the main thread).
+ */
+int result_log_add(ResultLog *log, in_addr_t addr, int port, const ScanResult *scan,
+                   const Match *matches, int count);
+
+/*
+ * Write out the rows buffered so far (as a short block) and get them
+ * onto the disk. Returns the size of the file, or -1 on error.
+ */
+int64_t result_log_sync(ResultLog *log);
+
+/* Write out the rows still buffered and close the file */
+int result_log_close(ResultLog *log);
+
+/* Map a log for reading. Returns 0, or -1 (with a message). */
+int log_reader_open(LogReader *reader, const char *path);
+
+void log_reader_close(LogReader *reader);
+
+/*
+ * Rebuild the observation of row i, as far as scoring goes (no
+ * timings, no closed port). Patterns that didn't fit in the
+ * dictionary come back empty.
+ */
+void log_row_scan(const LogReader *reader, const LogRows *b, uint32_t i, ScanResult *scan);
+
+#endif
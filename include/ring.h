@@ -0,0 +1,108 @@
+/*
+ * ring.h - Lock-free single producer, single consumer queue
+ * 
+ * The stages of the batch scanner hand work to each other through
+ * these. One thread only ever writes 'tail' and the other only
+ * 'head', so no locks are needed, and the two sit on separate cache
+ * lines so the threads don't fight over one.
+ * 
+ * Items are used in place: the producer fills ring_slot() and
+ * commits it with ring_push(); the consumer reads ring_peek() and
+ * frees it with ring_pop().
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    /* Written by the consumer */
+    _Alignas(64) atomic_uint head;
+    
+    /* Written by the producer */
+    _Alignas(64) atomic_uint tail;
+    unsigned long pushes;
+    unsigned long full;         /* Times the producer had to wait (it counts them) */
+    unsigned long depth_sum;    /* Depth after each push, added up */
+    unsigned max_depth;
+    
+    _Alignas(64) unsigned size; /* A power of two */
+    size_t item_size;
+    char *items;
+} Ring;
+
+
+/* Returns 0, or -1 if out of memory. 'size' is rounded up to a power of two. */
+static inline int ring_init(Ring *r, unsigned size, size_t item_size)
+{
+    memset(r, 0, sizeof(*r));
+    
+    unsigned n = 1;
+    while (n < size) n <<= 1;
+    
+    r->size = n;
+    r->item_size = item_size;
+    r->items = calloc(n, item_size);
+    return r->items ? 0 : -1;
+}
+
+static inline void ring_free(Ring *r)
+{
+    free(r->items);
+    r->items = NULL;
+}
+
+/* Items waiting. Either side may ask. */
+static inline unsigned ring_depth(Ring *r)
+{
+    return atomic_load(&r->tail) - atomic_load(&r->head);
+}
+
+
+/* Producer: the next free item, or NULL if the ring is full */
+static inline void *ring_slot(Ring *r)
+{
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+    
+    if (tail - head == r->size)
+        return NULL;
+    return r->items + (size_t)(tail & (r->size - 1)) * r->item_size;
+}
+
+/* Producer: hand over the item from ring_slot(). Returns the new depth. */
+static inline unsigned ring_push(Ring *r)
+{
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed) + 1;
+    atomic_store(&r->tail, tail);
+    
+    unsigned depth = tail - atomic_load(&r->head);
+    r->pushes++;
+    r->depth_sum += depth;
+    if (depth > r->max_depth) r->max_depth = depth;
+    return depth;
+}
+
+
+/* Consumer: the oldest item, or NULL if the ring is empty */
+static inline void *ring_peek(Ring *r)
+{
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    
+    if (head == tail)
+        return NULL;
+    return r->items + (size_t)(head & (r->size - 1)) * r->item_size;
+}
+
+/* Consumer: done with the item from ring_peek() */
+static inline void ring_pop(Ring *r)
+{
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+#endif
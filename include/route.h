@@ -0,0 +1,31 @@
+/*
+ * route.h - Which source address to send from
+ * 
+ * A copy of the IPv4 routing table read over rtnetlink, kept up to
+ * date by a background thread, so finding the source address for a
+ * probe is a lookup in memory instead of a handful of system calls.
+ */
+
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include <netinet/in.h>
+
+/*
+ * Read the routing table and start watching it for changes.
+ * Returns 0, or -1 if netlink isn't available (lookups then fall
+ * back to asking the kernel each time).
+ */
+int route_cache_init(void);
+
+/*
+ * Longest prefix match for dst. Fills in the source address and
+ * outgoing interface and returns 0, or -1 if no route matches.
+ * Lock-free and safe to call from any thread.
+ */
+int route_lookup(in_addr_t dst, in_addr_t *src, int *ifindex);
+
+/* Source address for dst: the cache if it has a route, else the kernel */
+in_addr_t source_address(in_addr_t dst);
+
+#endif
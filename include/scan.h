@@ -0,0 +1,126 @@
+/*
+ * scan.h - Fingerprint many targets at once
+ * 
+ * A batch scan is a pipeline of threads joined by lock-free rings:
+ * 
+ *   targets -> probe workers -> matchers -> emitter
+ * 
+ * The calling thread reads the targets and gives each one to the
+ * worker that owns it. Workers send the probe bursts, receive and
+ * decode the replies through a PACKET_FANOUT group that steers on
+ * the source address (so a host's replies always reach the worker
+ * that probed it), and pass finished results on. Matchers score
+ * them, and a single emitter writes them out. When a stage falls
+ * behind, the rings in front of it fill up and the stages before
+ * it wait, so scoring and output never hold up receiving.
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <signal.h>
+
+#include "defs.h"
+#include "matcher.h"
+#include "targets.h"
+#include "checkpoint.h"
+
+/* Limits */
+#define MAX_WORKERS     64
+#define MAX_MATCHERS    16
+#define MAX_STAGE_CPUS  64
+#define WORKER_INFLIGHT 64      /* Targets each worker probes at once */
+
+/* Ring sizes */
+#define TARGET_QUEUE    256     /* Targets queued for each worker */
+#define RESULT_QUEUE    128     /* Results from each worker to its matcher */
+#define MATCHED_QUEUE   256     /* Scored results from each matcher */
+
+/* Pipeline stages, for CPU pinning and metrics */
+enum { STAGE_PROBE, STAGE_MATCH, STAGE_EMIT, STAGES };
+
+/* A host on its way through the pipeline */
+typedef struct {
+    char target[INET_ADDRSTRLEN];
+    in_addr_t addr;             /* 'target', already parsed */
+    int port;
+    uint64_t seq;               /* Order it was handed out in */
+    ScanResult result;
+    Match matches[TOP_MATCHES];
+    int count;
+} ScanRecord;
+
+/* Match stage: fills in matches and count. Runs on several threads. */
+typedef void (*ScanMatch)(ScanRecord *rec, void *arg);
+
+/* Emit stage: writes a record out. Always runs on the same thread. */
+typedef void (*ScanEmit)(const ScanRecord *rec, void *arg);
+
+/*
+ * Emit stage, before a checkpoint: get everything emitted so far
+ * onto the disk and fill in the output file sizes (-1 = not a file).
+ * Returns 0, or -1 if it couldn't.
+ */
+typedef int (*ScanSync)(int64_t sizes[CHECKPOINT_OUTPUTS], void *arg);
+
+typedef struct {
+    int workers;
+    int matchers;
+    ScanMatch match;
+    ScanEmit emit;
+    void *arg;
+    
+    long rate;                  /* Packets per second for the whole scan, 0 = no limit */
+    int subnet_cap;             /* Targets in flight per /24, 0 = no limit */
+    
+    /* Checkpoints (see checkpoint.h) */
+    const char *checkpoint;     /* File to keep them in, NULL = none */
+    int checkpoint_secs;        /* 0 = CHECKPOINT_SECS */
+    uint64_t scan_id;           /* Saved in them: checkpoint_id() ... */
+    uint64_t seed;              /* ... and the seed of the target order */
+    const Checkpoint *resume;   /* Pick up from here (the stream already restored) */
+    ScanSync sync;
+    volatile sig_atomic_t *stop;    /* Set (by a signal handler) to stop handing out targets */
+    
+    /* CPUs to pin each stage's threads to, one each in turn (none = any) */
+    int cpus[STAGES][MAX_STAGE_CPUS];
+    int cpu_count[STAGES];
+} ScanConfig;
+
+/* How full the rings into a stage got */
+typedef struct {
+    unsigned long pushes;
+    unsigned long full;         /* Times a producer had to wait */
+    double avg_depth;
+    unsigned max_depth;
+    unsigned capacity;
+} QueueStats;
+
+/* Totals for a batch */
+typedef struct {
+    int targets;
+    int responded;
+    long packets_sent;
+    long packets_seen;
+    long retries;               /* Bursts sent again */
+    long rate;                  /* Where the pacer ended up (0 = no limit) */
+    long min_rate;              /* The lowest it backed off to */
+    int backoffs;               /* Times it halved the rate */
+    QueueStats queues[STAGES];  /* The rings feeding each stage */
+} ScanStats;
+
+/*
+ * Fingerprint every target on 'port'. With a checkpoint file, the
+ * progress is saved every checkpoint_secs and once more at the end.
+ * Returns 0, or -1 if the sockets or threads couldn't be set up.
+ */
+int scan_batch(TargetGen *targets, int port, const ScanConfig *config,
+               ScanStats *stats);
+
+/* Which worker owns a target, the same way the fanout program decides */
+int scan_owner(in_addr_t addr, int workers);
+
+/* Parse a CPU list like "0-3,8". Returns the count, or -1 if it's bad. */
+int parse_cpu_list(const char *text, int *cpus, int max);
+
+#endif
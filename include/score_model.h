@@ -0,0 +1,157 @@
+/*
+ * score_model.h - Database compiled into bitmasks for fast scoring
+ * 
+ * At load time every fingerprint is turned into a set of bitmasks
+ * over a fixed feature space (TTL value, window, option pattern...).
+ * A scan result is encoded into the same space with one bit set per
+ * feature, and scoring a fingerprint is just AND + popcount.
+ */
+
+#ifndef SCORE_MODEL_H
+#define SCORE_MODEL_H
+
+#include <stdint.h>
+
+#include "defs.h"
+
+/* Every partial score is a multiple of this */
+#define SCORE_UNIT 10
+
+/*
+ * Bit planes per fingerprint.
+ * Plane j holds bit j of each feature's weight (in SCORE_UNITs),
+ * so the weight of a feature can be up to 2^SCORE_PLANES - 1.
+ */
+#define SCORE_PLANES 7
+
+/*
+ * Feature layout. Each block is one observed value; exactly one bit
+ * per block is set in an encoded scan.
+ * 
+ * TTLs are grouped into ranges where no fingerprint's score changes.
+ * Windows, MSS values and option patterns use a dictionary of the
+ * values most common in the database.
+ */
+#define FEAT_TTL        0
+#define FEAT_TTL_N      64      /* TTL ranges */
+#define FEAT_WINDOW     (FEAT_TTL + FEAT_TTL_N)
+#define FEAT_WINDOW_N   64      /* Window dictionary */
+#define FEAT_PATTERN    (FEAT_WINDOW + FEAT_WINDOW_N)
+#define FEAT_PATTERN_N  32      /* Option pattern dictionary */
+#define FEAT_MSS        (FEAT_PATTERN + FEAT_PATTERN_N)
+#define FEAT_MSS_N      32      /* MSS dictionary */
+#define FEAT_WSCALE     (FEAT_MSS + FEAT_MSS_N)
+#define FEAT_WSCALE_N   16      /* Window scale 0-15 */
+#define FEAT_SACK_TS    (FEAT_WSCALE + FEAT_WSCALE_N)
+#define FEAT_SACK_TS_N  4       /* SACK x timestamp */
+#define FEAT_DF         (FEAT_SACK_TS + FEAT_SACK_TS_N)
+#define FEAT_DF_N       2       /* Y or N */
+#define FEAT_BEHAV      (FEAT_DF + FEAT_DF_N)
+#define FEAT_BEHAV_N    4       /* T2 x T3 responded */
+#define FEAT_PROBES     (FEAT_BEHAV + FEAT_BEHAV_N)
+#define FEAT_PROBES_N   64      /* T4-T7: 16 reply kinds each */
+#define FEAT_ECHO       (FEAT_PROBES + FEAT_PROBES_N)
+#define FEAT_ECHO_N     13      /* IE: no reply, or DFI x CD */
+#define FEAT_UNREACH    (FEAT_ECHO + FEAT_ECHO_N)
+#define FEAT_UNREACH_N  3       /* U1: no reply, DF Y, DF N */
+#define FEAT_IPL        (FEAT_UNREACH + FEAT_UNREACH_N)
+#define FEAT_IPL_N      8       /* U1 reply length dictionary */
+#define FEAT_QUOTE      (FEAT_IPL + FEAT_IPL_N)
+#define FEAT_QUOTE_N    64      /* U1 quote checks passed (QUOTE_*) */
+#define FEAT_BITS       (FEAT_QUOTE + FEAT_QUOTE_N)
+
+/*
+ * Reply kinds for T4-T7: no reply, or one of a few common flag
+ * combinations with DF set or not. Anything else is rare.
+ */
+#define PROBE_KINDS     16
+#define NUM_REPLY_FLAGS 7
+
+#define FEAT_WORDS      ((FEAT_BITS + 63) / 64)
+
+/*
+ * Values missing from a dictionary can't be encoded. Those blocks
+ * are flagged and scored with the plain score_*() functions instead.
+ */
+#define RARE_WINDOW  0x01
+#define RARE_PATTERN 0x02
+#define RARE_MSS     0x04
+#define RARE_WSCALE  0x08
+#define RARE_TTL     0x10
+#define RARE_DF      0x20
+#define RARE_T4      0x40   /* RARE_T4 << n for T4+n */
+#define RARE_IPL     0x400
+
+/*
+ * One fingerprint, compiled.
+ * The planes of each word sit next to each other, so one feature
+ * word costs a single cache line to score.
+ */
+typedef struct {
+    uint64_t plane[FEAT_WORDS][SCORE_PLANES];
+} FpCode;
+
+/* One scan result, encoded */
+typedef struct {
+    uint64_t bits[FEAT_WORDS];
+    int words[FEAT_WORDS];      /* Indexes of the non-zero words */
+    int nwords;
+    int offset;                 /* Subtracted from every score, in units */
+    unsigned rare;              /* RARE_* blocks to score the slow way */
+    const ScanResult *scan;
+} ScanCode;
+
+/* The compiled database */
+typedef struct {
+    int count;
+    Fingerprint **fps;          /* Grouped by OS family, like the database */
+    OSType *os;                 /* OS family of each entry */
+    FpCode *codes;
+    
+    /* Where each family's entries are, and their highest weight per bit */
+    int part_start[OS_TYPES];
+    int part_count[OS_TYPES];
+    unsigned char part_max[OS_TYPES][FEAT_BITS];
+    
+    /* TTL range for every TTL value (-1 = past the last range) */
+    signed char ttl_range[256];
+    unsigned char ttl_first[FEAT_TTL_N];    /* First TTL in each range */
+    int ttl_count;
+    
+    /* Dictionaries, sorted by value for lookup */
+    int win_values[FEAT_WINDOW_N];
+    int win_count;
+    int mss_values[FEAT_MSS_N];
+    int mss_count;
+    char patterns[FEAT_PATTERN_N][32];
+    int pattern_count;
+    int ipl_values[FEAT_IPL_N];
+    int ipl_count;
+    
+    /* Blocks with negative weights are shifted up by these */
+    int ttl_offset;
+    int behav_offset;
+    int probe_offset;
+    int echo_offset;
+    int unreach_offset;
+} ScoreModel;
+
+/* Compile a loaded database. Returns NULL on error (errno ERANGE if a score is too big). */
+ScoreModel *build_score_model(FingerprintDB *db);
+
+/* Free a compiled database (not the fingerprints themselves) */
+void free_score_model(ScoreModel *model);
+
+/* Encode a scan result for scoring */
+void encode_scan(const ScoreModel *model, const ScanResult *scan, ScanCode *code);
+
+/* Score database entry 'index' - same result as calculate_score() */
+int model_score(const ScoreModel *model, int index, const ScanCode *code);
+
+/*
+ * The highest score any entry of family 'os' can get, or INT_MAX
+ * when the scan has rare values and no bound is known.
+ */
+int partition_bound(const ScoreModel *model, OSType os, const ScanCode *code);
+
+#endif
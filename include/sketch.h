@@ -0,0 +1,65 @@
+/*
+ * sketch.h - Small fixed-size summaries of big streams
+ * 
+ * Two sketches, each a flat struct of counters that never grows
+ * however many items go in, and that merges with another of the same
+ * kind by plain element-wise max or sum. That makes them safe to
+ * write to disk as they are and add up across runs and machines.
+ * 
+ *   - HyperLogLog counts distinct items: 2^HLL_BITS one byte
+ *     registers, about 0.8% standard error.
+ *   - A count-min sketch estimates how often each item was seen, never
+ *     too low and too high by at most about e/CMS_WIDTH of the total
+ *     (with probability 1 - e^-CMS_DEPTH). Next to it a short table
+ *     keeps the SKETCH_TOP items with the highest estimates, the heavy
+ *     hitters, since the counters alone can't say which items exist.
+ */
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HLL_BITS     14
+#define HLL_REGS     (1 << HLL_BITS)
+
+#define CMS_DEPTH    4
+#define CMS_WIDTH    2048
+#define SKETCH_TOP   32         /* Heavy hitters kept */
+#define SKETCH_KEY   64         /* Longest item name, with its terminator */
+
+typedef struct {
+    uint8_t regs[HLL_REGS];
+} Hll;
+
+/* An item and its estimated count */
+typedef struct {
+    uint64_t hash;              /* Of the whole name; 'key' may be cut short */
+    char key[SKETCH_KEY];
+    uint64_t count;
+} HeavyHitter;
+
+typedef struct {
+    uint64_t cells[CMS_DEPTH][CMS_WIDTH];
+    uint64_t total;
+    HeavyHitter top[SKETCH_TOP];    /* Highest first */
+    uint32_t top_count;
+    uint32_t reserved;
+} FreqSketch;
+
+/* 64-bit hash of a key, and of a 64-bit number */
+uint64_t sketch_hash(const void *data, size_t len);
+uint64_t sketch_hash64(uint64_t x);
+
+/* HyperLogLog: add an item by its hash, estimate, and take the union */
+void hll_add(Hll *h, uint64_t hash);
+double hll_count(const Hll *h);
+void hll_merge(Hll *dst, const Hll *src);
+
+/* Count-min with heavy hitters: add n of an item, estimate, and add up */
+void freq_add(FreqSketch *f, const char *key, uint64_t n);
+uint64_t freq_estimate(const FreqSketch *f, const char *key);
+void freq_merge(FreqSketch *dst, const FreqSketch *src);
+
+#endif
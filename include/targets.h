@@ -0,0 +1,65 @@
+/*
+ * targets.h - Where batch targets come from
+ * 
+ * Targets are addresses, CIDR ranges like 10.0.0.0/16, or files
+ * with one of those per line ("-" is stdin). Nothing is expanded
+ * into a list. Command line ranges are visited in a random order by
+ * walking a cyclic group modulo a prime, the way zmap does, so
+ * consecutive probes are spread over all the ranges instead of
+ * hitting one subnet at a time. Files are read a line at a time.
+ * 
+ * With sharding, shard i of n gets every n-th target of the same
+ * order (given the same seed), so several machines can split one
+ * scan without talking to each other.
+ */
+
+#ifndef TARGETS_H
+#define TARGETS_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+typedef struct TargetGen TargetGen;
+
+/*
+ * Where a stream is, for checkpoints: enough to carry on from the
+ * same place in a stream opened again with the same arguments.
+ */
+typedef struct {
+    uint64_t x;                 /* Walk through the command line ranges */
+    uint64_t left;
+    uint64_t file_offset;       /* Next line of the target file */
+    uint64_t file_index;
+    uint64_t rng;
+    uint32_t line_base;         /* Range of the current line ... */
+    uint64_t line_size;
+    uint64_t line_prime;        /* ... and the walk through it */
+    uint64_t line_step;
+    uint64_t line_x;
+    uint64_t line_left;
+} TargetState;
+
+/*
+ * Set up a target stream from 'count' address/range specs and an
+ * optional file (NULL for none, "-" for stdin).
+ * Returns NULL (with a message) if a spec or the file is bad.
+ */
+TargetGen *targets_open(char **specs, int count, const char *file,
+                        int shard, int shards, uint64_t seed);
+
+/* Next target. Returns 0, or -1 when there are no more. */
+int targets_next(TargetGen *gen, in_addr_t *addr);
+
+/* Addresses in the command line ranges (before sharding) */
+uint64_t targets_total(const TargetGen *gen);
+
+/*
+ * Save where the stream is, or go back there. Returns 0, or -1 if
+ * targets come from stdin, which can't be read again.
+ */
+int targets_save(const TargetGen *gen, TargetState *state);
+int targets_restore(TargetGen *gen, const TargetState *state);
+
+void targets_close(TargetGen *gen);
+
+#endif
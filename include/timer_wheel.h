@@ -0,0 +1,65 @@
+/*
+ * timer_wheel.h - Hierarchical timing wheel
+ * 
+ * Keeps a deadline for every outstanding target of a batch worker.
+ * Time is counted in milliseconds. Level 0 has a bucket for each of
+ * the next 64 ms, level 1 a bucket for each of the next 64 spans of
+ * 64 ms, and so on up to WHEEL_LEVELS levels (about 4.6 hours).
+ * When level 0 wraps around, the next bucket of level 1 is spread
+ * out over level 0, and so on up.
+ * 
+ * Adding and cancelling a timer is O(1), and all the timers of a
+ * millisecond expire together as one list. A bitmap per level lets
+ * empty stretches be skipped without looking at every bucket.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+/* Put one in whatever the deadline is for, and use container_of-style casts */
+typedef struct Timer {
+    struct Timer *next;
+    struct Timer **pprev;       /* NULL when the timer isn't pending */
+    uint64_t expires;           /* In wheel ticks (ms) */
+} Timer;
+
+typedef struct {
+    uint64_t now;               /* Every timer before this has expired */
+    uint64_t occupied[WHEEL_LEVELS];
+    Timer *buckets[WHEEL_LEVELS][WHEEL_SLOTS];
+    long pending;
+} TimerWheel;
+
+void wheel_init(TimerWheel *w, uint64_t now);
+
+/* Arm a timer (rearming it if it's pending). Past deadlines fire next tick. */
+void wheel_add(TimerWheel *w, Timer *t, uint64_t expires);
+
+/* Disarm a timer. Doing it twice, or to one that has fired, is fine. */
+void wheel_cancel(TimerWheel *w, Timer *t);
+
+static inline int timer_pending(const Timer *t)
+{
+    return t->pprev != 0;
+}
+
+/*
+ * Move the wheel on to 'now' and return every timer that expired,
+ * as a list linked through 'next'. They are no longer pending.
+ */
+Timer *wheel_expire(TimerWheel *w, uint64_t now);
+
+/*
+ * Milliseconds until the wheel next needs to be moved on, or -1 if
+ * there are no timers. May be early (when far timers move down a
+ * level) but never late.
+ */
+long wheel_next(const TimerWheel *w);
+
+#endif
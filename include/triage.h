@@ -0,0 +1,127 @@
+/*
+ * triage.h - Decision tree for classifying a single SYN-ACK
+ * 
+ * A full match needs all the probes and scores every fingerprint.
+ * For a quick look, osfp_tree builds a decision tree offline from
+ * the database: it works out what the full match would be for the
+ * SYN-ACKs each fingerprint sends (from a few hop counts), and
+ * learns a tree over the SYN-ACK alone that leads to those answers.
+ * Each leaf has an OS family and a short ranked list of candidates.
+ * 
+ * The tree is saved next to the database ("nmap-os-db.tree") with
+ * the size and time of the database it was built from, so a stale
+ * tree is noticed.
+ */
+
+#ifndef TRIAGE_H
+#define TRIAGE_H
+
+#include <stdint.h>
+
+#include "defs.h"
+
+#define TRIAGE_MAGIC     "OSFPTRE1"
+#define TRIAGE_SUFFIX    ".tree"
+#define TRIAGE_SHORTLIST 5          /* Candidates per leaf */
+#define TRIAGE_PATTERNS  255        /* Option patterns in the table */
+
+/*
+ * What the tree tests, all from the SYN-ACK. The option pattern is
+ * compared with ==, everything else with <=. Options that weren't
+ * sent (or don't count) have the empty pattern, MSS 0 and scale -1.
+ */
+enum {
+    TRIAGE_TTL = 0,
+    TRIAGE_WINDOW,
+    TRIAGE_PATTERN,     /* Index into the pattern table, -1 if not in it */
+    TRIAGE_MSS,
+    TRIAGE_WSCALE,
+    TRIAGE_DF,          /* 1 if set */
+    TRIAGE_FEATURES
+};
+
+#define TRIAGE_LEAF 0xFF
+
+/* A test, or a leaf (feature TRIAGE_LEAF, value = leaf number) */
+typedef struct {
+    uint8_t feature;
+    uint8_t pad[3];
+    int32_t value;
+    uint32_t yes;           /* Node to go to if the test holds */
+    uint32_t no;
+} TriageNode;
+
+typedef struct {
+    uint8_t os;             /* OSType most of the leaf's hosts turn out to be */
+    uint8_t count;          /* Candidates */
+    uint16_t pad;
+    uint32_t first;         /* Index of the first one in 'cands' */
+} TriageLeaf;
+
+typedef struct {
+    uint32_t name;          /* Index into the name table */
+    uint32_t share;         /* Per mille of the leaf's hosts it was the best match for */
+} TriageCand;
+
+/* On disk: this header, then each table, 8-byte aligned */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_count;
+    uint32_t leaf_count;
+    uint32_t cand_count;
+    uint32_t pattern_count;
+    uint32_t name_count;
+    uint32_t names_size;    /* Bytes of NUL-terminated names */
+    uint32_t pad;
+    uint64_t db_size;       /* The database it was built from */
+    int64_t db_mtime;
+} TriageHeader;
+
+typedef struct {
+    TriageNode *nodes;      /* The root is node 0 */
+    int node_count;
+    TriageLeaf *leaves;
+    int leaf_count;
+    TriageCand *cands;
+    int cand_count;
+    char (*patterns)[32];
+    int pattern_count;
+    char **names;
+    uint8_t *name_os;
+    int name_count;
+    char *name_data;
+    int names_size;
+    uint64_t db_size;
+    int64_t db_mtime;
+} TriageTree;
+
+/* What the tree says about one SYN-ACK */
+typedef struct {
+    OSType os;
+    int comparisons;        /* Tests on the way to the leaf */
+    int count;
+    const char *names[TRIAGE_SHORTLIST];
+    int share[TRIAGE_SHORTLIST];
+} TriageResult;
+
+/*
+ * Load the tree saved next to 'db_path'. Returns NULL (with a
+ * message) if there is none or it's damaged, and warns if the
+ * database has changed since it was built.
+ */
+TriageTree *triage_load(const char *db_path);
+
+/* Save a tree next to 'db_path'. Returns 0, or -1 on error. */
+int triage_save(const TriageTree *tree, const char *db_path);
+
+/* Free a tree from triage_load() or one built in memory */
+void triage_free(TriageTree *tree);
+
+/* The tree's view of a SYN-ACK: TRIAGE_FEATURES values */
+void triage_features(const TriageTree *tree, const ScanResult *scan, int *f);
+
+/* Walk the tree for the SYN-ACK in 'scan' */
+void triage_classify(const TriageTree *tree, const ScanResult *scan, TriageResult *out);
+
+#endif
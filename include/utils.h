@@ -5,17 +5,32 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stddef.h>
+
 #include "defs.h"
 
+/* Round a size up to a multiple of 8, for the sections of binary files */
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
 /* Network helpers */
 unsigned short checksum(void *data, int len);
-void get_local_ip(char *buffer, const char *target);
+in_addr_t get_local_addr(in_addr_t target);
 
 /* String parsing helpers for the database */
 int parse_hex(const char *line, const char *key);
 void parse_string(const char *line, const char *key, char *dest, int max);
 void parse_range(const char *line, const char *key, int *min, int *max);
 
+/* Parse an nmap flags string like "AR" into TH_* bits */
+int parse_flags(const char *str);
+
+/* Write TH_* bits as an nmap flags string (at least 8 bytes) */
+void format_flags(int flags, char *out);
+
+/* nmap's letter for an observed DFI_* or CD_* value of IE */
+char dfi_letter(int dfi);
+char cd_letter(int cd);
+
 /* Parse TCP options string like "M5B4NW8ST11" */
 void parse_options(const char *str, TCPOpts *opts);
 
@@ -24,4 +39,7 @@ OSType guess_os_from_ttl(int ttl);
 OSType guess_os_from_name(const char *name);
 const char *os_type_name(OSType type);
 
+/* Write all of 'data', going on after EINTR and short writes. Returns 0 or -1. */
+int write_all(int fd, const void *data, size_t len);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,287 @@
+/*
+ * aggregate.c - Bounded summaries of scan results, and their snapshots
+ * 
+ * A snapshot is the aggregate as it is in memory: a header, the two
+ * HyperLogLogs and the two frequency sketches, then a row for every
+ * /16 that has any results (most have none). Loading one adds it to
+ * an aggregate, so loading several is merging them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "../include/aggregate.h"
+#include "../include/utils.h"
+
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t hll_bits;          /* The sketch sizes, which have to agree */
+    uint32_t cms_depth;
+    uint32_t cms_width;
+    uint32_t top;
+    uint32_t subnet_rows;
+    uint64_t results;
+    uint64_t responded;
+} AggFileHeader;
+
+typedef struct {
+    uint32_t net;               /* The /16, host order, as a.b.0.0 */
+    uint32_t counts[OS_TYPES];
+} AggSubnetRow;
+
+
+Aggregate *agg_new(void)
+{
+    Aggregate *agg = calloc(1, sizeof(Aggregate));
+    if (!agg)
+        return NULL;
+    
+    agg->subnets = calloc(AGG_SUBNETS, sizeof(*agg->subnets));
+    if (!agg->subnets) {
+        free(agg);
+        return NULL;
+    }
+    return agg;
+}
+
+
+void agg_free(Aggregate *agg)
+{
+    if (!agg) return;
+    free(agg->subnets);
+    free(agg);
+}
+
+
+void agg_add(Aggregate *agg, in_addr_t addr, const ScanResult *scan,
+             const Match *matches, int count)
+{
+    agg->results++;
+    hll_add(&agg->hosts, sketch_hash64(addr));
+    
+    int family = count ? matches[0].fp->os : OS_UNKNOWN;
+    agg->subnets[ntohl(addr) >> 16][family]++;
+    
+    if (count)
+        freq_add(&agg->fingerprints, matches[0].fp->name, 1);
+    
+    if (scan->got_response) {
+        agg->responded++;
+        
+        char sig[SKETCH_KEY];
+        int len = snprintf(sig, sizeof(sig), "%s:%d:%d:%d", scan->opts.pattern, scan->window,
+                           scan->opts.mss, scan->opts.window_scale);
+        if (len >= (int)sizeof(sig))
+            len = sizeof(sig) - 1;
+        
+        hll_add(&agg->signatures, sketch_hash(sig, len));
+        freq_add(&agg->options, sig, 1);
+    }
+}
+
+
+void agg_merge(Aggregate *dst, const Aggregate *src)
+{
+    dst->results += src->results;
+    dst->responded += src->responded;
+    hll_merge(&dst->hosts, &src->hosts);
+    hll_merge(&dst->signatures, &src->signatures);
+    freq_merge(&dst->fingerprints, &src->fingerprints);
+    freq_merge(&dst->options, &src->options);
+    
+    for (int net = 0; net < AGG_SUBNETS; net++) {
+        for (int f = 0; f < OS_TYPES; f++)
+            dst->subnets[net][f] += src->subnets[net][f];
+    }
+}
+
+
+static uint64_t subnet_total(const Aggregate *agg, int net)
+{
+    uint64_t total = 0;
+    for (int f = 0; f < OS_TYPES; f++)
+        total += agg->subnets[net][f];
+    return total;
+}
+
+
+int agg_save(const Aggregate *agg, const char *path)
+{
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    
+    AggFileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, AGG_MAGIC, 8);
+    h.version = AGG_VERSION;
+    h.hll_bits = HLL_BITS;
+    h.cms_depth = CMS_DEPTH;
+    h.cms_width = CMS_WIDTH;
+    h.top = SKETCH_TOP;
+    h.results = agg->results;
+    h.responded = agg->responded;
+    for (int net = 0; net < AGG_SUBNETS; net++)
+        h.subnet_rows += subnet_total(agg, net) > 0;
+    
+    FILE *f = fopen(tmp, "wb");
+    if (!f)
+        return -1;
+    
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             fwrite(&agg->hosts, sizeof(Hll), 1, f) == 1 &&
+             fwrite(&agg->signatures, sizeof(Hll), 1, f) == 1 &&
+             fwrite(&agg->fingerprints, sizeof(FreqSketch), 1, f) == 1 &&
+             fwrite(&agg->options, sizeof(FreqSketch), 1, f) == 1;
+    
+    for (int net = 0; ok && net < AGG_SUBNETS; net++) {
+        if (subnet_total(agg, net) == 0)
+            continue;
+        AggSubnetRow row;
+        row.net = (uint32_t)net << 16;
+        memcpy(row.counts, agg->subnets[net], sizeof(row.counts));
+        ok = fwrite(&row, sizeof(row), 1, f) == 1;
+    }
+    
+    ok = ok && fflush(f) == 0 && fdatasync(fileno(f)) == 0;
+    int err = errno;
+    if (fclose(f) != 0 && ok) {
+        ok = 0;
+        err = errno;
+    }
+    
+    if (ok && rename(tmp, path) == 0)
+        return 0;
+    if (ok)
+        err = errno;
+    unlink(tmp);
+    errno = err;
+    return -1;
+}
+
+
+int agg_load(Aggregate *agg, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return -1;
+    
+    Aggregate *snap = agg_new();
+    if (!snap) {
+        fclose(f);
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    AggFileHeader h;
+    int ok = fread(&h, sizeof(h), 1, f) == 1 &&
+             memcmp(h.magic, AGG_MAGIC, 8) == 0 && h.version == AGG_VERSION &&
+             h.hll_bits == HLL_BITS && h.cms_depth == CMS_DEPTH &&
+             h.cms_width == CMS_WIDTH && h.top == SKETCH_TOP &&
+             h.subnet_rows <= AGG_SUBNETS &&
+             fread(&snap->hosts, sizeof(Hll), 1, f) == 1 &&
+             fread(&snap->signatures, sizeof(Hll), 1, f) == 1 &&
+             fread(&snap->fingerprints, sizeof(FreqSketch), 1, f) == 1 &&
+             fread(&snap->options, sizeof(FreqSketch), 1, f) == 1;
+    
+    ok = ok && snap->fingerprints.top_count <= SKETCH_TOP &&
+         snap->options.top_count <= SKETCH_TOP;
+    for (int i = 0; ok && i < SKETCH_TOP; i++) {
+        snap->fingerprints.top[i].key[SKETCH_KEY - 1] = '\0';
+        snap->options.top[i].key[SKETCH_KEY - 1] = '\0';
+    }
+    
+    for (uint32_t i = 0; ok && i < h.subnet_rows; i++) {
+        AggSubnetRow row;
+        ok = fread(&row, sizeof(row), 1, f) == 1 && (row.net & 0xffff) == 0;
+        if (ok)
+            memcpy(snap->subnets[row.net >> 16], row.counts, sizeof(row.counts));
+    }
+    ok = ok && fgetc(f) == EOF;
+    fclose(f);
+    
+    if (ok) {
+        snap->results = h.results;
+        snap->responded = h.responded;
+        agg_merge(agg, snap);
+    }
+    agg_free(snap);
+    
+    if (!ok) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+
+/* /16 order for printing, most results first */
+static const Aggregate *sort_agg;
+
+static int by_results(const void *a, const void *b)
+{
+    uint64_t ca = subnet_total(sort_agg, *(const int *)a);
+    uint64_t cb = subnet_total(sort_agg, *(const int *)b);
+    return (ca < cb) - (ca > cb);
+}
+
+
+static void print_top(const FreqSketch *f, const char *title, int top)
+{
+    printf("\n%-48s %10s\n", title, "results");
+    for (uint32_t i = 0; i < f->top_count && (int)i < top; i++)
+        printf("%-48s %10llu  %5.1f%%\n", f->top[i].key, (unsigned long long)f->top[i].count,
+               100.0 * f->top[i].count / (f->total ? f->total : 1));
+}
+
+
+void agg_print(const Aggregate *agg, int top)
+{
+    printf("%llu results (%llu answered), about %.0f distinct hosts\n",
+           (unsigned long long)agg->results, (unsigned long long)agg->responded,
+           hll_count(&agg->hosts));
+    
+    int *order = malloc(sizeof(int) * AGG_SUBNETS);
+    int used = 0;
+    for (int net = 0; order && net < AGG_SUBNETS; net++) {
+        if (subnet_total(agg, net)) order[used++] = net;
+    }
+    
+    if (order && used) {
+        sort_agg = agg;
+        qsort(order, used, sizeof(int), by_results);
+        
+        printf("\n%-16s %10s", "Subnet", "results");
+        for (int f = OS_WINDOWS; f < OS_TYPES; f++)
+            printf(" %14s", os_type_name(f));
+        printf(" %14s\n", "no match");
+        
+        for (int i = 0; i < used && i < top; i++) {
+            int net = order[i];
+            uint64_t total = subnet_total(agg, net);
+            char name[32];
+            snprintf(name, sizeof(name), "%d.%d.0.0/16", net >> 8, net & 0xff);
+            
+            printf("%-16s %10llu", name, (unsigned long long)total);
+            for (int f = OS_WINDOWS; f < OS_TYPES; f++)
+                printf(" %13.1f%%", 100.0 * agg->subnets[net][f] / total);
+            printf(" %13.1f%%\n", 100.0 * agg->subnets[net][OS_UNKNOWN] / total);
+        }
+        if (used > top)
+            printf("(%d more /16s)\n", used - top);
+    }
+    free(order);
+    
+    print_top(&agg->fingerprints, "Best match", top);
+    printf("\nAbout %.0f distinct option signatures (options:window:mss:wscale)\n",
+           hll_count(&agg->signatures));
+    print_top(&agg->options, "Option signature", top);
+}
@@ -0,0 +1,152 @@
+/*
+ * batch_rank.c - Tiled, multithreaded matching of many observations
+ * 
+ * Threads take groups of RANK_OBS_TILE observations off a shared
+ * counter. For each group the database is walked a stretch at a
+ * time; a stretch is cut where an OS family ends, so the family
+ * bounds of score_model.c can skip it for the observations that
+ * can't get anything out of it, the same way rank_matches() does.
+ * 
+ * Like rank_matches(), every observation first gets the family its
+ * TTL points to, so its list fills up with good scores early and
+ * the bounds can skip more of the other families.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "../include/batch_rank.h"
+#include "../include/utils.h"
+
+
+typedef struct {
+    const ScoreModel *model;
+    const ScanResult *scans;
+    int count;
+    int top;
+    Match *out;
+    int *counts;
+    atomic_int next;            /* First observation of the next group */
+} BatchJob;
+
+
+/* Match one group of observations */
+static void rank_group(BatchJob *job, int first, int n)
+{
+    const ScoreModel *model = job->model;
+    int top = job->top;
+    ScanCode codes[RANK_OBS_TILE];
+    int bounds[RANK_OBS_TILE][OS_TYPES];
+    OSType likely[RANK_OBS_TILE];
+    
+    for (int k = 0; k < n; k++) {
+        encode_scan(model, &job->scans[first + k], &codes[k]);
+        for (int f = 0; f < OS_TYPES; f++)
+            bounds[k][f] = partition_bound(model, f, &codes[k]);
+        likely[k] = guess_os_from_ttl(job->scans[first + k].ttl);
+        job->counts[first + k] = 0;
+    }
+    
+    /* Pass 0 is every observation's likely family, pass 1 the rest */
+    for (int pass = 0; pass < 2; pass++) {
+        for (int f = 0; f < OS_TYPES; f++) {
+            /* Skip non-Windows/Linux fingerprints entirely */
+            if (f == OS_OTHER)
+                continue;
+            
+            int end = model->part_start[f] + model->part_count[f];
+            
+            for (int start = model->part_start[f]; start < end; start += RANK_FP_TILE) {
+                int stop = start + RANK_FP_TILE < end ? start + RANK_FP_TILE : end;
+                
+                for (int k = 0; k < n; k++) {
+                    if ((likely[k] == (OSType)f) != (pass == 0))
+                        continue;
+                    
+                    Match *out = &job->out[(size_t)(first + k) * top];
+                    int *count = &job->counts[first + k];
+                    int bound = bounds[k][f];
+                    
+                    /* Can anything in here make the list? */
+                    if (bound != INT_MAX) {
+                        if (bound <= -100)
+                            continue;
+                        if (*count == top && bound < out[top - 1].score)
+                            continue;
+                    }
+                    
+                    for (int i = start; i < stop; i++) {
+                        int score = model_score(model, i, &codes[k]);
+                        if (score > -100)
+                            *count = add_match(out, *count, top, model->fps[i], score);
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+static void *rank_thread(void *data)
+{
+    BatchJob *job = data;
+    
+    while (1) {
+        int first = atomic_fetch_add(&job->next, RANK_OBS_TILE);
+        if (first >= job->count)
+            break;
+        
+        int n = job->count - first < RANK_OBS_TILE ? job->count - first : RANK_OBS_TILE;
+        rank_group(job, first, n);
+    }
+    return NULL;
+}
+
+
+int rank_batch(const ScoreModel *model, const ScanResult *scans, int count, int top,
+               int threads, Match *out, int *counts)
+{
+    if (!model || count <= 0 || top <= 0)
+        return 0;
+    
+    BatchJob job;
+    job.model = model;
+    job.scans = scans;
+    job.count = count;
+    job.top = top;
+    job.out = out;
+    job.counts = counts;
+    atomic_init(&job.next, 0);
+    
+    /* No point in more threads than groups */
+    int groups = (count + RANK_OBS_TILE - 1) / RANK_OBS_TILE;
+    if (threads > groups) threads = groups;
+    if (threads < 1) threads = 1;
+    
+    pthread_t *ids = malloc(sizeof(pthread_t) * threads);
+    if (!ids) {
+        printf("Error: Out of memory.\n");
+        return -1;
+    }
+    
+    /* The calling thread is one of them */
+    int started = 0;
+    for (int t = 1; t < threads; t++) {
+        if (pthread_create(&ids[started], NULL, rank_thread, &job) != 0) {
+            printf("Warning: Could not start a match thread.\n");
+            break;
+        }
+        started++;
+    }
+    
+    rank_thread(&job);
+    
+    for (int t = 0; t < started; t++)
+        pthread_join(ids[t], NULL);
+    
+    free(ids);
+    return 0;
+}
@@ -0,0 +1,837 @@
+/*
+ * build_tree.c - Build the SYN-ACK decision tree for a database
+ * 
+ * Usage: ./osfp_tree [-t threads] [nmap-os-db]
+ * 
+ * Every fingerprint is turned into the hosts it describes: the
+ * replies it expects to every probe, with the SYN-ACK coming from a
+ * few hop counts away and with each window it lists. Those hosts are
+ * matched in full, which says what a complete scan would report for
+ * them. A tree is then grown over the SYN-ACK alone, each test picked
+ * to best separate those answers (information gain), and saved next to
+ * the database.
+ * 
+ * Last, the tree is checked against calculate_score() on hosts at
+ * hop counts it wasn't built from.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include "../include/defs.h"
+#include "../include/db_parser.h"
+#include "../include/matcher.h"
+#include "../include/score_model.h"
+#include "../include/batch_rank.h"
+#include "../include/triage.h"
+
+
+/* Hops between the host and us for the hosts the tree learns from... */
+static const int train_hops[] = {0, 2, 5, 10, 20};
+
+/* ...and for the ones it's checked on */
+static const int test_hops[] = {1, 3, 7, 15};
+
+#define MAX_DEPTH   40
+#define MAX_WINDOWS 7
+#define SCAN_BATCH  4096    /* Hosts matched at a time */
+#define TEST_MAX    2000    /* Hosts checked with calculate_score() */
+
+
+/* One host: its SYN-ACK and what the full match made of it */
+typedef struct {
+    int f[TRIAGE_FEATURES];
+    int best[3];            /* Database entries of the top matches, -1 if fewer */
+} Sample;
+
+/* Feature values and labels of a node's samples, sorted for a split */
+typedef struct {
+    int value;
+    int label;
+} Pair;
+
+typedef struct {
+    const FingerprintDB *db;
+    TriageTree *tree;
+    Sample *samples;
+    int none;               /* Label for "no match", after the last entry */
+    
+    /* Scratch, all zero between uses */
+    int *tot;               /* Label counts of the node */
+    int *grp;               /* ...of one side of a split */
+    int *points;            /* Candidate points in a leaf */
+    int *seen;
+    Pair *pairs;
+    int *labels;
+    
+    double *xlogx;          /* x log x for every count up to the sample count */
+    
+    int *name_of;           /* Name table index of each entry, -1 if not in it */
+    int node_cap, leaf_cap, cand_cap, name_cap, names_cap;
+    int max_depth;
+    long depth_sum;         /* Depth of every sample's leaf, added up */
+} Builder;
+
+
+static void usage(const char *prog)
+{
+    printf("\n");
+    printf("Build the decision tree used by os_fingerprint -q\n");
+    printf("\n");
+    printf("Usage: %s [-t threads] [nmap-os-db]\n", prog);
+    printf("\n");
+    printf("The tree is written next to the database, as nmap-os-db%s.\n", TRIAGE_SUFFIX);
+    printf("\n");
+}
+
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+
+/* Grow an array when it's full. Returns -1 if out of memory. */
+static int reserve(void *array, int *cap, int count, size_t size)
+{
+    if (count < *cap)
+        return 0;
+    
+    int n = *cap ? *cap * 2 : 256;
+    void *p = realloc(*(void **)array, n * size);
+    if (!p) return -1;
+    *(void **)array = p;
+    *cap = n;
+    return 0;
+}
+
+
+/*
+ * Hosts.
+ */
+
+/* The TTL a fingerprint's replies start out with, 0 if it doesn't say */
+static int initial_ttl(const Fingerprint *fp)
+{
+    return fp->ttl_guess > 0 ? fp->ttl_guess : fp->ttl_min;
+}
+
+/* Every window a fingerprint lists (T1's and the WIN line's), no repeats */
+static int host_windows(const Fingerprint *fp, int *out)
+{
+    int n = 0;
+    
+    if (fp->window > 0)
+        out[n++] = fp->window;
+    
+    for (int i = 0; i < 6; i++) {
+        int w = fp->window_values[i];
+        int dup = w <= 0;
+        for (int j = 0; j < n && !dup; j++)
+            dup = out[j] == w;
+        if (!dup) out[n++] = w;
+    }
+    
+    if (n == 0)
+        out[n++] = 0;
+    return n;
+}
+
+/* The replies a host 'fp' describes would send, with this TTL and window */
+static void host_scan(const Fingerprint *fp, int ttl, int window, ScanResult *s)
+{
+    memset(s, 0, sizeof(*s));
+    
+    s->got_response = 1;
+    s->ttl = ttl;
+    s->window = window;
+    s->df_flag = fp->df_flag ? fp->df_flag : 'N';
+    strcpy(s->flags, "SA");
+    s->opts.window_scale = -1;
+    
+    if (fp->options && fp->options[0]) {
+        snprintf(s->options, sizeof(s->options), "%s", fp->options);
+        s->opts = fp->opts;
+    }
+    
+    s->t2_responded = fp->t2_responds == 'Y';
+    s->t3_responded = fp->t3_responds == 'Y';
+    
+    ProbeReply *t1 = &s->reply[PROBE_T1];
+    t1->responded = 1;
+    t1->flags = TH_SYN | TH_ACK;
+    t1->ttl = ttl;
+    t1->window = window;
+    t1->df_flag = s->df_flag;
+    
+    for (int p = PROBE_T4; p <= PROBE_T7; p++) {
+        const ProbeExpect *e = &fp->expect[p];
+        ProbeReply *r = &s->reply[p];
+        
+        r->responded = e->responds == 'Y';
+        if (r->responded) {
+            r->flags = e->flag_count ? e->flags[0] : 0;
+            r->ttl = ttl;
+            r->df_flag = e->df_flag ? e->df_flag : 'N';
+        }
+    }
+    s->t4_responded = s->reply[PROBE_T4].responded;
+}
+
+
+/* Calls 'fn' for every host of the database at these hop counts */
+typedef int (*HostFn)(const ScanResult *scan, void *arg);
+
+static int each_host(const FingerprintDB *db, const int *hops, int nhops, HostFn fn, void *arg)
+{
+    ScanResult scan;
+    
+    for (int i = 0; i < db->count; i++) {
+        const Fingerprint *fp = &db->entries[i];
+        int ttl = initial_ttl(fp);
+        if (ttl <= 0)
+            continue;
+        
+        int windows[MAX_WINDOWS];
+        int nw = host_windows(fp, windows);
+        
+        for (int w = 0; w < nw; w++) {
+            for (int h = 0; h < nhops; h++) {
+                host_scan(fp, ttl - hops[h] > 0 ? ttl - hops[h] : 1, windows[w], &scan);
+                if (fn(&scan, arg) < 0)
+                    return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/* Counting hosts */
+static int count_host(const ScanResult *scan, void *arg)
+{
+    (void)scan;
+    (*(int *)arg)++;
+    return 0;
+}
+
+
+/* Matching the training hosts a batch at a time with rank_batch() */
+typedef struct {
+    Builder *b;
+    const ScoreModel *model;
+    int threads;
+    ScanResult *scans;
+    int pending;
+    int count;              /* Samples done */
+    Match *matches;
+    int *counts;
+} Trainer;
+
+static int flush_hosts(Trainer *tr)
+{
+    Builder *b = tr->b;
+    
+    if (rank_batch(tr->model, tr->scans, tr->pending, 3, tr->threads,
+                   tr->matches, tr->counts) < 0)
+        return -1;
+    
+    for (int i = 0; i < tr->pending; i++) {
+        Sample *s = &b->samples[tr->count++];
+        
+        triage_features(b->tree, &tr->scans[i], s->f);
+        for (int k = 0; k < 3; k++) {
+            const Match *m = &tr->matches[i * 3 + k];
+            s->best[k] = k < tr->counts[i] ? (int)(m->fp - b->db->entries) : -1;
+        }
+    }
+    tr->pending = 0;
+    return 0;
+}
+
+static int add_host(const ScanResult *scan, void *arg)
+{
+    Trainer *tr = arg;
+    
+    tr->scans[tr->pending++] = *scan;
+    return tr->pending == SCAN_BATCH ? flush_hosts(tr) : 0;
+}
+
+
+/* The label a sample is learned by: its best full match */
+static int label_of(const Builder *b, const Sample *s)
+{
+    return s->best[0] >= 0 ? s->best[0] : b->none;
+}
+
+
+/*
+ * Growing the tree.
+ * 
+ * A split is scored by how much it lowers the entropy of the labels.
+ * With n_s samples on a side, c_l of them with label l, the entropy
+ * of the sides weighted by their size is the sum over both sides of
+ * n_s log n_s - sum(c_l log c_l), so the best split has the largest
+ * sum(c_l log c_l) - n_s log n_s. The sums are kept up to date as
+ * samples move from one side to the other, with x log x from a table.
+ * (Gini impurity would be cheaper, but with many labels seen equally
+ * often it scores every threshold the same, and the tree ends up
+ * peeling off one label at a time.)
+ */
+
+static int compare_pairs(const void *a, const void *b)
+{
+    const Pair *x = a, *y = b;
+    return (x->value > y->value) - (x->value < y->value);
+}
+
+
+/*
+ * The best test on one feature. Returns 1 and sets 'score' and
+ * 'value' if there is one, 0 if the feature doesn't split the node.
+ */
+static int best_test(Builder *b, const int *idx, int n, int feature,
+                     double tot_s, double *score, int *value)
+{
+    const double *xlx = b->xlogx;
+    Pair *p = b->pairs;
+    int found = 0;
+    
+    for (int i = 0; i < n; i++) {
+        p[i].value = b->samples[idx[i]].f[feature];
+        p[i].label = label_of(b, &b->samples[idx[i]]);
+    }
+    qsort(p, n, sizeof(Pair), compare_pairs);
+    
+    if (p[0].value == p[n - 1].value)
+        return 0;
+    
+    if (feature != TRIAGE_PATTERN) {
+        /* value <= v: move the samples over to the 'yes' side in order */
+        double yes_s = 0, no_s = tot_s;
+        
+        for (int i = 0; i < n - 1; i++) {
+            int l = p[i].label, c = b->grp[l]++, r = b->tot[l] - c;
+            yes_s += xlx[c + 1] - xlx[c];
+            no_s += xlx[r - 1] - xlx[r];
+            
+            if (p[i].value == p[i + 1].value)
+                continue;
+            
+            double s = yes_s - xlx[i + 1] + no_s - xlx[n - i - 1];
+            if (!found || s > *score) {
+                found = 1;
+                *score = s;
+                *value = p[i].value;
+            }
+        }
+        for (int i = 0; i < n; i++)
+            b->grp[p[i].label] = 0;
+        return found;
+    }
+    
+    /* value == v: each run of equal values against the rest */
+    for (int start = 0; start < n; ) {
+        int end = start;
+        double yes_s = 0, no_s = tot_s;
+        
+        while (end < n && p[end].value == p[start].value) {
+            int l = p[end].label, c = b->grp[l]++, r = b->tot[l] - c;
+            yes_s += xlx[c + 1] - xlx[c];
+            no_s += xlx[r - 1] - xlx[r];
+            end++;
+        }
+        
+        int yes = end - start;
+        double s = yes_s - xlx[yes] + no_s - xlx[n - yes];
+        if (yes < n && (!found || s > *score)) {
+            found = 1;
+            *score = s;
+            *value = p[start].value;
+        }
+        
+        for (int i = start; i < end; i++)
+            b->grp[p[i].label] = 0;
+        start = end;
+    }
+    return found;
+}
+
+
+/* Does sample s go to the 'yes' side of this test? */
+static int takes_yes(const Sample *s, int feature, int value)
+{
+    int v = s->f[feature];
+    return feature == TRIAGE_PATTERN ? v == value : v <= value;
+}
+
+
+/* The name table index of an entry, adding it if needed */
+static int entry_name(Builder *b, int entry)
+{
+    if (b->name_of[entry] >= 0)
+        return b->name_of[entry];
+    
+    TriageTree *t = b->tree;
+    const Fingerprint *fp = &b->db->entries[entry];
+    int len = strlen(fp->name) + 1;
+    
+    if (reserve(&t->name_os, &b->name_cap, t->name_count, 1) < 0)
+        return -1;
+    while (t->names_size + len > b->names_cap) {
+        int n = b->names_cap ? b->names_cap * 2 : 4096;
+        char *p = realloc(t->name_data, n);
+        if (!p) return -1;
+        t->name_data = p;
+        b->names_cap = n;
+    }
+    
+    memcpy(t->name_data + t->names_size, fp->name, len);
+    t->names_size += len;
+    t->name_os[t->name_count] = fp->os;
+    b->name_of[entry] = t->name_count;
+    return t->name_count++;
+}
+
+
+/*
+ * A leaf: the family most of its samples turned out to be, and the
+ * candidates ranked by how often they were the first, second or
+ * third match (3, 2 and 1 points), then by how often the first.
+ */
+static int make_leaf(Builder *b, const int *idx, int n)
+{
+    TriageTree *t = b->tree;
+    int family[OS_TYPES] = {0};
+    int distinct = 0;
+    
+    for (int i = 0; i < n; i++) {
+        const Sample *s = &b->samples[idx[i]];
+        family[s->best[0] >= 0 ? b->db->entries[s->best[0]].os : OS_UNKNOWN]++;
+        
+        for (int k = 0; k < 3; k++) {
+            int e = s->best[k];
+            if (e < 0) break;
+            if (!b->seen[e]) {
+                b->seen[e] = 1;
+                b->labels[distinct++] = e;
+            }
+            b->points[e] += 3 - k;
+        }
+    }
+    
+    int os = OS_UNKNOWN;
+    for (int f = 0; f < OS_TYPES; f++) {
+        if (family[f] > family[os]) os = f;
+    }
+    
+    /* The top few, by insertion */
+    int top[TRIAGE_SHORTLIST];
+    int count = 0;
+    
+    for (int i = 0; i < distinct; i++) {
+        int e = b->labels[i];
+        int pos = count < TRIAGE_SHORTLIST ? count : TRIAGE_SHORTLIST;
+        
+        while (pos > 0) {
+            int o = top[pos - 1];
+            int above = b->points[e] > b->points[o] ||
+                        (b->points[e] == b->points[o] &&
+                         (b->tot[e] > b->tot[o] || (b->tot[e] == b->tot[o] && e < o)));
+            if (!above) break;
+            if (pos < TRIAGE_SHORTLIST) top[pos] = o;
+            pos--;
+        }
+        if (pos < TRIAGE_SHORTLIST) {
+            top[pos] = e;
+            if (count < TRIAGE_SHORTLIST) count++;
+        }
+    }
+    
+    for (int i = 0; i < distinct; i++) {
+        b->seen[b->labels[i]] = 0;
+        b->points[b->labels[i]] = 0;
+    }
+    
+    if (reserve(&t->leaves, &b->leaf_cap, t->leaf_count, sizeof(TriageLeaf)) < 0 ||
+        reserve(&t->cands, &b->cand_cap, t->cand_count + TRIAGE_SHORTLIST,
+                sizeof(TriageCand)) < 0)
+        return -1;
+    
+    TriageLeaf *leaf = &t->leaves[t->leaf_count];
+    leaf->os = os;
+    leaf->count = count;
+    leaf->pad = 0;
+    leaf->first = t->cand_count;
+    
+    for (int i = 0; i < count; i++) {
+        int name = entry_name(b, top[i]);
+        if (name < 0) return -1;
+        
+        TriageCand *c = &t->cands[t->cand_count++];
+        c->name = name;
+        c->share = (uint32_t)(1000L * b->tot[top[i]] / n);
+    }
+    return t->leaf_count++;
+}
+
+
+/* Grow the subtree for samples idx[0..n). Returns its node, or -1. */
+static int grow(Builder *b, int *idx, int n, int depth)
+{
+    TriageTree *t = b->tree;
+    
+    if (reserve(&t->nodes, &b->node_cap, t->node_count, sizeof(TriageNode)) < 0)
+        return -1;
+    int node = t->node_count++;
+    memset(&t->nodes[node], 0, sizeof(TriageNode));
+    
+    /* Label counts of this node */
+    double tot_s = 0;
+    int pure = 1;
+    for (int i = 0; i < n; i++) {
+        int l = label_of(b, &b->samples[idx[i]]);
+        tot_s += b->xlogx[b->tot[l] + 1] - b->xlogx[b->tot[l]];
+        b->tot[l]++;
+        pure &= b->tot[l] == i + 1;
+    }
+    
+    int feature = -1, value = 0;
+    double best = tot_s - b->xlogx[n];
+    
+    if (depth < MAX_DEPTH && !pure) {
+        for (int f = 0; f < TRIAGE_FEATURES; f++) {
+            int v = 0;
+            double score = 0;
+            
+            /* Only splits that make the sides purer */
+            if (best_test(b, idx, n, f, tot_s, &score, &v) && score > best + 1e-6) {
+                best = score;
+                feature = f;
+                value = v;
+            }
+        }
+    }
+    
+    if (feature < 0) {
+        int leaf = make_leaf(b, idx, n);
+        for (int i = 0; i < n; i++)
+            b->tot[label_of(b, &b->samples[idx[i]])] = 0;
+        if (leaf < 0) return -1;
+        
+        t->nodes[node].feature = TRIAGE_LEAF;
+        t->nodes[node].value = leaf;
+        if (depth > b->max_depth) b->max_depth = depth;
+        b->depth_sum += (long)depth * n;
+        return node;
+    }
+    
+    for (int i = 0; i < n; i++)
+        b->tot[label_of(b, &b->samples[idx[i]])] = 0;
+    
+    /* The 'yes' side first */
+    int yes = 0;
+    for (int i = 0; i < n; i++) {
+        if (takes_yes(&b->samples[idx[i]], feature, value)) {
+            int tmp = idx[yes];
+            idx[yes++] = idx[i];
+            idx[i] = tmp;
+        }
+    }
+    
+    int left = grow(b, idx, yes, depth + 1);
+    int right = left < 0 ? -1 : grow(b, idx + yes, n - yes, depth + 1);
+    if (right < 0)
+        return -1;
+    
+    TriageNode *nd = &t->nodes[node];
+    nd->feature = feature;
+    nd->value = value;
+    nd->yes = left;
+    nd->no = right;
+    return node;
+}
+
+
+/* The option patterns the database has, "" for none */
+static void collect_patterns(const FingerprintDB *db, TriageTree *t)
+{
+    strcpy(t->patterns[t->pattern_count++], "");
+    
+    for (int i = 0; i < db->count && t->pattern_count < TRIAGE_PATTERNS; i++) {
+        const Fingerprint *fp = &db->entries[i];
+        if (!fp->options || !fp->options[0])
+            continue;
+        
+        int found = 0;
+        for (int j = 0; j < t->pattern_count && !found; j++)
+            found = strcmp(t->patterns[j], fp->opts.pattern) == 0;
+        if (!found)
+            snprintf(t->patterns[t->pattern_count++], 32, "%s", fp->opts.pattern);
+    }
+}
+
+
+/* Point the name table into the block of names, as triage_load() does */
+static int index_tree_names(TriageTree *t)
+{
+    t->names = malloc(sizeof(char *) * (t->name_count ? t->name_count : 1));
+    if (!t->names) return -1;
+    
+    char *p = t->name_data;
+    for (int i = 0; i < t->name_count; i++) {
+        t->names[i] = p;
+        p += strlen(p) + 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Checking.
+ * 
+ * For each test host the reference answer is calculate_score() over
+ * the whole database; the tree only gets to see the SYN-ACK.
+ */
+typedef struct {
+    const FingerprintDB *db;
+    const TriageTree *tree;
+    ScanResult *scans;
+    int count, cap;
+    int every, seen;        /* Keep every n-th host */
+} Checker;
+
+static int keep_host(const ScanResult *scan, void *arg)
+{
+    Checker *c = arg;
+    
+    if (c->seen++ % c->every == 0 && c->count < c->cap)
+        c->scans[c->count++] = *scan;
+    return 0;
+}
+
+/* The best entry by calculate_score(), as rank_matches() picks it; NULL if none */
+static const Fingerprint *reference_best(const FingerprintDB *db, const ScanResult *scan)
+{
+    const Fingerprint *best = NULL;
+    int best_score = 0;
+    
+    for (int i = 0; i < db->count; i++) {
+        const Fingerprint *fp = &db->entries[i];
+        int score = calculate_score(fp, scan);
+        
+        if (score > -100 && (!best || score > best_score ||
+                             (score == best_score && fp->index < best->index))) {
+            best = fp;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+static void test_tree(Checker *c, const ScoreModel *model)
+{
+    int family = 0, first = 0, listed = 0, max_cmp = 0;
+    long cmp = 0;
+    
+    for (int i = 0; i < c->count; i++) {
+        const Fingerprint *truth = reference_best(c->db, &c->scans[i]);
+        TriageResult r;
+        triage_classify(c->tree, &c->scans[i], &r);
+        
+        cmp += r.comparisons;
+        if (r.comparisons > max_cmp) max_cmp = r.comparisons;
+        
+        if (r.os == (truth ? truth->os : OS_UNKNOWN))
+            family++;
+        for (int k = 0; truth && k < r.count; k++) {
+            if (strcmp(r.names[k], truth->name) == 0) {
+                listed++;
+                if (k == 0) first++;
+                break;
+            }
+        }
+    }
+    
+    int n = c->count ? c->count : 1;
+    printf("\nChecked on %d hosts at other hop counts, against calculate_score():\n", c->count);
+    printf("  OS family right:          %5.1f%%\n", 100.0 * family / n);
+    printf("  Best match first:         %5.1f%%\n", 100.0 * first / n);
+    printf("  Best match in the list:   %5.1f%%\n", 100.0 * listed / n);
+    printf("  Comparisons:              %.1f on average, %d at most\n", (double)cmp / n, max_cmp);
+    
+    /* And what it costs next to a full match */
+    int rounds = 100;
+    double start = now_ms();
+    TriageResult r;
+    for (int k = 0; k < rounds; k++) {
+        for (int i = 0; i < c->count; i++)
+            triage_classify(c->tree, &c->scans[i], &r);
+    }
+    double tree_us = (now_ms() - start) * 1000.0 / ((double)rounds * n);
+    
+    Match matches[TOP_MATCHES];
+    start = now_ms();
+    for (int i = 0; i < c->count; i++)
+        rank_matches(model, &c->scans[i], matches, TOP_MATCHES);
+    double full_us = (now_ms() - start) * 1000.0 / n;
+    
+    printf("  Time per host:            %.3f us (rank_matches: %.1f us)\n", tree_us, full_us);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+            case 't': threads = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (threads < 1)
+        threads = 1;
+    
+    const char *db_path = optind < argc ? argv[optind] : "data/nmap-os-db";
+    
+    struct stat st;
+    if (stat(db_path, &st) < 0) {
+        perror(db_path);
+        return 1;
+    }
+    
+    FingerprintDB *db = load_database(db_path);
+    if (!db) {
+        printf("Error: Could not load %s.\n", db_path);
+        return 1;
+    }
+    
+    ScoreModel *model = build_score_model(db);
+    TriageTree *tree = calloc(1, sizeof(TriageTree));
+    Builder b;
+    memset(&b, 0, sizeof(b));
+    Trainer tr;
+    memset(&tr, 0, sizeof(tr));
+    
+    int hosts = 0;
+    each_host(db, train_hops, sizeof(train_hops) / sizeof(train_hops[0]), count_host, &hosts);
+    
+    int labels = db->count + 1;
+    b.db = db;
+    b.tree = tree;
+    b.none = db->count;
+    b.samples = malloc(sizeof(Sample) * (hosts ? hosts : 1));
+    b.tot = calloc(labels, sizeof(int));
+    b.grp = calloc(labels, sizeof(int));
+    b.points = calloc(labels, sizeof(int));
+    b.seen = calloc(labels, sizeof(int));
+    b.labels = malloc(sizeof(int) * labels);
+    b.name_of = malloc(sizeof(int) * labels);
+    b.pairs = malloc(sizeof(Pair) * (hosts ? hosts : 1));
+    b.xlogx = malloc(sizeof(double) * (hosts + 1));
+    int *idx = malloc(sizeof(int) * (hosts ? hosts : 1));
+    
+    tr.b = &b;
+    tr.model = model;
+    tr.threads = threads;
+    tr.scans = malloc(sizeof(ScanResult) * SCAN_BATCH);
+    tr.matches = malloc(sizeof(Match) * 3 * SCAN_BATCH);
+    tr.counts = malloc(sizeof(int) * SCAN_BATCH);
+    
+    if (tree)
+        tree->patterns = malloc(32 * TRIAGE_PATTERNS);
+    
+    int rc = 1;
+    
+    if (!model || !tree || !tree->patterns || !b.samples || !b.tot || !b.grp ||
+        !b.points || !b.seen || !b.labels || !b.name_of || !b.pairs || !b.xlogx || !idx ||
+        !tr.scans || !tr.matches || !tr.counts) {
+        printf("Error: Out of memory.\n");
+        goto done;
+    }
+    
+    for (int i = 0; i < labels; i++)
+        b.name_of[i] = -1;
+    for (int i = 0; i <= hosts; i++)
+        b.xlogx[i] = i > 0 ? i * log(i) : 0;
+    tree->db_size = st.st_size;
+    tree->db_mtime = st.st_mtime;
+    collect_patterns(db, tree);
+    
+    /* What a full scan says about each training host */
+    printf("Matching %d hosts in full with %d threads...\n", hosts, threads);
+    double start = now_ms();
+    
+    if (each_host(db, train_hops, sizeof(train_hops) / sizeof(train_hops[0]), add_host, &tr) < 0 ||
+        (tr.pending > 0 && flush_hosts(&tr) < 0)) {
+        printf("Error: Out of memory.\n");
+        goto done;
+    }
+    printf("   done in %.0f ms\n", now_ms() - start);
+    
+    printf("Growing the tree...\n");
+    start = now_ms();
+    
+    for (int i = 0; i < tr.count; i++)
+        idx[i] = i;
+    if (tr.count == 0 || grow(&b, idx, tr.count, 0) < 0) {
+        printf("Error: %s\n", tr.count ? "Out of memory." : "Nothing to learn from.");
+        goto done;
+    }
+    
+    printf("   %d nodes, %d leaves, %d names, depth %.1f on average and %d at most (%.0f ms)\n",
+           tree->node_count, tree->leaf_count, tree->name_count,
+           (double)b.depth_sum / tr.count, b.max_depth, now_ms() - start);
+    
+    if (index_tree_names(tree) < 0 || triage_save(tree, db_path) < 0)
+        goto done;
+    printf("Saved %s%s\n", db_path, TRIAGE_SUFFIX);
+    
+    /* Checked on hosts it hasn't seen */
+    Checker c;
+    memset(&c, 0, sizeof(c));
+    c.db = db;
+    c.tree = tree;
+    c.scans = tr.scans;
+    c.cap = SCAN_BATCH < TEST_MAX ? SCAN_BATCH : TEST_MAX;
+    
+    int nhops = sizeof(test_hops) / sizeof(test_hops[0]);
+    int total = 0;
+    each_host(db, test_hops, nhops, count_host, &total);
+    c.every = total / c.cap + 1;
+    each_host(db, test_hops, nhops, keep_host, &c);
+    test_tree(&c, model);
+    rc = 0;
+    
+done:
+    free(idx);
+    free(b.xlogx);
+    free(b.pairs);
+    free(b.name_of);
+    free(b.labels);
+    free(b.seen);
+    free(b.points);
+    free(b.grp);
+    free(b.tot);
+    free(b.samples);
+    free(tr.counts);
+    free(tr.matches);
+    free(tr.scans);
+    triage_free(tree);
+    free_score_model(model);
+    free_database(db);
+    return rc;
+}
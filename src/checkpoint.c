@@ -0,0 +1,174 @@
+/*
+ * checkpoint.c - Atomic checkpoint files for batch scans
+ * 
+ * A checkpoint is small (a header, a bitmap of at most
+ * CHECKPOINT_WINDOW bits and a few addresses), so it's written in
+ * one go to "<path>.tmp", synced, and renamed over the old one; the
+ * directory is synced too, so the rename itself survives a crash.
+ * A checksum catches a file that was cut short or damaged anyway.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+#include "../include/checkpoint.h"
+#include "../include/utils.h"
+
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ p[i]) * FNV_PRIME;
+    return hash;
+}
+
+
+uint64_t checkpoint_id(char **specs, int count, const char *file, int port,
+                       int shard, int shards)
+{
+    uint64_t hash = FNV_OFFSET;
+    
+    /* The terminators keep "1.2.3.4" "5" apart from "1.2.3.45" */
+    for (int i = 0; i < count; i++)
+        hash = fnv1a(hash, specs[i], strlen(specs[i]) + 1);
+    hash = fnv1a(hash, file ? file : "", file ? strlen(file) + 1 : 1);
+    
+    int numbers[] = {port, shard, shards};
+    return fnv1a(hash, numbers, sizeof(numbers));
+}
+
+
+static size_t bitmap_bytes(const CheckpointHeader *h)
+{
+    return (h->next - h->base + 7) / 8;
+}
+
+
+static uint64_t file_checksum(Checkpoint *cp)
+{
+    CheckpointHeader h = cp->head;
+    h.checksum = 0;
+    
+    uint64_t hash = fnv1a(FNV_OFFSET, &h, sizeof(h));
+    hash = fnv1a(hash, cp->done, bitmap_bytes(&h));
+    return fnv1a(hash, cp->pending, h.pending * sizeof(in_addr_t));
+}
+
+
+/* Make a rename in path's directory stick */
+static int sync_directory(const char *path)
+{
+    char copy[4096];
+    snprintf(copy, sizeof(copy), "%s", path);
+    
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+
+int checkpoint_write(const char *path, Checkpoint *cp)
+{
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    
+    memcpy(cp->head.magic, CHECKPOINT_MAGIC, 8);
+    cp->head.version = CHECKPOINT_VERSION;
+    cp->head.reserved = 0;
+    cp->head.checksum = file_checksum(cp);
+    
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    
+    int rc = 0;
+    if (write_all(fd, &cp->head, sizeof(cp->head)) < 0 ||
+        write_all(fd, cp->done, bitmap_bytes(&cp->head)) < 0 ||
+        write_all(fd, cp->pending, cp->head.pending * sizeof(in_addr_t)) < 0 ||
+        fdatasync(fd) < 0)
+        rc = -1;
+    
+    int err = errno;
+    close(fd);
+    
+    if (rc == 0 && rename(tmp, path) == 0)
+        return sync_directory(path);
+    
+    if (rc == 0)
+        err = errno;
+    unlink(tmp);
+    errno = err;
+    return -1;
+}
+
+
+int checkpoint_read(const char *path, Checkpoint *cp)
+{
+    memset(cp, 0, sizeof(*cp));
+    
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return -1;
+    
+    CheckpointHeader *h = &cp->head;
+    int ok = fread(h, sizeof(*h), 1, f) == 1 &&
+             memcmp(h->magic, CHECKPOINT_MAGIC, 8) == 0 &&
+             h->version == CHECKPOINT_VERSION &&
+             h->base <= h->next && h->next - h->base <= CHECKPOINT_WINDOW &&
+             h->pending <= h->next - h->base;
+    
+    int err = EINVAL;
+    if (ok) {
+        cp->done = malloc(bitmap_bytes(h) + 1);
+        cp->pending = malloc(h->pending * sizeof(in_addr_t) + 1);
+        if (!cp->done || !cp->pending) {
+            err = ENOMEM;
+            ok = 0;
+        }
+    }
+    
+    ok = ok && fread(cp->done, 1, bitmap_bytes(h), f) == bitmap_bytes(h) &&
+         fread(cp->pending, sizeof(in_addr_t), h->pending, f) == h->pending &&
+         fgetc(f) == EOF && file_checksum(cp) == h->checksum;
+    fclose(f);
+    
+    /* One address for every target that isn't done */
+    uint64_t missing = 0;
+    for (uint64_t i = 0; ok && i < h->next - h->base; i++)
+        missing += !(cp->done[i / 8] & (1u << (i % 8)));
+    ok = ok && missing == h->pending;
+    
+    if (!ok) {
+        checkpoint_free(cp);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+
+void checkpoint_free(Checkpoint *cp)
+{
+    free(cp->done);
+    free(cp->pending);
+    cp->done = NULL;
+    cp->pending = NULL;
+}
@@ -4,21 +4,198 @@
  * The database contains thousands of OS fingerprints.
  * Each fingerprint has expected values for TTL, window size,
  * TCP options, and behavioral responses.
+ * 
+ * Entries don't depend on each other, so the file is mapped and cut
+ * into chunks where an entry starts, and the chunks are parsed on a
+ * few threads. Each chunk keeps its strings and classes in its own
+ * arena, and the entries are put back together in file order.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "../include/defs.h"
+#include "../include/db_parser.h"
 #include "../include/utils.h"
+#include "../include/probes.h"
+
+/* About this much of the file per chunk, on at most this many threads */
+#define DB_CHUNK_SIZE   (256 * 1024)
+#define DB_MAX_THREADS  16
+
+/* Arena block size; anything bigger gets a block of its own */
+#define DB_ARENA_BLOCK  (64 * 1024)
+
+
+/*
+ * Strings and classes are carved out of big blocks instead of being
+ * malloc()ed one by one, so a thread doesn't fight the others over
+ * the heap, and freeing the database is a walk down the list.
+ */
+typedef struct DBArena {
+    struct DBArena *next;
+    size_t used;
+    size_t size;
+    char data[];
+} DBArena;
+
+/* One piece of the file and what came out of it */
+typedef struct {
+    const char *start;
+    const char *end;
+    Fingerprint *entries;
+    int count;
+    int cap;
+    OSClass *classes;       /* Class lines of the entry being parsed */
+    int class_cap;
+    DBArena *arena;
+    int failed;
+} DBChunk;
+
+typedef struct {
+    DBChunk *chunks;
+    int count;
+    atomic_int next;        /* Next chunk to parse */
+} DBLoad;
+
+
+static void *arena_alloc(DBArena **arena, size_t len)
+{
+    len = (len + 7) & ~(size_t)7;
+    
+    DBArena *a = *arena;
+    if (!a || a->size - a->used < len) {
+        size_t size = len > DB_ARENA_BLOCK ? len : DB_ARENA_BLOCK;
+        DBArena *block = malloc(sizeof(DBArena) + size);
+        if (!block) return NULL;
+        
+        block->next = a;
+        block->used = 0;
+        block->size = size;
+        *arena = a = block;
+    }
+    
+    void *p = a->data + a->used;
+    a->used += len;
+    return p;
+}
+
+
+static char *arena_strdup(DBArena **arena, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *copy = arena_alloc(arena, len);
+    if (copy) memcpy(copy, s, len);
+    return copy;
+}
+
+
+static void free_arena(DBArena *a)
+{
+    while (a) {
+        DBArena *next = a->next;
+        free(a);
+        a = next;
+    }
+}
+
+
+/*
+ * Parse a value with alternatives, like "DFI=N|S", into a bitmask:
+ * bit i for the letter names[i], and 'other' for anything else
+ * (hex values, for instance). 0 if the key isn't there.
+ */
+static int parse_choices(const char *line, const char *key, const char *names, int other)
+{
+    char tmp[MAX_OPTIONS];
+    parse_string(line, key, tmp, sizeof(tmp));
+    
+    int mask = 0;
+    char *p = tmp;
+    while (*p) {
+        size_t len = strcspn(p, "|");
+        const char *hit = (len == 1) ? strchr(names, *p) : NULL;
+        mask |= hit ? 1 << (hit - names) : other;
+        
+        p += len;
+        if (*p == '|') p++;
+    }
+    return mask;
+}
+
+
+/*
+ * Flag combinations separated by "|", like "AR|R". Each one is a
+ * whole set of flags a reply may have, so they aren't OR-ed together.
+ */
+static void parse_flag_choices(const char *line, const char *key, ProbeExpect *e)
+{
+    char tmp[MAX_OPTIONS];
+    parse_string(line, key, tmp, sizeof(tmp));
+    
+    e->flag_count = 0;
+    char *p = tmp;
+    while (*p && e->flag_count < FLAG_CHOICES) {
+        size_t len = strcspn(p, "|");
+        char save = p[len];
+        p[len] = '\0';
+        int flags = parse_flags(p);
+        p[len] = save;
+        
+        int dup = 0;
+        for (int i = 0; i < e->flag_count; i++)
+            dup |= e->flags[i] == flags;
+        if (!dup)
+            e->flags[e->flag_count++] = flags;
+        
+        p += len;
+        if (*p == '|') p++;
+    }
+}
+
+
+/*
+ * The U1 checks on what the reply quotes of our packet.
+ * Only a check with a single answer (good or not) is scored.
+ */
+static void parse_quote(const char *line, UnreachExpect *u)
+{
+    static const struct {
+        const char *key;
+        const char *good;
+        int check;
+    } checks[QUOTE_CHECKS] = {
+        {"RIPL=",  "G", QUOTE_RIPL},
+        {"RID=",   "G", QUOTE_RID},
+        {"RIPCK=", "G", QUOTE_RIPCK},
+        {"RUCK=",  "G", QUOTE_RUCK},
+        {"RUD=",   "G", QUOTE_RUD},
+        {"%UN=",   "0", QUOTE_UN},
+    };
+    
+    for (int i = 0; i < QUOTE_CHECKS; i++) {
+        int mask = parse_choices(line, checks[i].key, checks[i].good, 2);
+        if (mask == 1 || mask == 2)
+            u->quote_known |= checks[i].check;
+        if (mask == 1)
+            u->quote_good |= checks[i].check;
+    }
+}
 
 
 /*
  * Parse a single test line from the database.
  * These look like: T1(R=Y%DF=Y%T=80%W=FFFF%O=M5B4...)
  */
-static void parse_test(const char *line, Fingerprint *fp)
+static void parse_test(const char *line, Fingerprint *fp, DBArena **arena)
 {
     char tmp[MAX_OPTIONS];
     
@@ -36,7 +213,7 @@ static void parse_test(const char *line, Fingerprint *fp)
         
         parse_string(line, "O=", tmp, sizeof(tmp));
         if (tmp[0]) {
-            fp->options = strdup(tmp);
+            fp->options = arena_strdup(arena, tmp);
             parse_options(tmp, &fp->opts);
         }
     }
@@ -50,6 +227,48 @@ static void parse_test(const char *line, Fingerprint *fp)
         parse_string(line, "R=", tmp, sizeof(tmp));
         if (tmp[0]) fp->t3_responds = tmp[0];
     }
+    /* T4 = ACK probe, T5-T7 = probes to a closed port */
+    else if (line[0] == 'T' && line[1] >= '4' && line[1] <= '7' && line[2] == '(') {
+        ProbeExpect *e = &fp->expect[PROBE_T4 + (line[1] - '4')];
+        
+        parse_string(line, "(R=", tmp, sizeof(tmp));
+        if (tmp[0]) e->responds = tmp[0];
+        
+        parse_string(line, "%DF=", tmp, sizeof(tmp));
+        if (tmp[0]) e->df_flag = tmp[0];
+        
+        /* "%F=" so we don't pick up the end of "DF=" */
+        parse_flag_choices(line, "%F=", e);
+    }
+    /* IE = the two ICMP echo requests */
+    else if (strncmp(line, "IE(", 3) == 0) {
+        parse_string(line, "(R=", tmp, sizeof(tmp));
+        if (tmp[0]) fp->echo.responds = tmp[0];
+        
+        fp->echo.dfi = parse_choices(line, "DFI=", "NSYO", DFI_O);
+        fp->echo.cd = parse_choices(line, "CD=", "ZSO", CD_O);
+    }
+    /* U1 = UDP to a closed port */
+    else if (strncmp(line, "U1(", 3) == 0) {
+        UnreachExpect *u = &fp->unreach;
+        
+        parse_string(line, "(R=", tmp, sizeof(tmp));
+        if (tmp[0]) u->responds = tmp[0];
+        
+        parse_string(line, "%DF=", tmp, sizeof(tmp));
+        if (tmp[0] == 'Y' || tmp[0] == 'N') u->df_flag = tmp[0];
+        
+        /* Up to two lengths, like "164|38" */
+        parse_string(line, "%IPL=", tmp, sizeof(tmp));
+        char *p = tmp;
+        for (int i = 0; i < 2 && *p; i++) {
+            u->ipl[i] = (int)strtol(p, &p, 16);
+            if (*p != '|') break;
+            p++;
+        }
+        
+        parse_quote(line, u);
+    }
     /* WIN = Window sizes for different probes */
     else if (strncmp(line, "WIN(", 4) == 0) {
         fp->window_values[0] = parse_hex(line, "W1=");
@@ -63,83 +282,408 @@ static void parse_test(const char *line, Fingerprint *fp)
 
 
 /*
- * Load the nmap fingerprint database.
- * Returns a linked list of fingerprints.
+ * Parse a line like "Class Microsoft | Windows | 10 | general purpose".
  */
-FingerprintNode *load_database(const char *path)
+static void parse_class(const char *line, OSClass *c)
 {
-    FILE *file = fopen(path, "r");
-    if (!file) {
-        printf("Error: Can't open database at %s\n", path);
-        return NULL;
+    memset(c, 0, sizeof(*c));
+    
+    char *fields[4] = {c->vendor, c->family, c->generation, c->device_type};
+    size_t sizes[4] = {sizeof(c->vendor), sizeof(c->family),
+                       sizeof(c->generation), sizeof(c->device_type)};
+    
+    const char *p = line + 6;
+    for (int f = 0; f < 4 && *p; f++) {
+        /* Trim the spaces around each field */
+        while (*p == ' ') p++;
+        size_t len = strcspn(p, "|\n\r");
+        size_t end = len;
+        while (end > 0 && p[end - 1] == ' ') end--;
+        
+        if (end >= sizes[f]) end = sizes[f] - 1;
+        memcpy(fields[f], p, end);
+        
+        p += len;
+        if (*p == '|') p++;
+        else break;
+    }
+}
+
+
+/*
+ * The OS family of an entry.
+ * The Class lines say it directly; entries without any fall back
+ * to guessing from the name.
+ */
+static OSType classify(const Fingerprint *fp)
+{
+    if (fp->class_count == 0)
+        return guess_os_from_name(fp->name);
+    
+    for (int i = 0; i < fp->class_count; i++) {
+        const char *family = fp->classes[i].family;
+        
+        if (strcmp(family, "Windows") == 0)
+            return OS_WINDOWS;
+        if (strcmp(family, "Linux") == 0 || strcmp(family, "Android") == 0)
+            return OS_LINUX;
     }
+    return OS_OTHER;
+}
+
+
+/*
+ * The last entry of the chunk is complete: move its classes into
+ * the arena and work out its family.
+ */
+static int finish_entry(DBChunk *c)
+{
+    if (c->count == 0)
+        return 0;
     
-    FingerprintNode *head = NULL;
-    FingerprintNode *tail = NULL;
-    char line[MAX_LINE];
-    int count = 0;
+    Fingerprint *fp = &c->entries[c->count - 1];
+    if (fp->class_count > 0) {
+        fp->classes = arena_alloc(&c->arena, sizeof(OSClass) * fp->class_count);
+        if (!fp->classes) return -1;
+        memcpy(fp->classes, c->classes, sizeof(OSClass) * fp->class_count);
+    }
+    fp->os = classify(fp);
+    return 0;
+}
+
+
+/*
+ * Parse one line into the chunk.
+ * Returns -1 if out of memory.
+ */
+static int parse_line(DBChunk *c, char *line)
+{
+    /* Skip comments and blank lines */
+    if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+        return 0;
+    
+    Fingerprint *fp = c->count ? &c->entries[c->count - 1] : NULL;
     
-    printf("Loading fingerprint database... ");
-    fflush(stdout);
-    
-    while (fgets(line, sizeof(line), file)) {
-        /* Skip comments and blank lines */
-        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
-            continue;
-        
-        /* New fingerprint entry */
-        if (strncmp(line, "Fingerprint ", 12) == 0) {
-            FingerprintNode *node = malloc(sizeof(FingerprintNode));
-            node->fp = calloc(1, sizeof(Fingerprint));
-            node->next = NULL;
-            
-            /* Extract the OS name */
-            char *name = line + 12;
-            name[strcspn(name, "\n\r")] = '\0';
-            node->fp->name = strdup(name);
-            
-            /* Add to list */
-            if (!head) {
-                head = tail = node;
-            } else {
-                tail->next = node;
-                tail = node;
-            }
-            count++;
+    /* New fingerprint entry */
+    if (strncmp(line, "Fingerprint ", 12) == 0) {
+        if (finish_entry(c) < 0)
+            return -1;
+        
+        if (c->count == c->cap) {
+            int cap = c->cap ? c->cap * 2 : 256;
+            Fingerprint *grown = realloc(c->entries, sizeof(Fingerprint) * cap);
+            if (!grown) return -1;
+            c->entries = grown;
+            c->cap = cap;
         }
-        /* Parse test data for current fingerprint */
-        else if (tail && (
-            strncmp(line, "T1(", 3) == 0 ||
-            strncmp(line, "T2(", 3) == 0 ||
-            strncmp(line, "T3(", 3) == 0 ||
-            strncmp(line, "WIN(", 4) == 0))
-        {
-            parse_test(line, tail->fp);
+        
+        fp = &c->entries[c->count++];
+        memset(fp, 0, sizeof(*fp));
+        fp->unreach.ipl[0] = fp->unreach.ipl[1] = -1;
+        
+        /* Extract the OS name */
+        char *name = line + 12;
+        name[strcspn(name, "\n\r")] = '\0';
+        fp->name = arena_strdup(&c->arena, name);
+        if (!fp->name) return -1;
+    }
+    /* What kind of system it is */
+    else if (fp && strncmp(line, "Class ", 6) == 0) {
+        if (fp->class_count == c->class_cap) {
+            int cap = c->class_cap ? c->class_cap * 2 : 16;
+            OSClass *grown = realloc(c->classes, sizeof(OSClass) * cap);
+            if (!grown) return -1;
+            c->classes = grown;
+            c->class_cap = cap;
         }
+        parse_class(line, &c->classes[fp->class_count++]);
     }
+    /* Parse test data for current fingerprint */
+    else if (fp && (
+        strncmp(line, "T1(", 3) == 0 ||
+        strncmp(line, "T2(", 3) == 0 ||
+        strncmp(line, "T3(", 3) == 0 ||
+        strncmp(line, "T4(", 3) == 0 ||
+        strncmp(line, "T5(", 3) == 0 ||
+        strncmp(line, "T6(", 3) == 0 ||
+        strncmp(line, "T7(", 3) == 0 ||
+        strncmp(line, "IE(", 3) == 0 ||
+        strncmp(line, "U1(", 3) == 0 ||
+        strncmp(line, "WIN(", 4) == 0))
+    {
+        parse_test(line, fp, &c->arena);
+    }
+    return 0;
+}
+
+
+static void parse_chunk(DBChunk *c)
+{
+    char line[MAX_LINE];
+    const char *p = c->start;
     
-    printf("done (%d entries)\n", count);
-    fclose(file);
+    while (p < c->end) {
+        /* One line at a time, cut at MAX_LINE - 1 bytes like fgets() */
+        const char *nl = memchr(p, '\n', c->end - p);
+        size_t len = nl ? (size_t)(nl - p) + 1 : (size_t)(c->end - p);
+        if (len > MAX_LINE - 1) len = MAX_LINE - 1;
+        
+        memcpy(line, p, len);
+        line[len] = '\0';
+        p += len;
+        
+        if (parse_line(c, line) < 0) {
+            c->failed = 1;
+            return;
+        }
+    }
     
-    return head;
+    if (finish_entry(c) < 0)
+        c->failed = 1;
+}
+
+
+static void *load_thread(void *data)
+{
+    DBLoad *load = data;
+    
+    while (1) {
+        int i = atomic_fetch_add(&load->next, 1);
+        if (i >= load->count)
+            break;
+        parse_chunk(&load->chunks[i]);
+    }
+    return NULL;
+}
+
+
+/* The start of the first "Fingerprint " line at or after p */
+static const char *next_entry(const char *map, const char *p, const char *end)
+{
+    if (p > map && p[-1] != '\n') {
+        p = memchr(p, '\n', end - p);
+        if (!p) return end;
+        p++;
+    }
+    
+    while (p < end) {
+        if ((size_t)(end - p) >= 12 && memcmp(p, "Fingerprint ", 12) == 0)
+            return p;
+        p = memchr(p, '\n', end - p);
+        if (!p) return end;
+        p++;
+    }
+    return end;
 }
 
 
 /*
- * Free all database memory.
+ * Cut the file into chunks of about DB_CHUNK_SIZE bytes. Every chunk
+ * but the first starts with a "Fingerprint " line, so no entry is
+ * split between two of them.
+ */
+static DBChunk *split_file(const char *map, size_t size, int *count)
+{
+    DBChunk *chunks = calloc(size / DB_CHUNK_SIZE + 1, sizeof(DBChunk));
+    if (!chunks) return NULL;
+    
+    const char *p = map;
+    const char *end = map + size;
+    int n = 0;
+    
+    while (p < end) {
+        const char *cut = end;
+        if ((size_t)(end - p) > DB_CHUNK_SIZE)
+            cut = next_entry(map, p + DB_CHUNK_SIZE, end);
+        
+        chunks[n].start = p;
+        chunks[n].end = cut;
+        n++;
+        p = cut;
+    }
+    
+    *count = n;
+    return chunks;
+}
+
+
+static void free_chunks(DBChunk *chunks, int count)
+{
+    for (int i = 0; i < count; i++) {
+        free(chunks[i].entries);
+        free(chunks[i].classes);
+        free_arena(chunks[i].arena);
+    }
+    free(chunks);
+}
+
+
+/* Parse all chunks, on as many threads as there are cores */
+static void parse_chunks(DBChunk *chunks, int count)
+{
+    DBLoad load;
+    load.chunks = chunks;
+    load.count = count;
+    atomic_init(&load.next, 0);
+    
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > DB_MAX_THREADS) threads = DB_MAX_THREADS;
+    if (threads > count) threads = count;
+    if (threads < 1) threads = 1;
+    
+    pthread_t ids[DB_MAX_THREADS];
+    int started = 0;
+    
+    /* The calling thread is one of them */
+    for (int t = 1; t < threads; t++) {
+        if (pthread_create(&ids[started], NULL, load_thread, &load) != 0)
+            break;
+        started++;
+    }
+    
+    load_thread(&load);
+    
+    for (int t = 0; t < started; t++)
+        pthread_join(ids[t], NULL);
+}
+
+
+/*
+ * Put the entries of all chunks together in file order, grouped by
+ * family (database order within each group), and hand the chunks'
+ * arenas over to the database.
  */
-void free_database(FingerprintNode *head)
+static FingerprintDB *join_chunks(DBChunk *chunks, int count)
 {
-    while (head) {
-        FingerprintNode *next = head->next;
+    FingerprintDB *db = calloc(1, sizeof(FingerprintDB));
+    if (!db) return NULL;
+    
+    for (int c = 0; c < count; c++) {
+        for (int i = 0; i < chunks[c].count; i++)
+            db->part_count[chunks[c].entries[i].os]++;
+        db->count += chunks[c].count;
+    }
+    
+    db->entries = malloc(sizeof(Fingerprint) * (db->count + 1));
+    if (!db->entries) {
+        free(db);
+        return NULL;
+    }
+    
+    int next[OS_TYPES];
+    int start = 0;
+    for (int f = 0; f < OS_TYPES; f++) {
+        db->part_start[f] = next[f] = start;
+        start += db->part_count[f];
+    }
+    
+    int index = 0;
+    for (int c = 0; c < count; c++) {
+        for (int i = 0; i < chunks[c].count; i++) {
+            Fingerprint *fp = &chunks[c].entries[i];
+            fp->index = index++;
+            db->entries[next[fp->os]++] = *fp;
+        }
         
-        if (head->fp) {
-            free(head->fp->name);
-            free(head->fp->options);
-            free(head->fp);
+        /* Chain the chunk's arena blocks onto the database's */
+        DBArena *a = chunks[c].arena;
+        if (a) {
+            while (a->next) a = a->next;
+            a->next = db->arena;
+            db->arena = chunks[c].arena;
+            chunks[c].arena = NULL;
         }
-        free(head);
+    }
+    return db;
+}
+
+
+/*
+ * Read the nmap fingerprint database without printing anything.
+ * Returns the entries in one array, grouped by OS family, or NULL
+ * with errno set.
+ */
+FingerprintDB *read_database(const char *path)
+{
+    OSFP_PROBE1(db_load_start, path);
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    
+    size_t size = (size_t)st.st_size;
+    const char *map = NULL;
+    if (size > 0) {
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return NULL;
+        }
+        madvise((void *)map, size, MADV_WILLNEED);
+    }
+    close(fd);
+    
+    int count = 0;
+    DBChunk *chunks = split_file(map, size, &count);
+    FingerprintDB *db = NULL;
+    
+    if (chunks) {
+        parse_chunks(chunks, count);
         
-        head = next;
+        int failed = 0;
+        for (int i = 0; i < count; i++)
+            failed |= chunks[i].failed;
+        if (!failed)
+            db = join_chunks(chunks, count);
+        free_chunks(chunks, count);
     }
-}
\ No newline at end of file
+    
+    if (map)
+        munmap((void *)map, size);
+    
+    if (!db) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    OSFP_PROBE1(db_load_end, db->count);
+    return db;
+}
+
+
+/*
+ * Load the nmap fingerprint database, saying how it went.
+ */
+FingerprintDB *load_database(const char *path)
+{
+    FingerprintDB *db = read_database(path);
+    if (!db) {
+        if (errno == ENOMEM) printf("Error: Out of memory.\n");
+        else                 printf("Error: Can't open database at %s\n", path);
+        return NULL;
+    }
+    
+    printf("Loading fingerprint database... done (%d entries: %d Windows, %d Linux/Android, %d other)\n", db->count,
+           db->part_count[OS_WINDOWS], db->part_count[OS_LINUX],
+           db->part_count[OS_OTHER] + db->part_count[OS_UNKNOWN]);
+    return db;
+}
+
+
+/*
+ * Free all database memory.
+ */
+void free_database(FingerprintDB *db)
+{
+    if (!db) return;
+    
+    free_arena(db->arena);
+    free(db->entries);
+    free(db);
+}
@@ -6,7 +6,11 @@
  * 
  * It focuses on detecting Windows, Linux, and Android devices.
  * 
- * Usage: sudo ./os_fingerprint <target_ip> [port]
+ * Usage: sudo ./os_fingerprint [-j] [-o file] [-b log] [-w] [-e engine] <target_ip> [port]
+ *        sudo ./os_fingerprint -q [-j] [-o file] <target_ip> [port]
+ *        sudo ./os_fingerprint -t threads [-m matchers] [-C cpus] [-p port] [-f file]
+ *                              [-s i/n -S seed] [-c checkpoint] [-A summary] [-j] [-o file] [-b log]
+ *                              <target_ip or CIDR>...
  * 
  * How it works:
  * 1. Find an open port on the target (or use the one specified)
@@ -22,63 +26,584 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
-#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <arpa/inet.h>
 
 #include "../include/defs.h"
 #include "../include/utils.h"
 #include "../include/network.h"
 #include "../include/db_parser.h"
 #include "../include/matcher.h"
+#include "../include/output.h"
+#include "../include/score_model.h"
+#include "../include/scan.h"
+#include "../include/engine.h"
+#include "../include/route.h"
+#include "../include/targets.h"
+#include "../include/result_log.h"
+#include "../include/batch_rank.h"
+#include "../include/triage.h"
+#include "../include/probes.h"
+#include "../include/checkpoint.h"
+#include "../include/aggregate.h"
 
 
-/* Common ports to scan */
+/* Common ports to scan, in order of preference */
 static int common_ports[] = {22, 80, 443, 445, 135, 8080, 3389, 8443};
 static int num_ports = 8;
 
 
 /*
- * Try to find an open port on the target.
- * Returns the port number, or -1 if none found.
+ * Print usage information.
+ */
+static void usage(const char *prog)
+{
+    printf("\n");
+    printf("OS Fingerprinter - Identify remote operating systems\n");
+    printf("\n");
+    printf("Usage: sudo %s [-j] [-o file] [-b log] [-w] [-e engine] <target_ip> [port]\n", prog);
+    printf("       sudo %s -q [-j] [-o file] <target_ip> [port]\n", prog);
+    printf("       sudo %s -t threads [-m matchers] [-C cpus] [-p port] [-f file]\n", prog);
+    printf("              [-s i/n -S seed] [-R pps] [-n per24] [-c file] [-A file]\n");
+    printf("              [-j] [-o file] [-b log] <target_ip or CIDR>...\n");
+    printf("       %s -r log [-t threads] [-b new_log]\n", prog);
+    printf("\n");
+    printf("Options:\n");
+    printf("  -j        Write results as JSON Lines to stdout\n");
+    printf("  -o file   Write results as JSON Lines to a file\n");
+    printf("  -b log    Append results to a binary result log (see osfp_query)\n");
+    printf("  -w        Wait for every probe, even once the answer is settled\n");
+    printf("  -e name   Probe engine: raw (default), uring, xdp or xdp-generic\n");
+    printf("  -q        Quick look: classify one SYN-ACK with the decision tree (osfp_tree)\n");
+    printf("  -t N      Fingerprint all the targets with N probe threads\n");
+    printf("  -m N      Threads scoring the results with -t (default 1)\n");
+    printf("  -C cpus   Pin the probe/match/emit threads, like 0-3/4-5/6\n");
+    printf("  -p port   Port to use with -t (default 80)\n");
+    printf("  -f file   Also read targets from a file, one per line (- for stdin)\n");
+    printf("  -s i/n    Only scan shard i (0 to n-1) of n\n");
+    printf("  -S seed   Seed for the target order (the same on every shard)\n");
+    printf("  -R pps    Send at most this many packets per second with -t (backs off on loss)\n");
+    printf("  -n N      Probe at most N hosts of a /24 at once with -t\n");
+    printf("  -c file   Save the progress of a -t scan in file, and resume from it if it's there\n");
+    printf("  -A file   Add a summary of a -t scan to file instead of listing every host\n");
+    printf("  -r log    Match the hosts in a result log again with the current database\n");
+    printf("\n");
+    printf("Examples:\n");
+    printf("  sudo %s 192.168.1.100\n", prog);
+    printf("  sudo %s 192.168.1.100 22\n", prog);
+    printf("  sudo %s -j 192.168.1.100 | jq .\n", prog);
+    printf("  sudo %s -t 4 -p 22 -o hosts.jsonl 10.0.0.1 10.0.0.2 10.0.0.3\n", prog);
+    printf("  sudo %s -t 4 -p 443 -s 0/2 -S 42 10.0.0.0/16 172.16.0.0/20\n", prog);
+    printf("  sudo %s -t 4 -p 80 -R 100000 -n 16 10.0.0.0/8\n", prog);
+    printf("  sudo %s -t 8 -p 443 -c scan.ckpt -o hosts.jsonl -f targets.txt\n", prog);
+    printf("  sudo %s -t 8 -p 80 -A net10.agg 10.0.0.0/8\n", prog);
+    printf("  %s -r monday.log -t 8 -b monday-rematched.log\n", prog);
+    printf("\n");
+}
+
+
+/* Stop probing once the replies so far settle the best match */
+static int match_settled(const ScanResult *result, unsigned answered, void *arg)
+{
+    return inc_matcher_settled(arg, result, answered);
+}
+
+
+/* Milliseconds between two readings of the same clock */
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000.0 +
+           (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+
+/*
+ * Load the fingerprint database and compile it for scoring.
+ * Returns NULL (with a message) if either step fails.
+ */
+static ScoreModel *load_model(FingerprintDB **db_out)
+{
+    FingerprintDB *db = load_database("data/nmap-os-db");
+    if (!db) {
+        /* Try alternate location */
+        db = load_database("/usr/share/nmap/nmap-os-db");
+    }
+    if (!db) {
+        printf("Error: Could not load fingerprint database.\n");
+        printf("Make sure nmap-os-db is in ./data/ or /usr/share/nmap/\n");
+        return NULL;
+    }
+    
+    /* Compile it for fast scoring */
+    ScoreModel *model = build_score_model(db);
+    if (!model) {
+        printf("Error: Could not compile fingerprint database.\n");
+        free_database(db);
+        return NULL;
+    }
+    
+    *db_out = db;
+    return model;
+}
+
+
+/*
+ * -q: put the SYN-ACK port discovery got through the decision tree
+ * osfp_tree built, instead of sending the other probes and scoring
+ * the whole database. The database itself isn't even loaded.
  */
-static int find_open_port(const char *target)
+static int run_triage(const char *target, int port, const ScanResult *result, OutBuf *out)
 {
-    printf("Looking for an open port...\n");
+    const char *db_path = access("data/nmap-os-db", R_OK) == 0 ?
+                          "data/nmap-os-db" : "/usr/share/nmap/nmap-os-db";
+    TriageTree *tree = triage_load(db_path);
+    TriageResult triage;
+    int rc = 0;
     
-    for (int i = 0; i < num_ports; i++) {
-        int port = common_ports[i];
-        printf("   Port %d: ", port);
-        fflush(stdout);
+    if (!tree) {
+        rc = 1;
+    } else if (!result->got_response) {
+        printf("\nNo SYN-ACK to classify (no open port answered).\n");
+    } else {
+        triage_classify(tree, result, &triage);
         
-        if (is_port_open(target, port)) {
-            printf("open\n");
-            return port;
+        printf("\nPort %d, TTL %d, window %d, options %s\n", port, result->ttl,
+               result->window, result->options[0] ? result->options : "none");
+        printf("Decision tree (%d comparisons): %s\n", triage.comparisons,
+               os_type_name(triage.os));
+        for (int i = 0; i < triage.count; i++)
+            printf("  %d. %-40s %5.1f%% of these hosts\n", i + 1, triage.names[i],
+                   triage.share[i] / 10.0);
+    }
+    
+    if (out) {
+        if (tree)
+            write_json_triage(out, target, port, result,
+                              result->got_response ? &triage : NULL);
+        outbuf_free(out);
+        close(out->fd);
+    }
+    
+    triage_free(tree);
+    printf("\n");
+    return rc;
+}
+
+
+/* Shared by the batch pipeline stages */
+typedef struct {
+    const ScoreModel *model;
+    OutBuf *out;                /* NULL for plain text */
+    int out_is_file;            /* 'out' is -o, not stdout */
+    ResultLog *log;             /* NULL if not logging */
+    Aggregate *agg;             /* -A, NULL if not summing up */
+    const char *agg_path;
+} BatchOutput;
+
+/* Set by SIGINT or SIGTERM during a scan with a checkpoint */
+static volatile sig_atomic_t stop_requested;
+
+
+/* Match stage: scoring only reads the model, so it runs on any thread */
+static void batch_match(ScanRecord *rec, void *arg)
+{
+    BatchOutput *bo = arg;
+    
+    rec->count = 0;
+    if (rec->result.got_response)
+        rec->count = rank_matches(bo->model, &rec->result, rec->matches, TOP_MATCHES);
+}
+
+
+/* Emit stage: always the same thread, so the output needs no lock */
+static void batch_emit(const ScanRecord *rec, void *arg)
+{
+    BatchOutput *bo = arg;
+    const ScanResult *result = &rec->result;
+    const char *confidence = match_confidence(rec->matches, rec->count);
+    
+    OSFP_PROBE4(result_emit, rec->addr, rec->port,
+                rec->count ? rec->matches[0].score : 0,
+                rec->count ? rec->matches[0].fp->name : NULL);
+    
+    if (bo->log)
+        result_log_add(bo->log, rec->addr, rec->port, result,
+                       rec->matches, rec->count);
+    
+    if (bo->agg)
+        agg_add(bo->agg, rec->addr, result, rec->matches, rec->count);
+    
+    /* With -A and no JSON, the summary at the end stands in for the host list */
+    if (bo->out) {
+        write_json_result(bo->out, rec->target, rec->port, result, rec->matches,
+                          rec->count, NULL);
+    } else if (bo->agg) {
+        return;
+    } else if (!result->got_response) {
+        printf("%-16s no response\n", rec->target);
+    } else if (!confidence) {
+        printf("%-16s no confident match (TTL says %s)\n", rec->target,
+               os_type_name(guess_os_from_ttl(result->ttl)));
+    } else {
+        printf("%-16s %s (%s, score %d)\n", rec->target, rec->matches[0].fp->name,
+               confidence, rec->matches[0].score);
+    }
+}
+
+
+/*
+ * Before a checkpoint: get what has been written so far onto the
+ * disk, and say how big the files are with it.
+ */
+static int batch_sync(int64_t sizes[CHECKPOINT_OUTPUTS], void *arg)
+{
+    BatchOutput *bo = arg;
+    sizes[CHECKPOINT_JSON] = sizes[CHECKPOINT_LOG] = -1;
+    fflush(stdout);
+    
+    if (bo->out) {
+        if (outbuf_flush(bo->out) < 0)
+            return -1;
+        if (bo->out_is_file) {
+            off_t size = lseek(bo->out->fd, 0, SEEK_END);
+            if (size < 0 || fdatasync(bo->out->fd) < 0)
+                return -1;
+            sizes[CHECKPOINT_JSON] = size;
         }
-        printf("closed\n");
     }
     
-    return -1;
+    if (bo->log && (sizes[CHECKPOINT_LOG] = result_log_sync(bo->log)) < 0)
+        return -1;
+    
+    /* The summary so far, so a resumed run adds to exactly this */
+    if (bo->agg && agg_save(bo->agg, bo->agg_path) < 0)
+        return -1;
+    return 0;
+}
+
+
+/* The first ^C stops handing out targets; the scan then finishes what it started */
+static void on_stop(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+
+/* Cut an output back to the size a checkpoint saw */
+static int cut_output(const char *path, int64_t size)
+{
+    if (!path || size < 0)
+        return 0;
+    if (truncate(path, size) < 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* How full the ring into each stage got: a stage that can't keep up fills its ring */
+static void print_queue_stats(const ScanStats *stats)
+{
+    static const char *names[] = {"probe", "match", "emit"};
+    
+    printf("\nStage   queued   avg depth   max depth   producer waits\n");
+    for (int i = 0; i < STAGES; i++) {
+        const QueueStats *q = &stats->queues[i];
+        printf("%-6s %8lu   %5.1f/%-4u  %5u/%-4u  %lu\n", names[i], q->pushes,
+               q->avg_depth, q->capacity, q->max_depth, q->capacity, q->full);
+    }
 }
 
 
 /*
- * Print usage information.
+ * Parse -C: CPU lists for the probe, match and emit stages,
+ * separated by '/'. Stages left out or empty aren't pinned.
  */
-static void usage(const char *prog)
+static int parse_stage_cpus(const char *text, ScanConfig *config)
 {
-    printf("\n");
-    printf("OS Fingerprinter - Identify remote operating systems\n");
-    printf("\n");
-    printf("Usage: sudo %s <target_ip> [port]\n", prog);
-    printf("\n");
-    printf("Examples:\n");
-    printf("  sudo %s 192.168.1.100\n", prog);
-    printf("  sudo %s 192.168.1.100 22\n", prog);
-    printf("\n");
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", text);
+    
+    char *rest = copy;
+    for (int stage = 0; stage < STAGES && rest; stage++) {
+        char *list = rest;
+        rest = strchr(rest, '/');
+        if (rest) *rest++ = '\0';
+        
+        int n = parse_cpu_list(list, config->cpus[stage], MAX_STAGE_CPUS);
+        if (n < 0)
+            return -1;
+        config->cpu_count[stage] = n;
+    }
+    return rest ? -1 : 0;
+}
+
+
+/* Fingerprint a stream of targets on several threads */
+static int run_batch(TargetGen *targets, const char *file, int port, ScanConfig *config,
+                     OutBuf *out, int out_is_file, ResultLog *log,
+                     Aggregate *agg, const char *agg_path)
+{
+    FingerprintDB *db;
+    ScoreModel *model = load_model(&db);
+    if (!model) {
+        targets_close(targets);
+        result_log_close(log);
+        agg_free(agg);
+        return 1;
+    }
+    
+    printf("Fingerprinting %llu addresses%s on port %d with %d probe and %d match threads...\n\n",
+           (unsigned long long)targets_total(targets),
+           file ? " and the target file" : "", port, config->workers, config->matchers);
+    
+    BatchOutput bo;
+    bo.model = model;
+    bo.out = out;
+    bo.out_is_file = out_is_file;
+    bo.log = log;
+    bo.agg = agg;
+    bo.agg_path = agg_path;
+    
+    config->match = batch_match;
+    config->emit = batch_emit;
+    config->arg = &bo;
+    
+    /* With a checkpoint, stopping early loses nothing, so let ^C do it (twice to kill) */
+    if (config->checkpoint) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_stop;
+        sa.sa_flags = SA_RESETHAND;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        
+        config->sync = batch_sync;
+        config->stop = &stop_requested;
+    }
+    
+    ScanStats stats;
+    struct timespec t_start, t_end;
+    
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    int rc = scan_batch(targets, port, config, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    
+    targets_close(targets);
+    
+    if (out) {
+        outbuf_free(out);
+        close(out->fd);
+    }
+    result_log_close(log);
+    
+    double secs = elapsed_ms(&t_start, &t_end) / 1000.0;
+    printf("\n%d targets (%d responded) in %.2f s, %.1f hosts/s, %ld packets sent, %ld retries\n",
+           stats.targets, stats.responded, secs,
+           secs > 0 ? stats.targets / secs : 0.0, stats.packets_sent, stats.retries);
+    if (config->rate > 0)
+        printf("Sent %.0f packets/s with %ld allowed, ending at %ld (lowest %ld, %d backoffs)\n",
+               secs > 0 ? stats.packets_sent / secs : 0.0, config->rate, stats.rate,
+               stats.min_rate, stats.backoffs);
+    if (stop_requested)
+        printf("Stopped early; run the same command again to pick up from %s.\n",
+               config->checkpoint);
+    print_queue_stats(&stats);
+    
+    if (agg) {
+        if (agg_save(agg, agg_path) < 0) {
+            printf("Error: Could not save the summary to %s: %s\n", agg_path, strerror(errno));
+            rc = -1;
+        }
+        printf("\nSummary (saved in %s):\n", agg_path);
+        agg_print(agg, 10);
+        agg_free(agg);
+    }
+    
+    free_score_model(model);
+    free_database(db);
+    
+    return rc < 0 ? 1 : 0;
+}
+
+
+/*
+ * Match the observations in a result log again, for example after
+ * a database update, a block at a time with rank_batch(). With
+ * 'out_path' the new matches are written to another log.
+ */
+static int run_rematch(const char *path, int threads, const char *out_path)
+{
+    if (out_path && strcmp(out_path, path) == 0) {
+        printf("Error: Write the new matches to a different log.\n");
+        return 1;
+    }
+    
+    LogReader r;
+    if (log_reader_open(&r, path) < 0)
+        return 1;
+    
+    FingerprintDB *db;
+    ScoreModel *model = load_model(&db);
+    ResultLog *log = NULL;
+    
+    if (!model || (out_path && !(log = result_log_open(out_path)))) {
+        if (model) {
+            free_score_model(model);
+            free_database(db);
+        }
+        log_reader_close(&r);
+        return 1;
+    }
+    
+    ScanResult *scans = malloc(sizeof(ScanResult) * RESLOG_BLOCK_ROWS);
+    Match *matches = malloc(sizeof(Match) * TOP_MATCHES * RESLOG_BLOCK_ROWS);
+    int *counts = malloc(sizeof(int) * RESLOG_BLOCK_ROWS);
+    uint32_t *rows = malloc(sizeof(uint32_t) * RESLOG_BLOCK_ROWS);
+    int rc = 0;
+    
+    if (!scans || !matches || !counts || !rows) {
+        printf("Error: Out of memory.\n");
+        rc = -1;
+    }
+    
+    printf("Matching %llu hosts from %s again with %d threads...\n",
+           (unsigned long long)r.rows, path, threads);
+    
+    uint64_t total = 0, changed = 0, skipped = 0;
+    double busy_ms = 0;
+    
+    for (int k = 0; k < r.block_count && rc == 0; k++) {
+        const LogRows *b = &r.blocks[k];
+        if (b->count > RESLOG_BLOCK_ROWS) {
+            /* This writer never makes one, so the block is damaged or foreign */
+            printf("Warning: Skipping block %d of %s: %u rows, more than %d.\n",
+                   k, path, b->count, RESLOG_BLOCK_ROWS);
+            skipped += b->count;
+            continue;
+        }
+        
+        /* Hosts that never answered have nothing to match */
+        int n = 0;
+        for (uint32_t i = 0; i < b->count; i++) {
+            if (!(b->probes[i] & RESLOG_REPLIED(PROBE_T1)))
+                continue;
+            log_row_scan(&r, b, i, &scans[n]);
+            rows[n++] = i;
+        }
+        
+        struct timespec t_start, t_end;
+        clock_gettime(CLOCK_MONOTONIC, &t_start);
+        rc = rank_batch(model, scans, n, TOP_MATCHES, threads, matches, counts);
+        clock_gettime(CLOCK_MONOTONIC, &t_end);
+        busy_ms += elapsed_ms(&t_start, &t_end);
+        
+        for (int j = 0; rc == 0 && j < n; j++) {
+            uint32_t i = rows[j];
+            const Match *best = &matches[j * TOP_MATCHES];
+            uint32_t old = b->fp[0][i];
+            const char *was = old < r.name_count ? r.names[old] : NULL;
+            const char *now = counts[j] ? best->fp->name : NULL;
+            
+            /* IDs change with the database, so compare names */
+            if ((was == NULL) != (now == NULL) || (was && strcmp(was, now) != 0))
+                changed++;
+            
+            if (log)
+                result_log_add(log, b->ip[i], b->port[i], &scans[j], best, counts[j]);
+        }
+        total += n;
+    }
+    
+    double secs = busy_ms / 1000.0;
+    printf("\n%llu hosts matched in %.2f s, %.0f hosts/s\n", (unsigned long long)total,
+           secs, secs > 0 ? total / secs : 0.0);
+    printf("The best match changed for %llu (%.1f%%)\n", (unsigned long long)changed,
+           total ? 100.0 * changed / total : 0.0);
+    if (skipped)
+        printf("%llu rows in oversized blocks were not matched\n", (unsigned long long)skipped);
+    
+    if (result_log_close(log) < 0)
+        rc = -1;
+    free(rows);
+    free(counts);
+    free(matches);
+    free(scans);
+    free_score_model(model);
+    free_database(db);
+    log_reader_close(&r);
+    return rc < 0 ? 1 : 0;
 }
 
 
 int main(int argc, char *argv[])
 {
+    int json = 0;
+    int wait_all = 0;
+    int triage = 0;
+    int threads = 0;
+    int matchers = 1;
+    const char *cpu_lists = NULL;
+    int batch_port = 80;
+    long rate = 0;
+    int subnet_cap = 0;
+    const char *rematch_path = NULL;
+    const char *json_path = NULL;
+    const char *log_path = NULL;
+    const char *engine_name = "raw";
+    const char *target_file = NULL;
+    const char *checkpoint_path = NULL;
+    const char *agg_path = NULL;
+    int shard = 0, shards = 1;
+    uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    int have_seed = 0;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "jo:b:wqt:m:C:p:e:f:s:S:R:n:c:A:r:")) != -1) {
+        switch (opt) {
+            case 'j': json = 1; break;
+            case 'o': json_path = optarg; break;
+            case 'b': log_path = optarg; break;
+            case 'w': wait_all = 1; break;
+            case 'q': triage = 1; break;
+            case 't': threads = atoi(optarg); break;
+            case 'm': matchers = atoi(optarg); break;
+            case 'C': cpu_lists = optarg; break;
+            case 'p': batch_port = atoi(optarg); break;
+            case 'e': engine_name = optarg; break;
+            case 'f': target_file = optarg; break;
+            case 's':
+                if (sscanf(optarg, "%d/%d", &shard, &shards) != 2) {
+                    printf("Error: Shard should look like 0/4.\n");
+                    return 1;
+                }
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 0);
+                have_seed = 1;
+                break;
+            case 'R': rate = atol(optarg); break;
+            case 'n': subnet_cap = atoi(optarg); break;
+            case 'c': checkpoint_path = optarg; break;
+            case 'A': agg_path = optarg; break;
+            case 'r': rematch_path = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    
+    /* Matching a log again sends nothing, so it needs no root */
+    if (rematch_path) {
+        if (threads <= 0)
+            threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        return run_rematch(rematch_path, threads, log_path);
+    }
+    
     /* Must run as root for raw sockets */
     if (getuid() != 0) {
         printf("Error: This tool requires root privileges.\n");
@@ -87,17 +612,175 @@ int main(int argc, char *argv[])
     }
     
     /* Need at least a target IP */
-    if (argc < 2) {
+    if (optind >= argc && !target_file) {
         usage(argv[0]);
         return 1;
     }
     
-    char *target = argv[1];
-    int port = (argc > 2) ? atoi(argv[2]) : 0;
+    /* Ranges and target files always go to the batch scanner */
+    int batch = threads > 0 || target_file ||
+                (optind < argc && strchr(argv[optind], '/'));
+    if (batch && threads <= 0)
+        threads = 1;
+    
+    if (triage && (batch || log_path)) {
+        printf("Error: -q looks at a single target and has no scores to log.\n");
+        return 1;
+    }
+    
+    if (shards > 1 && !have_seed) {
+        printf("Error: Every shard needs the same -S seed.\n");
+        return 1;
+    }
+    
+    /* Batch pipeline: thread counts and CPUs for each stage */
+    static ScanConfig config;
+    config.workers = threads;
+    config.matchers = matchers;
+    config.rate = rate;
+    config.subnet_cap = subnet_cap;
+    
+    if (cpu_lists && parse_stage_cpus(cpu_lists, &config) < 0) {
+        printf("Error: CPUs should look like 0-3/4-5/6 (probe/match/emit).\n");
+        return 1;
+    }
+    
+    /*
+     * -c: if the checkpoint is there, this is the same scan run again.
+     * It gets the same target order, and the outputs lose whatever
+     * was written after the checkpoint, since those hosts are
+     * scanned again.
+     */
+    Checkpoint resume;
+    int resuming = 0;
+    
+    if (checkpoint_path) {
+        if (!batch) {
+            printf("Error: -c is for batch scans (-t, ranges or -f).\n");
+            return 1;
+        }
+        if (target_file && strcmp(target_file, "-") == 0) {
+            printf("Error: Targets from stdin can't be read again, so -c needs a file.\n");
+            return 1;
+        }
+        
+        config.scan_id = checkpoint_id(argv + optind, argc - optind, target_file,
+                                       batch_port, shard, shards);
+        if (checkpoint_read(checkpoint_path, &resume) == 0) {
+            if (resume.head.scan_id != config.scan_id) {
+                printf("Error: %s is the checkpoint of a different scan.\n", checkpoint_path);
+                return 1;
+            }
+            if (cut_output(json_path, resume.head.outputs[CHECKPOINT_JSON]) < 0 ||
+                cut_output(log_path, resume.head.outputs[CHECKPOINT_LOG]) < 0)
+                return 1;
+            seed = resume.head.seed;
+            resuming = 1;
+        } else if (errno != ENOENT) {
+            printf("Error: Could not read checkpoint %s: %s\n", checkpoint_path, strerror(errno));
+            return 1;
+        }
+        
+        config.checkpoint = checkpoint_path;
+        config.seed = seed;
+        config.resume = resuming ? &resume : NULL;
+    }
+    
+    /* -A: sum up into the snapshot that's there, if any */
+    Aggregate *agg = NULL;
+    if (agg_path) {
+        if (!batch) {
+            printf("Error: -A is for batch scans (-t, ranges or -f).\n");
+            return 1;
+        }
+        agg = agg_new();
+        if (!agg) {
+            printf("Error: Out of memory.\n");
+            return 1;
+        }
+        if (agg_load(agg, agg_path) < 0 && errno != ENOENT) {
+            printf("Error: Could not read the summary in %s: %s\n", agg_path, strerror(errno));
+            agg_free(agg);
+            return 1;
+        }
+    }
+    
+    char *target = argv[optind];
+    int port = (optind + 1 < argc) ? atoi(argv[optind + 1]) : 0;
+    
+    const EngineOps *engine_ops = find_engine(engine_name);
+    if (!engine_ops) {
+        printf("Error: Unknown engine '%s' (use raw, uring, xdp or xdp-generic).\n", engine_name);
+        return 1;
+    }
+    
+    /*
+     * Set up JSON output.
+     * With -j the records go to stdout, so all the progress messages
+     * are moved over to stderr to keep stdout machine-readable.
+     */
+    OutBuf out = {0};
+    int json_fd = -1;
+    
+    if (json_path) {
+        json_fd = open(json_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (json_fd < 0) {
+            perror(json_path);
+            return 1;
+        }
+    } else if (json) {
+        fflush(stdout);
+        json_fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+    
+    if (json_fd >= 0 && outbuf_init(&out, json_fd, OUTBUF_SIZE) < 0) {
+        printf("Error: Out of memory.\n");
+        return 1;
+    }
+    
+    /* Binary result log */
+    ResultLog *log = NULL;
+    if (log_path && !(log = result_log_open(log_path)))
+        return 1;
     
     /* Seed random number generator */
     srand(time(NULL));
     
+    /* Source addresses come from a cached copy of the routing table */
+    route_cache_init();
+    
+    /* Many targets go to the batch scanner */
+    if (batch) {
+        TargetGen *targets = targets_open(argv + optind, argc - optind, target_file,
+                                          shard, shards, seed);
+        if (!targets) {
+            result_log_close(log);
+            agg_free(agg);
+            return 1;
+        }
+        if (resuming && targets_restore(targets, &resume.head.targets) < 0) {
+            printf("Error: Could not find our place in the target file again.\n");
+            targets_close(targets);
+            result_log_close(log);
+            agg_free(agg);
+            return 1;
+        }
+        
+        if (resuming)
+            printf("Resuming from %s: %llu targets done, %llu to probe again.\n",
+                   checkpoint_path,
+                   (unsigned long long)(resume.head.next - resume.head.pending),
+                   (unsigned long long)resume.head.pending);
+        
+        int rc = run_batch(targets, target_file, batch_port, &config,
+                           json_fd >= 0 ? &out : NULL, json_path != NULL, log,
+                           agg, agg_path);
+        if (resuming)
+            checkpoint_free(&resume);
+        return rc;
+    }
+    
     /* Print banner */
     printf("\n");
     printf("================================================\n");
@@ -106,40 +789,114 @@ int main(int argc, char *argv[])
     printf("================================================\n");
     printf("\n");
     
-    /* Find an open port if not specified */
-    if (port <= 0) {
-        port = find_open_port(target);
-        
-        if (port < 0) {
-            printf("\nNo open ports found.\n");
-            printf("Trying port 80 anyway (limited results)...\n");
-            port = 80;
-        }
+    /*
+     * Find an open port if not specified. IE and U1 go out in the same
+     * burst, so a host with every TCP port filtered can still be
+     * matched on its ICMP replies without a full run.
+     */
+    ScanResult result;
+    memset(&result, 0, sizeof(result));
+    
+    int answered;
+    int open = port > 0 ? discover_target(target, &port, 1, &result, &answered)
+                        : discover_target(target, common_ports, num_ports, &result, &answered);
+    int icmp_only = 0;
+    
+    /* -q: the SYN-ACK from discovery is all the tree looks at */
+    if (triage)
+        return run_triage(target, port > 0 ? port : open, &result,
+                          json_fd >= 0 ? &out : NULL);
+    
+    if (port <= 0 && open >= 0) {
+        port = open;
+    } else if (port <= 0 && answered == 0 && scan_has_replies(&result)) {
+        printf("\nNo TCP replies at all; matching on the ICMP replies.\n");
+        icmp_only = 1;
+        port = 0;
+    } else if (port <= 0) {
+        printf("\nNo open ports found.\n");
+        printf("Trying port 80 anyway (limited results)...\n");
+        port = 80;
     }
     
-    printf("\nUsing port %d for fingerprinting.\n\n", port);
+    if (!icmp_only)
+        printf("\nUsing port %d for fingerprinting.\n\n", port);
     
     /* Load the fingerprint database */
-    FingerprintNode *db = load_database("data/nmap-os-db");
-    if (!db) {
-        /* Try alternate location */
-        db = load_database("/usr/share/nmap/nmap-os-db");
-    }
-    if (!db) {
-        printf("Error: Could not load fingerprint database.\n");
-        printf("Make sure nmap-os-db is in ./data/ or /usr/share/nmap/\n");
+    FingerprintDB *db;
+    ScoreModel *model = load_model(&db);
+    if (!model)
         return 1;
+    
+    EngineStats stats = {0};
+    struct timespec t_start, t_probed, t_matched, cpu_start, cpu_end;
+    
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    
+    /* Run the fingerprinting probes, matching as the replies come in */
+    if (!icmp_only) {
+        printf("Running fingerprint probes (%s engine)...\n", engine_ops->name);
+        
+        Engine *engine = engine_ops->open();
+        if (!engine) {
+            printf("Error: Could not start the %s engine.\n", engine_ops->name);
+            free_score_model(model);
+            free_database(db);
+            return 1;
+        }
+        
+        IncMatcher *im = wait_all ? NULL : inc_matcher_new(model);
+        fingerprint_target(engine, target, port, &result, im ? match_settled : NULL, im);
+        inc_matcher_free(im);
+        
+        stats = engine->stats;
+        engine_ops->close(engine);
     }
     
-    /* Run the fingerprinting probes */
-    printf("Running fingerprint probes...\n");
+    clock_gettime(CLOCK_MONOTONIC, &t_probed);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
     
-    ScanResult result;
-    fingerprint_target(target, port, &result);
+    if (!icmp_only)
+        printf("   %ld syscalls, %.3f ms CPU\n", stats.syscalls,
+               elapsed_ms(&cpu_start, &cpu_end));
+    if (stats.send_errors)
+        printf("   %ld probes could not be sent\n", stats.send_errors);
+    
+    /* Machine-readable records */
+    if (json_fd >= 0 || log) {
+        Match matches[TOP_MATCHES];
+        int count = 0;
+        
+        if (scan_has_replies(&result))
+            count = rank_matches(model, &result, matches, TOP_MATCHES);
+        clock_gettime(CLOCK_MONOTONIC, &t_matched);
+        
+        OSFP_PROBE4(result_emit, inet_addr(target), port, count ? matches[0].score : 0,
+                    count ? matches[0].fp->name : NULL);
+        
+        if (log) {
+            result_log_add(log, inet_addr(target), port, &result, matches, count);
+            result_log_close(log);
+        }
+        
+        if (json_fd >= 0) {
+            ScanTiming timing;
+            timing.probe_ms = elapsed_ms(&t_start, &t_probed);
+            timing.match_ms = elapsed_ms(&t_probed, &t_matched);
+            timing.cpu_ms = elapsed_ms(&cpu_start, &cpu_end);
+            timing.engine = engine_ops->name;
+            timing.syscalls = stats.syscalls;
+            
+            write_json_result(&out, target, port, &result, matches, count, &timing);
+            outbuf_free(&out);
+            close(json_fd);
+        }
+    }
     
     /* Analyze and show results */
-    if (result.got_response) {
-        find_matches(db, &result);
+    if (scan_has_replies(&result)) {
+        find_matches(model, &result);
     } else {
         printf("\nNo response from target.\n");
         printf("The host may be:\n");
@@ -149,6 +906,7 @@ int main(int argc, char *argv[])
     }
     
     /* Cleanup */
+    free_score_model(model);
     free_database(db);
     
     printf("\n");
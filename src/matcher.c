@@ -7,83 +7,36 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <math.h>
 
 #include "../include/defs.h"
 #include "../include/matcher.h"
 #include "../include/utils.h"
-
-
-/* A match candidate with its score */
-typedef struct {
-    Fingerprint *fp;
-    int score;
-} Match;
+#include "../include/score_model.h"
+#include "../include/probes.h"
 
 
 /*
- * Compare TCP options patterns.
- * Returns a score based on how similar they are.
+ * The score is built from independent parts, one per thing we observed.
+ * Each part only looks at one observed value, which lets the compiled
+ * scorer (score_model.c) precompute it for every possible value.
+ * 
+ * All weights are multiples of SCORE_UNIT.
  */
-static int compare_options(TCPOpts *observed, TCPOpts *expected)
-{
-    int score = 0;
-    
-    /* Check if the option order matches */
-    if (observed->pattern[0] && expected->pattern[0]) {
-        if (strcmp(observed->pattern, expected->pattern) == 0) {
-            score += 300;  /* Exact match is great */
-        } else {
-            /* Count matching characters */
-            int matches = 0;
-            int len = strlen(observed->pattern);
-            for (int i = 0; i < len && expected->pattern[i]; i++) {
-                if (observed->pattern[i] == expected->pattern[i])
-                    matches++;
-            }
-            if (matches >= len * 0.8)
-                score += 150;  /* Pretty close */
-        }
-    }
-    
-    /* MSS match */
-    if (observed->mss > 0 && expected->mss > 0) {
-        if (observed->mss == expected->mss)
-            score += 100;
-        else if (abs(observed->mss - expected->mss) < 100)
-            score += 30;
-    }
-    
-    /* Window scale match */
-    if (observed->window_scale >= 0 && expected->window_scale >= 0) {
-        if (observed->window_scale == expected->window_scale)
-            score += 100;
-        else if (abs(observed->window_scale - expected->window_scale) <= 2)
-            score += 30;
-    }
-    
-    /* SACK and timestamp */
-    if (observed->has_sack == expected->has_sack)
-        score += 20;
-    if (observed->has_timestamp == expected->has_timestamp)
-        score += 20;
-    
-    return score;
-}
 
 
 /*
- * Calculate how well a fingerprint matches our scan result.
- * Higher score = better match.
+ * OS family and TTL.
+ * Both only depend on the observed TTL.
  */
-static int calculate_score(Fingerprint *fp, ScanResult *scan)
+int score_ttl(const Fingerprint *fp, OSType fp_os, int ttl)
 {
     int score = 0;
     
     /* What OS type did we observe based on TTL? */
-    OSType observed_os = guess_os_from_ttl(scan->ttl);
-    OSType fp_os = guess_os_from_name(fp->name);
+    OSType observed_os = guess_os_from_ttl(ttl);
     
     /*
      * OS family match is critical.
@@ -96,21 +49,17 @@ static int calculate_score(Fingerprint *fp, ScanResult *scan)
             score -= 400;  /* Big penalty for mismatch */
     }
     
-    /* Skip non-Windows/Linux fingerprints entirely */
-    if (fp_os == OS_OTHER)
-        return -9999;
-    
     /*
      * TTL matching
      */
     int ttl_target = fp->ttl_guess > 0 ? fp->ttl_guess : fp->ttl_min;
     
-    if (ttl_target > 0 && scan->ttl > 0) {
-        int diff = abs(scan->ttl - ttl_target);
+    if (ttl_target > 0 && ttl > 0) {
+        int diff = abs(ttl - ttl_target);
         
         /* Check if within expected range */
         if (fp->ttl_min > 0 && fp->ttl_max > 0) {
-            if (scan->ttl >= fp->ttl_min && scan->ttl <= fp->ttl_max)
+            if (ttl >= fp->ttl_min && ttl <= fp->ttl_max)
                 score += 100;
         }
         
@@ -123,58 +72,141 @@ static int calculate_score(Fingerprint *fp, ScanResult *scan)
             score -= 50;
     }
     
-    /*
-     * Window size matching
-     */
-    if (scan->window > 0) {
-        /* Check against WIN section values */
-        int win_match = 0;
-        for (int i = 0; i < 6; i++) {
-            if (fp->window_values[i] > 0 && 
-                scan->window == fp->window_values[i]) {
-                win_match = 1;
-                break;
-            }
+    return score;
+}
+
+
+/*
+ * Window size matching
+ */
+int score_window(const Fingerprint *fp, OSType fp_os, int window)
+{
+    if (window <= 0) return 0;
+    
+    int score = 0;
+    
+    /* Check against WIN section values */
+    int win_match = 0;
+    for (int i = 0; i < 6; i++) {
+        if (fp->window_values[i] > 0 && 
+            window == fp->window_values[i]) {
+            win_match = 1;
+            break;
         }
-        
-        if (win_match) {
+    }
+    
+    if (win_match) {
+        score += 150;
+    } else if (fp->window > 0) {
+        if (window == fp->window)
             score += 150;
-        } else if (fp->window > 0) {
-            if (scan->window == fp->window)
-                score += 150;
-            else if (abs(scan->window - fp->window) < 1000)
-                score += 50;
-        }
-        
-        /* Windows typically uses 65535 */
-        if (scan->window == 65535 && fp_os == OS_WINDOWS)
+        else if (abs(window - fp->window) < 1000)
             score += 50;
     }
     
-    /*
-     * TCP options matching
-     */
-    if (scan->got_response && scan->options[0] && fp->options) {
-        score += compare_options(&scan->opts, &fp->opts);
+    /* Windows typically uses 65535 */
+    if (window == 65535 && fp_os == OS_WINDOWS)
+        score += 50;
+    
+    return score;
+}
+
+
+/*
+ * DF flag matching
+ */
+int score_df(const Fingerprint *fp, char df_flag)
+{
+    if (df_flag && fp->df_flag && df_flag == fp->df_flag)
+        return 30;
+    return 0;
+}
+
+
+/*
+ * TCP options, one part at a time.
+ * These only count if both sides have options (see calculate_score).
+ */
+
+/* Check if the option order matches */
+int score_pattern(const Fingerprint *fp, const char *pattern)
+{
+    const char *expected = fp->opts.pattern;
+    
+    if (!pattern[0] || !expected[0])
+        return 0;
+    
+    if (strcmp(pattern, expected) == 0)
+        return 300;  /* Exact match is great */
+    
+    /* Count matching characters */
+    int matches = 0;
+    int len = strlen(pattern);
+    for (int i = 0; i < len && expected[i]; i++) {
+        if (pattern[i] == expected[i])
+            matches++;
     }
+    if (matches >= len * 0.8)
+        return 150;  /* Pretty close */
     
-    /*
-     * DF flag matching
-     */
-    if (scan->df_flag && fp->df_flag) {
-        if (scan->df_flag == fp->df_flag)
-            score += 30;
+    return 0;
+}
+
+/* MSS match */
+int score_mss(const Fingerprint *fp, int mss)
+{
+    int expected = fp->opts.mss;
+    
+    if (mss > 0 && expected > 0) {
+        if (mss == expected)
+            return 100;
+        if (abs(mss - expected) < 100)
+            return 30;
     }
+    return 0;
+}
+
+/* Window scale match */
+int score_wscale(const Fingerprint *fp, int window_scale)
+{
+    int expected = fp->opts.window_scale;
+    
+    if (window_scale >= 0 && expected >= 0) {
+        if (window_scale == expected)
+            return 100;
+        if (abs(window_scale - expected) <= 2)
+            return 30;
+    }
+    return 0;
+}
+
+/* SACK and timestamp */
+int score_sack_ts(const Fingerprint *fp, int has_sack, int has_timestamp)
+{
+    int score = 0;
+    
+    if (has_sack == fp->opts.has_sack)
+        score += 20;
+    if (has_timestamp == fp->opts.has_timestamp)
+        score += 20;
+    
+    return score;
+}
+
+
+/*
+ * Behavioral tests
+ * 
+ * T3 is particularly useful - Windows usually doesn't respond
+ * to weird flag combinations, but Linux often does.
+ */
+int score_behavior(const Fingerprint *fp, int t2_responded, int t3_responded)
+{
+    int score = 0;
     
-    /*
-     * Behavioral tests
-     * 
-     * T3 is particularly useful - Windows usually doesn't respond
-     * to weird flag combinations, but Linux often does.
-     */
     if (fp->t3_responds) {
         int expected = (fp->t3_responds == 'Y');
-        if (expected == scan->t3_responded)
+        if (expected == t3_responded)
             score += 100;
         else
             score -= 50;
@@ -182,7 +214,7 @@ static int calculate_score(Fingerprint *fp, ScanResult *scan)
     
     if (fp->t2_responds) {
         int expected = (fp->t2_responds == 'Y');
-        if (expected == scan->t2_responded)
+        if (expected == t2_responded)
             score += 50;
     }
     
@@ -190,26 +222,494 @@ static int calculate_score(Fingerprint *fp, ScanResult *scan)
 }
 
 
-/* Sort matches by score (highest first) */
-static int compare_matches(const void *a, const void *b)
+/* Is 'flags' one of the combinations the database allows? */
+static int expects_flags(const ProbeExpect *e, int flags)
 {
-    const Match *ma = a;
-    const Match *mb = b;
-    return mb->score - ma->score;
+    for (int i = 0; i < e->flag_count; i++) {
+        if (e->flags[i] == flags)
+            return 1;
+    }
+    return 0;
 }
 
 
 /*
- * Find and display the best matching fingerprints.
+ * The ACK probe and the closed port probes (T4-T7).
+ * Closed ports have to answer with a RST, and how they do it
+ * (RST or RST-ACK, DF or not, at all or not) differs a lot
+ * between stacks.
+ */
+int score_probe(const Fingerprint *fp, int probe, int responded, int flags, char df_flag)
+{
+    const ProbeExpect *e = &fp->expect[probe];
+    
+    if (!e->responds)
+        return 0;
+    
+    int expected = (e->responds == 'Y');
+    if (expected != responded)
+        return -20;
+    
+    int score = 40;
+    
+    if (responded) {
+        if (expects_flags(e, flags))
+            score += 30;
+        if (e->df_flag && df_flag == e->df_flag)
+            score += 10;
+    }
+    
+    return score;
+}
+
+
+/*
+ * The ICMP echo probes (IE).
+ * Whether they're answered at all says a lot (many Windows hosts
+ * drop them), and so does what happens to the DF bit and the code.
+ */
+int score_echo(const Fingerprint *fp, int responded, int dfi, int cd)
+{
+    const EchoExpect *e = &fp->echo;
+    
+    if (!e->responds)
+        return 0;
+    
+    int expected = (e->responds == 'Y');
+    if (expected != responded)
+        return -20;
+    
+    int score = 30;
+    
+    if (responded) {
+        if (e->dfi & dfi)
+            score += 20;
+        if (e->cd & cd)
+            score += 20;
+    }
+    
+    return score;
+}
+
+
+/*
+ * The UDP probe to a closed port (U1): is there a port
+ * unreachable, and with DF or not?
  */
-void find_matches(FingerprintNode *db, ScanResult *scan)
+int score_unreach(const Fingerprint *fp, int responded, char df_flag)
 {
-    if (!db || !scan) return;
+    const UnreachExpect *u = &fp->unreach;
+    
+    if (!u->responds)
+        return 0;
+    
+    int expected = (u->responds == 'Y');
+    if (expected != responded)
+        return -20;
+    
+    int score = 30;
+    
+    if (responded && u->df_flag && df_flag == u->df_flag)
+        score += 10;
+    
+    return score;
+}
+
+/* Length of the port unreachable */
+int score_ipl(const Fingerprint *fp, int ipl)
+{
+    const UnreachExpect *u = &fp->unreach;
+    
+    if (ipl > 0 && (ipl == u->ipl[0] || ipl == u->ipl[1]))
+        return 20;
+    return 0;
+}
+
+/* How much of our packet it quotes, and whether that came back intact */
+int score_quote(const Fingerprint *fp, int quote)
+{
+    const UnreachExpect *u = &fp->unreach;
+    int agree = ~(quote ^ u->quote_good) & u->quote_known;
+    
+    return 10 * __builtin_popcount(agree);
+}
+
+
+/* Do the TCP options take part in scoring? */
+int scan_has_options(const ScanResult *scan)
+{
+    return scan->got_response && scan->options[0];
+}
+
+
+/* Is there anything to match? The SYN-ACK, or IE or U1 without it */
+int scan_has_replies(const ScanResult *scan)
+{
+    return scan->got_response ||
+           (scan->icmp_sent && (scan->echo.responded || scan->unreach.responded));
+}
+
+
+/*
+ * Calculate how well a fingerprint matches our scan result.
+ * Higher score = better match.
+ * 
+ * This is the reference scorer. rank_matches() uses the compiled
+ * form from score_model.c, which gives the same numbers.
+ */
+int calculate_score(const Fingerprint *fp, const ScanResult *scan)
+{
+    OSType fp_os = fp->os;
+    
+    /* Skip non-Windows/Linux fingerprints entirely */
+    if (fp_os == OS_OTHER)
+        return -9999;
+    
+    int score = score_ttl(fp, fp_os, scan->ttl);
+    score += score_window(fp, fp_os, scan->window);
+    
+    /*
+     * TCP options matching
+     */
+    if (scan_has_options(scan) && fp->options) {
+        score += score_pattern(fp, scan->opts.pattern);
+        score += score_mss(fp, scan->opts.mss);
+        score += score_wscale(fp, scan->opts.window_scale);
+        score += score_sack_ts(fp, scan->opts.has_sack, scan->opts.has_timestamp);
+    }
+    
+    score += score_df(fp, scan->df_flag);
+    score += score_behavior(fp, scan->t2_responded, scan->t3_responded);
+    
+    for (int p = PROBE_T4; p <= PROBE_T7; p++) {
+        const ProbeReply *r = &scan->reply[p];
+        score += score_probe(fp, p, r->responded, r->flags, r->df_flag);
+    }
+    
+    /* IE and U1, if they were sent */
+    if (scan->icmp_sent) {
+        const EchoReply *e = &scan->echo;
+        const UnreachReply *u = &scan->unreach;
+        
+        score += score_echo(fp, e->responded, e->dfi, e->cd);
+        score += score_unreach(fp, u->responded, u->df_flag);
+        if (u->responded) {
+            score += score_ipl(fp, u->ipl);
+            score += score_quote(fp, u->quote);
+        }
+    }
+    
+    return score;
+}
+
+
+/* Does a rank above b? Equal scores keep database order. */
+static int ranks_above(int score, const Fingerprint *a, const Match *b)
+{
+    return score > b->score || (score == b->score && a->index < b->fp->index);
+}
+
+
+/*
+ * We only ever show a handful of results, so instead of sorting
+ * thousands of matches we keep a small sorted array and insert
+ * into it.
+ */
+int add_match(Match *out, int count, int max, Fingerprint *fp, int score)
+{
+    /* Full and not better than the last one? */
+    if (count == max && !ranks_above(score, fp, &out[count - 1]))
+        return count;
+    
+    /* Find where it goes and shift the rest down */
+    int pos = (count < max) ? count : max - 1;
+    while (pos > 0 && ranks_above(score, fp, &out[pos - 1])) {
+        out[pos] = out[pos - 1];
+        pos--;
+    }
+    out[pos].fp = fp;
+    out[pos].score = score;
+    
+    return count < max ? count + 1 : count;
+}
+
+
+/*
+ * Score all fingerprints and keep only the best ones.
+ * 
+ * The database is grouped by OS family. The family the TTL points
+ * to goes first, since that is where the best match usually is;
+ * after that, a family whose best possible score can't make the
+ * list is skipped without scoring any of its entries.
+ */
+int rank_matches(const ScoreModel *model, ScanResult *scan, Match *out, int max)
+{
+    if (!model || !scan || max <= 0) return 0;
+    
+    OSFP_PROBE2(match_start, scan->ttl, scan->window);
     
-    /* Allocate space for matches */
-    int capacity = 10000;
-    Match *matches = malloc(sizeof(Match) * capacity);
     int count = 0;
+    ScanCode code;
+    encode_scan(model, scan, &code);
+    
+    OSType order[OS_TYPES];
+    int parts = 0;
+    OSType likely = guess_os_from_ttl(scan->ttl);
+    
+    order[parts++] = likely;
+    for (int f = 0; f < OS_TYPES; f++) {
+        if (f != (int)likely) order[parts++] = f;
+    }
+    
+    for (int k = 0; k < parts; k++) {
+        OSType os = order[k];
+        
+        /* Skip non-Windows/Linux fingerprints entirely */
+        if (os == OS_OTHER || model->part_count[os] == 0)
+            continue;
+        
+        /* Can anything in here make the list? */
+        int bound = partition_bound(model, os, &code);
+        if (bound != INT_MAX) {
+            if (bound <= -100)
+                continue;
+            if (count == max && bound < out[count - 1].score)
+                continue;
+        }
+        
+        int end = model->part_start[os] + model->part_count[os];
+        for (int i = model->part_start[os]; i < end; i++) {
+            int score = model_score(model, i, &code);
+            
+            /* Only keep reasonable matches */
+            if (score > -100)
+                count = add_match(out, count, max, model->fps[i], score);
+        }
+    }
+    
+    OSFP_PROBE2(match_end, count, count ? out[0].score : 0);
+    return count;
+}
+
+
+/*
+ * How sure are we about the best match?
+ * 0 is no match, then LOW, MEDIUM and HIGH.
+ */
+static int confidence_level(int score)
+{
+    if (score > 600) return 3;
+    if (score > 350) return 2;
+    if (score > 200) return 1;
+    return 0;
+}
+
+int match_level(const Match *best, int count)
+{
+    return count > 0 ? confidence_level(best->score) : 0;
+}
+
+/* Returns NULL if the score is too low to call it a match */
+const char *match_confidence(const Match *best, int count)
+{
+    static const char *names[] = {NULL, "LOW", "MEDIUM", "HIGH"};
+    
+    return names[match_level(best, count)];
+}
+
+
+/*
+ * Incremental matching.
+ * 
+ * Everything from the SYN-ACK (TTL, window, DF, options) is scored
+ * once, when it arrives. The rest of the score comes from T2-T7,
+ * and for the probes that haven't answered yet we look at every
+ * reply they could still bring: none, or one with the flags and
+ * DF bit either entry expects, or something else. If no such
+ * outcome can lift another entry over the current best one, and
+ * the best one's confidence can't change either, the answer is
+ * settled and there is no point waiting for the rest.
+ */
+struct IncMatcher {
+    const ScoreModel *model;
+    int *t1;            /* Score from the SYN-ACK alone, per entry */
+    int have_t1;
+};
+
+
+IncMatcher *inc_matcher_new(const ScoreModel *model)
+{
+    IncMatcher *im = calloc(1, sizeof(IncMatcher));
+    if (!im) return NULL;
+    
+    im->model = model;
+    im->t1 = malloc(sizeof(int) * (model->count ? model->count : 1));
+    if (!im->t1) {
+        free(im);
+        return NULL;
+    }
+    return im;
+}
+
+
+void inc_matcher_free(IncMatcher *im)
+{
+    if (!im) return;
+    free(im->t1);
+    free(im);
+}
+
+
+/* The T2-T7 part of the score, as the scan stands */
+static int later_parts(const Fingerprint *fp, const ScanResult *scan)
+{
+    int score = score_behavior(fp, scan->t2_responded, scan->t3_responded);
+    
+    for (int p = PROBE_T4; p <= PROBE_T7; p++) {
+        const ProbeReply *r = &scan->reply[p];
+        score += score_probe(fp, p, r->responded, r->flags, r->df_flag);
+    }
+    return score;
+}
+
+
+/* score_probe(), where a missing fingerprint scores nothing */
+static int probe_part(const Fingerprint *fp, int p, int responded, int flags, char df)
+{
+    return fp ? score_probe(fp, p, responded, flags, df) : 0;
+}
+
+
+/*
+ * The smallest score(a) - score(b) probe p can still give.
+ * Either fingerprint can be NULL, which gives plain bounds.
+ */
+static int probe_gap(const Fingerprint *a, const Fingerprint *b, int p,
+                     const ScanResult *scan, unsigned answered)
+{
+    if (answered & (1u << p)) {
+        const ProbeReply *r = &scan->reply[p];
+        return probe_part(a, p, 1, r->flags, r->df_flag) -
+               probe_part(b, p, 1, r->flags, r->df_flag);
+    }
+    
+    /* Flags either one allows, and some neither does */
+    int flags[2 * FLAG_CHOICES + 1];
+    int count = 0;
+    flags[count++] = -2;
+    for (int i = 0; a && i < a->expect[p].flag_count; i++)
+        flags[count++] = a->expect[p].flags[i];
+    for (int i = 0; b && i < b->expect[p].flag_count; i++)
+        flags[count++] = b->expect[p].flags[i];
+    static const char dfs[] = {'Y', 'N'};
+    
+    /* No reply at all */
+    int worst = probe_part(a, p, 0, 0, 0) - probe_part(b, p, 0, 0, 0);
+    
+    for (int f = 0; f < count; f++) {
+        for (int d = 0; d < 2; d++) {
+            int gap = probe_part(a, p, 1, flags[f], dfs[d]) -
+                      probe_part(b, p, 1, flags[f], dfs[d]);
+            if (gap < worst) worst = gap;
+        }
+    }
+    return worst;
+}
+
+
+/* Same for all of T2-T7. T2 and T3 are scored together. */
+static int later_gap(const Fingerprint *a, const Fingerprint *b,
+                     const ScanResult *scan, unsigned answered)
+{
+    int worst = 0, first = 1;
+    
+    for (int t2 = 0; t2 <= 1; t2++) {
+        if ((answered & (1u << PROBE_T2)) && !t2) continue;
+        for (int t3 = 0; t3 <= 1; t3++) {
+            if ((answered & (1u << PROBE_T3)) && !t3) continue;
+            
+            int gap = (a ? score_behavior(a, t2, t3) : 0) -
+                      (b ? score_behavior(b, t2, t3) : 0);
+            if (first || gap < worst) worst = gap;
+            first = 0;
+        }
+    }
+    
+    for (int p = PROBE_T4; p <= PROBE_T7; p++)
+        worst += probe_gap(a, b, p, scan, answered);
+    
+    return worst;
+}
+
+
+int inc_matcher_settled(IncMatcher *im, const ScanResult *scan, unsigned answered)
+{
+    const ScoreModel *m = im->model;
+    
+    /* Nothing to go on without the SYN-ACK */
+    if (!(answered & (1u << PROBE_T1)))
+        return 0;
+    
+    if (!im->have_t1) {
+        ScanCode code;
+        encode_scan(m, scan, &code);
+        
+        for (int i = 0; i < m->count; i++) {
+            if (m->os[i] == OS_OTHER) continue;
+            im->t1[i] = model_score(m, i, &code) - later_parts(m->fps[i], scan);
+        }
+        im->have_t1 = 1;
+    }
+    
+    /* The best match if we stopped now (ties go to the first entry) */
+    int best = -1, best_score = 0;
+    for (int i = 0; i < m->count; i++) {
+        if (m->os[i] == OS_OTHER) continue;
+        
+        int score = im->t1[i] + later_parts(m->fps[i], scan);
+        if (best < 0 || score > best_score ||
+            (score == best_score && m->fps[i]->index < m->fps[best]->index)) {
+            best = i;
+            best_score = score;
+        }
+    }
+    if (best < 0)
+        return 1;
+    
+    /* It has to stay listed, and at the same confidence */
+    const Fingerprint *b = m->fps[best];
+    int low = im->t1[best] + later_gap(b, NULL, scan, answered);
+    int high = im->t1[best] - later_gap(NULL, b, scan, answered);
+    
+    if (low <= -100 || confidence_level(low) != confidence_level(high))
+        return 0;
+    
+    /* And nothing may be able to overtake it */
+    for (int i = 0; i < m->count; i++) {
+        if (i == best || m->os[i] == OS_OTHER) continue;
+        
+        const Fingerprint *fp = m->fps[i];
+        int high_i = im->t1[i] - later_gap(NULL, fp, scan, answered);
+        if (high_i < low || high_i <= -100)
+            continue;
+        
+        int gap = im->t1[best] - im->t1[i] + later_gap(b, fp, scan, answered);
+        if (gap < 0 || (gap == 0 && fp->index < b->index))
+            return 0;
+    }
+    
+    return 1;
+}
+
+
+/*
+ * Find and display the best matching fingerprints.
+ */
+void find_matches(const ScoreModel *model, ScanResult *scan)
+{
+    if (!model || !scan) return;
+    
+    Match matches[TOP_MATCHES];
     
     /* What OS family does the TTL suggest? */
     OSType observed_os = guess_os_from_ttl(scan->ttl);
@@ -229,61 +729,56 @@ void find_matches(FingerprintNode *db, ScanResult *scan)
     printf("  XMAS probe: %s\n", scan->t3_responded ? "yes" : "no");
     printf("  ACK probe:  %s\n", scan->t4_responded ? "yes" : "no");
     printf("\n");
+    printf("Closed port %d:\n", scan->closed_port);
+    printf("  SYN probe:  %s\n", scan->reply[PROBE_T5].responded ? "yes" : "no");
+    printf("  ACK probe:  %s\n", scan->reply[PROBE_T6].responded ? "yes" : "no");
+    printf("  FPU probe:  %s\n", scan->reply[PROBE_T7].responded ? "yes" : "no");
+    printf("\n");
     
-    /* Score all fingerprints */
-    FingerprintNode *node = db;
-    while (node && count < capacity) {
-        int score = calculate_score(node->fp, scan);
+    if (scan->icmp_sent) {
+        const EchoReply *e = &scan->echo;
+        const UnreachReply *u = &scan->unreach;
         
-        /* Only keep reasonable matches */
-        if (score > -100) {
-            matches[count].fp = node->fp;
-            matches[count].score = score;
-            count++;
-        }
+        if (e->responded)
+            printf("ICMP echo:   reply (DFI=%c, CD=%c)\n", dfi_letter(e->dfi), cd_letter(e->cd));
+        else
+            printf("ICMP echo:   no reply\n");
         
-        node = node->next;
+        if (u->responded)
+            printf("Closed UDP:  port unreachable (IPL=%X, %d of %d quote checks good)\n",
+                   u->ipl, __builtin_popcount(u->quote), QUOTE_CHECKS);
+        else
+            printf("Closed UDP:  no reply\n");
+        printf("\n");
     }
     
-    /* Sort by score */
-    qsort(matches, count, sizeof(Match), compare_matches);
+    /* Score all fingerprints */
+    int count = rank_matches(model, scan, matches, TOP_MATCHES);
     
     /* Show top matches */
     printf("============================================\n");
     printf(" Top %d Matches\n", TOP_MATCHES);
     printf("============================================\n");
     
-    int shown = 0;
-    for (int i = 0; i < count && shown < TOP_MATCHES; i++) {
+    for (int i = 0; i < count; i++) {
         Match *m = &matches[i];
-        OSType os = guess_os_from_name(m->fp->name);
-        
-        /* Skip if not Windows or Linux */
-        if (os == OS_OTHER) continue;
+        OSType os = m->fp->os;
         
-        printf("\n#%d  %s\n", shown + 1, m->fp->name);
+        printf("\n#%d  %s\n", i + 1, m->fp->name);
         printf("    Score: %d\n", m->score);
         printf("    Type:  %s\n", os_type_name(os));
-        
-        shown++;
     }
     
     /* Summary */
     printf("\n--------------------------------------------\n");
     
-    if (shown > 0 && matches[0].score > 200) {
+    const char *confidence = match_confidence(&matches[0], count);
+    
+    if (confidence) {
         printf("Best guess: %s\n", matches[0].fp->name);
-        
-        if (matches[0].score > 600)
-            printf("Confidence: HIGH\n");
-        else if (matches[0].score > 350)
-            printf("Confidence: MEDIUM\n");
-        else
-            printf("Confidence: LOW\n");
+        printf("Confidence: %s\n", confidence);
     } else {
         printf("No confident match found.\n");
         printf("Based on TTL, this is likely: %s\n", os_type_name(observed_os));
     }
-    
-    free(matches);
-}
\ No newline at end of file
+}
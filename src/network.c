@@ -11,15 +11,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/socket.h>
-#include <sys/wait.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <netinet/ip_icmp.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 
 #include "../include/defs.h"
 #include "../include/network.h"
 #include "../include/utils.h"
+#include "../include/engine.h"
+#include "../include/route.h"
+#include "../include/probes.h"
 
 
 /* Pseudo header for TCP checksum calculation */
@@ -33,83 +40,176 @@ struct pseudo_header {
 
 
 /*
- * Read TCP options from a received packet.
- * Builds both a string representation and fills the opts structure.
+ * What we know about each option kind.
+ * 
+ * letter  - what nmap writes for it (0 = not shown)
+ * min_len - shortest length we accept; 1 means it has no length byte
+ * value   - which value gets printed after the letter
  */
-void read_tcp_options(struct tcphdr *tcp, char *out_str, TCPOpts *opts)
+enum { OV_NONE, OV_MSS, OV_WSCALE, OV_TIMESTAMP };
+
+typedef struct {
+    char letter;
+    uint8_t min_len;
+    uint8_t value;
+} OptSpec;
+
+static const OptSpec opt_table[256] = {
+    [0] = {'L', 1, OV_NONE},        /* End of options */
+    [1] = {'N', 1, OV_NONE},        /* NOP */
+    [2] = {'M', 4, OV_MSS},         /* Maximum Segment Size */
+    [3] = {'W', 3, OV_WSCALE},      /* Window Scale */
+    [4] = {'S', 2, OV_NONE},        /* SACK Permitted */
+    [8] = {'T', 10, OV_TIMESTAMP},  /* Timestamp */
+};
+
+
+/* Unaligned big-endian reads - option values can sit at any offset */
+static uint16_t load_be16(const unsigned char *p)
 {
-    out_str[0] = '\0';
-    memset(opts, 0, sizeof(TCPOpts));
-    opts->mss = -1;
-    opts->window_scale = -1;
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t load_be32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+
+/*
+ * Append an uppercase hex number without leading zeros.
+ * Returns the new write position, never going past 'end'.
+ */
+static char *put_hex(char *o, char *end, uint32_t v)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    char tmp[8];
+    int n = 0;
     
-    /* Options start after the fixed TCP header (20 bytes) */
-    int opt_len = (tcp->doff * 4) - 20;
-    if (opt_len <= 0) return;
+    do {
+        tmp[n++] = digits[v & 0xF];
+        v >>= 4;
+    } while (v);
     
-    unsigned char *p = (unsigned char *)tcp + 20;
-    unsigned char *end = p + opt_len;
-    char tmp[32];
-    int idx = 0;
+    while (n && o < end)
+        *o++ = tmp[--n];
+    return o;
+}
+
+
+/*
+ * Decode TCP options in one pass.
+ * 
+ * Fills the record and writes the nmap-style string at the same time.
+ * The string is always terminated and never longer than out_len - 1.
+ */
+int decode_tcp_options(const unsigned char *p, int len, TCPOptRecord *rec,
+                       char *out_str, size_t out_len)
+{
+    memset(rec, 0, sizeof(*rec));
     
-    while (p < end) {
-        unsigned char kind = *p;
-        
-        /* End of options */
-        if (kind == 0) break;
+    if (out_len == 0) return 0;
+    
+    char *o = out_str;
+    char *o_end = out_str + out_len - 1;    /* Room for the terminator */
+    const unsigned char *end = p + (len > 0 ? len : 0);
+    
+    while (p < end && rec->count < MAX_TCP_OPTS) {
+        uint8_t kind = *p;
+        const OptSpec *spec = &opt_table[kind];
+        int opt_len = 1;
         
-        /* NOP - single byte padding */
-        if (kind == 1) {
-            strcat(out_str, "N");
-            if (idx < 31) opts->pattern[idx++] = 'N';
-            p++;
-            continue;
+        /* Everything except EOL and NOP has a length byte */
+        if (spec->min_len != 1) {
+            if (p + 1 >= end) break;
+            opt_len = p[1];
+            if (opt_len < 2 || p + opt_len > end) break;
         }
         
-        /* All other options have a length byte */
-        if (p + 1 >= end) break;
-        int len = p[1];
-        if (len < 2 || p + len > end) break;
+        /* Too short to hold its value: skip it */
+        int valid = (opt_len >= spec->min_len);
+        if (valid || spec->value == OV_TIMESTAMP)
+            rec->kinds[rec->count++] = kind;
         
-        switch (kind) {
-            case 2:  /* MSS */
-                if (len >= 4) {
-                    opts->mss = ntohs(*(uint16_t *)(p + 2));
-                    sprintf(tmp, "M%X", opts->mss);
-                    strcat(out_str, tmp);
-                    if (idx < 31) opts->pattern[idx++] = 'M';
-                }
+        switch (spec->value) {
+            case OV_MSS:
+                if (!valid) break;
+                rec->has_mss = 1;
+                rec->mss = load_be16(p + 2);
                 break;
-                
-            case 3:  /* Window Scale */
-                if (len >= 3) {
-                    opts->window_scale = p[2];
-                    sprintf(tmp, "W%X", opts->window_scale);
-                    strcat(out_str, tmp);
-                    if (idx < 31) opts->pattern[idx++] = 'W';
-                }
-                break;
-                
-            case 4:  /* SACK Permitted */
-                opts->has_sack = 1;
-                strcat(out_str, "S");
-                if (idx < 31) opts->pattern[idx++] = 'S';
+            case OV_WSCALE:
+                if (!valid) break;
+                rec->has_wscale = 1;
+                rec->window_scale = p[2];
                 break;
-                
-            case 8:  /* Timestamp */
-                opts->has_timestamp = 1;
-                if (len >= 10) {
-                    uint32_t ts = ntohl(*(uint32_t *)(p + 2));
-                    sprintf(tmp, "T%X", ts ? 1 : 0);
-                    strcat(out_str, tmp);
+            case OV_TIMESTAMP:
+                rec->has_timestamp = 1;
+                if (valid) {
+                    rec->ts_val = load_be32(p + 2);
+                    rec->ts_ecr = load_be32(p + 6);
                 }
-                if (idx < 31) opts->pattern[idx++] = 'T';
                 break;
         }
+        if (kind == 4) rec->has_sack = 1;
         
-        p += len;
+        /* The string part */
+        if (spec->letter && (valid || spec->value == OV_TIMESTAMP) && o < o_end) {
+            *o++ = spec->letter;
+            
+            if (spec->value == OV_MSS) {
+                o = put_hex(o, o_end, rec->mss);
+            } else if (spec->value == OV_WSCALE) {
+                o = put_hex(o, o_end, rec->window_scale);
+            } else if (spec->value == OV_TIMESTAMP && valid) {
+                /* nmap only says whether TSval and TSecr are zero */
+                if (o + 2 <= o_end) {
+                    *o++ = rec->ts_val ? '1' : '0';
+                    *o++ = rec->ts_ecr ? '1' : '0';
+                } else {
+                    o_end = o;      /* No room: stop here rather than leave a gap */
+                }
+            }
+        }
+        
+        /* Nothing after End of Options counts */
+        if (kind == 0) break;
+        
+        p += opt_len;
     }
     
+    *o = '\0';
+    return (int)(o - out_str);
+}
+
+
+/*
+ * Read TCP options from a received packet.
+ * Builds both a string representation and fills the opts structure.
+ */
+void read_tcp_options(const struct tcphdr *tcp, char *out_str, size_t out_len,
+                      TCPOpts *opts)
+{
+    TCPOptRecord rec;
+    
+    /* Options start after the fixed TCP header (20 bytes) */
+    int opt_len = (tcp->doff * 4) - 20;
+    decode_tcp_options((const unsigned char *)tcp + 20, opt_len, &rec,
+                       out_str, out_len);
+    
+    memset(opts, 0, sizeof(TCPOpts));
+    opts->mss = rec.has_mss ? rec.mss : -1;
+    opts->window_scale = rec.has_wscale ? rec.window_scale : -1;
+    opts->has_sack = rec.has_sack;
+    opts->has_timestamp = rec.has_timestamp;
+    
+    /* Option order for the matcher, known kinds only */
+    int idx = 0;
+    for (int i = 0; i < rec.count && idx < (int)sizeof(opts->pattern) - 1; i++) {
+        const OptSpec *spec = &opt_table[rec.kinds[i]];
+        if (spec->letter && rec.kinds[i] != 0)
+            opts->pattern[idx++] = spec->letter;
+    }
     opts->pattern[idx] = '\0';
 }
 
@@ -157,17 +257,67 @@ static int build_options(unsigned char *buf)
 
 
 /*
- * Send a TCP packet with specified flags.
+ * Ask the kernel to timestamp our outgoing packets.
+ * The timestamp is taken in the driver and handed back to us
+ * on the socket's error queue.
  */
-void send_packet(const char *target, int port, int flags)
+static void enable_tx_timestamps(int sock)
 {
-    int sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
-    if (sock < 0) {
-        perror("socket");
-        return;
+    int val = SOF_TIMESTAMPING_TX_SOFTWARE |
+              SOF_TIMESTAMPING_SOFTWARE |
+              SOF_TIMESTAMPING_OPT_TSONLY;
+    
+    setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val));
+}
+
+
+/*
+ * Read the transmit timestamp for the packet we just sent.
+ * Returns 1 if we got one, 0 if the kernel didn't give us one.
+ */
+static int read_tx_timestamp(int sock, struct timespec *ts)
+{
+    char data[256];
+    char control[512];
+    
+    /* It's normally queued by the time sendto() returns, but give it a moment */
+    struct pollfd pfd = {sock, POLLERR, 0};
+    if (poll(&pfd, 1, 5) <= 0)
+        return 0;
+    
+    struct iovec iov = {data, sizeof(data)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        return 0;
+    
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping *tss = (struct scm_timestamping *)CMSG_DATA(cm);
+            if (tss->ts[0].tv_sec || tss->ts[0].tv_nsec) {
+                *ts = tss->ts[0];
+                return 1;
+            }
+        }
     }
     
-    char packet[4096] = {0};
+    return 0;
+}
+
+
+/*
+ * Build a TCP packet (no IP header - the kernel adds that).
+ * Returns the packet length.
+ */
+int build_tcp_packet(char *packet, in_addr_t src, in_addr_t dst,
+                     int sport, int dport, int flags, uint32_t seq)
+{
+    memset(packet, 0, sizeof(struct tcphdr) + 40);
+    
     struct tcphdr *tcp = (struct tcphdr *)packet;
     unsigned char *opts = (unsigned char *)(packet + sizeof(struct tcphdr));
     
@@ -177,20 +327,10 @@ void send_packet(const char *target, int port, int flags)
         opt_len = build_options(opts);
     }
     
-    /* Destination */
-    struct sockaddr_in dst = {0};
-    dst.sin_family = AF_INET;
-    dst.sin_port = htons(port);
-    dst.sin_addr.s_addr = inet_addr(target);
-    
-    /* Get our source IP */
-    char src_ip[32];
-    get_local_ip(src_ip, target);
-    
     /* Fill TCP header */
-    tcp->source = htons(40000 + (rand() % 10000));
-    tcp->dest = htons(port);
-    tcp->seq = htonl(rand());
+    tcp->source = htons(sport);
+    tcp->dest = htons(dport);
+    tcp->seq = htonl(seq);
     tcp->ack_seq = 0;
     tcp->doff = (sizeof(struct tcphdr) + opt_len) / 4;
     tcp->fin = (flags & TH_FIN) ? 1 : 0;
@@ -203,186 +343,1075 @@ void send_packet(const char *target, int port, int flags)
     
     /* Calculate checksum */
     struct pseudo_header ph = {0};
-    ph.src = inet_addr(src_ip);
-    ph.dst = dst.sin_addr.s_addr;
+    ph.src = src;
+    ph.dst = dst;
     ph.protocol = IPPROTO_TCP;
     ph.tcp_len = htons(sizeof(struct tcphdr) + opt_len);
     
-    char csum_buf[4096];
+    char csum_buf[128];
     memcpy(csum_buf, &ph, sizeof(ph));
     memcpy(csum_buf + sizeof(ph), packet, sizeof(struct tcphdr) + opt_len);
     tcp->check = checksum(csum_buf, sizeof(ph) + sizeof(struct tcphdr) + opt_len);
     
+    return sizeof(struct tcphdr) + opt_len;
+}
+
+
+/*
+ * Send one TCP packet on an already open raw socket.
+ * If 'sent' is given, it gets the time the packet left.
+ */
+static void send_on_socket(int sock, in_addr_t src, in_addr_t dst,
+                           int sport, int dport, int flags,
+                           struct timespec *sent)
+{
+    char packet[128];
+    int len = build_tcp_packet(packet, src, dst, sport, dport, flags, rand());
+    
+    /* Destination */
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(dport);
+    addr.sin_addr.s_addr = dst;
+    
+    /* Userspace fallback in case there's no kernel timestamp */
+    if (sent) clock_gettime(CLOCK_REALTIME, sent);
+    
     /* Send it */
-    sendto(sock, packet, sizeof(struct tcphdr) + opt_len, 0,
-           (struct sockaddr *)&dst, sizeof(dst));
+    sendto(sock, packet, len, 0, (struct sockaddr *)&addr, sizeof(addr));
     
-    close(sock);
+    if (sent) read_tx_timestamp(sock, sent);
 }
 
 
 /*
- * Wait for a TCP response from the target.
- * Returns NULL on timeout.
+ * Send a TCP packet with specified flags.
+ * If 'sent' is given, it gets the time the packet left.
  */
-struct tcphdr *wait_for_response(const char *target, int timeout, struct iphdr **ip_out)
+void send_packet(const char *target, int port, int flags, struct timespec *sent)
 {
-    static char buffer[4096];
+    int sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+    if (sock < 0) {
+        perror("socket");
+        return;
+    }
+    
+    if (sent) enable_tx_timestamps(sock);
+    
+    in_addr_t dst = inet_addr(target);
+    OSFP_PROBE3(probe_send, dst, port, -1);
+    send_on_socket(sock, source_address(dst), dst,
+                   40000 + (rand() % 10000), port, flags, sent);
     
+    close(sock);
+}
+
+
+/*
+ * Open the socket we receive replies on.
+ * It has to exist before the probe goes out, or we could miss
+ * a fast reply. Every packet gets a kernel receive timestamp.
+ */
+int open_listener(void)
+{
     int sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
-    if (sock < 0) return NULL;
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+    
+    return sock;
+}
+
+
+/* Milliseconds left until a deadline (CLOCK_MONOTONIC) */
+static int ms_until(const struct timespec *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    long ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+              (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int)ms : 0;
+}
+
+
+/* A deadline 'ms' milliseconds from now (CLOCK_MONOTONIC) */
+static void deadline_in(int ms, struct timespec *deadline)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+
+/*
+ * Receive one packet before the deadline.
+ * Returns its length, or -1 on timeout. If 'received' is given,
+ * it gets the kernel's receive timestamp.
+ */
+static int recv_packet(int sock, const struct timespec *deadline,
+                       char *buffer, size_t size, in_addr_t *from_addr,
+                       struct timespec *received)
+{
+    char control[256];
+    
+    int left = ms_until(deadline);
+    if (left <= 0) return -1;
     
     /* Set timeout */
-    struct timeval tv = {timeout, 0};
+    struct timeval tv = {left / 1000, (left % 1000) * 1000};
     setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
     
-    while (1) {
-        struct sockaddr_in from;
-        socklen_t from_len = sizeof(from);
+    struct sockaddr_in from;
+    struct iovec iov = {buffer, size};
+    struct msghdr msg = {0};
+    msg.msg_name = &from;
+    msg.msg_namelen = sizeof(from);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    int len = recvmsg(sock, &msg, 0);
+    if (len < 0)
+        return -1;
+    
+    *from_addr = from.sin_addr.s_addr;
+    
+    if (received) {
+        /* Userspace fallback if there's no kernel timestamp */
+        clock_gettime(CLOCK_REALTIME, received);
+        
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS)
+                memcpy(received, CMSG_DATA(cm), sizeof(*received));
+        }
+    }
+    
+    return len;
+}
+
+
+/*
+ * The raw socket engine.
+ * One sendto() per probe (plus one to read its transmit timestamp)
+ * and a setsockopt() + recvmsg() per received packet.
+ */
+typedef struct {
+    Engine base;
+    int sender;
+    int listener;
+    int queued;
+    in_addr_t dst[ENGINE_QUEUE];
+    int len[ENGINE_QUEUE];
+    char packet[ENGINE_QUEUE][128];
+} RawEngine;
+
+
+static Engine *raw_open(void)
+{
+    RawEngine *e = calloc(1, sizeof(RawEngine));
+    if (!e) return NULL;
+    
+    e->base.ops = &raw_engine;
+    e->listener = open_listener();
+    e->sender = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+    
+    if (e->listener < 0 || e->sender < 0) {
+        if (e->sender < 0) perror("socket");
+        if (e->listener >= 0) close(e->listener);
+        if (e->sender >= 0) close(e->sender);
+        free(e);
+        return NULL;
+    }
+    
+    enable_tx_timestamps(e->sender);
+    return &e->base;
+}
+
+
+static int raw_send(Engine *base, in_addr_t dst, const char *packet, int len)
+{
+    RawEngine *e = (RawEngine *)base;
+    
+    if (e->queued == ENGINE_QUEUE || len > (int)sizeof(e->packet[0]))
+        return -1;
+    
+    e->dst[e->queued] = dst;
+    e->len[e->queued] = len;
+    memcpy(e->packet[e->queued], packet, len);
+    e->queued++;
+    return 0;
+}
+
+
+static int raw_flush(Engine *base, struct timespec *sent)
+{
+    RawEngine *e = (RawEngine *)base;
+    
+    for (int i = 0; i < e->queued; i++) {
+        struct tcphdr *tcp = (struct tcphdr *)e->packet[i];
+        
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = tcp->dest;
+        addr.sin_addr.s_addr = e->dst[i];
         
-        int len = recvfrom(sock, buffer, sizeof(buffer), 0,
-                          (struct sockaddr *)&from, &from_len);
+        /* Userspace fallback in case there's no kernel timestamp */
+        if (sent) clock_gettime(CLOCK_REALTIME, &sent[i]);
         
+        if (sendto(e->sender, e->packet[i], e->len[i], 0,
+                   (struct sockaddr *)&addr, sizeof(addr)) > 0)
+            e->base.stats.sent++;
+        else
+            e->base.stats.send_errors++;
+        e->base.stats.syscalls++;
+        
+        if (sent) {
+            read_tx_timestamp(e->sender, &sent[i]);
+            e->base.stats.syscalls += 2;
+        }
+    }
+    
+    e->queued = 0;
+    return 0;
+}
+
+
+static int raw_recv(Engine *base, const struct timespec *deadline, char *buffer,
+                    int size, struct timespec *received)
+{
+    RawEngine *e = (RawEngine *)base;
+    in_addr_t from;
+    
+    int len = recv_packet(e->listener, deadline, buffer, size, &from, received);
+    e->base.stats.syscalls += 2;
+    
+    if (len >= 0)
+        e->base.stats.received++;
+    return len;
+}
+
+
+static void raw_close(Engine *base)
+{
+    RawEngine *e = (RawEngine *)base;
+    
+    close(e->sender);
+    close(e->listener);
+    free(e);
+}
+
+
+const EngineOps raw_engine = {
+    "raw", raw_open, raw_send, raw_flush, raw_recv, raw_close
+};
+
+
+const EngineOps *find_engine(const char *name)
+{
+    static const EngineOps *engines[] = {&raw_engine, &uring_engine, &xdp_engine,
+                                         &xdp_generic_engine};
+    
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        if (strcmp(engines[i]->name, name) == 0)
+            return engines[i];
+    }
+    return NULL;
+}
+
+
+/* The TCP header of a received packet, or NULL if it's too short */
+struct tcphdr *tcp_header(char *buffer, int len)
+{
+    struct iphdr *ip = (struct iphdr *)buffer;
+    
+    if (len < (int)sizeof(struct iphdr) ||
+        len < (int)(ip->ihl * 4 + sizeof(struct tcphdr)))
+        return NULL;
+    
+    return (struct tcphdr *)(buffer + ip->ihl * 4);
+}
+
+
+/* Microseconds between two timestamps */
+static int diff_us(const struct timespec *a, const struct timespec *b)
+{
+    return (int)((b->tv_sec - a->tv_sec) * 1000000L +
+                 (b->tv_nsec - a->tv_nsec) / 1000);
+}
+
+
+/*
+ * Wait for a TCP response from the target's port, read into the
+ * caller's buffer. Returns NULL on timeout, or the TCP header inside
+ * 'buffer'. If 'received' is given, it gets the kernel's receive
+ * timestamp for the reply.
+ */
+struct tcphdr *wait_for_response(int sock, const char *target, int port,
+                                 int timeout_ms, char *buffer, int size,
+                                 struct iphdr **ip_out, struct timespec *received)
+{
+    in_addr_t target_addr = inet_addr(target);
+    
+    /* Other traffic must not keep us waiting past the timeout */
+    struct timespec deadline;
+    deadline_in(timeout_ms, &deadline);
+    
+    /* For the tracepoint: how long until the reply came */
+    struct timespec start, when;
+    clock_gettime(CLOCK_REALTIME, &start);
+    if (!received) received = &when;
+    
+    while (1) {
+        in_addr_t from;
+        int len = recv_packet(sock, &deadline, buffer, size, &from, received);
         if (len < 0) {
-            close(sock);
+            OSFP_PROBE3(probe_timeout, target_addr, -1, 0);
             return NULL;
         }
         
         /* Check if it's from our target */
-        if (from.sin_addr.s_addr == inet_addr(target)) {
-            struct iphdr *ip = (struct iphdr *)buffer;
-            struct tcphdr *tcp = (struct tcphdr *)(buffer + ip->ihl * 4);
-            
-            if (ip_out) *ip_out = ip;
-            close(sock);
-            return tcp;
-        }
+        if (from != target_addr)
+            continue;
+        
+        struct tcphdr *tcp = tcp_header(buffer, len);
+        
+        /* Only replies from the port we probed (this skips our own probe on loopback) */
+        if (!tcp || ntohs(tcp->source) != port)
+            continue;
+        
+        OSFP_PROBE3(probe_reply, from, -1, diff_us(&start, received));
+        if (ip_out) *ip_out = (struct iphdr *)buffer;
+        return tcp;
     }
 }
 
 
+/*
+ * Send one probe and wait for its reply.
+ * The listener is opened before sending so no reply can slip past.
+ * Fills in the timing and returns the reply (inside 'buffer'), or
+ * NULL on timeout.
+ */
+static struct tcphdr *run_probe(const char *target, int port, int flags,
+                                int timeout_ms, char *buffer, int size,
+                                ProbeTiming *timing, struct iphdr **ip_out)
+{
+    ProbeTiming t = {0};
+    t.rtt_us = -1;
+    
+    int sock = open_listener();
+    if (sock < 0) {
+        if (timing) *timing = t;
+        return NULL;
+    }
+    
+    send_packet(target, port, flags, &t.sent);
+    
+    struct tcphdr *tcp = wait_for_response(sock, target, port, timeout_ms,
+                                           buffer, size, ip_out, &t.received);
+    close(sock);
+    
+    if (tcp) {
+        t.rtt_us = diff_us(&t.sent, &t.received);
+        if (t.rtt_us < 0) t.rtt_us = 0;
+    } else {
+        memset(&t.received, 0, sizeof(t.received));
+    }
+    
+    if (timing) *timing = t;
+    return tcp;
+}
+
+
+/*
+ * Pick a timeout from a measured round trip time.
+ * A few RTTs is plenty; we don't go below MIN_TIMEOUT_MS or
+ * above the default.
+ */
+int adaptive_timeout(int rtt_us)
+{
+    if (rtt_us < 0) return PROBE_TIMEOUT_MS;
+    
+    int ms = (rtt_us * 3) / 1000;
+    if (ms < MIN_TIMEOUT_MS) ms = MIN_TIMEOUT_MS;
+    if (ms > PROBE_TIMEOUT_MS) ms = PROBE_TIMEOUT_MS;
+    return ms;
+}
+
+
 /*
  * Quick check if a port is open.
  * Sends SYN, looks for SYN-ACK.
  */
 int is_port_open(const char *target, int port)
 {
-    pid_t pid = fork();
+    char buffer[4096];
+    struct tcphdr *resp = run_probe(target, port, TH_SYN, 1000, buffer, sizeof(buffer),
+                                    NULL, NULL);
     
-    if (pid == 0) {
-        /* Child: send the packet after a small delay */
-        usleep(50000);
-        send_packet(target, port, TH_SYN);
-        exit(0);
-    }
+    return (resp && resp->syn && resp->ack);
+}
+
+
+/*
+ * The probes we send, in order.
+ * T1-T4 go to the open port, T5-T7 to a closed one.
+ */
+static const struct {
+    const char *name;
+    int flags;
+    int closed;
+} probe_info[PROBE_COUNT] = {
+    [PROBE_T1] = {"SYN",         TH_SYN,                            0},
+    [PROBE_T2] = {"NULL",        0,                                 0},
+    [PROBE_T3] = {"XMAS",        TH_SYN | TH_FIN | TH_PUSH | TH_URG, 0},
+    [PROBE_T4] = {"ACK",         TH_ACK,                            0},
+    [PROBE_T5] = {"Closed SYN",  TH_SYN,                            1},
+    [PROBE_T6] = {"Closed ACK",  TH_ACK,                            1},
+    [PROBE_T7] = {"Closed FPU",  TH_FIN | TH_PUSH | TH_URG,         1},
+};
+
+
+/*
+ * Pick a port to use as the closed one.
+ * Like nmap without a port scan, we take a random high port;
+ * almost nothing listens up there.
+ */
+static int choose_closed_port(int open_port)
+{
+    int port;
+    do {
+        port = 30000 + rand() % 30000;
+    } while (port == open_port);
+    return port;
+}
+
+
+/* TH_* flags probe p is sent with, and whether it goes to the closed port */
+int probe_flags(int probe)
+{
+    return probe_info[probe].flags;
+}
+
+int probe_to_closed_port(int probe)
+{
+    return probe_info[probe].closed;
+}
+
+
+/* TH_* flags of a TCP header */
+static int tcp_flags(const struct tcphdr *tcp)
+{
+    return (tcp->fin ? TH_FIN : 0) | (tcp->syn ? TH_SYN : 0) |
+           (tcp->rst ? TH_RST : 0) | (tcp->psh ? TH_PUSH : 0) |
+           (tcp->ack ? TH_ACK : 0) | (tcp->urg ? TH_URG : 0);
+}
+
+
+/*
+ * Record the reply to one probe.
+ * The SYN-ACK to T1 is where most of the fingerprint comes from.
+ */
+void record_reply(ScanResult *result, int probe, struct iphdr *ip,
+                  struct tcphdr *tcp)
+{
+    ProbeReply *r = &result->reply[probe];
     
-    /* Parent: wait for response */
-    struct tcphdr *resp = wait_for_response(target, 1, NULL);
-    wait(NULL);
+    r->responded = 1;
+    r->flags = tcp_flags(tcp);
+    r->ttl = ip->ttl;
+    r->window = ntohs(tcp->window);
+    r->df_flag = (ntohs(ip->frag_off) & 0x4000) ? 'Y' : 'N';
     
-    return (resp && resp->syn && resp->ack);
+    switch (probe) {
+        case PROBE_T1:
+            result->got_response = 1;
+            result->ttl = r->ttl;
+            result->window = r->window;
+            result->df_flag = r->df_flag;
+        
+            /* Get flags as string */
+            result->flags[0] = '\0';
+            if (tcp->syn) strcat(result->flags, "S");
+            if (tcp->ack) strcat(result->flags, "A");
+            if (tcp->rst) strcat(result->flags, "R");
+        
+            read_tcp_options(tcp, result->options, sizeof(result->options),
+                             &result->opts);
+            break;
+        case PROBE_T2: result->t2_responded = 1; break;
+        case PROBE_T3: result->t3_responded = 1; break;
+        case PROBE_T4: result->t4_responded = 1; break;
+    }
+}
+
+
+/* Without a SYN-ACK the TTL comes from the ICMP replies */
+static void icmp_ttl(ScanResult *result)
+{
+    if (result->got_response || !result->icmp_sent)
+        return;
+    
+    if (result->echo.responded)
+        result->ttl = result->echo.ttl;
+    else if (result->unreach.responded)
+        result->ttl = result->unreach.ttl;
 }
 
 
 /*
  * Run all fingerprinting probes.
- * This sends several different packets and records the responses.
+ * 
+ * All seven probes go out back to back, each from its own source
+ * port, so the whole run costs one round trip. Replies are matched
+ * to probes by port. We wait until everything has answered, or
+ * until a few RTTs after the SYN-ACK (the probes that haven't
+ * answered by then aren't going to), or until 'check' says the
+ * replies so far are enough.
  */
-void fingerprint_target(const char *target, int port, ScanResult *result)
+void fingerprint_target(Engine *engine, const char *target, int port,
+                        ScanResult *result, ReplyCheck check, void *arg)
 {
-    struct iphdr *ip = NULL;
-    struct tcphdr *tcp = NULL;
-    pid_t pid;
+    char buffer[4096];
+    
+    /* IE and U1 went out with the discovery burst; keep their replies */
+    int icmp_sent = result->icmp_sent;
+    EchoReply echo = result->echo;
+    UnreachReply unreach = result->unreach;
     
     memset(result, 0, sizeof(ScanResult));
+    result->icmp_sent = icmp_sent;
+    result->echo = echo;
+    result->unreach = unreach;
+    for (int i = 0; i < PROBE_COUNT; i++)
+        result->timing[i].rtt_us = -1;
+    
+    result->closed_port = choose_closed_port(port);
     
-    /*
-     * Probe 1: Normal SYN packet
-     * This is our main probe - we learn the most from this.
-     */
-    printf("   Sending SYN probe... ");
-    fflush(stdout);
-    
-    pid = fork();
-    if (pid == 0) {
-        usleep(100000);
-        send_packet(target, port, TH_SYN);
-        exit(0);
+    /* Get our source IP */
+    in_addr_t dst = inet_addr(target);
+    in_addr_t src = source_address(dst);
+    
+    /* Probe i is sent from port base + i */
+    int base = 40000 + rand() % 10000;
+    
+    printf("   Sending %d probes (closed port %d)...\n", PROBE_COUNT, result->closed_port);
+    
+    struct timespec sent[PROBE_COUNT];
+    
+    for (int i = 0; i < PROBE_COUNT; i++) {
+        char packet[128];
+        int dport = probe_info[i].closed ? result->closed_port : port;
+        int len = build_tcp_packet(packet, src, dst, base + i, dport,
+                                   probe_info[i].flags, rand());
+        OSFP_PROBE3(probe_send, dst, dport, i);
+        engine->ops->send(engine, dst, packet, len);
     }
+    engine->ops->flush(engine, sent);
     
-    tcp = wait_for_response(target, 2, &ip);
-    wait(NULL);
+    for (int i = 0; i < PROBE_COUNT; i++)
+        result->timing[i].sent = sent[i];
     
-    if (tcp && ip) {
-        result->got_response = 1;
-        result->ttl = ip->ttl;
-        result->window = ntohs(tcp->window);
-        result->df_flag = (ntohs(ip->frag_off) & 0x4000) ? 'Y' : 'N';
+    /* Collect replies */
+    struct timespec deadline;
+    deadline_in(PROBE_TIMEOUT_MS, &deadline);
+    unsigned all = (1u << PROBE_COUNT) - 1;
+    unsigned answered = 0;
+    
+    while (answered != all) {
+        struct timespec received;
+        int len = engine->ops->recv(engine, &deadline, buffer, sizeof(buffer),
+                                    &received);
+        if (len < 0)
+            break;
         
-        /* Get flags as string */
-        result->flags[0] = '\0';
-        if (tcp->syn) strcat(result->flags, "S");
-        if (tcp->ack) strcat(result->flags, "A");
-        if (tcp->rst) strcat(result->flags, "R");
+        struct tcphdr *tcp = tcp_header(buffer, len);
+        if (!tcp || ((struct iphdr *)buffer)->saddr != dst)
+            continue;
         
-        read_tcp_options(tcp, result->options, &result->opts);
+        /* Which probe is this a reply to? */
+        int probe = ntohs(tcp->dest) - base;
+        if (probe < 0 || probe >= PROBE_COUNT || result->reply[probe].responded)
+            continue;
         
-        printf("got response (TTL=%d, Win=%d)\n", result->ttl, result->window);
-    } else {
-        printf("timeout\n");
+        int dport = probe_info[probe].closed ? result->closed_port : port;
+        if (ntohs(tcp->source) != dport)
+            continue;
+        
+        record_reply(result, probe, (struct iphdr *)buffer, tcp);
+        answered |= 1u << probe;
+        
+        ProbeTiming *t = &result->timing[probe];
+        t->received = received;
+        t->rtt_us = diff_us(&t->sent, &t->received);
+        if (t->rtt_us < 0) t->rtt_us = 0;
+        OSFP_PROBE3(probe_reply, dst, probe, t->rtt_us);
+        
+        /* Now we know the RTT, don't wait much longer for the rest */
+        if (probe == PROBE_T1) {
+            struct timespec sooner;
+            deadline_in(adaptive_timeout(t->rtt_us), &sooner);
+            if (sooner.tv_sec < deadline.tv_sec ||
+                (sooner.tv_sec == deadline.tv_sec && sooner.tv_nsec < deadline.tv_nsec))
+                deadline = sooner;
+        }
+        
+        if (check && answered != all && check(result, answered, arg)) {
+            result->stopped_early = 1;
+            break;
+        }
     }
     
-    /*
-     * Probe 2: NULL packet (no flags)
-     * Some systems respond, others don't.
-     */
-    printf("   Sending NULL probe... ");
-    fflush(stdout);
-    
-    pid = fork();
-    if (pid == 0) {
-        usleep(100000);
-        send_packet(target, port, 0);
-        exit(0);
+    if (answered != all && !result->stopped_early)
+        OSFP_PROBE3(probe_timeout, dst, all & ~answered, 0);
+    
+    /* Show what happened */
+    for (int i = 0; i < PROBE_COUNT; i++) {
+        ProbeReply *r = &result->reply[i];
+        printf("   %-11s ", probe_info[i].name);
+        
+        if (!r->responded) {
+            printf("%s\n", result->stopped_early ? "not needed" : "no response");
+            continue;
+        }
+        
+        char flags[8];
+        format_flags(r->flags, flags);
+        printf("response (Flags=%s, TTL=%d, Win=%d, RTT=%.3f ms)\n", flags,
+               r->ttl, r->window, result->timing[i].rtt_us / 1000.0);
     }
     
-    result->t2_responded = (wait_for_response(target, 2, NULL) != NULL);
-    wait(NULL);
-    printf("%s\n", result->t2_responded ? "response" : "no response");
-    
-    /*
-     * Probe 3: Weird flags (SYN+FIN+PSH+URG)
-     * Windows typically ignores this, Linux may respond.
-     */
-    printf("   Sending XMAS probe... ");
-    fflush(stdout);
-    
-    pid = fork();
-    if (pid == 0) {
-        usleep(100000);
-        send_packet(target, port, TH_SYN | TH_FIN | TH_PUSH | TH_URG);
-        exit(0);
+    if (result->stopped_early)
+        printf("   (stopped early, the other replies couldn't change the best match)\n");
+    
+    icmp_ttl(result);
+}
+
+
+/*
+ * Port discovery.
+ * 
+ * The SYNs to the candidate ports go out in one burst together with
+ * IE (two ICMP echo requests) and U1 (a UDP packet to a closed port),
+ * so a host whose TCP ports are all filtered can still be matched on
+ * its ICMP replies after a single round trip. IE and U1 are built the
+ * way nmap sends them, since nmap-os-db describes the replies to
+ * exactly those packets. They need their own IP headers (DF, TOS and
+ * IP ID are part of the test), so they go out on an IPPROTO_RAW socket.
+ */
+#define IE_SEQ          295
+#define U1_IP_ID        0x1042
+#define U1_DATA_LEN     300
+#define U1_LEN          (20 + 8 + U1_DATA_LEN)
+
+/* What went out, to check the replies against */
+typedef struct {
+    in_addr_t dst;
+    const int *ports;
+    int count;
+    int base;               /* The SYN to ports[i] leaves from base + i */
+    unsigned answered;      /* Ports that sent a SYN-ACK or RST */
+    unsigned open;          /* ...the ones with a SYN-ACK */
+    int t1;                 /* Port whose SYN-ACK is in the result, count if none */
+    
+    int echo_id;
+    int echo_got[2];
+    int echo_df[2];
+    int echo_code[2];
+    int echo_ttl;
+    
+    int udp_sport;
+    int udp_dport;
+    uint16_t u1_ip_check;
+    uint16_t u1_udp_check;
+} Discovery;
+
+
+/* An IPv4 header for a packet sent on an IPPROTO_RAW socket */
+static void build_ip_header(struct iphdr *ip, in_addr_t src, in_addr_t dst, int protocol,
+                            int len, int id, int tos, int df)
+{
+    memset(ip, 0, sizeof(*ip));
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->tos = tos;
+    ip->tot_len = htons(len);
+    ip->id = htons(id);
+    ip->frag_off = df ? htons(IP_DF) : 0;
+    ip->ttl = 64;
+    ip->protocol = protocol;
+    ip->saddr = src;
+    ip->daddr = dst;
+    ip->check = checksum(ip, sizeof(*ip));
+}
+
+
+/*
+ * One of the two IE requests. The first has DF set, code 9 and 120
+ * zero bytes; the second TOS 4, code 0 and 150 bytes.
+ */
+static int build_echo(char *packet, in_addr_t src, const Discovery *d, int which)
+{
+    int data_len = which ? 150 : 120;
+    int len = sizeof(struct iphdr) + sizeof(struct icmphdr) + data_len;
+    memset(packet, 0, len);
+    
+    struct icmphdr *icmp = (struct icmphdr *)(packet + sizeof(struct iphdr));
+    icmp->type = ICMP_ECHO;
+    icmp->code = which ? 0 : 9;
+    icmp->un.echo.id = htons(d->echo_id);
+    icmp->un.echo.sequence = htons(IE_SEQ + which);
+    icmp->checksum = checksum(icmp, sizeof(struct icmphdr) + data_len);
+    
+    build_ip_header((struct iphdr *)packet, src, d->dst, IPPROTO_ICMP, len,
+                    rand() & 0xFFFF, which ? 4 : 0, !which);
+    return len;
+}
+
+
+/* U1: 300 bytes of 'C' to a closed UDP port, with IP ID 0x1042 */
+static int build_u1(char *packet, in_addr_t src, Discovery *d)
+{
+    memset(packet, 0, U1_LEN);
+    
+    struct iphdr *ip = (struct iphdr *)packet;
+    struct udphdr *udp = (struct udphdr *)(packet + sizeof(struct iphdr));
+    memset(udp + 1, 'C', U1_DATA_LEN);
+    
+    udp->source = htons(d->udp_sport);
+    udp->dest = htons(d->udp_dport);
+    udp->len = htons(sizeof(struct udphdr) + U1_DATA_LEN);
+    
+    struct pseudo_header ph = {0};
+    ph.src = src;
+    ph.dst = d->dst;
+    ph.protocol = IPPROTO_UDP;
+    ph.tcp_len = udp->len;
+    
+    char csum_buf[sizeof(ph) + sizeof(struct udphdr) + U1_DATA_LEN];
+    memcpy(csum_buf, &ph, sizeof(ph));
+    memcpy(csum_buf + sizeof(ph), udp, sizeof(struct udphdr) + U1_DATA_LEN);
+    udp->check = checksum(csum_buf, sizeof(csum_buf));
+    if (udp->check == 0) udp->check = 0xFFFF;
+    
+    build_ip_header(ip, src, d->dst, IPPROTO_UDP, U1_LEN, U1_IP_ID, 0, 0);
+    
+    d->u1_ip_check = ip->check;
+    d->u1_udp_check = udp->check;
+    return U1_LEN;
+}
+
+
+/*
+ * A SYN-ACK or RST to one of the SYNs. The SYNs carry the same
+ * options as T1, so the SYN-ACK from the port we'll use is kept
+ * as T1's reply (for -q; a full run sends T1 again).
+ */
+static void discovery_tcp(Discovery *d, ScanResult *result, char *buffer, int len)
+{
+    struct tcphdr *tcp = tcp_header(buffer, len);
+    if (!tcp || ((struct iphdr *)buffer)->saddr != d->dst)
+        return;
+    
+    int i = ntohs(tcp->dest) - d->base;
+    if (i < 0 || i >= d->count || (d->answered & (1u << i)) ||
+        ntohs(tcp->source) != d->ports[i])
+        return;
+    
+    if (tcp->syn && tcp->ack) {
+        d->open |= 1u << i;
+        if (i < d->t1) {
+            record_reply(result, PROBE_T1, (struct iphdr *)buffer, tcp);
+            d->t1 = i;
+        }
+    } else if (!tcp->rst) {
+        return;
+    }
+    
+    d->answered |= 1u << i;
+    OSFP_PROBE3(probe_reply, d->dst, -1, 0);
+}
+
+
+/*
+ * Which of the U1 checks a port unreachable passes: its unused field
+ * is zero, and what it quotes of our packet (length, IP ID, both
+ * checksums, the data) is what we sent. 'len' counts from the ICMP
+ * header on. Parts that aren't quoted at all pass.
+ */
+static int quote_checks(const Discovery *d, const unsigned char *icmp, int len)
+{
+    int quote = 0;
+    
+    if (load_be32(icmp + 4) == 0)
+        quote |= QUOTE_UN;
+    
+    const unsigned char *q = icmp + 8;
+    int qhl = (q[0] & 0x0F) * 4;
+    
+    if (load_be16(q + 2) == U1_LEN)
+        quote |= QUOTE_RIPL;
+    if (load_be16(q + 4) == U1_IP_ID)
+        quote |= QUOTE_RID;
+    if (memcmp(q + 10, &d->u1_ip_check, 2) == 0)
+        quote |= QUOTE_RIPCK;
+    
+    /* The UDP header and data, as far as they're quoted */
+    const unsigned char *udp = q + qhl;
+    int left = len - 8 - qhl;
+    
+    if (left < 8 || memcmp(udp + 6, &d->u1_udp_check, 2) == 0)
+        quote |= QUOTE_RUCK;
+    
+    quote |= QUOTE_RUD;
+    for (int i = 8; i < left && i < 8 + U1_DATA_LEN; i++) {
+        if (udp[i] != 'C') {
+            quote &= ~QUOTE_RUD;
+            break;
+        }
     }
     
-    result->t3_responded = (wait_for_response(target, 2, NULL) != NULL);
-    wait(NULL);
-    printf("%s\n", result->t3_responded ? "response" : "no response");
-    
-    /*
-     * Probe 4: ACK packet
-     * Used to check firewall behavior.
-     */
-    printf("   Sending ACK probe... ");
-    fflush(stdout);
-    
-    pid = fork();
-    if (pid == 0) {
-        usleep(100000);
-        send_packet(target, port, TH_ACK);
-        exit(0);
+    return quote;
+}
+
+
+/* An echo reply to IE, or the port unreachable for U1 */
+static void discovery_icmp(Discovery *d, ScanResult *result, const char *buffer, int len)
+{
+    const struct iphdr *ip = (const struct iphdr *)buffer;
+    int hl = ip->ihl * 4;
+    
+    if (len < hl + 8 || ip->saddr != d->dst)
+        return;
+    
+    const unsigned char *p = (const unsigned char *)buffer + hl;
+    const struct icmphdr *icmp = (const struct icmphdr *)p;
+    int df = (ntohs(ip->frag_off) & IP_DF) != 0;
+    
+    if (icmp->type == ICMP_ECHOREPLY && ntohs(icmp->un.echo.id) == d->echo_id) {
+        int which = ntohs(icmp->un.echo.sequence) - IE_SEQ;
+        if (which < 0 || which > 1 || d->echo_got[which])
+            return;
+        
+        d->echo_got[which] = 1;
+        d->echo_df[which] = df;
+        d->echo_code[which] = icmp->code;
+        if (!d->echo_ttl) d->echo_ttl = ip->ttl;
+        OSFP_PROBE3(probe_reply, d->dst, -2, 0);
+        return;
     }
     
-    result->t4_responded = (wait_for_response(target, 2, NULL) != NULL);
-    wait(NULL);
-    printf("%s\n", result->t4_responded ? "response" : "no response");
+    if (icmp->type != ICMP_DEST_UNREACH || icmp->code != ICMP_PORT_UNREACH ||
+        result->unreach.responded)
+        return;
+    
+    /* It has to quote our UDP packet, at least up to the ports */
+    const unsigned char *q = p + 8;
+    int qlen = len - hl - 8;
+    int qhl = (q[0] & 0x0F) * 4;
+    
+    if (qlen < 20 || qhl < 20 || qlen < qhl + 4 || q[9] != IPPROTO_UDP ||
+        memcmp(q + 16, &d->dst, 4) != 0 ||
+        load_be16(q + qhl) != d->udp_sport || load_be16(q + qhl + 2) != d->udp_dport)
+        return;
+    
+    UnreachReply *u = &result->unreach;
+    u->responded = 1;
+    u->ttl = ip->ttl;
+    u->df_flag = df ? 'Y' : 'N';
+    u->ipl = ntohs(ip->tot_len);
+    u->quote = quote_checks(d, p, len - hl);
+    OSFP_PROBE3(probe_reply, d->dst, -3, 0);
+}
+
+
+/* Done once IE and U1 are in and the port we'd pick is known */
+static int discovery_done(const Discovery *d, const ScanResult *result)
+{
+    if (result->icmp_sent &&
+        (!d->echo_got[0] || !d->echo_got[1] || !result->unreach.responded))
+        return 0;
+    
+    unsigned all = d->count == 32 ? ~0u : (1u << d->count) - 1;
+    if (d->answered == all)
+        return 1;
+    
+    /* The first open port, with every port before it closed */
+    if (d->open) {
+        unsigned before = (d->open & -d->open) - 1;
+        return (d->answered & before) == before;
+    }
+    return 0;
+}
+
+
+static void show_discovery(const Discovery *d, const ScanResult *result)
+{
+    for (int i = 0; i < d->count; i++) {
+        const char *state = "no response";
+        if (d->open & (1u << i))
+            state = "open";
+        else if (d->answered & (1u << i))
+            state = "closed";
+        printf("   Port %d: %s\n", d->ports[i], state);
+    }
+    
+    if (!result->icmp_sent)
+        return;
+    
+    const EchoReply *e = &result->echo;
+    if (e->responded)
+        printf("   ICMP echo: reply (TTL=%d, DFI=%c, CD=%c)\n", e->ttl,
+               dfi_letter(e->dfi), cd_letter(e->cd));
+    else
+        printf("   ICMP echo: %s\n", d->echo_got[0] || d->echo_got[1] ?
+               "only one reply" : "no response");
+    
+    const UnreachReply *u = &result->unreach;
+    if (u->responded)
+        printf("   UDP %d: port unreachable (TTL=%d, DF=%c, IPL=%X, %d of %d checks good)\n",
+               d->udp_dport, u->ttl, u->df_flag, u->ipl,
+               __builtin_popcount(u->quote), QUOTE_CHECKS);
+    else
+        printf("   UDP %d: no response\n", d->udp_dport);
+}
+
+
+int discover_target(const char *target, const int *ports, int count,
+                    ScanResult *result, int *answered)
+{
+    Discovery d;
+    memset(&d, 0, sizeof(d));
+    
+    d.dst = inet_addr(target);
+    d.ports = ports;
+    d.count = count < 32 ? count : 32;
+    d.t1 = d.count;
+    d.base = 40000 + rand() % 10000;
+    d.echo_id = rand() & 0xFFFF;
+    d.udp_sport = 40000 + rand() % 10000;
+    d.udp_dport = choose_closed_port(0);
+    
+    result->icmp_sent = 0;
+    memset(&result->echo, 0, sizeof(result->echo));
+    memset(&result->unreach, 0, sizeof(result->unreach));
+    *answered = 0;
+    
+    int tcp_in = open_listener();
+    int icmp_in = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+    int tcp_out = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+    int raw_out = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+    
+    if (tcp_in < 0 || icmp_in < 0 || tcp_out < 0 || raw_out < 0) {
+        perror("socket");
+        if (tcp_in >= 0) close(tcp_in);
+        if (icmp_in >= 0) close(icmp_in);
+        if (tcp_out >= 0) close(tcp_out);
+        if (raw_out >= 0) close(raw_out);
+        return -1;
+    }
+    
+    printf("Looking for an open port (with ICMP echo and UDP probes)...\n");
+    
+    /* Everything goes out back to back */
+    in_addr_t src = source_address(d.dst);
+    
+    for (int i = 0; i < d.count; i++) {
+        OSFP_PROBE3(probe_send, d.dst, ports[i], -1);
+        send_on_socket(tcp_out, src, d.dst, d.base + i, ports[i], TH_SYN, NULL);
+    }
+    
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = d.dst;
+    
+    char packet[U1_LEN];
+    int sent = 0;
+    
+    for (int which = 0; which < 2; which++) {
+        int len = build_echo(packet, src, &d, which);
+        OSFP_PROBE3(probe_send, d.dst, 0, -2);
+        sent += sendto(raw_out, packet, len, 0, (struct sockaddr *)&addr, sizeof(addr)) > 0;
+    }
+    
+    int len = build_u1(packet, src, &d);
+    OSFP_PROBE3(probe_send, d.dst, d.udp_dport, -3);
+    sent += sendto(raw_out, packet, len, 0, (struct sockaddr *)&addr, sizeof(addr)) > 0;
+    
+    result->icmp_sent = (sent == 3);
+    
+    /* Collect replies from both listeners */
+    struct timespec start, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline_in(DISCOVERY_TIMEOUT_MS, &deadline);
+    int shortened = 0;
+    
+    struct pollfd fds[2] = {{tcp_in, POLLIN, 0}, {icmp_in, POLLIN, 0}};
+    
+    while (!discovery_done(&d, result)) {
+        int left = ms_until(&deadline);
+        if (left <= 0 || poll(fds, 2, left) <= 0)
+            break;
+        
+        for (int s = 0; s < 2; s++) {
+            if (!(fds[s].revents & POLLIN))
+                continue;
+            
+            char buffer[4096];
+            int n;
+            while ((n = recv(fds[s].fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+                if (s == 0) discovery_tcp(&d, result, buffer, n);
+                else        discovery_icmp(&d, result, buffer, n);
+            }
+        }
+        
+        /* The first reply gives the RTT; the rest won't take much longer */
+        if (!shortened && (d.answered || d.echo_got[0] || d.echo_got[1] ||
+                           result->unreach.responded)) {
+            struct timespec now, sooner;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            deadline_in(adaptive_timeout(diff_us(&start, &now)), &sooner);
+            if (sooner.tv_sec < deadline.tv_sec ||
+                (sooner.tv_sec == deadline.tv_sec && sooner.tv_nsec < deadline.tv_nsec))
+                deadline = sooner;
+            shortened = 1;
+        }
+    }
+    
+    close(tcp_in);
+    close(icmp_in);
+    close(tcp_out);
+    close(raw_out);
+    
+    /* IE counts as answered when both requests were */
+    if (d.echo_got[0] && d.echo_got[1]) {
+        EchoReply *e = &result->echo;
+        int df0 = d.echo_df[0], df1 = d.echo_df[1];
+        int c0 = d.echo_code[0], c1 = d.echo_code[1];
+        
+        e->responded = 1;
+        e->ttl = d.echo_ttl;
+        e->dfi = (!df0 && !df1) ? DFI_N : (df0 && !df1) ? DFI_S :
+                 (df0 && df1) ? DFI_Y : DFI_O;
+        e->cd = (c0 == 0 && c1 == 0) ? CD_Z : (c0 == 9 && c1 == 0) ? CD_S : CD_O;
+    }
+    
+    if (result->icmp_sent && !(d.echo_got[0] && d.echo_got[1] && result->unreach.responded))
+        OSFP_PROBE3(probe_timeout, d.dst, -1, 0);
+    
+    icmp_ttl(result);
+    show_discovery(&d, result);
+    
+    *answered = __builtin_popcount(d.answered);
+    return d.open ? ports[__builtin_ctz(d.open)] : -1;
 }
@@ -0,0 +1,292 @@
+/*
+ * osfp.c - libosfp, the non-blocking library API
+ * 
+ * A scanner is one prober (src/prober.c), the same engine a batch
+ * scan worker runs, driven by the caller's loop instead of a thread
+ * of ours. What the caller waits on is an epoll descriptor holding
+ * three others:
+ * 
+ *   - the packet socket the replies come in on
+ *   - a timerfd set to the prober's next retry or give-up
+ *   - an eventfd that stays readable while results are waiting
+ * 
+ * so it's readable whenever osfp_process() or osfp_next_result()
+ * has something to do, and can itself go into the caller's epoll.
+ * 
+ * Finished hosts wait in a queue as big as max_inflight, and a
+ * target is only taken while there's room for it in flight and in
+ * the queue, so a caller that's slow to take results is told EAGAIN
+ * instead of running us out of memory. Matching is left to
+ * osfp_next_result(), so the caller decides when to spend the CPU.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <netinet/ip.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#include "../include/osfp.h"
+#include "../include/prober.h"
+#include "../include/db_parser.h"
+#include "../include/score_model.h"
+
+
+struct OsfpScanner {
+    FingerprintDB *db;
+    ScoreModel *model;
+    Prober prober;
+    
+    int epoll_fd;               /* What the caller waits on */
+    int timer_fd;
+    int ready_fd;               /* eventfd: results are waiting */
+    
+    OsfpResult *queue;          /* Finished hosts, not matched yet */
+    int head;
+    int count;
+    int size;
+};
+
+
+/*
+ * The receive socket only needs TCP; a filter keeps everything else
+ * from being copied to it in the first place.
+ */
+static int open_recv_socket(void)
+{
+    int sock = socket(AF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, htons(ETH_P_IP));
+    if (sock < 0)
+        return -1;
+    
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF + 9),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xFFFF),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+    setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+    
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+    
+    int size = 1 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    return sock;
+}
+
+
+static int watch(int epoll_fd, int fd)
+{
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+/* Reset an eventfd or timerfd that may or may not be readable */
+static void clear_fd(int fd)
+{
+    uint64_t value;
+    while (read(fd, &value, sizeof(value)) > 0)
+        ;
+}
+
+
+/* Make an eventfd readable */
+static void signal_fd(int fd)
+{
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+
+/* Set the timer for the prober's next deadline, or stop it */
+static void arm_timer(OsfpScanner *s)
+{
+    long ms = prober_timeout(&s->prober);
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    
+    /* A zero value would disarm it, so "now" is a nanosecond away */
+    if (ms == 0) {
+        its.it_value.tv_nsec = 1;
+    } else if (ms > 0) {
+        its.it_value.tv_sec = ms / 1000;
+        its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    }
+    timerfd_settime(s->timer_fd, 0, &its, NULL);
+}
+
+
+/* The prober finished a host: queue it for osfp_next_result() */
+static int queue_result(Flight *f, void *arg)
+{
+    OsfpScanner *s = arg;
+    if (s->count == s->size)
+        return -1;
+    
+    OsfpResult *r = &s->queue[(s->head + s->count) % s->size];
+    memcpy(r->target, f->target, sizeof(r->target));
+    r->addr = f->addr;
+    r->port = f->port;
+    r->user = f->user;
+    r->result = f->result;
+    r->count = 0;
+    r->confidence = NULL;
+    
+    /* It's read back to 0 whenever the queue empties, so this can't overflow */
+    if (s->count++ == 0)
+        signal_fd(s->ready_fd);
+    return 0;
+}
+
+
+OsfpScanner *osfp_open(const OsfpConfig *config)
+{
+    const char *path = config && config->db_path ? config->db_path : OSFP_DEFAULT_DB;
+    int inflight = config && config->max_inflight > 0 ? config->max_inflight : OSFP_INFLIGHT;
+    if (inflight > PROBER_MAX_INFLIGHT)
+        inflight = PROBER_MAX_INFLIGHT;
+    
+    OsfpScanner *s = calloc(1, sizeof(OsfpScanner));
+    if (!s)
+        return NULL;
+    s->epoll_fd = s->timer_fd = s->ready_fd = -1;
+    
+    uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32) ^ (uintptr_t)s;
+    if (prober_init(&s->prober, inflight, seed, queue_result, s) < 0) {
+        free(s);
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    int err = 0;
+    s->size = inflight;
+    s->queue = calloc(s->size, sizeof(OsfpResult));
+    if (!s->queue)
+        err = ENOMEM;
+    
+    if (!err && !(s->db = read_database(path)))
+        err = errno;
+    errno = 0;
+    if (!err && !(s->model = build_score_model(s->db)))
+        err = errno ? errno : ENOMEM;
+    
+    if (!err) {
+        Prober *p = &s->prober;
+        p->send_sock = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+        p->recv_sock = p->send_sock >= 0 ? open_recv_socket() : -1;
+        s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        s->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        s->ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        
+        if (p->send_sock < 0 || p->recv_sock < 0 || s->epoll_fd < 0 ||
+            s->timer_fd < 0 || s->ready_fd < 0 ||
+            watch(s->epoll_fd, p->recv_sock) < 0 ||
+            watch(s->epoll_fd, s->timer_fd) < 0 ||
+            watch(s->epoll_fd, s->ready_fd) < 0)
+            err = errno;
+    }
+    
+    if (err) {
+        osfp_close(s);
+        errno = err;
+        return NULL;
+    }
+    return s;
+}
+
+
+void osfp_close(OsfpScanner *s)
+{
+    if (!s) return;
+    
+    prober_free(&s->prober);
+    if (s->epoll_fd >= 0) close(s->epoll_fd);
+    if (s->timer_fd >= 0) close(s->timer_fd);
+    if (s->ready_fd >= 0) close(s->ready_fd);
+    
+    free_score_model(s->model);
+    free_database(s->db);
+    free(s->queue);
+    free(s);
+}
+
+
+int osfp_fd(const OsfpScanner *s)
+{
+    return s->epoll_fd;
+}
+
+
+int osfp_submit(OsfpScanner *s, in_addr_t addr, int port, void *user)
+{
+    if (port < 1 || port > 65535) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    /* Not more finished hosts than the queue can hold, either */
+    if (s->prober.inflight + s->count >= s->size) {
+        errno = EAGAIN;
+        return -1;
+    }
+    
+    Flight *f = prober_start(&s->prober, addr, port);
+    if (!f) {
+        errno = EAGAIN;
+        return -1;
+    }
+    f->user = user;
+    
+    arm_timer(s);
+    return 0;
+}
+
+
+int osfp_process(OsfpScanner *s)
+{
+    clear_fd(s->timer_fd);
+    prober_drain(&s->prober);
+    prober_expire(&s->prober);
+    arm_timer(s);
+    return s->count;
+}
+
+
+int osfp_next_result(OsfpScanner *s, OsfpResult *out)
+{
+    if (s->count == 0)
+        return 0;
+    
+    *out = s->queue[s->head];
+    s->head = (s->head + 1) % s->size;
+    
+    /* Empty again: the descriptor shouldn't say otherwise */
+    if (--s->count == 0)
+        clear_fd(s->ready_fd);
+    
+    if (out->result.got_response)
+        out->count = rank_matches(s->model, &out->result, out->matches, TOP_MATCHES);
+    out->confidence = match_confidence(out->matches, out->count);
+    return 1;
+}
+
+
+int osfp_pending(const OsfpScanner *s)
+{
+    return s->prober.inflight + s->count;
+}
@@ -0,0 +1,360 @@
+/*
+ * output.c - JSON Lines result output
+ * 
+ * Each host becomes one line like:
+ *   {"target":"10.0.0.1","port":22,"response":true,"ttl":64,...}
+ * 
+ * Records are appended to a big buffer that is only written out
+ * when it's nearly full, so a bulk scan costs one write() per
+ * thousands of hosts instead of dozens of printf calls per host.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "../include/defs.h"
+#include "../include/output.h"
+#include "../include/utils.h"
+
+
+/*
+ * Biggest record we expect. We flush before starting a record if
+ * there's less than this left, so records are never split across
+ * writes unless a single one is huge.
+ */
+#define RECORD_RESERVE 4096
+
+
+int outbuf_init(OutBuf *ob, int fd, size_t cap)
+{
+    if (cap < RECORD_RESERVE * 2)
+        cap = RECORD_RESERVE * 2;
+    
+    ob->buf = malloc(cap);
+    if (!ob->buf) return -1;
+    
+    ob->fd = fd;
+    ob->len = 0;
+    ob->cap = cap;
+    return 0;
+}
+
+
+int outbuf_flush(OutBuf *ob)
+{
+    size_t done = 0;
+    
+    while (done < ob->len) {
+        ssize_t n = write(ob->fd, ob->buf + done, ob->len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            ob->len = 0;
+            return -1;
+        }
+        done += n;
+    }
+    
+    ob->len = 0;
+    return 0;
+}
+
+
+void outbuf_free(OutBuf *ob)
+{
+    if (!ob->buf) return;
+    
+    outbuf_flush(ob);
+    free(ob->buf);
+    ob->buf = NULL;
+}
+
+
+/*
+ * Low level append helpers.
+ * They only flush when a single piece doesn't fit.
+ */
+static void put_mem(OutBuf *ob, const char *s, size_t n)
+{
+    if (ob->len + n > ob->cap) {
+        outbuf_flush(ob);
+        
+        /* Still too big? Write it straight through */
+        if (n > ob->cap) {
+            if (write(ob->fd, s, n) < 0)
+                perror("write");
+            return;
+        }
+    }
+    
+    memcpy(ob->buf + ob->len, s, n);
+    ob->len += n;
+}
+
+#define put_lit(ob, s) put_mem((ob), (s), sizeof(s) - 1)
+
+static void put_char(OutBuf *ob, char c)
+{
+    if (ob->len == ob->cap)
+        outbuf_flush(ob);
+    ob->buf[ob->len++] = c;
+}
+
+static void put_int(OutBuf *ob, long v)
+{
+    char tmp[24];
+    int i = sizeof(tmp);
+    unsigned long u = (v < 0) ? -(unsigned long)v : (unsigned long)v;
+    
+    do {
+        tmp[--i] = '0' + (u % 10);
+        u /= 10;
+    } while (u);
+    
+    if (v < 0) tmp[--i] = '-';
+    
+    put_mem(ob, tmp + i, sizeof(tmp) - i);
+}
+
+/* Milliseconds with 3 decimals, without going through printf */
+static void put_ms(OutBuf *ob, double ms)
+{
+    if (ms < 0) ms = 0;
+    
+    long us = (long)(ms * 1000.0 + 0.5);
+    put_int(ob, us / 1000);
+    put_char(ob, '.');
+    put_char(ob, '0' + (us / 100) % 10);
+    put_char(ob, '0' + (us / 10) % 10);
+    put_char(ob, '0' + us % 10);
+}
+
+/* Quoted JSON string with escaping */
+static void put_str(OutBuf *ob, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    
+    put_char(ob, '"');
+    
+    for (; *s; s++) {
+        unsigned char c = *s;
+        
+        if (c == '"' || c == '\\') {
+            put_char(ob, '\\');
+            put_char(ob, c);
+        } else if (c < 0x20) {
+            char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+            put_mem(ob, esc, sizeof(esc));
+        } else {
+            put_char(ob, c);
+        }
+    }
+    
+    put_char(ob, '"');
+}
+
+static void put_bool(OutBuf *ob, int v)
+{
+    if (v) put_lit(ob, "true");
+    else   put_lit(ob, "false");
+}
+
+/* Single character field, or null if it was never seen */
+static void put_flag(OutBuf *ob, char c)
+{
+    if (!c) {
+        put_lit(ob, "null");
+        return;
+    }
+    char s[2] = {c, '\0'};
+    put_str(ob, s);
+}
+
+
+/*
+ * Write one host as a single JSON line.
+ */
+void write_json_result(OutBuf *ob, const char *target, int port,
+                       const ScanResult *scan, const Match *matches,
+                       int count, const ScanTiming *timing)
+{
+    if (ob->cap - ob->len < RECORD_RESERVE)
+        outbuf_flush(ob);
+    
+    put_lit(ob, "{\"target\":");
+    put_str(ob, target);
+    put_lit(ob, ",\"port\":");
+    put_int(ob, port);
+    put_lit(ob, ",\"response\":");
+    put_bool(ob, scan->got_response);
+    put_lit(ob, ",\"stopped_early\":");
+    put_bool(ob, scan->stopped_early);
+    
+    /* What we observed */
+    put_lit(ob, ",\"observed\":{\"ttl\":");
+    put_int(ob, scan->ttl);
+    put_lit(ob, ",\"ttl_os\":");
+    put_str(ob, os_type_name(guess_os_from_ttl(scan->ttl)));
+    put_lit(ob, ",\"window\":");
+    put_int(ob, scan->window);
+    put_lit(ob, ",\"df\":");
+    put_flag(ob, scan->df_flag);
+    put_lit(ob, ",\"flags\":");
+    put_str(ob, scan->flags);
+    put_lit(ob, ",\"options\":");
+    put_str(ob, scan->options);
+    put_lit(ob, ",\"mss\":");
+    put_int(ob, scan->opts.mss);
+    put_lit(ob, ",\"wscale\":");
+    put_int(ob, scan->opts.window_scale);
+    put_lit(ob, ",\"sack\":");
+    put_bool(ob, scan->opts.has_sack);
+    put_lit(ob, ",\"timestamp\":");
+    put_bool(ob, scan->opts.has_timestamp);
+    put_lit(ob, ",\"t2\":");
+    put_bool(ob, scan->t2_responded);
+    put_lit(ob, ",\"t3\":");
+    put_bool(ob, scan->t3_responded);
+    put_lit(ob, ",\"t4\":");
+    put_bool(ob, scan->t4_responded);
+    put_lit(ob, ",\"closed_port\":");
+    put_int(ob, scan->closed_port);
+    
+    /* Closed port replies: their flags, or null if there was none */
+    static const char *closed_keys[] = {",\"t5\":", ",\"t6\":", ",\"t7\":"};
+    for (int p = PROBE_T5; p <= PROBE_T7; p++) {
+        const ProbeReply *r = &scan->reply[p];
+        put_mem(ob, closed_keys[p - PROBE_T5], strlen(closed_keys[p - PROBE_T5]));
+        
+        if (r->responded) {
+            char flags[8];
+            format_flags(r->flags, flags);
+            put_str(ob, flags);
+        } else {
+            put_lit(ob, "null");
+        }
+    }
+    
+    /* IE and U1, null if there was no reply; left out if not sent */
+    if (scan->icmp_sent) {
+        const EchoReply *e = &scan->echo;
+        const UnreachReply *u = &scan->unreach;
+        
+        put_lit(ob, ",\"ie\":");
+        if (e->responded) {
+            put_lit(ob, "{\"ttl\":");
+            put_int(ob, e->ttl);
+            put_lit(ob, ",\"dfi\":");
+            put_flag(ob, dfi_letter(e->dfi));
+            put_lit(ob, ",\"cd\":");
+            put_flag(ob, cd_letter(e->cd));
+            put_char(ob, '}');
+        } else {
+            put_lit(ob, "null");
+        }
+        
+        put_lit(ob, ",\"u1\":");
+        if (u->responded) {
+            put_lit(ob, "{\"ttl\":");
+            put_int(ob, u->ttl);
+            put_lit(ob, ",\"df\":");
+            put_flag(ob, u->df_flag);
+            put_lit(ob, ",\"ipl\":");
+            put_int(ob, u->ipl);
+            put_lit(ob, ",\"quote_ok\":");
+            put_int(ob, u->quote);
+            put_char(ob, '}');
+        } else {
+            put_lit(ob, "null");
+        }
+    }
+    put_char(ob, '}');
+    
+    /* Best matches, highest score first */
+    put_lit(ob, ",\"matches\":[");
+    for (int i = 0; i < count; i++) {
+        if (i) put_char(ob, ',');
+        put_lit(ob, "{\"name\":");
+        put_str(ob, matches[i].fp->name);
+        put_lit(ob, ",\"score\":");
+        put_int(ob, matches[i].score);
+        put_lit(ob, ",\"type\":");
+        put_str(ob, os_type_name(matches[i].fp->os));
+        put_char(ob, '}');
+    }
+    put_char(ob, ']');
+    
+    const char *confidence = match_confidence(matches, count);
+    put_lit(ob, ",\"confidence\":");
+    if (confidence) put_str(ob, confidence);
+    else            put_lit(ob, "null");
+    
+    if (timing) {
+        put_lit(ob, ",\"timing\":{\"probe_ms\":");
+        put_ms(ob, timing->probe_ms);
+        put_lit(ob, ",\"match_ms\":");
+        put_ms(ob, timing->match_ms);
+        put_lit(ob, ",\"cpu_ms\":");
+        put_ms(ob, timing->cpu_ms);
+        put_lit(ob, ",\"engine\":");
+        put_str(ob, timing->engine);
+        put_lit(ob, ",\"syscalls\":");
+        put_int(ob, timing->syscalls);
+        put_char(ob, '}');
+    }
+    
+    /* Kernel-timestamped round trip per probe, null if unanswered */
+    put_lit(ob, ",\"rtt_us\":[");
+    for (int i = 0; i < PROBE_COUNT; i++) {
+        if (i) put_char(ob, ',');
+        if (scan->timing[i].rtt_us >= 0) put_int(ob, scan->timing[i].rtt_us);
+        else                             put_lit(ob, "null");
+    }
+    put_char(ob, ']');
+    
+    put_lit(ob, "}\n");
+}
+
+
+/*
+ * Write what the decision tree (-q) made of a host's SYN-ACK.
+ */
+void write_json_triage(OutBuf *ob, const char *target, int port,
+                       const ScanResult *scan, const TriageResult *triage)
+{
+    if (ob->cap - ob->len < RECORD_RESERVE)
+        outbuf_flush(ob);
+    
+    put_lit(ob, "{\"target\":");
+    put_str(ob, target);
+    put_lit(ob, ",\"port\":");
+    put_int(ob, port);
+    put_lit(ob, ",\"response\":");
+    put_bool(ob, scan->got_response);
+    
+    put_lit(ob, ",\"triage\":");
+    if (!triage) {
+        put_lit(ob, "null}\n");
+        return;
+    }
+    
+    put_lit(ob, "{\"type\":");
+    put_str(ob, os_type_name(triage->os));
+    put_lit(ob, ",\"comparisons\":");
+    put_int(ob, triage->comparisons);
+    
+    /* Shares are fractions, with the same 3 decimals as milliseconds */
+    put_lit(ob, ",\"candidates\":[");
+    for (int i = 0; i < triage->count; i++) {
+        if (i) put_char(ob, ',');
+        put_lit(ob, "{\"name\":");
+        put_str(ob, triage->names[i]);
+        put_lit(ob, ",\"share\":");
+        put_ms(ob, triage->share[i] / 1000.0);
+        put_char(ob, '}');
+    }
+    put_lit(ob, "]}}\n");
+}
@@ -0,0 +1,198 @@
+/*
+ * pacer.c - Global rate cap, per-/24 cap and loss backoff
+ * 
+ * Everything here is lock-free: the bucket is a compare-and-swap on
+ * one word, the subnet caps are counters, and the rate is
+ * reconsidered by whichever worker's feedback first lands in a new
+ * window.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "../include/pacer.h"
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void set_rate(Pacer *p, long rate)
+{
+    atomic_store(&p->rate, rate);
+    atomic_store(&p->interval, 1000000000UL / rate);
+}
+
+
+int pacer_init(Pacer *p, long rate, int subnet_cap)
+{
+    /* A billion packets per second is as fine as nanoseconds go */
+    p->max_rate = rate > 0 ? rate : 0;
+    if (p->max_rate > 1000000000L)
+        p->max_rate = 1000000000L;
+    p->subnet_cap = subnet_cap > 0 ? subnet_cap : 0;
+    p->subnets = NULL;
+    
+    atomic_init(&p->tat, now_ns());
+    atomic_init(&p->interval, 0);
+    atomic_init(&p->rate, 0);
+    atomic_init(&p->replies, 0);
+    atomic_init(&p->lost, 0);
+    atomic_init(&p->next_adjust, now_ns() + PACER_WINDOW_MS * 1000000ULL);
+    atomic_init(&p->min_rate, p->max_rate);
+    atomic_init(&p->backoffs, 0);
+    
+    if (p->max_rate)
+        set_rate(p, p->max_rate);
+    
+    if (p->subnet_cap) {
+        p->subnets = calloc(PACER_SUBNETS, sizeof(atomic_int));
+        if (!p->subnets)
+            return -1;
+    }
+    return 0;
+}
+
+
+void pacer_free(Pacer *p)
+{
+    free(p->subnets);
+    p->subnets = NULL;
+}
+
+
+/* How far ahead of the clock a burst may run at this interval */
+static uint64_t tolerance(uint64_t interval)
+{
+    uint64_t t = interval * PACER_BURST_PKTS;
+    return t < PACER_BURST_NS ? t : PACER_BURST_NS;
+}
+
+
+uint64_t pacer_take(Pacer *p, int n)
+{
+    if (!p->max_rate)
+        return 0;
+    
+    uint64_t now = now_ns();
+    uint64_t interval = atomic_load(&p->interval);
+    uint64_t tau = tolerance(interval);
+    uint64_t tat = atomic_load(&p->tat);
+    uint64_t next;
+    
+    /*
+     * The bucket is as full as it gets when tat is at or behind the
+     * clock; every packet moves tat an interval on, and a send is
+     * let through as long as tat isn't more than tau ahead.
+     */
+    do {
+        uint64_t start = tat > now ? tat : now;
+        if (start - now > tau)
+            return start - now - tau;
+        next = start + n * interval;
+    } while (!atomic_compare_exchange_weak(&p->tat, &tat, next));
+    
+    return 0;
+}
+
+
+void pacer_charge(Pacer *p, int n)
+{
+    if (!p->max_rate)
+        return;
+    
+    uint64_t now = now_ns();
+    uint64_t interval = atomic_load(&p->interval);
+    uint64_t tat = atomic_load(&p->tat);
+    uint64_t next;
+    
+    do {
+        next = (tat > now ? tat : now) + n * interval;
+    } while (!atomic_compare_exchange_weak(&p->tat, &tat, next));
+}
+
+
+static atomic_int *subnet_counter(Pacer *p, in_addr_t addr)
+{
+    /* Fibonacci hashing of the /24, top 16 bits */
+    uint32_t net = ntohl(addr) >> 8;
+    return &p->subnets[(uint32_t)(net * 2654435769u) >> 16];
+}
+
+
+int pacer_enter(Pacer *p, in_addr_t addr)
+{
+    if (!p->subnet_cap)
+        return 0;
+    
+    atomic_int *c = subnet_counter(p, addr);
+    if (atomic_fetch_add(c, 1) >= p->subnet_cap) {
+        atomic_fetch_sub(c, 1);
+        return -1;
+    }
+    return 0;
+}
+
+
+void pacer_leave(Pacer *p, in_addr_t addr)
+{
+    if (p->subnet_cap)
+        atomic_fetch_sub(subnet_counter(p, addr), 1);
+}
+
+
+/*
+ * Additive increase, multiplicative decrease, once per window, by
+ * whoever gets there first.
+ */
+static void adjust_rate(Pacer *p)
+{
+    long replies = atomic_exchange(&p->replies, 0);
+    long lost = atomic_exchange(&p->lost, 0);
+    
+    /* Too few to tell: keep counting into the next window */
+    if (replies < PACER_SAMPLES) {
+        atomic_fetch_add(&p->replies, replies);
+        atomic_fetch_add(&p->lost, lost);
+        return;
+    }
+    
+    long rate = atomic_load(&p->rate);
+    long loss = lost * 1000 / replies;
+    
+    if (loss > PACER_LOSS_HIGH) {
+        long floor = p->max_rate / 64 > 0 ? p->max_rate / 64 : 1;
+        rate = rate / 2 > floor ? rate / 2 : floor;
+        atomic_fetch_add(&p->backoffs, 1);
+        if (rate < atomic_load(&p->min_rate))
+            atomic_store(&p->min_rate, rate);
+    } else if (loss < PACER_LOSS_LOW && rate < p->max_rate) {
+        long step = p->max_rate / 16 > 0 ? p->max_rate / 16 : 1;
+        rate = rate + step < p->max_rate ? rate + step : p->max_rate;
+    } else {
+        return;
+    }
+    set_rate(p, rate);
+}
+
+
+void pacer_feedback(Pacer *p, int lost)
+{
+    if (!p->max_rate)
+        return;
+    
+    atomic_fetch_add(&p->replies, 1);
+    if (lost)
+        atomic_fetch_add(&p->lost, 1);
+    
+    uint64_t now = now_ns();
+    uint64_t due = atomic_load(&p->next_adjust);
+    if (now >= due &&
+        atomic_compare_exchange_strong(&p->next_adjust, &due, now + PACER_WINDOW_MS * 1000000ULL))
+        adjust_rate(p);
+}
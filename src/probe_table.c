@@ -0,0 +1,113 @@
+/*
+ * probe_table.c - Open addressing table of outstanding probes
+ */
+
+#include <stdlib.h>
+
+#include "../include/probe_table.h"
+
+
+static uint64_t make_key(in_addr_t addr, int dport, int sport)
+{
+    return ((uint64_t)addr << 32) | ((uint64_t)(dport & 0xffff) << 16) | (sport & 0xffff);
+}
+
+/* Fibonacci hashing: the top bits of key * 2^64/phi */
+static size_t home_slot(const ProbeTable *t, uint64_t key)
+{
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> t->shift);
+}
+
+
+int probe_table_init(ProbeTable *t, size_t max)
+{
+    size_t slots = 16;
+    int bits = 4;
+    
+    /* At most half full */
+    while (slots < max * 2) {
+        slots <<= 1;
+        bits++;
+    }
+    
+    t->entries = calloc(slots, sizeof(ProbeEntry));
+    t->mask = slots - 1;
+    t->count = 0;
+    t->max = max;
+    t->shift = 64 - bits;
+    return t->entries ? 0 : -1;
+}
+
+void probe_table_free(ProbeTable *t)
+{
+    free(t->entries);
+    t->entries = NULL;
+}
+
+
+ProbeEntry *probe_table_add(ProbeTable *t, in_addr_t addr, int dport, int sport)
+{
+    uint64_t key = make_key(addr, dport, sport);
+    
+    if (t->count == t->max || key == 0)
+        return NULL;
+    
+    for (size_t i = home_slot(t, key); ; i = (i + 1) & t->mask) {
+        ProbeEntry *e = &t->entries[i];
+        if (e->key == key)
+            return NULL;
+        if (e->key == 0) {
+            e->key = key;
+            e->sent_us = 0;
+            e->flight = 0;
+            e->probe = 0;
+            e->retries = 0;
+            t->count++;
+            return e;
+        }
+    }
+}
+
+
+ProbeEntry *probe_table_find(const ProbeTable *t, in_addr_t addr, int dport, int sport)
+{
+    uint64_t key = make_key(addr, dport, sport);
+    
+    /* Runs end at an empty slot, and there always is one */
+    for (size_t i = home_slot(t, key); ; i = (i + 1) & t->mask) {
+        ProbeEntry *e = &t->entries[i];
+        if (e->key == key)
+            return key ? e : NULL;
+        if (e->key == 0)
+            return NULL;
+    }
+}
+
+
+/*
+ * Backward shift: walk the run after the hole, and move back every
+ * entry whose home slot is not between the hole and where it sits,
+ * since it can't be found across the hole any more.
+ */
+void probe_table_remove(ProbeTable *t, ProbeEntry *e)
+{
+    size_t hole = e - t->entries;
+    size_t i = hole;
+    
+    while (1) {
+        i = (i + 1) & t->mask;
+        ProbeEntry *next = &t->entries[i];
+        if (next->key == 0)
+            break;
+        
+        /* Distance from its home slot to i, and from the hole to i */
+        size_t home = home_slot(t, next->key);
+        if (((i - home) & t->mask) >= ((i - hole) & t->mask)) {
+            t->entries[hole] = *next;
+            hole = i;
+        }
+    }
+    
+    t->entries[hole].key = 0;
+    t->count--;
+}
@@ -0,0 +1,416 @@
+/*
+ * prober.c - The probe engine shared by scan workers and libosfp
+ * 
+ * Everything a prober touches is its own: its sockets, its buffers
+ * and its random numbers (rand() is shared state, so it can't be
+ * used from several threads). So several probers can run on
+ * different threads, and one can live inside somebody else's event
+ * loop, without any locking.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <linux/if_packet.h>
+
+#include "../include/defs.h"
+#include "../include/network.h"
+#include "../include/prober.h"
+#include "../include/route.h"
+#include "../include/probes.h"
+
+
+/* Probes go out from random ports in [SPORT_BASE, SPORT_BASE + SPORT_RANGE) */
+#define SPORT_BASE  32768
+#define SPORT_RANGE 28232
+
+
+/* xorshift64 - small, fast and private to the prober */
+static uint32_t next_random(Prober *p)
+{
+    uint64_t x = p->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    p->rng = x;
+    return (uint32_t)(x >> 32);
+}
+
+
+uint64_t prober_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Microseconds, cut to 32 bits: differences are right for 71 minutes */
+static uint32_t us32(const struct timespec *ts)
+{
+    return (uint32_t)((uint64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000);
+}
+
+
+int prober_init(Prober *p, int capacity, uint64_t seed, FlightDone done, void *arg)
+{
+    memset(p, 0, sizeof(*p));
+    p->send_sock = -1;
+    p->recv_sock = -1;
+    
+    if (capacity < 1) capacity = 1;
+    if (capacity > PROBER_MAX_INFLIGHT) capacity = PROBER_MAX_INFLIGHT;
+    
+    p->capacity = capacity;
+    p->rng = seed | 1;
+    p->done = done;
+    p->arg = arg;
+    
+    p->flights = calloc(capacity, sizeof(Flight));
+    p->free_slots = malloc(sizeof(int) * capacity);
+    if (!p->flights || !p->free_slots ||
+        probe_table_init(&p->probes, (size_t)capacity * PROBE_COUNT) < 0) {
+        prober_free(p);
+        return -1;
+    }
+    
+    /* Hand out the low slots first */
+    for (int i = 0; i < capacity; i++)
+        p->free_slots[i] = capacity - 1 - i;
+    p->free_count = capacity;
+    
+    wheel_init(&p->wheel, prober_now());
+    return 0;
+}
+
+
+void prober_free(Prober *p)
+{
+    if (p->send_sock >= 0) close(p->send_sock);
+    if (p->recv_sock >= 0) close(p->recv_sock);
+    p->send_sock = p->recv_sock = -1;
+    
+    probe_table_free(&p->probes);
+    free(p->flights);
+    free(p->free_slots);
+    p->flights = NULL;
+    p->free_slots = NULL;
+}
+
+
+long prober_timeout(const Prober *p)
+{
+    long next = wheel_next(&p->wheel);
+    if (next < 0)
+        return -1;
+    
+    /* The wheel counts from its last expiry run, which may be a while ago */
+    uint64_t due = p->wheel.now + next;
+    uint64_t now = prober_now();
+    return due > now ? (long)(due - now) : 0;
+}
+
+
+/*
+ * Put a probe in the table. The first time, it gets a source port
+ * no other probe to the same address and port is using.
+ */
+static ProbeEntry *track_probe(Prober *p, Flight *f, int probe, int dport)
+{
+    if (f->sports[probe]) {
+        ProbeEntry *e = probe_table_find(&p->probes, f->addr, dport, f->sports[probe]);
+        if (e) e->retries++;
+        return e;
+    }
+    
+    for (int tries = 0; tries < 16; tries++) {
+        int sport = SPORT_BASE + next_random(p) % SPORT_RANGE;
+        ProbeEntry *e = probe_table_add(&p->probes, f->addr, dport, sport);
+        if (e) {
+            e->flight = f - p->flights;
+            e->probe = probe;
+            f->sports[probe] = sport;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Send the probes in 'which' (a bitmask) to a flight's target.
+ * They all go out with a single sendmmsg().
+ */
+static void send_probes(Prober *p, Flight *f, unsigned which)
+{
+    ScanResult *r = &f->result;
+    in_addr_t src = source_address(f->addr);
+    
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    
+    struct sockaddr_in addr[PROBE_COUNT];
+    struct iovec iov[PROBE_COUNT];
+    struct mmsghdr msgs[PROBE_COUNT];
+    int count = 0;
+    memset(msgs, 0, sizeof(msgs));
+    
+    for (int probe = 0; probe < PROBE_COUNT; probe++) {
+        if (!(which & (1u << probe)))
+            continue;
+        
+        int dport = probe_to_closed_port(probe) ? r->closed_port : f->port;
+        ProbeEntry *e = track_probe(p, f, probe, dport);
+        if (!e)
+            continue;
+        
+        /* A resent probe's RTT counts from the last copy */
+        e->sent_us = us32(&now);
+        r->timing[probe].sent = now;
+        
+        int sport = f->sports[probe];
+        int n = count++;
+        OSFP_PROBE3(probe_send, f->addr, dport, probe);
+        
+        iov[n].iov_base = p->packets[probe];
+        iov[n].iov_len = build_tcp_packet(p->packets[probe], src, f->addr, sport,
+                                          dport, probe_flags(probe), next_random(p));
+        
+        memset(&addr[n], 0, sizeof(addr[n]));
+        addr[n].sin_family = AF_INET;
+        addr[n].sin_port = htons(dport);
+        addr[n].sin_addr.s_addr = f->addr;
+        
+        msgs[n].msg_hdr.msg_name = &addr[n];
+        msgs[n].msg_hdr.msg_namelen = sizeof(addr[n]);
+        msgs[n].msg_hdr.msg_iov = &iov[n];
+        msgs[n].msg_hdr.msg_iovlen = 1;
+    }
+    
+    int sent = sendmmsg(p->send_sock, msgs, count, 0);
+    if (sent > 0)
+        p->packets_sent += sent;
+}
+
+
+/* Take a new target and send it the whole burst */
+Flight *prober_start(Prober *p, in_addr_t target, int port)
+{
+    if (p->free_count == 0)
+        return NULL;
+    
+    /* Its /24 first, so tokens aren't spent on a target that can't go */
+    if (p->pacer) {
+        if (pacer_enter(p->pacer, target) < 0) {
+            p->pace_wait = PACER_RETRY_NS;
+            return NULL;
+        }
+        uint64_t wait = pacer_take(p->pacer, PROBE_COUNT);
+        if (wait) {
+            pacer_leave(p->pacer, target);
+            p->pace_wait = wait;
+            return NULL;
+        }
+    }
+    
+    Flight *f = &p->flights[p->free_slots[--p->free_count]];
+    ScanResult *r = &f->result;
+    
+    memset(f, 0, sizeof(*f));
+    f->used = 1;
+    f->addr = target;
+    f->port = port;
+    inet_ntop(AF_INET, &target, f->target, sizeof(f->target));
+    p->inflight++;
+    
+    for (int i = 0; i < PROBE_COUNT; i++)
+        r->timing[i].rtt_us = -1;
+    
+    do {
+        r->closed_port = 30000 + next_random(p) % 30000;
+    } while (r->closed_port == port);
+    
+    send_probes(p, f, (1u << PROBE_COUNT) - 1);
+    
+    uint64_t now = prober_now();
+    f->give_up = now + PROBE_TIMEOUT_MS;
+    wheel_add(&p->wheel, &f->timer, now + RETRY_MS);
+    return f;
+}
+
+
+/* Match one received packet to a probe and record it */
+static void handle_packet(Prober *p, int len, const struct timespec *received)
+{
+    struct iphdr *ip = (struct iphdr *)p->buffer;
+    if (len < (int)sizeof(struct iphdr) || ip->protocol != IPPROTO_TCP)
+        return;
+    
+    struct tcphdr *tcp = tcp_header(p->buffer, len);
+    if (!tcp)
+        return;
+    
+    /* Which probe is this the reply to? Answered ones are gone already. */
+    ProbeEntry *e = probe_table_find(&p->probes, ip->saddr, ntohs(tcp->source),
+                                     ntohs(tcp->dest));
+    if (!e)
+        return;
+    
+    int probe = e->probe;
+    int resent = e->retries > 0;
+    Flight *f = &p->flights[e->flight];
+    int rtt = (int)(us32(received) - e->sent_us);
+    probe_table_remove(&p->probes, e);
+    
+    record_reply(&f->result, probe, ip, tcp);
+    f->answered |= 1u << probe;
+    
+    ProbeTiming *t = &f->result.timing[probe];
+    t->received = *received;
+    t->rtt_us = rtt < 0 ? 0 : rtt;
+    OSFP_PROBE3(probe_reply, f->addr, probe, t->rtt_us);
+    
+    /* Everything is in: hand it on at the next expiry run */
+    if (f->answered == (1u << PROBE_COUNT) - 1) {
+        wheel_add(&p->wheel, &f->timer, 0);
+        return;
+    }
+    
+    /*
+     * Now we know the host is up and its RTT: no more retries, and
+     * don't wait much longer for the rest
+     */
+    if (probe == PROBE_T1) {
+        if (p->pacer)
+            pacer_feedback(p->pacer, resent);
+        
+        uint64_t sooner = prober_now() + adaptive_timeout(t->rtt_us);
+        if (sooner < f->give_up)
+            f->give_up = sooner;
+        wheel_add(&p->wheel, &f->timer, f->give_up);
+    }
+}
+
+
+void prober_drain(Prober *p)
+{
+    char control[256];
+    
+    while (1) {
+        struct sockaddr_ll from;
+        struct iovec iov = {p->buffer, sizeof(p->buffer)};
+        struct msghdr msg = {0};
+        msg.msg_name = &from;
+        msg.msg_namelen = sizeof(from);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        
+        int len = recvmsg(p->recv_sock, &msg, MSG_DONTWAIT);
+        if (len < 0)
+            return;
+        
+        /* On loopback we also see our own probes go out */
+        if (from.sll_pkttype == PACKET_OUTGOING)
+            continue;
+        
+        p->packets_seen++;
+        
+        struct timespec received;
+        clock_gettime(CLOCK_REALTIME, &received);
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS)
+                memcpy(&received, CMSG_DATA(c), sizeof(received));
+        }
+        
+        handle_packet(p, len, &received);
+    }
+}
+
+
+/*
+ * Hand a finished target to the callback and free its slot.
+ * Returns 0, or -1 if the callback can't take it yet.
+ */
+static int finish_flight(Prober *p, Flight *f)
+{
+    if (p->done(f, p->arg) < 0)
+        return -1;
+    
+    /* Replies to the probes still in the table are too late now */
+    for (int probe = 0; probe < PROBE_COUNT; probe++) {
+        if (!f->sports[probe] || (f->answered & (1u << probe)))
+            continue;
+        int dport = probe_to_closed_port(probe) ? f->result.closed_port : f->port;
+        ProbeEntry *e = probe_table_find(&p->probes, f->addr, dport, f->sports[probe]);
+        if (e) probe_table_remove(&p->probes, e);
+    }
+    
+    if (p->pacer)
+        pacer_leave(p->pacer, f->addr);
+    
+    f->used = 0;
+    p->free_slots[p->free_count++] = f - p->flights;
+    p->inflight--;
+    return 0;
+}
+
+
+/*
+ * A flight's timer went off. Until T1 is answered the timer is the
+ * retry timer: resend what hasn't been answered, up to MAX_RETRIES
+ * times. After that (or once T1 is in) it means the flight is done.
+ */
+static void flight_expired(Prober *p, Flight *f, uint64_t now)
+{
+    unsigned all = (1u << PROBE_COUNT) - 1;
+    int waiting = f->answered != all && now < f->give_up;
+    
+    if (waiting && !(f->answered & (1u << PROBE_T1)) && f->retries < MAX_RETRIES) {
+        unsigned missing = all & ~f->answered;
+        f->retries++;
+        if (p->pacer)
+            pacer_charge(p->pacer, __builtin_popcount(missing));
+        send_probes(p, f, missing);
+        
+        uint64_t next = now + RETRY_MS;
+        wheel_add(&p->wheel, &f->timer, next < f->give_up ? next : f->give_up);
+        return;
+    }
+    
+    if (waiting) {
+        wheel_add(&p->wheel, &f->timer, f->give_up);
+        return;
+    }
+    
+    /* Whoever takes the results is behind: try again next tick */
+    unsigned missing = all & ~f->answered;
+    in_addr_t addr = f->addr;
+    int retries = f->retries;
+    
+    if (finish_flight(p, f) < 0) {
+        wheel_add(&p->wheel, &f->timer, now + 1);
+        return;
+    }
+    
+    if (missing)
+        OSFP_PROBE3(probe_timeout, addr, missing, retries);
+}
+
+
+void prober_expire(Prober *p)
+{
+    uint64_t now = prober_now();
+    Timer *t = wheel_expire(&p->wheel, now);
+    
+    while (t) {
+        Timer *next = t->next;
+        flight_expired(p, (Flight *)t, now);
+        t = next;
+    }
+}
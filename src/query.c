@@ -0,0 +1,380 @@
+/*
+ * query.c - Filter and count results in a result log
+ * 
+ * Usage: ./osfp_query [-F family] [-c confidence] [-w window] [-t ttl[-ttl]]
+ *                     [-P pattern] [-g column] [-k N] [-l] <log>
+ *        ./osfp_query -a [-k N] [-o merged] <summary>...
+ * 
+ * The log is mapped, not read. Filters run a column at a time over
+ * each block: every filter ANDs its test into a byte per row, in
+ * plain loops over packed arrays the compiler can vectorize, and
+ * only the columns a query uses are ever touched.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "../include/defs.h"
+#include "../include/utils.h"
+#include "../include/result_log.h"
+#include "../include/aggregate.h"
+
+
+/* What to keep */
+typedef struct {
+    int family;             /* OSType of the best match, -1 for any */
+    int level;              /* Minimum confidence level, 0 for any */
+    int window;             /* -1 for any */
+    int ttl_min, ttl_max;
+    int pattern;            /* Pattern ID, -1 for any, -2 if not in the log */
+} Filter;
+
+/* Columns to group by */
+enum { GROUP_NONE, GROUP_FP, GROUP_FAMILY, GROUP_WINDOW, GROUP_TTL,
+       GROUP_PATTERN, GROUP_LEVEL };
+
+static const char *level_names[] = {"none", "LOW", "MEDIUM", "HIGH"};
+
+
+static void usage(const char *prog)
+{
+    printf("\n");
+    printf("Query a result log written with -b\n");
+    printf("\n");
+    printf("Usage: %s [options] <log>\n", prog);
+    printf("       %s -a [-k N] [-o merged] <summary>...\n", prog);
+    printf("\n");
+    printf("Filters:\n");
+    printf("  -F family   windows, linux or other (family of the best match)\n");
+    printf("  -c level    Lowest confidence: low, medium or high\n");
+    printf("  -w window   TCP window size\n");
+    printf("  -t ttl      TTL, or a range like 60-64\n");
+    printf("  -P pattern  TCP option pattern like MSTNW\n");
+    printf("\n");
+    printf("Output:\n");
+    printf("  -g column   Count by fp, family, window, ttl, pattern or level\n");
+    printf("  -k N        Show the N biggest groups (default 20)\n");
+    printf("  -l          List the matching hosts\n");
+    printf("\n");
+    printf("Summaries (os_fingerprint -A):\n");
+    printf("  -a          Add up the summaries and show the total\n");
+    printf("  -o file     Save the total as a summary too\n");
+    printf("\n");
+    printf("Examples:\n");
+    printf("  %s -F windows -g window scan.log\n", prog);
+    printf("  %s -c high -w 8192 -l scan.log\n", prog);
+    printf("  %s -a -o all.agg node1.agg node2.agg node3.agg\n", prog);
+    printf("\n");
+}
+
+
+static int parse_family(const char *s)
+{
+    if (strcasecmp(s, "windows") == 0) return OS_WINDOWS;
+    if (strcasecmp(s, "linux") == 0 || strcasecmp(s, "android") == 0) return OS_LINUX;
+    if (strcasecmp(s, "other") == 0) return OS_OTHER;
+    return -1;
+}
+
+static int parse_level(const char *s)
+{
+    for (int i = 1; i < 4; i++) {
+        if (strcasecmp(s, level_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+static int parse_group(const char *s)
+{
+    static const char *names[] = {"", "fp", "family", "window", "ttl", "pattern", "level"};
+    
+    for (int i = 1; i < 7; i++) {
+        if (strcmp(s, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+
+/*
+ * Mark the rows of a block that pass the filter.
+ * 'family_ok' says for every fingerprint ID whether it passes.
+ */
+static void select_rows(const LogRows *b, const Filter *f, const uint8_t *family_ok,
+                        uint32_t name_count, uint8_t *sel)
+{
+    uint32_t n = b->count;
+    
+    memset(sel, 1, n);
+    
+    if (f->level > 0) {
+        const uint8_t *level = b->level;
+        uint8_t min = f->level;
+        for (uint32_t i = 0; i < n; i++)
+            sel[i] &= level[i] >= min;
+    }
+    
+    if (f->window >= 0) {
+        const uint16_t *window = b->window;
+        uint16_t w = f->window;
+        for (uint32_t i = 0; i < n; i++)
+            sel[i] &= window[i] == w;
+    }
+    
+    if (f->ttl_min > 0 || f->ttl_max < 255) {
+        const uint8_t *ttl = b->ttl;
+        uint8_t lo = f->ttl_min, hi = f->ttl_max;
+        for (uint32_t i = 0; i < n; i++)
+            sel[i] &= (ttl[i] >= lo) & (ttl[i] <= hi);
+    }
+    
+    if (f->pattern != -1) {
+        const uint8_t *pattern = b->pattern;
+        int id = f->pattern;
+        for (uint32_t i = 0; i < n; i++)
+            sel[i] &= pattern[i] == id;
+    }
+    
+    if (f->family >= 0) {
+        const uint32_t *fp = b->fp[0];
+        for (uint32_t i = 0; i < n; i++)
+            sel[i] &= fp[i] < name_count && family_ok[fp[i]];
+    }
+}
+
+
+/* The group key of row i */
+static uint32_t group_key(const LogReader *r, const LogRows *b, int group, uint32_t i)
+{
+    switch (group) {
+        case GROUP_FP:
+            return b->fp[0][i] < r->name_count ? b->fp[0][i] : r->name_count;
+        case GROUP_FAMILY:
+            return b->fp[0][i] < r->name_count ? r->families[b->fp[0][i]] : OS_UNKNOWN;
+        case GROUP_WINDOW:  return b->window[i];
+        case GROUP_TTL:     return b->ttl[i];
+        case GROUP_PATTERN: return b->pattern[i];
+        case GROUP_LEVEL:   return b->level[i] & 3;
+    }
+    return 0;
+}
+
+/* How many keys a column can have */
+static uint32_t group_size(const LogReader *r, int group)
+{
+    switch (group) {
+        case GROUP_FP:      return r->name_count + 1;
+        case GROUP_FAMILY:  return 256;
+        case GROUP_WINDOW:  return 65536;
+        case GROUP_TTL:     return 256;
+        case GROUP_PATTERN: return 256;
+        case GROUP_LEVEL:   return 4;
+    }
+    return 1;
+}
+
+static void print_key(const LogReader *r, int group, uint32_t key)
+{
+    switch (group) {
+        case GROUP_FP:
+            printf("%s", key < r->name_count && r->names[key] ? r->names[key] : "(no match)");
+            break;
+        case GROUP_FAMILY:
+            printf("%s", os_type_name(key));
+            break;
+        case GROUP_PATTERN:
+            printf("%s", key < (uint32_t)r->pattern_count ? r->patterns[key] : "(other)");
+            break;
+        case GROUP_LEVEL:
+            printf("%s", level_names[key]);
+            break;
+        default:
+            printf("%u", key);
+    }
+}
+
+
+static void list_row(const LogReader *r, const LogRows *b, uint32_t i)
+{
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &b->ip[i], ip, sizeof(ip));
+    
+    uint32_t fp = b->fp[0][i];
+    const char *name = fp < r->name_count && r->names[fp] ? r->names[fp] : "-";
+    const char *pattern = b->pattern[i] < r->pattern_count ? r->patterns[b->pattern[i]] : "?";
+    
+    printf("%-16s %5u  ttl %3u  win %5u  %-8s %-6s %5d  %s\n", ip, b->port[i],
+           b->ttl[i], b->window[i], pattern, level_names[b->level[i] & 3],
+           b->score[0][i], name);
+}
+
+
+/* Index order of counts, biggest first */
+static const uint64_t *sort_counts;
+
+static int by_count(const void *a, const void *b)
+{
+    uint64_t ca = sort_counts[*(const uint32_t *)a];
+    uint64_t cb = sort_counts[*(const uint32_t *)b];
+    return (ca < cb) - (ca > cb);
+}
+
+
+/* -a: merge summaries, print the total and maybe save it */
+static int show_summaries(char **paths, int count, int top, const char *out_path)
+{
+    Aggregate *agg = agg_new();
+    if (!agg) {
+        printf("Error: Out of memory.\n");
+        return 1;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        if (agg_load(agg, paths[i]) < 0) {
+            printf("Error: Could not read the summary in %s: %s\n", paths[i], strerror(errno));
+            agg_free(agg);
+            return 1;
+        }
+    }
+    
+    int rc = 0;
+    if (out_path && agg_save(agg, out_path) < 0) {
+        printf("Error: Could not save %s: %s\n", out_path, strerror(errno));
+        rc = 1;
+    }
+    
+    agg_print(agg, top);
+    agg_free(agg);
+    return rc;
+}
+
+
+int main(int argc, char *argv[])
+{
+    Filter f = {-1, 0, -1, 0, 255, -1};
+    const char *pattern = NULL;
+    int group = GROUP_NONE;
+    int top = 20;
+    int list = 0;
+    int summaries = 0;
+    const char *out_path = NULL;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "F:c:w:t:P:g:k:lao:")) != -1) {
+        switch (opt) {
+            case 'F': f.family = parse_family(optarg); break;
+            case 'c': f.level = parse_level(optarg); break;
+            case 'w': f.window = atoi(optarg); break;
+            case 't':
+                if (sscanf(optarg, "%d-%d", &f.ttl_min, &f.ttl_max) == 1)
+                    f.ttl_max = f.ttl_min;
+                break;
+            case 'P': pattern = optarg; break;
+            case 'g': group = parse_group(optarg); break;
+            case 'k': top = atoi(optarg); break;
+            case 'l': list = 1; break;
+            case 'a': summaries = 1; break;
+            case 'o': out_path = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+        if (f.family == -1 && opt == 'F') {
+            printf("Error: Unknown family '%s'.\n", optarg);
+            return 1;
+        }
+        if (f.level < 0 || group < 0) {
+            printf("Error: Bad value '%s' for -%c.\n", optarg, opt);
+            return 1;
+        }
+    }
+    
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    if (summaries)
+        return show_summaries(argv + optind, argc - optind, top, out_path);
+    
+    LogReader r;
+    if (log_reader_open(&r, argv[optind]) < 0)
+        return 1;
+    
+    /* Patterns are stored by ID; find it once */
+    if (pattern) {
+        f.pattern = -2;
+        for (int i = 0; i < r.pattern_count; i++) {
+            if (strcmp(r.patterns[i], pattern) == 0) f.pattern = i;
+        }
+    }
+    
+    uint8_t *family_ok = calloc(r.name_count + 1, 1);
+    uint32_t keys = group_size(&r, group);
+    uint64_t *counts = calloc(keys, sizeof(uint64_t));
+    uint8_t *sel = malloc(RESLOG_BLOCK_ROWS);
+    
+    if (!family_ok || !counts || !sel) {
+        printf("Error: Out of memory.\n");
+        return 1;
+    }
+    
+    for (uint32_t i = 0; i < r.name_count; i++)
+        family_ok[i] = r.families[i] == f.family;
+    
+    uint64_t matched = 0;
+    
+    for (int k = 0; k < r.block_count; k++) {
+        const LogRows *b = &r.blocks[k];
+        if (b->count > RESLOG_BLOCK_ROWS)
+            continue;
+        
+        select_rows(b, &f, family_ok, r.name_count, sel);
+        
+        for (uint32_t i = 0; i < b->count; i++) {
+            if (!sel[i]) continue;
+            matched++;
+            if (group != GROUP_NONE)
+                counts[group_key(&r, b, group, i)]++;
+            if (list)
+                list_row(&r, b, i);
+        }
+    }
+    
+    if (list)
+        printf("\n");
+    printf("%llu of %llu hosts match\n", (unsigned long long)matched,
+           (unsigned long long)r.rows);
+    
+    /* Biggest groups first */
+    if (group != GROUP_NONE) {
+        uint32_t *order = malloc(sizeof(uint32_t) * keys);
+        uint32_t used = 0;
+        
+        for (uint32_t key = 0; order && key < keys; key++) {
+            if (counts[key]) order[used++] = key;
+        }
+        
+        sort_counts = counts;
+        if (order) qsort(order, used, sizeof(uint32_t), by_count);
+        
+        printf("\n");
+        for (uint32_t i = 0; order && i < used && (int)i < top; i++) {
+            printf("%10llu  %5.1f%%  ", (unsigned long long)counts[order[i]],
+                   100.0 * counts[order[i]] / (matched ? matched : 1));
+            print_key(&r, group, order[i]);
+            printf("\n");
+        }
+        free(order);
+    }
+    
+    free(sel);
+    free(counts);
+    free(family_ok);
+    log_reader_close(&r);
+    return 0;
+}
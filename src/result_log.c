@@ -0,0 +1,700 @@
+/*
+ * result_log.c - Write and map the columnar result log
+ * 
+ * The writer fills one block of columns in memory and writes it
+ * with a single write() when it is full. New fingerprint names and
+ * option patterns are collected on the side and written as one
+ * dictionary block just before the row block that first uses them.
+ * Because every block is written whole, a crash can only leave a
+ * partial block at the very end, and the next open cuts it off.
+ * 
+ * The dictionaries only grow: a name gets the next free ID the first
+ * time it's used and keeps it in every later run, whatever database
+ * that run loaded, so rows written long ago still read correctly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../include/result_log.h"
+#include "../include/utils.h"
+
+
+#define RESLOG_VERSION 3      /* 2 could reuse name IDs */
+
+/* Sanity limit on fingerprint IDs when reading */
+#define RESLOG_MAX_NAMES (1u << 24)
+
+
+/* Where each column of an n row block starts, after the block header */
+typedef struct {
+    size_t ip, port, ttl, window, pattern, probes, level;
+    size_t fp[RESLOG_TOP];
+    size_t score[RESLOG_TOP];
+    size_t mss, wscale, opts, df;
+    size_t flags[PROBE_COUNT];
+    size_t size;
+} RowLayout;
+
+static void row_layout(uint32_t n, RowLayout *l)
+{
+    size_t off = 0;
+    
+    l->ip = off;      off += ALIGN8(n * sizeof(uint32_t));
+    l->port = off;    off += ALIGN8(n * sizeof(uint16_t));
+    l->ttl = off;     off += ALIGN8(n);
+    l->window = off;  off += ALIGN8(n * sizeof(uint16_t));
+    l->pattern = off; off += ALIGN8(n);
+    l->probes = off;  off += ALIGN8(n);
+    l->level = off;   off += ALIGN8(n);
+    
+    for (int k = 0; k < RESLOG_TOP; k++) {
+        l->fp[k] = off;
+        off += ALIGN8(n * sizeof(uint32_t));
+    }
+    for (int k = 0; k < RESLOG_TOP; k++) {
+        l->score[k] = off;
+        off += ALIGN8(n * sizeof(int16_t));
+    }
+    
+    l->mss = off;     off += ALIGN8(n * sizeof(uint16_t));
+    l->wscale = off;  off += ALIGN8(n);
+    l->opts = off;    off += ALIGN8(n);
+    l->df = off;      off += ALIGN8(n);
+    for (int p = 0; p < PROBE_COUNT; p++) {
+        l->flags[p] = off;
+        off += ALIGN8(n);
+    }
+    l->size = off;
+}
+
+
+/*
+ * Reading
+ */
+
+/* Add the entries of a name block to the dictionary */
+static int read_names(LogReader *r, const uint8_t *p, const uint8_t *end, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        if (end - p < 6) return -1;
+        
+        uint32_t id;
+        memcpy(&id, p, sizeof(id));
+        uint8_t family = p[4];
+        uint8_t len = p[5];
+        p += 6;
+        if (end - p < len || id >= RESLOG_MAX_NAMES) return -1;
+        
+        if (id >= r->name_count) {
+            uint32_t n = id + 1;
+            char **names = realloc(r->names, n * sizeof(char *));
+            if (!names) return -1;
+            r->names = names;
+            
+            uint8_t *families = realloc(r->families, n);
+            if (!families) return -1;
+            r->families = families;
+            
+            for (uint32_t j = r->name_count; j < n; j++) {
+                r->names[j] = NULL;
+                r->families[j] = OS_UNKNOWN;
+            }
+            r->name_count = n;
+        }
+        
+        /* IDs are never reused; one given a different name means damage */
+        if (r->names[id]) {
+            if (strlen(r->names[id]) != len || memcmp(r->names[id], p, len) != 0)
+                return -1;
+        } else if (!(r->names[id] = strndup((const char *)p, len))) {
+            return -1;
+        }
+        r->families[id] = family;
+        p += len;
+    }
+    return 0;
+}
+
+
+static int read_patterns(LogReader *r, const uint8_t *p, const uint8_t *end, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        if (end - p < 2) return -1;
+        
+        uint8_t id = p[0];
+        uint8_t len = p[1];
+        p += 2;
+        if (end - p < len || id >= RESLOG_PATTERNS || len >= 32) return -1;
+        
+        memcpy(r->patterns[id], p, len);
+        r->patterns[id][len] = '\0';
+        if (id >= r->pattern_count) r->pattern_count = id + 1;
+        p += len;
+    }
+    return 0;
+}
+
+
+static int add_rows(LogReader *r, const uint8_t *data, uint64_t size, uint32_t count)
+{
+    RowLayout l;
+    row_layout(count, &l);
+    if (l.size > size) return -1;
+    
+    if (r->block_count % 64 == 0) {
+        LogRows *blocks = realloc(r->blocks, (r->block_count + 64) * sizeof(LogRows));
+        if (!blocks) return -1;
+        r->blocks = blocks;
+    }
+    
+    LogRows *b = &r->blocks[r->block_count++];
+    b->count = count;
+    b->ip = (const uint32_t *)(data + l.ip);
+    b->port = (const uint16_t *)(data + l.port);
+    b->ttl = data + l.ttl;
+    b->window = (const uint16_t *)(data + l.window);
+    b->pattern = data + l.pattern;
+    b->probes = data + l.probes;
+    b->level = data + l.level;
+    for (int k = 0; k < RESLOG_TOP; k++) {
+        b->fp[k] = (const uint32_t *)(data + l.fp[k]);
+        b->score[k] = (const int16_t *)(data + l.score[k]);
+    }
+    b->mss = (const uint16_t *)(data + l.mss);
+    b->wscale = data + l.wscale;
+    b->opts = data + l.opts;
+    b->df = data + l.df;
+    for (int p = 0; p < PROBE_COUNT; p++)
+        b->flags[p] = data + l.flags[p];
+    
+    r->rows += count;
+    return 0;
+}
+
+
+int log_reader_open(LogReader *r, const char *path)
+{
+    memset(r, 0, sizeof(*r));
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(LogFileHeader)) {
+        printf("Error: %s is not a result log.\n", path);
+        close(fd);
+        return -1;
+    }
+    
+    r->size = st.st_size;
+    r->map = mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r->map == MAP_FAILED) {
+        perror("mmap");
+        r->map = NULL;
+        return -1;
+    }
+    
+    const LogFileHeader *fh = r->map;
+    if (memcmp(fh->magic, RESLOG_MAGIC, 8) != 0 || fh->version != RESLOG_VERSION ||
+        fh->top != RESLOG_TOP) {
+        printf("Error: %s is not a result log this version can read.\n", path);
+        log_reader_close(r);
+        return -1;
+    }
+    
+    /* Walk the blocks; stop at one that isn't all there */
+    const uint8_t *base = r->map;
+    size_t off = sizeof(LogFileHeader);
+    
+    while (off + sizeof(LogBlockHeader) <= r->size) {
+        const LogBlockHeader *bh = (const LogBlockHeader *)(base + off);
+        const uint8_t *data = base + off + sizeof(LogBlockHeader);
+        
+        if (bh->size > r->size - off - sizeof(LogBlockHeader))
+            break;
+        
+        int rc = 0;
+        if (bh->type == RESLOG_ROWS)
+            rc = add_rows(r, data, bh->size, bh->count);
+        else if (bh->type == RESLOG_NAMES)
+            rc = read_names(r, data, data + bh->size, bh->count);
+        else if (bh->type == RESLOG_PATTERN)
+            rc = read_patterns(r, data, data + bh->size, bh->count);
+        
+        if (rc < 0) {
+            printf("Error: Damaged block at offset %zu of %s.\n", off, path);
+            break;
+        }
+        off += sizeof(LogBlockHeader) + bh->size;
+    }
+    
+    r->valid = off;
+    return 0;
+}
+
+
+void log_reader_close(LogReader *r)
+{
+    if (r->map)
+        munmap(r->map, r->size);
+    
+    for (uint32_t i = 0; i < r->name_count; i++)
+        free(r->names[i]);
+    free(r->names);
+    free(r->families);
+    free(r->blocks);
+    memset(r, 0, sizeof(*r));
+}
+
+
+void log_row_scan(const LogReader *r, const LogRows *b, uint32_t i, ScanResult *scan)
+{
+    memset(scan, 0, sizeof(*scan));
+    
+    for (int p = 0; p < PROBE_COUNT; p++) {
+        ProbeReply *reply = &scan->reply[p];
+        scan->timing[p].rtt_us = -1;
+        
+        if (!(b->probes[i] & RESLOG_REPLIED(p)))
+            continue;
+        reply->responded = 1;
+        reply->flags = b->flags[p][i];
+        reply->df_flag = (b->df[i] & RESLOG_REPLIED(p)) ? 'Y' : 'N';
+    }
+    
+    scan->t2_responded = scan->reply[PROBE_T2].responded;
+    scan->t3_responded = scan->reply[PROBE_T3].responded;
+    scan->t4_responded = scan->reply[PROBE_T4].responded;
+    
+    if (!scan->reply[PROBE_T1].responded)
+        return;
+    
+    scan->got_response = 1;
+    scan->ttl = b->ttl[i];
+    scan->window = b->window[i];
+    scan->df_flag = scan->reply[PROBE_T1].df_flag;
+    scan->reply[PROBE_T1].ttl = scan->ttl;
+    scan->reply[PROBE_T1].window = scan->window;
+    
+    if (b->pattern[i] < r->pattern_count)
+        strcpy(scan->opts.pattern, r->patterns[b->pattern[i]]);
+    scan->opts.mss = b->mss[i];
+    scan->opts.window_scale = b->wscale[i];
+    scan->opts.has_sack = (b->opts[i] & RESLOG_SACK) != 0;
+    scan->opts.has_timestamp = (b->opts[i] & RESLOG_TIMESTAMP) != 0;
+    
+    /* Only whether there were options matters; the pattern stands in */
+    if (b->opts[i] & RESLOG_OPTIONS)
+        snprintf(scan->options, sizeof(scan->options), "%s",
+                 scan->opts.pattern[0] ? scan->opts.pattern : "?");
+}
+
+
+/*
+ * Writing
+ */
+
+struct ResultLog {
+    int fd;
+    
+    /* The row block being filled: header, then the columns */
+    uint8_t *block;
+    RowLayout layout;
+    uint32_t rows;
+    
+    /* What the dictionaries in the file already hold */
+    char **names;               /* By ID, cut to 255 bytes like in the file */
+    uint32_t name_count;
+    uint32_t name_cap;
+    uint32_t *name_slots;       /* Hash of names: ID + 1, 0 = empty */
+    uint32_t slot_count;        /* Power of two */
+    uint32_t *by_index;         /* ID + 1 by Fingerprint index, for this run */
+    uint32_t by_index_count;
+    char patterns[RESLOG_PATTERNS][32];
+    int pattern_count;
+    
+    /* Entries to write before the next row block */
+    uint8_t *new_names;
+    size_t new_names_len, new_names_cap;
+    uint32_t new_name_count;
+    uint8_t new_patterns[RESLOG_PATTERNS * 34];
+    size_t new_patterns_len;
+    uint32_t new_pattern_count;
+};
+
+
+static uint32_t hash_name(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    return h;
+}
+
+
+/* The hash slot holding this name, or the empty one where it would go */
+static uint32_t *find_name(ResultLog *log, const char *name, size_t len)
+{
+    uint32_t mask = log->slot_count - 1;
+    
+    for (uint32_t i = hash_name(name, len) & mask;; i = (i + 1) & mask) {
+        uint32_t id = log->name_slots[i];
+        if (id == 0)
+            return &log->name_slots[i];
+        
+        const char *known = log->names[id - 1];
+        if (strncmp(known, name, len) == 0 && known[len] == '\0')
+            return &log->name_slots[i];
+    }
+}
+
+
+/* Keep the hash at most half full */
+static int grow_name_slots(ResultLog *log)
+{
+    if (log->slot_count && log->name_count * 2 < log->slot_count)
+        return 0;
+    
+    uint32_t count = log->slot_count ? log->slot_count * 2 : 1024;
+    uint32_t *slots = calloc(count, sizeof(uint32_t));
+    if (!slots) return -1;
+    
+    free(log->name_slots);
+    log->name_slots = slots;
+    log->slot_count = count;
+    
+    for (uint32_t id = 0; id < log->name_count; id++) {
+        if (log->names[id])
+            *find_name(log, log->names[id], strlen(log->names[id])) = id + 1;
+    }
+    return 0;
+}
+
+
+/* Copy the dictionaries of an existing log, so IDs carry on */
+static int load_dictionaries(ResultLog *log, const LogReader *r)
+{
+    log->names = calloc(r->name_count + 1, sizeof(char *));
+    if (!log->names) return -1;
+    log->name_count = r->name_count;
+    log->name_cap = r->name_count + 1;
+    
+    for (uint32_t i = 0; i < r->name_count; i++) {
+        if (r->names[i] && !(log->names[i] = strdup(r->names[i])))
+            return -1;
+    }
+    if (grow_name_slots(log) < 0)
+        return -1;
+    
+    memcpy(log->patterns, r->patterns, sizeof(log->patterns));
+    log->pattern_count = r->pattern_count;
+    return 0;
+}
+
+
+ResultLog *result_log_open(const char *path)
+{
+    ResultLog *log = calloc(1, sizeof(ResultLog));
+    if (!log) return NULL;
+    
+    row_layout(RESLOG_BLOCK_ROWS, &log->layout);
+    log->block = malloc(sizeof(LogBlockHeader) + log->layout.size);
+    
+    log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log->fd < 0) {
+        perror(path);
+        free(log->block);
+        free(log);
+        return NULL;
+    }
+    
+    struct stat st;
+    int ok = log->block && fstat(log->fd, &st) == 0;
+    
+    if (ok && st.st_size == 0) {
+        /* New log */
+        LogFileHeader fh;
+        memset(&fh, 0, sizeof(fh));
+        memcpy(fh.magic, RESLOG_MAGIC, 8);
+        fh.version = RESLOG_VERSION;
+        fh.top = RESLOG_TOP;
+        ok = write_all(log->fd, &fh, sizeof(fh)) == 0;
+    } else if (ok) {
+        /* Carry on from where the last run stopped */
+        LogReader r;
+        ok = log_reader_open(&r, path) == 0;
+        if (ok) {
+            ok = load_dictionaries(log, &r) == 0;
+            if (ok && r.valid < r.size)
+                ok = ftruncate(log->fd, r.valid) == 0;
+            log_reader_close(&r);
+        }
+    }
+    
+    if (!ok) {
+        printf("Error: Could not open result log %s.\n", path);
+        result_log_close(log);
+        return NULL;
+    }
+    return log;
+}
+
+
+/*
+ * The ID of a fingerprint's name, giving it the next one (and queuing
+ * the name) if the file doesn't have it yet. The fingerprint's index
+ * only serves to remember the answer for the rest of this run.
+ */
+static uint32_t name_id(ResultLog *log, const Fingerprint *fp)
+{
+    uint32_t index = (uint32_t)fp->index;
+    if (index < log->by_index_count && log->by_index[index])
+        return log->by_index[index] - 1;
+    
+    if (index >= log->by_index_count) {
+        uint32_t count = index + 1 > 2 * log->by_index_count ? index + 1 : 2 * log->by_index_count;
+        uint32_t *grown = realloc(log->by_index, count * sizeof(uint32_t));
+        if (!grown) return RESLOG_NONE;
+        memset(grown + log->by_index_count, 0, (count - log->by_index_count) * sizeof(uint32_t));
+        log->by_index = grown;
+        log->by_index_count = count;
+    }
+    
+    size_t len = strlen(fp->name);
+    if (len > 255) len = 255;
+    
+    if (grow_name_slots(log) < 0)
+        return RESLOG_NONE;
+    uint32_t *slot = find_name(log, fp->name, len);
+    if (*slot) {
+        log->by_index[index] = *slot;
+        return *slot - 1;
+    }
+    
+    if (log->name_count == log->name_cap) {
+        uint32_t cap = log->name_cap ? log->name_cap * 2 : 256;
+        char **names = realloc(log->names, cap * sizeof(char *));
+        if (!names) return RESLOG_NONE;
+        log->names = names;
+        log->name_cap = cap;
+    }
+    
+    if (log->new_names_len + 6 + len > log->new_names_cap) {
+        size_t cap = log->new_names_cap ? log->new_names_cap * 2 : 4096;
+        uint8_t *grown = realloc(log->new_names, cap);
+        if (!grown) return RESLOG_NONE;
+        log->new_names = grown;
+        log->new_names_cap = cap;
+    }
+    
+    uint32_t id = log->name_count;
+    if (!(log->names[id] = strndup(fp->name, len)))
+        return RESLOG_NONE;
+    log->name_count++;
+    *slot = id + 1;
+    log->by_index[index] = id + 1;
+    
+    uint8_t *p = log->new_names + log->new_names_len;
+    memcpy(p, &id, sizeof(id));
+    p[4] = (uint8_t)fp->os;
+    p[5] = (uint8_t)len;
+    memcpy(p + 6, fp->name, len);
+    log->new_names_len += 6 + len;
+    log->new_name_count++;
+    
+    return id;
+}
+
+
+/* Same for an option pattern */
+static uint8_t pattern_id(ResultLog *log, const char *pattern)
+{
+    for (int i = 0; i < log->pattern_count; i++) {
+        if (strcmp(log->patterns[i], pattern) == 0)
+            return i;
+    }
+    
+    size_t len = strlen(pattern);
+    if (log->pattern_count == RESLOG_PATTERNS || len >= 32)
+        return RESLOG_PATTERNS;
+    
+    uint8_t id = log->pattern_count++;
+    strcpy(log->patterns[id], pattern);
+    
+    uint8_t *p = log->new_patterns + log->new_patterns_len;
+    p[0] = id;
+    p[1] = (uint8_t)len;
+    memcpy(p + 2, pattern, len);
+    log->new_patterns_len += 2 + len;
+    log->new_pattern_count++;
+    
+    return id;
+}
+
+
+/* Write a dictionary block */
+static int write_entries(int fd, uint32_t type, uint32_t count, const uint8_t *data, size_t len)
+{
+    static const uint8_t zeros[8] = {0};
+    LogBlockHeader bh = {type, count, ALIGN8(len)};
+    
+    if (write_all(fd, &bh, sizeof(bh)) < 0 || write_all(fd, data, len) < 0)
+        return -1;
+    return write_all(fd, zeros, ALIGN8(len) - len);
+}
+
+
+/* Write the dictionary entries and rows collected so far */
+static int flush_block(ResultLog *log)
+{
+    if (log->new_name_count) {
+        if (write_entries(log->fd, RESLOG_NAMES, log->new_name_count,
+                          log->new_names, log->new_names_len) < 0)
+            return -1;
+        log->new_names_len = 0;
+        log->new_name_count = 0;
+    }
+    
+    if (log->new_pattern_count) {
+        if (write_entries(log->fd, RESLOG_PATTERN, log->new_pattern_count,
+                          log->new_patterns, log->new_patterns_len) < 0)
+            return -1;
+        log->new_patterns_len = 0;
+        log->new_pattern_count = 0;
+    }
+    
+    if (log->rows == 0)
+        return 0;
+    
+    /*
+     * The block was filled with the layout of a full one. A short
+     * block gets its columns moved down to where they belong.
+     */
+    uint8_t *data = log->block + sizeof(LogBlockHeader);
+    const RowLayout *full = &log->layout;
+    RowLayout l;
+    row_layout(log->rows, &l);
+    
+    if (log->rows < RESLOG_BLOCK_ROWS) {
+        size_t from[] = {full->ip, full->port, full->ttl, full->window, full->pattern,
+                         full->probes, full->level};
+        size_t to[] = {l.ip, l.port, l.ttl, l.window, l.pattern, l.probes, l.level};
+        size_t width[] = {4, 2, 1, 2, 1, 1, 1};
+        
+        for (int c = 0; c < 7; c++)
+            memmove(data + to[c], data + from[c], log->rows * width[c]);
+        for (int k = 0; k < RESLOG_TOP; k++)
+            memmove(data + l.fp[k], data + full->fp[k], log->rows * 4);
+        for (int k = 0; k < RESLOG_TOP; k++)
+            memmove(data + l.score[k], data + full->score[k], log->rows * 2);
+        
+        memmove(data + l.mss, data + full->mss, log->rows * 2);
+        memmove(data + l.wscale, data + full->wscale, log->rows);
+        memmove(data + l.opts, data + full->opts, log->rows);
+        memmove(data + l.df, data + full->df, log->rows);
+        for (int p = 0; p < PROBE_COUNT; p++)
+            memmove(data + l.flags[p], data + full->flags[p], log->rows);
+    }
+    
+    LogBlockHeader *bh = (LogBlockHeader *)log->block;
+    bh->type = RESLOG_ROWS;
+    bh->count = log->rows;
+    bh->size = l.size;
+    
+    log->rows = 0;
+    return write_all(log->fd, log->block, sizeof(LogBlockHeader) + l.size);
+}
+
+
+int result_log_add(ResultLog *log, in_addr_t addr, int port, const ScanResult *scan,
+                   const Match *matches, int count)
+{
+    const RowLayout *l = &log->layout;
+    uint8_t *data = log->block + sizeof(LogBlockHeader);
+    uint32_t row = log->rows;
+    
+    uint8_t probes = 0, df = 0;
+    for (int p = 0; p < PROBE_COUNT; p++) {
+        const ProbeReply *reply = &scan->reply[p];
+        if (reply->responded)
+            probes |= RESLOG_REPLIED(p);
+        if (reply->responded && reply->df_flag == 'Y')
+            df |= RESLOG_REPLIED(p);
+        (data + l->flags[p])[row] = reply->responded ? (uint8_t)reply->flags : 0;
+    }
+    
+    uint8_t opts = 0;
+    if (scan->options[0]) opts |= RESLOG_OPTIONS;
+    if (scan->opts.has_sack) opts |= RESLOG_SACK;
+    if (scan->opts.has_timestamp) opts |= RESLOG_TIMESTAMP;
+    
+    ((uint32_t *)(data + l->ip))[row] = addr;
+    ((uint16_t *)(data + l->port))[row] = (uint16_t)port;
+    (data + l->ttl)[row] = (uint8_t)scan->ttl;
+    ((uint16_t *)(data + l->window))[row] = (uint16_t)scan->window;
+    (data + l->pattern)[row] = pattern_id(log, scan->got_response ? scan->opts.pattern : "");
+    (data + l->probes)[row] = probes;
+    (data + l->level)[row] = (uint8_t)match_level(matches, count);
+    ((uint16_t *)(data + l->mss))[row] = (uint16_t)scan->opts.mss;
+    (data + l->wscale)[row] = (uint8_t)scan->opts.window_scale;
+    (data + l->opts)[row] = opts;
+    (data + l->df)[row] = df;
+    
+    for (int k = 0; k < RESLOG_TOP; k++) {
+        uint32_t id = k < count ? name_id(log, matches[k].fp) : RESLOG_NONE;
+        int score = k < count ? matches[k].score : 0;
+        if (score > INT16_MAX) score = INT16_MAX;
+        if (score < INT16_MIN) score = INT16_MIN;
+        
+        ((uint32_t *)(data + l->fp[k]))[row] = id;
+        ((int16_t *)(data + l->score[k]))[row] = (int16_t)score;
+    }
+    
+    if (++log->rows == RESLOG_BLOCK_ROWS)
+        return flush_block(log);
+    return 0;
+}
+
+
+int64_t result_log_sync(ResultLog *log)
+{
+    if (flush_block(log) < 0 || fdatasync(log->fd) < 0)
+        return -1;
+    
+    off_t size = lseek(log->fd, 0, SEEK_END);
+    return size < 0 ? -1 : (int64_t)size;
+}
+
+
+int result_log_close(ResultLog *log)
+{
+    if (!log) return 0;
+    
+    int rc = 0;
+    if (log->fd >= 0 && log->block) {
+        rc = flush_block(log);
+        if (rc < 0) perror("result log");
+    }
+    if (log->fd >= 0) close(log->fd);
+    
+    for (uint32_t i = 0; i < log->name_count; i++)
+        free(log->names[i]);
+    free(log->names);
+    free(log->name_slots);
+    free(log->by_index);
+    free(log->new_names);
+    free(log->block);
+    free(log);
+    return rc;
+}
@@ -0,0 +1,492 @@
+/*
+ * route.c - Cached routing table for source address lookups
+ * 
+ * We read the IPv4 routes (main and local tables) and interface
+ * addresses over rtnetlink, work out the source address for every
+ * route, and publish the result as one read-only table. A thread
+ * listens for route and address change notifications and publishes
+ * a fresh table when something changes.
+ * 
+ * Lookups never lock and never make a system call: they load the
+ * current table pointer and do a longest prefix match, trying each
+ * prefix length present (longest first) with a binary search.
+ * 
+ * A replaced table can't be freed right away, since a lookup on
+ * another thread could still be reading it. Each thread that looks
+ * routes up gets a slot of its own, where it writes the epoch it
+ * started in and clears it when done. Every new table starts a new
+ * epoch, and the watcher frees an old table once no slot shows an
+ * epoch from before it was replaced. A thread that can't get a slot
+ * (too many at once) asks the kernel instead.
+ * 
+ * Policy routing rules aren't followed; routes from other tables
+ * are ignored.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "../include/route.h"
+#include "../include/utils.h"
+
+
+#define MAX_ADDRS 256
+#define READER_SLOTS 256
+
+/* One route */
+typedef struct {
+    uint32_t prefix;        /* Host byte order, masked */
+    uint8_t len;
+    uint8_t local;          /* One of our own addresses */
+    uint32_t metric;
+    in_addr_t gateway;
+    in_addr_t src;
+    int ifindex;
+} Route;
+
+/* An address on one of our interfaces */
+typedef struct {
+    int ifindex;
+    in_addr_t addr;
+    int prefix_len;
+} IfAddr;
+
+/* A published table. Routes are sorted longest prefix first. */
+typedef struct RouteTable {
+    int count;
+    Route *routes;
+    int nlens;
+    uint8_t lens[33];       /* Prefix lengths present, longest first */
+    int start[33];          /* Where each length starts in routes */
+    int len_count[33];
+    struct RouteTable *retired;     /* The next older table waiting to be freed */
+    unsigned long retired_at;       /* Epoch it was replaced in */
+} RouteTable;
+
+/* Where one reader thread says it's inside a lookup */
+typedef struct {
+    unsigned long epoch;            /* When its lookup started, 0 if none */
+    int used;
+} __attribute__((aligned(64))) ReaderSlot;
+
+/* Used while reading from netlink */
+typedef struct {
+    Route *routes;
+    int count;
+    int cap;
+    IfAddr addrs[MAX_ADDRS];
+    int naddrs;
+} Builder;
+
+
+static RouteTable *current;
+static RouteTable *retired;         /* Replaced tables, newest first */
+static unsigned long epoch = 1;
+
+static ReaderSlot readers[READER_SLOTS];
+static __thread ReaderSlot *my_slot;
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+
+
+static uint32_t prefix_mask(int len)
+{
+    return len ? ~0u << (32 - len) : 0;
+}
+
+
+/*
+ * Send a dump request and feed every reply message to 'handle'.
+ * Returns 0 when the dump is complete, -1 on error.
+ */
+static int nl_dump(int sock, int type, void (*handle)(Builder *, struct nlmsghdr *),
+                   Builder *b)
+{
+    static __thread unsigned seq;
+    long buf[4096];
+    
+    struct {
+        struct nlmsghdr nh;
+        struct rtgenmsg gen;
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtgenmsg));
+    req.nh.nlmsg_type = type;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nh.nlmsg_seq = ++seq;
+    req.gen.rtgen_family = AF_INET;
+    
+    struct sockaddr_nl kernel = {0};
+    kernel.nl_family = AF_NETLINK;
+    
+    if (sendto(sock, &req, req.nh.nlmsg_len, 0,
+               (struct sockaddr *)&kernel, sizeof(kernel)) < 0)
+        return -1;
+    
+    while (1) {
+        int len = recv(sock, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        
+        for (struct nlmsghdr *nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (unsigned)len);
+             nh = NLMSG_NEXT(nh, len)) {
+            if (nh->nlmsg_seq != req.nh.nlmsg_seq)
+                continue;
+            if (nh->nlmsg_type == NLMSG_DONE)
+                return 0;
+            if (nh->nlmsg_type == NLMSG_ERROR)
+                return -1;
+            handle(b, nh);
+        }
+    }
+}
+
+
+/* RTM_NEWADDR: remember the interface address */
+static void handle_addr(Builder *b, struct nlmsghdr *nh)
+{
+    struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+    if (nh->nlmsg_type != RTM_NEWADDR || ifa->ifa_family != AF_INET ||
+        b->naddrs == MAX_ADDRS)
+        return;
+    
+    in_addr_t local = 0, address = 0;
+    int len = IFA_PAYLOAD(nh);
+    
+    for (struct rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == IFA_LOCAL)
+            memcpy(&local, RTA_DATA(rta), 4);
+        else if (rta->rta_type == IFA_ADDRESS)
+            memcpy(&address, RTA_DATA(rta), 4);
+    }
+    
+    /* IFA_LOCAL is our end; IFA_ADDRESS is the peer on point-to-point links */
+    IfAddr *a = &b->addrs[b->naddrs++];
+    a->ifindex = ifa->ifa_index;
+    a->addr = local ? local : address;
+    a->prefix_len = ifa->ifa_prefixlen;
+}
+
+
+/* RTM_NEWROUTE: keep unicast and local routes from the main and local tables */
+static void handle_route(Builder *b, struct nlmsghdr *nh)
+{
+    struct rtmsg *rt = NLMSG_DATA(nh);
+    if (nh->nlmsg_type != RTM_NEWROUTE || rt->rtm_family != AF_INET)
+        return;
+    if (rt->rtm_type != RTN_UNICAST && rt->rtm_type != RTN_LOCAL)
+        return;
+    
+    Route r;
+    memset(&r, 0, sizeof(r));
+    r.len = rt->rtm_dst_len;
+    r.local = (rt->rtm_type == RTN_LOCAL);
+    
+    unsigned table = rt->rtm_table;
+    in_addr_t dst = 0;
+    int len = RTM_PAYLOAD(nh);
+    
+    for (struct rtattr *rta = RTM_RTA(rt); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+            case RTA_TABLE:    memcpy(&table, RTA_DATA(rta), 4); break;
+            case RTA_DST:      memcpy(&dst, RTA_DATA(rta), 4); break;
+            case RTA_OIF:      memcpy(&r.ifindex, RTA_DATA(rta), 4); break;
+            case RTA_PREFSRC:  memcpy(&r.src, RTA_DATA(rta), 4); break;
+            case RTA_GATEWAY:  memcpy(&r.gateway, RTA_DATA(rta), 4); break;
+            case RTA_PRIORITY: memcpy(&r.metric, RTA_DATA(rta), 4); break;
+        }
+    }
+    
+    if (table != RT_TABLE_MAIN && table != RT_TABLE_LOCAL)
+        return;
+    
+    r.prefix = ntohl(dst) & prefix_mask(r.len);
+    
+    if (b->count == b->cap) {
+        int cap = b->cap ? b->cap * 2 : 64;
+        Route *grown = realloc(b->routes, cap * sizeof(Route));
+        if (!grown) return;
+        b->routes = grown;
+        b->cap = cap;
+    }
+    b->routes[b->count++] = r;
+}
+
+
+/*
+ * Source address for a route without a preferred source: an address
+ * on its interface in the same subnet as the next hop, or failing
+ * that the interface's first address.
+ */
+static in_addr_t pick_source(const Builder *b, const Route *r)
+{
+    uint32_t hop = r->gateway ? ntohl(r->gateway) : r->prefix;
+    in_addr_t first = 0;
+    
+    for (int i = 0; i < b->naddrs; i++) {
+        const IfAddr *a = &b->addrs[i];
+        if (a->ifindex != r->ifindex)
+            continue;
+        if (!first)
+            first = a->addr;
+        
+        uint32_t mask = prefix_mask(a->prefix_len);
+        if ((ntohl(a->addr) & mask) == (hop & mask))
+            return a->addr;
+    }
+    return first;
+}
+
+
+/* Longest prefix first; for the same prefix, local routes then lowest metric */
+static int cmp_routes(const void *a, const void *b)
+{
+    const Route *x = a, *y = b;
+    
+    if (x->len != y->len) return y->len - x->len;
+    if (x->prefix != y->prefix) return x->prefix < y->prefix ? -1 : 1;
+    if (x->local != y->local) return y->local - x->local;
+    if (x->metric != y->metric) return x->metric < y->metric ? -1 : 1;
+    return 0;
+}
+
+
+/* Read the routing table from the kernel */
+static RouteTable *load_table(void)
+{
+    int sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock < 0)
+        return NULL;
+    
+    Builder *b = calloc(1, sizeof(Builder));
+    RouteTable *t = calloc(1, sizeof(RouteTable));
+    
+    if (!b || !t || nl_dump(sock, RTM_GETADDR, handle_addr, b) < 0 ||
+        nl_dump(sock, RTM_GETROUTE, handle_route, b) < 0) {
+        close(sock);
+        if (b) free(b->routes);
+        free(b);
+        free(t);
+        return NULL;
+    }
+    close(sock);
+    
+    for (int i = 0; i < b->count; i++) {
+        if (!b->routes[i].src)
+            b->routes[i].src = pick_source(b, &b->routes[i]);
+    }
+    
+    qsort(b->routes, b->count, sizeof(Route), cmp_routes);
+    
+    /* Keep the best route per prefix and index the prefix lengths */
+    int n = 0;
+    for (int i = 0; i < b->count; i++) {
+        Route *r = &b->routes[i];
+        if (n > 0 && b->routes[n - 1].len == r->len && b->routes[n - 1].prefix == r->prefix)
+            continue;
+        
+        if (n == 0 || b->routes[n - 1].len != r->len) {
+            t->lens[t->nlens] = r->len;
+            t->start[t->nlens] = n;
+            t->nlens++;
+        }
+        t->len_count[t->nlens - 1]++;
+        b->routes[n++] = *r;
+    }
+    
+    t->routes = b->routes;
+    t->count = n;
+    free(b);
+    return t;
+}
+
+
+/* A thread's slot goes back when it exits */
+static void release_slot(void *arg)
+{
+    ReaderSlot *slot = arg;
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->used, 0, __ATOMIC_RELEASE);
+}
+
+static void make_slot_key(void)
+{
+    pthread_key_create(&slot_key, release_slot);
+}
+
+
+/* This thread's reader slot, NULL if they're all taken */
+static ReaderSlot *reader_slot(void)
+{
+    if (my_slot)
+        return my_slot;
+    
+    pthread_once(&slot_once, make_slot_key);
+    for (int i = 0; i < READER_SLOTS; i++) {
+        int unused = 0;
+        if (__atomic_compare_exchange_n(&readers[i].used, &unused, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            my_slot = &readers[i];
+            pthread_setspecific(slot_key, my_slot);
+            return my_slot;
+        }
+    }
+    return NULL;
+}
+
+
+/* Free the replaced tables no lookup can still be reading */
+static void free_retired(void)
+{
+    /* The oldest lookup still going, by the epoch it started in */
+    unsigned long oldest = ~0ul;
+    for (int i = 0; i < READER_SLOTS; i++) {
+        unsigned long e = __atomic_load_n(&readers[i].epoch, __ATOMIC_SEQ_CST);
+        if (e && e < oldest)
+            oldest = e;
+    }
+    
+    /* A lookup that started before a table was replaced may still have it */
+    RouteTable **link = &retired;
+    while (*link) {
+        RouteTable *t = *link;
+        if (t->retired_at <= oldest) {
+            *link = t->retired;
+            free(t->routes);
+            free(t);
+        } else {
+            link = &t->retired;
+        }
+    }
+}
+
+
+/* Make 't' the table lookups see, and retire the one it replaces */
+static void publish_table(RouteTable *t)
+{
+    RouteTable *old = current;
+    __atomic_store_n(&current, t, __ATOMIC_SEQ_CST);
+    unsigned long now = __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+    
+    if (old) {
+        old->retired_at = now;
+        old->retired = retired;
+        retired = old;
+    }
+    free_retired();
+}
+
+
+/* Reload the table whenever the kernel says routes or addresses changed */
+static void *watch_routes(void *arg)
+{
+    int sock = (int)(long)arg;
+    long buf[2048];
+    
+    while (1) {
+        int len = recv(sock, buf, sizeof(buf), 0);
+        if (len < 0 && errno != EINTR && errno != ENOBUFS)
+            break;
+        
+        /* Changes come in bursts; read them all before reloading */
+        while (recv(sock, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+            ;
+        
+        RouteTable *t = load_table();
+        if (t)
+            publish_table(t);
+    }
+    
+    close(sock);
+    return NULL;
+}
+
+
+int route_cache_init(void)
+{
+    RouteTable *t = load_table();
+    if (!t)
+        return -1;
+    publish_table(t);
+    
+    /* Listen for changes */
+    int sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock < 0)
+        return 0;
+    
+    struct sockaddr_nl groups = {0};
+    groups.nl_family = AF_NETLINK;
+    groups.nl_groups = RTMGRP_IPV4_ROUTE | RTMGRP_IPV4_IFADDR;
+    
+    pthread_t thread;
+    if (bind(sock, (struct sockaddr *)&groups, sizeof(groups)) < 0 ||
+        pthread_create(&thread, NULL, watch_routes, (void *)(long)sock) != 0) {
+        close(sock);
+        return 0;
+    }
+    pthread_detach(thread);
+    
+    return 0;
+}
+
+
+int route_lookup(in_addr_t dst, in_addr_t *src, int *ifindex)
+{
+    if (!__atomic_load_n(&current, __ATOMIC_ACQUIRE))
+        return -1;
+    
+    ReaderSlot *slot = reader_slot();
+    if (!slot)
+        return -1;
+    
+    /* Say we're reading before picking up the table, so it isn't freed under us */
+    __atomic_store_n(&slot->epoch, __atomic_load_n(&epoch, __ATOMIC_ACQUIRE),
+                     __ATOMIC_SEQ_CST);
+    const RouteTable *t = __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+    
+    uint32_t addr = ntohl(dst);
+    int found = -1;
+    
+    for (int i = 0; i < t->nlens && found < 0; i++) {
+        uint32_t key = addr & prefix_mask(t->lens[i]);
+        const Route *r = t->routes + t->start[i];
+        int lo = 0, hi = t->len_count[i] - 1;
+        
+        while (lo <= hi) {
+            int mid = (lo + hi) / 2;
+            if (r[mid].prefix == key) {
+                if (src) *src = r[mid].src;
+                if (ifindex) *ifindex = r[mid].ifindex;
+                found = 0;
+                break;
+            }
+            if (r[mid].prefix < key) lo = mid + 1;
+            else                     hi = mid - 1;
+        }
+    }
+    
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+    return found;
+}
+
+
+in_addr_t source_address(in_addr_t dst)
+{
+    in_addr_t src;
+    
+    if (route_lookup(dst, &src, NULL) == 0 && src)
+        return src;
+    return get_local_addr(dst);
+}
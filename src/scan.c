@@ -0,0 +1,842 @@
+/*
+ * scan.c - Fingerprint many targets with a pipeline of threads
+ * 
+ * Every probe worker runs in its own thread around its own prober
+ * (src/prober.c), with a raw socket for sending and a packet socket
+ * for receiving. A worker keeps up to WORKER_INFLIGHT targets in
+ * flight and sends each one the same burst of seven probes as
+ * fingerprint_target().
+ * 
+ * The receive sockets are one PACKET_FANOUT group. A tiny classic
+ * BPF program picks the socket from the reply's source address the
+ * same way scan_owner() shards the targets, so a reply always lands
+ * on the thread that is waiting for it. Decoding a reply only
+ * touches the flight it belongs to, so it stays on that thread too.
+ * 
+ * Every ring has exactly one thread on each end: the calling thread
+ * feeds one target ring per worker, each worker feeds one result
+ * ring read by matcher (worker % matchers), and each matcher feeds
+ * one ring read by the emitter. A producer that finds its ring full
+ * waits, which is how a slow stage pushes back on the ones before
+ * it.
+ * 
+ * Targets are numbered as they are handed out. With checkpoints,
+ * the emitter marks each number done once its host is written out,
+ * and now and then saves that with the stream's position (see
+ * checkpoint.h).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#include "../include/defs.h"
+#include "../include/scan.h"
+#include "../include/route.h"
+#include "../include/ring.h"
+#include "../include/prober.h"
+
+
+/* A target on its way to a worker */
+typedef struct {
+    in_addr_t addr;
+    uint64_t seq;
+} Target;
+
+/*
+ * Which targets are done. The calling thread hands targets out
+ * under the lock, so a checkpoint sees the stream's position and
+ * 'next' together; only the emitter marks them done and moves
+ * 'base' on. Without checkpoints, only 'next' is used.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    TargetGen *targets;
+    uint64_t next;              /* Number of the next target */
+    atomic_ulong base;          /* Every target below this is done */
+    uint8_t *done;              /* Bit per target, by number % CHECKPOINT_WINDOW */
+    in_addr_t *addrs;           /* ... and its address */
+} Progress;
+
+/* Everything one probe worker needs */
+typedef struct {
+    int id;
+    int workers;
+    int port;
+    int cpu;                    /* -1 = not pinned */
+    
+    /* Targets in, from the calling thread */
+    Ring targets;
+    int wake_fd;                /* eventfd: the ring isn't empty any more */
+    atomic_int closed;          /* No more targets are coming */
+    
+    /* Results out, to a matcher */
+    Ring results;
+    int blocked;                /* Waiting for room in 'results' */
+    atomic_int done;            /* Everything has been handed on */
+    
+    Prober prober;
+    Target held;                /* Next target, waiting for the pacer */
+    int holding;
+    ScanStats stats;
+} Worker;
+
+/* A match stage thread */
+typedef struct {
+    int id;
+    int matchers;
+    int cpu;
+    Worker *workers;            /* Reads the results of workers id, id + matchers, ... */
+    int worker_count;
+    ScanMatch match;
+    void *arg;
+    
+    Ring out;                   /* To the emitter */
+    int blocked;
+    atomic_int done;
+} Matcher;
+
+/* The emit stage thread */
+typedef struct {
+    int cpu;
+    Matcher *matchers;
+    int matcher_count;
+    ScanEmit emit;
+    void *arg;
+    
+    /* Checkpoints */
+    const ScanConfig *config;
+    Progress *progress;
+    Checkpoint cp;              /* Buffers to build them in */
+    uint64_t due;               /* Wheel time (ms) of the next one */
+} Emitter;
+
+
+int scan_owner(in_addr_t addr, int workers)
+{
+    return ntohl(addr) % workers;
+}
+
+
+/*
+ * Open a receive socket and add it to the fanout group.
+ * The order sockets join in is the index the BPF program returns.
+ */
+static int open_fanout_socket(int group)
+{
+    int sock = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP));
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+    
+    int size = 4 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    
+    int fanout = group | (PACKET_FANOUT_CBPF << 16);
+    if (setsockopt(sock, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) < 0) {
+        perror("PACKET_FANOUT");
+        close(sock);
+        return -1;
+    }
+    
+    return sock;
+}
+
+
+/*
+ * Steer every packet to socket (source address % workers).
+ * SKF_NET_OFF makes the load relative to the IP header whether or
+ * not the device has a link layer header.
+ */
+static int set_fanout_program(int sock, int workers)
+{
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, workers),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+    
+    if (setsockopt(sock, SOL_PACKET, PACKET_FANOUT_DATA, &prog, sizeof(prog)) < 0) {
+        perror("PACKET_FANOUT_DATA");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Wait for something to do: yield for a while, then sleep in short
+ * naps, so an idle stage costs little but a busy one reacts quickly.
+ */
+static void backoff(int *idle)
+{
+    if (++*idle < 64) {
+        sched_yield();
+        return;
+    }
+    
+    struct timespec nap = {0, *idle < 1024 ? 50000 : 1000000};
+    nanosleep(&nap, NULL);
+}
+
+
+/* Wake a worker that may be asleep on an empty target ring */
+static void wake_worker(Worker *w)
+{
+    uint64_t one = 1;
+    if (write(w->wake_fd, &one, sizeof(one)) < 0)
+        perror("eventfd");
+}
+
+
+/* Give a target to its worker, waiting while the worker's ring is full */
+static void dispatch(Worker *w, const Target *t)
+{
+    Target *slot = ring_slot(&w->targets);
+    
+    if (!slot) {
+        int idle = 0;
+        w->targets.full++;
+        while (!(slot = ring_slot(&w->targets)))
+            backoff(&idle);
+    }
+    
+    *slot = *t;
+    
+    /* The worker only sleeps on an empty ring */
+    if (ring_push(&w->targets) == 1)
+        wake_worker(w);
+}
+
+
+/*
+ * Take the next target. Returns 0, -1 if there is none for now,
+ * or -2 if there won't be any more.
+ */
+static int next_target(Worker *w, Target *t)
+{
+    Target *item = ring_peek(&w->targets);
+    
+    if (!item) {
+        /* Closing comes after the last target, so look once more */
+        if (!atomic_load(&w->closed))
+            return -1;
+        item = ring_peek(&w->targets);
+        if (!item)
+            return -2;
+    }
+    
+    *t = *item;
+    ring_pop(&w->targets);
+    return 0;
+}
+
+
+/* Clear the ring's wakeup after it has been seen */
+static void clear_wakeup(Worker *w)
+{
+    uint64_t count;
+    if (read(w->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("eventfd");
+}
+
+
+/*
+ * Hand a finished target on to the matcher.
+ * Returns 0, or -1 if the matcher's ring is full.
+ */
+static int finish_target(Flight *f, void *arg)
+{
+    Worker *w = arg;
+    ScanRecord *rec = ring_slot(&w->results);
+    if (!rec) {
+        if (!w->blocked) w->results.full++;
+        w->blocked = 1;
+        return -1;
+    }
+    w->blocked = 0;
+    
+    w->stats.targets++;
+    if (f->result.got_response)
+        w->stats.responded++;
+    w->stats.retries += f->retries;
+    
+    memcpy(rec->target, f->target, sizeof(rec->target));
+    rec->addr = f->addr;
+    rec->port = f->port;
+    rec->seq = f->seq;
+    rec->result = f->result;
+    rec->count = 0;
+    ring_push(&w->results);
+    return 0;
+}
+
+
+static void *worker_main(void *data)
+{
+    Worker *w = data;
+    Prober *p = &w->prober;
+    
+    /* Pacing sleeps are microseconds; the default 50 us of slack would swamp them */
+    if (p->pacer)
+        prctl(PR_SET_TIMERSLACK, 1000UL);
+    
+    while (1) {
+        /*
+         * Start new targets while there's room. A target the pacer
+         * holds back is kept until it may go, so the order stays.
+         */
+        int more = 0;
+        while (p->inflight < p->capacity) {
+            if (!w->holding) {
+                more = next_target(w, &w->held);
+                if (more < 0)
+                    break;
+                w->holding = 1;
+            }
+            Flight *f = prober_start(p, w->held.addr, w->port);
+            if (!f)
+                break;
+            f->seq = w->held.seq;
+            w->holding = 0;
+        }
+        
+        if (p->inflight == 0 && !w->holding) {
+            if (more == -2)
+                break;
+            
+            /* Nothing to do until more targets come */
+            struct pollfd pfd = {w->wake_fd, POLLIN, 0};
+            poll(&pfd, 1, -1);
+            clear_wakeup(w);
+            continue;
+        }
+        
+        /* Sleep until a reply comes in, the wheel has timers due or the pacer lets us go on */
+        long timeout = prober_timeout(p);
+        int64_t wait_ns = timeout < 0 ? -1 : (int64_t)timeout * 1000000;
+        if (w->holding && p->inflight < p->capacity &&
+            (wait_ns < 0 || (int64_t)p->pace_wait < wait_ns))
+            wait_ns = p->pace_wait;
+        
+        struct timespec ts = {wait_ns / 1000000000, wait_ns % 1000000000};
+        struct pollfd pfd[2] = {
+            {p->recv_sock, POLLIN, 0},
+            {w->wake_fd, POLLIN, 0},
+        };
+        if (ppoll(pfd, 2, wait_ns < 0 ? NULL : &ts, NULL) > 0) {
+            if (pfd[0].revents)
+                prober_drain(p);
+            if (pfd[1].revents)
+                clear_wakeup(w);
+        }
+        
+        /* Retry, give up on or pass on the targets whose timers went off */
+        prober_expire(p);
+    }
+    
+    atomic_store(&w->done, 1);
+    return NULL;
+}
+
+
+static void *matcher_main(void *data)
+{
+    Matcher *m = data;
+    int idle = 0;
+    
+    while (1) {
+        int busy = 0, finished = 1;
+        
+        for (int i = m->id; i < m->worker_count; i += m->matchers) {
+            Worker *w = &m->workers[i];
+            int done = atomic_load(&w->done);
+            ScanRecord *in;
+            
+            while ((in = ring_peek(&w->results))) {
+                ScanRecord *out = ring_slot(&m->out);
+                if (!out) {
+                    if (!m->blocked) m->out.full++;
+                    m->blocked = 1;
+                    break;
+                }
+                m->blocked = 0;
+                
+                *out = *in;
+                ring_pop(&w->results);
+                m->match(out, m->arg);
+                ring_push(&m->out);
+                busy = 1;
+            }
+            
+            if (!done || ring_peek(&w->results))
+                finished = 0;
+        }
+        
+        if (finished)
+            break;
+        if (busy) idle = 0;
+        else backoff(&idle);
+    }
+    
+    atomic_store(&m->done, 1);
+    return NULL;
+}
+
+
+/* Take the next target from the stream and number it. Returns 0, or -1 at the end. */
+static int hand_out(Progress *pr, const ScanConfig *config, Target *t)
+{
+    if (!pr->done) {
+        t->seq = pr->next++;
+        return targets_next(pr->targets, &t->addr);
+    }
+    
+    /* Never more than the window past the oldest unfinished target */
+    int idle = 0;
+    while (pr->next - atomic_load(&pr->base) >= CHECKPOINT_WINDOW) {
+        if (config->stop && *config->stop)
+            return -1;
+        backoff(&idle);
+    }
+    
+    pthread_mutex_lock(&pr->lock);
+    int rc = targets_next(pr->targets, &t->addr);
+    if (rc == 0) {
+        t->seq = pr->next++;
+        pr->addrs[t->seq % CHECKPOINT_WINDOW] = t->addr;
+    }
+    pthread_mutex_unlock(&pr->lock);
+    return rc;
+}
+
+
+static int is_set(const uint8_t *bits, uint64_t i)
+{
+    return bits[i / 8] & (1u << (i % 8));
+}
+
+
+/* Set up the numbering where a checkpoint left it, before any thread runs */
+static void restore_progress(Progress *pr, const Checkpoint *cp)
+{
+    const CheckpointHeader *h = &cp->head;
+    uint64_t k = 0;
+    
+    pr->next = h->next;
+    atomic_store(&pr->base, h->base);
+    
+    for (uint64_t seq = h->base; seq < h->next; seq++) {
+        uint64_t i = seq % CHECKPOINT_WINDOW;
+        if (is_set(cp->done, seq - h->base))
+            pr->done[i / 8] |= 1u << (i % 8);
+        else
+            pr->addrs[i] = cp->pending[k++];
+    }
+}
+
+
+/* Hand out the targets a checkpoint left unfinished again, under their old numbers */
+static void resume_pending(const Checkpoint *cp, Worker *w, int workers)
+{
+    const CheckpointHeader *h = &cp->head;
+    uint64_t k = 0;
+    
+    for (uint64_t seq = h->base; seq < h->next; seq++) {
+        if (is_set(cp->done, seq - h->base))
+            continue;
+        Target t = {cp->pending[k++], seq};
+        dispatch(&w[scan_owner(t.addr, workers)], &t);
+    }
+}
+
+
+/* A host has been written out: mark it, and move 'base' past everything done */
+static void mark_done(Progress *pr, uint64_t seq)
+{
+    uint64_t i = seq % CHECKPOINT_WINDOW;
+    pr->done[i / 8] |= 1u << (i % 8);
+    
+    uint64_t base = atomic_load(&pr->base);
+    while (is_set(pr->done, i = base % CHECKPOINT_WINDOW)) {
+        pr->done[i / 8] &= ~(1u << (i % 8));
+        base++;
+    }
+    atomic_store(&pr->base, base);
+}
+
+
+/*
+ * Save a checkpoint. The outputs are synced first; since this thread
+ * is the only one that writes them and marks targets done, they then
+ * hold exactly the hosts the bitmap says are done.
+ */
+static void save_checkpoint(Emitter *e)
+{
+    Progress *pr = e->progress;
+    CheckpointHeader *h = &e->cp.head;
+    
+    if (e->config->sync && e->config->sync(h->outputs, e->arg) < 0) {
+        printf("Warning: Could not sync the output for checkpoint %s.\n", e->config->checkpoint);
+        return;
+    }
+    
+    pthread_mutex_lock(&pr->lock);
+    targets_save(pr->targets, &h->targets);
+    h->next = pr->next;
+    pthread_mutex_unlock(&pr->lock);
+    
+    h->base = atomic_load(&pr->base);
+    h->pending = 0;
+    memset(e->cp.done, 0, (h->next - h->base + 7) / 8);
+    
+    for (uint64_t seq = h->base; seq < h->next; seq++) {
+        uint64_t i = seq % CHECKPOINT_WINDOW;
+        uint64_t k = seq - h->base;
+        if (is_set(pr->done, i))
+            e->cp.done[k / 8] |= 1u << (k % 8);
+        else
+            e->cp.pending[h->pending++] = pr->addrs[i];
+    }
+    
+    if (checkpoint_write(e->config->checkpoint, &e->cp) < 0)
+        printf("Warning: Could not write checkpoint %s: %s\n", e->config->checkpoint,
+               strerror(errno));
+}
+
+
+static void *emitter_main(void *data)
+{
+    Emitter *e = data;
+    Progress *pr = e->progress->done ? e->progress : NULL;
+    int secs = e->config->checkpoint_secs > 0 ? e->config->checkpoint_secs : CHECKPOINT_SECS;
+    int idle = 0;
+    
+    e->due = prober_now() + secs * 1000ULL;
+    
+    while (1) {
+        int busy = 0, finished = 1;
+        
+        for (int i = 0; i < e->matcher_count; i++) {
+            Matcher *m = &e->matchers[i];
+            int done = atomic_load(&m->done);
+            ScanRecord *rec;
+            
+            while ((rec = ring_peek(&m->out))) {
+                e->emit(rec, e->arg);
+                if (pr)
+                    mark_done(pr, rec->seq);
+                ring_pop(&m->out);
+                busy = 1;
+            }
+            
+            if (!done)
+                finished = 0;
+        }
+        
+        if (finished)
+            break;
+        
+        if (pr && prober_now() >= e->due) {
+            save_checkpoint(e);
+            e->due = prober_now() + secs * 1000ULL;
+        }
+        
+        if (busy) idle = 0;
+        else backoff(&idle);
+    }
+    
+    /* Everything handed out is done now (or the stream is over) */
+    if (pr)
+        save_checkpoint(e);
+    return NULL;
+}
+
+
+/* Start a stage thread, pinned to 'cpu' unless it is -1 */
+static int start_thread(pthread_t *thread, void *(*run)(void *), void *arg, int cpu)
+{
+    if (pthread_create(thread, NULL, run, arg) != 0)
+        return -1;
+    
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(*thread, sizeof(set), &set) != 0)
+            printf("Warning: Could not pin a thread to CPU %d.\n", cpu);
+    }
+    return 0;
+}
+
+
+/* The CPU for thread k of a stage */
+static int stage_cpu(const ScanConfig *config, int stage, int k)
+{
+    if (config->cpu_count[stage] == 0)
+        return -1;
+    return config->cpus[stage][k % config->cpu_count[stage]];
+}
+
+
+/* Add one ring's numbers to a stage's */
+static void add_queue_stats(QueueStats *q, const Ring *r)
+{
+    double total = q->avg_depth * q->pushes + r->depth_sum;
+    
+    q->pushes += r->pushes;
+    q->full += r->full;
+    q->avg_depth = q->pushes ? total / q->pushes : 0;
+    if (r->max_depth > q->max_depth) q->max_depth = r->max_depth;
+    q->capacity = r->size;
+}
+
+
+int parse_cpu_list(const char *text, int *cpus, int max)
+{
+    int count = 0;
+    const char *p = text;
+    
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0)
+            return -1;
+        
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first)
+                return -1;
+            p = end;
+        }
+        
+        for (long c = first; c <= last; c++) {
+            if (count == max || c >= CPU_SETSIZE)
+                return -1;
+            cpus[count++] = (int)c;
+        }
+        
+        if (*p == ',') p++;
+        else if (*p) return -1;
+    }
+    return count;
+}
+
+
+int scan_batch(TargetGen *targets, int port, const ScanConfig *config,
+               ScanStats *stats)
+{
+    int workers = config->workers;
+    if (workers < 1) workers = 1;
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+    
+    int matchers = config->matchers;
+    if (matchers < 1) matchers = 1;
+    if (matchers > workers) matchers = workers;
+    if (matchers > MAX_MATCHERS) matchers = MAX_MATCHERS;
+    
+    Worker *w = calloc(workers, sizeof(Worker));
+    Matcher *m = calloc(matchers, sizeof(Matcher));
+    Progress progress = {PTHREAD_MUTEX_INITIALIZER, targets, 0, 0, NULL, NULL};
+    Emitter e = {.cpu = stage_cpu(config, STAGE_EMIT, 0), .matchers = m,
+                 .matcher_count = matchers, .emit = config->emit, .arg = config->arg,
+                 .config = config, .progress = &progress};
+    Pacer pacer;
+    
+    if (config->checkpoint) {
+        progress.done = calloc(CHECKPOINT_WINDOW / 8, 1);
+        progress.addrs = malloc(CHECKPOINT_WINDOW * sizeof(in_addr_t));
+        e.cp.done = malloc(CHECKPOINT_WINDOW / 8);
+        e.cp.pending = malloc(CHECKPOINT_WINDOW * sizeof(in_addr_t));
+        e.cp.head.scan_id = config->scan_id;
+        e.cp.head.seed = config->seed;
+        for (int i = 0; i < CHECKPOINT_OUTPUTS; i++)
+            e.cp.head.outputs[i] = -1;
+    }
+    
+    if (!w || !m || pacer_init(&pacer, config->rate, config->subnet_cap) < 0 ||
+        (config->checkpoint && (!progress.done || !progress.addrs ||
+                                !e.cp.done || !e.cp.pending))) {
+        printf("Error: Out of memory.\n");
+        free(w);
+        free(m);
+        free(progress.done);
+        free(progress.addrs);
+        checkpoint_free(&e.cp);
+        return -1;
+    }
+    
+    if (config->checkpoint && config->resume)
+        restore_progress(&progress, config->resume);
+    
+    /*
+     * Sockets are opened here, one after the other, so socket i is
+     * member i of the fanout group. None may be closed before all
+     * workers are done, or the members after it would shift down.
+     */
+    int group = getpid() & 0xffff;
+    uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    int ok = 1;
+    
+    for (int i = 0; i < workers; i++) {
+        w[i].id = i;
+        w[i].workers = workers;
+        w[i].port = port;
+        w[i].cpu = stage_cpu(config, STAGE_PROBE, i);
+        
+        if (prober_init(&w[i].prober, WORKER_INFLIGHT, seed + (i + 1) * 0x9E3779B97F4A7C15ULL,
+                        finish_target, &w[i]) == 0 && pacer_active(&pacer))
+            w[i].prober.pacer = &pacer;
+        
+        if (!w[i].prober.flights ||
+            ring_init(&w[i].targets, TARGET_QUEUE, sizeof(Target)) < 0 ||
+            ring_init(&w[i].results, RESULT_QUEUE, sizeof(ScanRecord)) < 0) {
+            printf("Error: Out of memory.\n");
+            ok = 0;
+        }
+        
+        w[i].wake_fd = eventfd(0, EFD_NONBLOCK);
+        if (w[i].wake_fd < 0) perror("eventfd");
+        
+        Prober *p = &w[i].prober;
+        p->send_sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+        if (p->send_sock < 0) perror("socket");
+        p->recv_sock = ok ? open_fanout_socket(group) : -1;
+        
+        if (p->send_sock < 0 || p->recv_sock < 0 || w[i].wake_fd < 0)
+            ok = 0;
+    }
+    
+    for (int i = 0; i < matchers; i++) {
+        m[i].id = i;
+        m[i].matchers = matchers;
+        m[i].cpu = stage_cpu(config, STAGE_MATCH, i);
+        m[i].workers = w;
+        m[i].worker_count = workers;
+        m[i].match = config->match;
+        m[i].arg = config->arg;
+        
+        if (ring_init(&m[i].out, MATCHED_QUEUE, sizeof(ScanRecord)) < 0) {
+            printf("Error: Out of memory.\n");
+            ok = 0;
+        }
+    }
+    
+    if (ok && set_fanout_program(w[0].prober.recv_sock, workers) < 0)
+        ok = 0;
+    
+    /* Start the stages from the back, so every ring has a reader */
+    pthread_t emit_thread;
+    pthread_t match_threads[MAX_MATCHERS];
+    pthread_t threads[MAX_WORKERS];
+    int emitting = 0, matching = 0, started = 0;
+    
+    if (ok) {
+        if (start_thread(&emit_thread, emitter_main, &e, e.cpu) == 0) emitting = 1;
+        else ok = 0;
+    }
+    
+    for (int i = 0; ok && i < matchers; i++) {
+        if (start_thread(&match_threads[i], matcher_main, &m[i], m[i].cpu) < 0) {
+            ok = 0;
+            break;
+        }
+        matching++;
+    }
+    
+    for (int i = 0; ok && i < workers; i++) {
+        if (start_thread(&threads[i], worker_main, &w[i], w[i].cpu) < 0) {
+            printf("Error: Could not start worker %d.\n", i);
+            ok = 0;
+            break;
+        }
+        started++;
+    }
+    
+    /* Hand out the targets, then tell the workers that was all */
+    if (ok && config->checkpoint && config->resume)
+        resume_pending(config->resume, w, workers);
+    
+    Target t;
+    while (ok && !(config->stop && *config->stop) && hand_out(&progress, config, &t) == 0)
+        dispatch(&w[scan_owner(t.addr, workers)], &t);
+    
+    for (int i = 0; i < workers; i++) {
+        if (i < started) {
+            atomic_store(&w[i].closed, 1);
+            wake_worker(&w[i]);
+        } else {
+            atomic_store(&w[i].done, 1);
+        }
+    }
+    for (int i = matching; i < matchers; i++)
+        atomic_store(&m[i].done, 1);
+    
+    /* Each stage finishes once the one before it has */
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    for (int i = 0; i < matching; i++)
+        pthread_join(match_threads[i], NULL);
+    if (emitting)
+        pthread_join(emit_thread, NULL);
+    
+    /* Add up and clean up */
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        stats->rate = atomic_load(&pacer.rate);
+        stats->min_rate = atomic_load(&pacer.min_rate);
+        stats->backoffs = atomic_load(&pacer.backoffs);
+    }
+    
+    for (int i = 0; i < workers; i++) {
+        if (stats) {
+            stats->targets += w[i].stats.targets;
+            stats->responded += w[i].stats.responded;
+            stats->packets_sent += w[i].prober.packets_sent;
+            stats->packets_seen += w[i].prober.packets_seen;
+            stats->retries += w[i].stats.retries;
+            add_queue_stats(&stats->queues[STAGE_PROBE], &w[i].targets);
+            add_queue_stats(&stats->queues[STAGE_MATCH], &w[i].results);
+        }
+        if (w[i].wake_fd >= 0) close(w[i].wake_fd);
+        ring_free(&w[i].targets);
+        ring_free(&w[i].results);
+        prober_free(&w[i].prober);
+    }
+    
+    for (int i = 0; i < matchers; i++) {
+        if (stats)
+            add_queue_stats(&stats->queues[STAGE_EMIT], &m[i].out);
+        ring_free(&m[i].out);
+    }
+    
+    pacer_free(&pacer);
+    free(progress.done);
+    free(progress.addrs);
+    checkpoint_free(&e.cp);
+    free(w);
+    free(m);
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,743 @@
+/*
+ * score_model.c - Compile the database into bitmasks
+ * 
+ * calculate_score() is a sum of parts, and each part only looks at one
+ * observed value (TTL, window, MSS...). Most of those values come from
+ * a small set, so we can work out every fingerprint's score for every
+ * possible value once, at load time.
+ * 
+ * Each possible value gets one bit in a feature vector. A fingerprint
+ * stores its score for that value, split into bit planes:
+ * 
+ *   plane[j] has bit b set  <=>  bit j of weight(b) is set
+ * 
+ * A scan has one bit set per block, so its score is
+ * 
+ *   sum over j of  popcount(scan & plane[j]) << j
+ * 
+ * which is a few dozen AND + popcount operations per fingerprint.
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../include/defs.h"
+#include "../include/matcher.h"
+#include "../include/score_model.h"
+#include "../include/utils.h"
+
+
+#define MAX_WEIGHT ((1 << SCORE_PLANES) - 1)
+
+
+/* A value and how often it shows up in the database */
+typedef struct {
+    int value;
+    int count;
+} ValueCount;
+
+static int cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+static int cmp_by_count(const void *a, const void *b)
+{
+    const ValueCount *x = a, *y = b;
+    if (x->count != y->count)
+        return y->count - x->count;
+    return (x->value > y->value) - (x->value < y->value);
+}
+
+
+/*
+ * Pick the 'max' most common values and return them sorted.
+ * 'values' gets reordered. Returns how many were picked.
+ */
+static int build_dictionary(int *values, int n, int *dict, int max)
+{
+    if (n == 0) return 0;
+    
+    qsort(values, n, sizeof(int), cmp_int);
+    
+    ValueCount *runs = malloc(sizeof(ValueCount) * n);
+    if (!runs) return 0;
+    
+    int nruns = 0;
+    for (int i = 0; i < n; i++) {
+        if (nruns && runs[nruns - 1].value == values[i]) {
+            runs[nruns - 1].count++;
+        } else {
+            runs[nruns].value = values[i];
+            runs[nruns].count = 1;
+            nruns++;
+        }
+    }
+    
+    qsort(runs, nruns, sizeof(ValueCount), cmp_by_count);
+    
+    int count = nruns < max ? nruns : max;
+    for (int i = 0; i < count; i++)
+        dict[i] = runs[i].value;
+    qsort(dict, count, sizeof(int), cmp_int);
+    
+    free(runs);
+    return count;
+}
+
+
+/* Position of a value in a sorted dictionary, or -1 */
+static int dict_find(const int *dict, int count, int value)
+{
+    const int *p = bsearch(&value, dict, count, sizeof(int), cmp_int);
+    return p ? (int)(p - dict) : -1;
+}
+
+static int pattern_find(const ScoreModel *m, const char *pattern)
+{
+    for (int i = 0; i < m->pattern_count; i++) {
+        if (strcmp(m->patterns[i], pattern) == 0)
+            return i;
+    }
+    return -1;
+}
+
+
+/*
+ * Collect the dictionaries from the whole database.
+ * Patterns are few, so they're simply counted in a small table.
+ */
+static int build_dictionaries(ScoreModel *m)
+{
+    int *values = malloc(sizeof(int) * m->count * 7);
+    if (!values) return -1;
+    
+    /* Windows: the T1 value and the WIN line */
+    int n = 0;
+    for (int i = 0; i < m->count; i++) {
+        Fingerprint *fp = m->fps[i];
+        if (fp->window > 0) values[n++] = fp->window;
+        for (int j = 0; j < 6; j++) {
+            if (fp->window_values[j] > 0)
+                values[n++] = fp->window_values[j];
+        }
+    }
+    m->win_count = build_dictionary(values, n, m->win_values, FEAT_WINDOW_N);
+    
+    /* MSS values */
+    n = 0;
+    for (int i = 0; i < m->count; i++) {
+        if (m->fps[i]->options && m->fps[i]->opts.mss > 0)
+            values[n++] = m->fps[i]->opts.mss;
+    }
+    m->mss_count = build_dictionary(values, n, m->mss_values, FEAT_MSS_N);
+    
+    /* U1 reply lengths */
+    n = 0;
+    for (int i = 0; i < m->count; i++) {
+        for (int j = 0; j < 2; j++) {
+            if (m->fps[i]->unreach.ipl[j] > 0)
+                values[n++] = m->fps[i]->unreach.ipl[j];
+        }
+    }
+    m->ipl_count = build_dictionary(values, n, m->ipl_values, FEAT_IPL_N);
+    
+    /* Option patterns - keep the most common ones */
+    char (*seen)[32] = malloc(sizeof(*seen) * m->count);
+    int *counts = calloc(m->count, sizeof(int));
+    int nseen = 0;
+    
+    if (!seen || !counts) {
+        free(seen);
+        free(counts);
+        free(values);
+        return -1;
+    }
+    
+    for (int i = 0; i < m->count; i++) {
+        Fingerprint *fp = m->fps[i];
+        if (!fp->options || !fp->opts.pattern[0]) continue;
+        
+        int j;
+        for (j = 0; j < nseen; j++) {
+            if (strcmp(seen[j], fp->opts.pattern) == 0) break;
+        }
+        if (j == nseen) {
+            strcpy(seen[nseen], fp->opts.pattern);
+            nseen++;
+        }
+        counts[j]++;
+    }
+    
+    m->pattern_count = 0;
+    while (m->pattern_count < FEAT_PATTERN_N) {
+        int best = -1;
+        for (int j = 0; j < nseen; j++) {
+            if (counts[j] > 0 && (best < 0 || counts[j] > counts[best]))
+                best = j;
+        }
+        if (best < 0) break;
+        
+        strcpy(m->patterns[m->pattern_count++], seen[best]);
+        counts[best] = 0;
+    }
+    
+    free(seen);
+    free(counts);
+    free(values);
+    return 0;
+}
+
+
+/*
+ * Split TTL values into ranges.
+ * score_ttl() only changes at a handful of points per fingerprint
+ * (its range ends, +-2, +-5, +-30 around its TTL, and the family
+ * limits), so between any two of those points every TTL scores the
+ * same and can share a bit.
+ */
+static void add_break(unsigned char *is_break, int ttl)
+{
+    if (ttl > 0 && ttl < 256)
+        is_break[ttl] = 1;
+}
+
+static void build_ttl_ranges(ScoreModel *m)
+{
+    unsigned char is_break[256] = {0};
+    
+    /* TTL 0 means "not seen", and the family limits */
+    add_break(is_break, 1);
+    add_break(is_break, 50);
+    add_break(is_break, 71);
+    add_break(is_break, 110);
+    add_break(is_break, 141);
+    
+    for (int i = 0; i < m->count; i++) {
+        Fingerprint *fp = m->fps[i];
+        
+        if (fp->ttl_min > 0 && fp->ttl_max > 0) {
+            add_break(is_break, fp->ttl_min);
+            add_break(is_break, fp->ttl_max + 1);
+        }
+        
+        int target = fp->ttl_guess > 0 ? fp->ttl_guess : fp->ttl_min;
+        if (target > 0) {
+            add_break(is_break, target - 30);
+            add_break(is_break, target - 5);
+            add_break(is_break, target - 2);
+            add_break(is_break, target + 3);
+            add_break(is_break, target + 6);
+            add_break(is_break, target + 31);
+        }
+    }
+    
+    /* Number the ranges; anything past the last bit is scored the slow way */
+    int range = 0;
+    m->ttl_first[0] = 0;
+    
+    for (int ttl = 0; ttl < 256; ttl++) {
+        if (ttl > 0 && is_break[ttl] && range >= 0) {
+            range++;
+            if (range == FEAT_TTL_N) range = -1;
+            else m->ttl_first[range] = ttl;
+        }
+        m->ttl_range[ttl] = range;
+    }
+    
+    m->ttl_count = (range < 0) ? FEAT_TTL_N : range + 1;
+}
+
+
+/*
+ * Flag combinations that get their own bit for T4-T7.
+ * Between them they cover nearly all closed port replies.
+ */
+static const int reply_flags[NUM_REPLY_FLAGS] = {
+    TH_RST,
+    TH_RST | TH_ACK,
+    TH_ACK,
+    TH_SYN | TH_ACK,
+    TH_SYN,
+    TH_FIN | TH_ACK,
+    TH_RST | TH_ACK | TH_PUSH,
+};
+
+/* Feature bit for a T4-T7 reply kind */
+static int probe_bit(int probe, int kind)
+{
+    return FEAT_PROBES + (probe - PROBE_T4) * PROBE_KINDS + kind;
+}
+
+/* Score of one reply kind: 0 = no reply, then flags x DF */
+static int probe_kind_score(const Fingerprint *fp, int probe, int kind)
+{
+    if (kind == 0)
+        return score_probe(fp, probe, 0, 0, 0);
+    
+    kind--;
+    return score_probe(fp, probe, 1, reply_flags[kind / 2],
+                       (kind % 2) ? 'N' : 'Y');
+}
+
+/* Reply kind of an observed reply, or -1 if it's not one of ours */
+static int reply_kind(const ProbeReply *r)
+{
+    if (!r->responded)
+        return 0;
+    
+    for (int i = 0; i < NUM_REPLY_FLAGS; i++) {
+        if (r->flags == reply_flags[i]) {
+            if (r->df_flag == 'Y') return 1 + i * 2;
+            if (r->df_flag == 'N') return 2 + i * 2;
+        }
+    }
+    return -1;
+}
+
+
+/* Score of one IE kind: 0 = no reply, then DFI x CD */
+static int echo_kind_score(const Fingerprint *fp, int kind)
+{
+    if (kind == 0)
+        return score_echo(fp, 0, 0, 0);
+    
+    kind--;
+    return score_echo(fp, 1, 1 << (kind / 3), 1 << (kind % 3));
+}
+
+/* Score of one U1 kind: 0 = no reply, 1 = DF, 2 = no DF */
+static int unreach_kind_score(const Fingerprint *fp, int kind)
+{
+    if (kind == 0)
+        return score_unreach(fp, 0, 0);
+    return score_unreach(fp, 1, kind == 1 ? 'Y' : 'N');
+}
+
+
+/* Every score part is a multiple of SCORE_UNIT, so nothing is lost here */
+static int to_units(int score)
+{
+    return score / SCORE_UNIT;
+}
+
+
+/*
+ * Store one feature's weight in the bit planes.
+ * Returns 0 if it didn't fit (the model is then unusable).
+ */
+static int set_weight(FpCode *code, int bit, int units)
+{
+    if (units < 0 || units > MAX_WEIGHT)
+        return 0;
+    
+    for (int j = 0; j < SCORE_PLANES; j++) {
+        if (units & (1 << j))
+            code->plane[bit / 64][j] |= 1ULL << (bit % 64);
+    }
+    return 1;
+}
+
+
+/*
+ * Work out how far the blocks with penalties need to be shifted
+ * so every stored weight is positive.
+ */
+static void find_offsets(ScoreModel *m)
+{
+    int ttl_min = 0, behav_min = 0, probe_min = 0, echo_min = 0, unreach_min = 0;
+    
+    for (int i = 0; i < m->count; i++) {
+        Fingerprint *fp = m->fps[i];
+        
+        for (int r = 0; r < m->ttl_count; r++) {
+            int w = to_units(score_ttl(fp, m->os[i], m->ttl_first[r]));
+            if (w < ttl_min) ttl_min = w;
+        }
+        for (int b = 0; b < FEAT_BEHAV_N; b++) {
+            int w = to_units(score_behavior(fp, b & 1, b >> 1));
+            if (w < behav_min) behav_min = w;
+        }
+        for (int p = PROBE_T4; p <= PROBE_T7; p++) {
+            for (int k = 0; k < 1 + NUM_REPLY_FLAGS * 2; k++) {
+                int w = to_units(probe_kind_score(fp, p, k));
+                if (w < probe_min) probe_min = w;
+            }
+        }
+        for (int k = 0; k < FEAT_ECHO_N; k++) {
+            int w = to_units(echo_kind_score(fp, k));
+            if (w < echo_min) echo_min = w;
+        }
+        for (int k = 0; k < FEAT_UNREACH_N; k++) {
+            int w = to_units(unreach_kind_score(fp, k));
+            if (w < unreach_min) unreach_min = w;
+        }
+    }
+    
+    m->ttl_offset = -ttl_min;
+    m->behav_offset = -behav_min;
+    m->probe_offset = -probe_min;
+    m->echo_offset = -echo_min;
+    m->unreach_offset = -unreach_min;
+}
+
+
+/*
+ * Compile one fingerprint: its weight for every feature bit.
+ */
+static int compile_entry(const ScoreModel *m, int index, FpCode *code)
+{
+    Fingerprint *fp = m->fps[index];
+    OSType os = m->os[index];
+    int ok = 1;
+    
+    memset(code, 0, sizeof(*code));
+    
+    for (int r = 0; r < m->ttl_count; r++) {
+        int w = to_units(score_ttl(fp, os, m->ttl_first[r])) + m->ttl_offset;
+        ok &= set_weight(code, FEAT_TTL + r, w);
+    }
+    
+    for (int i = 0; i < m->win_count; i++) {
+        int w = to_units(score_window(fp, os, m->win_values[i]));
+        ok &= set_weight(code, FEAT_WINDOW + i, w);
+    }
+    
+    for (int b = 0; b < FEAT_BEHAV_N; b++) {
+        int w = to_units(score_behavior(fp, b & 1, b >> 1)) + m->behav_offset;
+        ok &= set_weight(code, FEAT_BEHAV + b, w);
+    }
+    
+    for (int p = PROBE_T4; p <= PROBE_T7; p++) {
+        for (int k = 0; k < 1 + NUM_REPLY_FLAGS * 2; k++) {
+            int w = to_units(probe_kind_score(fp, p, k)) + m->probe_offset;
+            ok &= set_weight(code, probe_bit(p, k), w);
+        }
+    }
+    
+    for (int k = 0; k < FEAT_ECHO_N; k++) {
+        int w = to_units(echo_kind_score(fp, k)) + m->echo_offset;
+        ok &= set_weight(code, FEAT_ECHO + k, w);
+    }
+    
+    for (int k = 0; k < FEAT_UNREACH_N; k++) {
+        int w = to_units(unreach_kind_score(fp, k)) + m->unreach_offset;
+        ok &= set_weight(code, FEAT_UNREACH + k, w);
+    }
+    
+    for (int i = 0; i < m->ipl_count; i++)
+        ok &= set_weight(code, FEAT_IPL + i, to_units(score_ipl(fp, m->ipl_values[i])));
+    
+    for (int q = 0; q < FEAT_QUOTE_N; q++)
+        ok &= set_weight(code, FEAT_QUOTE + q, to_units(score_quote(fp, q)));
+    
+    ok &= set_weight(code, FEAT_DF + 0, to_units(score_df(fp, 'Y')));
+    ok &= set_weight(code, FEAT_DF + 1, to_units(score_df(fp, 'N')));
+    
+    /* Options only score against fingerprints that have some */
+    if (!fp->options)
+        return ok;
+    
+    for (int i = 0; i < m->pattern_count; i++) {
+        int w = to_units(score_pattern(fp, m->patterns[i]));
+        ok &= set_weight(code, FEAT_PATTERN + i, w);
+    }
+    
+    for (int i = 0; i < m->mss_count; i++) {
+        int w = to_units(score_mss(fp, m->mss_values[i]));
+        ok &= set_weight(code, FEAT_MSS + i, w);
+    }
+    
+    for (int ws = 0; ws < FEAT_WSCALE_N; ws++) {
+        int w = to_units(score_wscale(fp, ws));
+        ok &= set_weight(code, FEAT_WSCALE + ws, w);
+    }
+    
+    for (int b = 0; b < FEAT_SACK_TS_N; b++) {
+        int w = to_units(score_sack_ts(fp, b & 1, b >> 1));
+        ok &= set_weight(code, FEAT_SACK_TS + b, w);
+    }
+    
+    return ok;
+}
+
+
+/*
+ * Raise the per-family maximum weights to cover entry i.
+ */
+static void add_partition_max(ScoreModel *m, int i)
+{
+    const FpCode *fc = &m->codes[i];
+    unsigned char *max = m->part_max[m->os[i]];
+    
+    for (int bit = 0; bit < FEAT_BITS; bit++) {
+        int w = 0;
+        for (int j = 0; j < SCORE_PLANES; j++)
+            w |= ((fc->plane[bit / 64][j] >> (bit % 64)) & 1) << j;
+        if (w > max[bit]) max[bit] = w;
+    }
+}
+
+
+/*
+ * Compile the whole database.
+ */
+ScoreModel *build_score_model(FingerprintDB *db)
+{
+    ScoreModel *m = calloc(1, sizeof(ScoreModel));
+    if (!m) return NULL;
+    
+    m->count = db->count;
+    memcpy(m->part_start, db->part_start, sizeof(m->part_start));
+    memcpy(m->part_count, db->part_count, sizeof(m->part_count));
+    
+    m->fps = malloc(sizeof(Fingerprint *) * (m->count + 1));
+    m->os = malloc(sizeof(OSType) * (m->count + 1));
+    m->codes = malloc(sizeof(FpCode) * (m->count + 1));
+    
+    if (!m->fps || !m->os || !m->codes) {
+        free_score_model(m);
+        return NULL;
+    }
+    
+    int i;
+    for (i = 0; i < m->count; i++) {
+        m->fps[i] = &db->entries[i];
+        m->os[i] = db->entries[i].os;
+    }
+    
+    if (build_dictionaries(m) < 0) {
+        free_score_model(m);
+        return NULL;
+    }
+    
+    build_ttl_ranges(m);
+    find_offsets(m);
+    
+    for (i = 0; i < m->count; i++) {
+        /* A score too big for the bit planes; the caller says so */
+        if (!compile_entry(m, i, &m->codes[i])) {
+            free_score_model(m);
+            errno = ERANGE;
+            return NULL;
+        }
+        add_partition_max(m, i);
+    }
+    
+    return m;
+}
+
+
+void free_score_model(ScoreModel *model)
+{
+    if (!model) return;
+    
+    free(model->fps);
+    free(model->os);
+    free(model->codes);
+    free(model);
+}
+
+
+static void set_bit(ScanCode *code, int bit)
+{
+    code->bits[bit / 64] |= 1ULL << (bit % 64);
+}
+
+
+/*
+ * Encode a scan result.
+ * Values that aren't in a dictionary are flagged as rare instead.
+ */
+void encode_scan(const ScoreModel *model, const ScanResult *scan, ScanCode *code)
+{
+    memset(code, 0, sizeof(*code));
+    code->scan = scan;
+    
+    /* TTL */
+    int range = (scan->ttl >= 0 && scan->ttl < 256) ? model->ttl_range[scan->ttl] : -1;
+    if (range >= 0) {
+        set_bit(code, FEAT_TTL + range);
+        code->offset += model->ttl_offset;
+    } else {
+        code->rare |= RARE_TTL;
+    }
+    
+    /* Window */
+    if (scan->window > 0) {
+        int i = dict_find(model->win_values, model->win_count, scan->window);
+        if (i >= 0) set_bit(code, FEAT_WINDOW + i);
+        else        code->rare |= RARE_WINDOW;
+    }
+    
+    /* DF flag */
+    if (scan->df_flag == 'Y')     set_bit(code, FEAT_DF + 0);
+    else if (scan->df_flag == 'N') set_bit(code, FEAT_DF + 1);
+    else if (scan->df_flag)        code->rare |= RARE_DF;
+    
+    /* Behavioral probes */
+    set_bit(code, FEAT_BEHAV + (scan->t2_responded ? 1 : 0) + (scan->t3_responded ? 2 : 0));
+    code->offset += model->behav_offset;
+    
+    /* ACK and closed port probes */
+    for (int p = PROBE_T4; p <= PROBE_T7; p++) {
+        int kind = reply_kind(&scan->reply[p]);
+        if (kind >= 0) {
+            set_bit(code, probe_bit(p, kind));
+            code->offset += model->probe_offset;
+        } else {
+            code->rare |= RARE_T4 << (p - PROBE_T4);
+        }
+    }
+    
+    /* IE and U1 */
+    if (scan->icmp_sent) {
+        const EchoReply *e = &scan->echo;
+        const UnreachReply *u = &scan->unreach;
+        
+        int kind = e->responded ? 1 + __builtin_ctz(e->dfi) * 3 + __builtin_ctz(e->cd) : 0;
+        set_bit(code, FEAT_ECHO + kind);
+        code->offset += model->echo_offset;
+        
+        set_bit(code, FEAT_UNREACH + (u->responded ? (u->df_flag == 'Y' ? 1 : 2) : 0));
+        code->offset += model->unreach_offset;
+        
+        if (u->responded) {
+            int i = dict_find(model->ipl_values, model->ipl_count, u->ipl);
+            if (i >= 0) set_bit(code, FEAT_IPL + i);
+            else        code->rare |= RARE_IPL;
+            
+            set_bit(code, FEAT_QUOTE + u->quote);
+        }
+    }
+    
+    /* TCP options */
+    if (scan_has_options(scan)) {
+        const TCPOpts *o = &scan->opts;
+        
+        if (o->pattern[0]) {
+            int i = pattern_find(model, o->pattern);
+            if (i >= 0) set_bit(code, FEAT_PATTERN + i);
+            else        code->rare |= RARE_PATTERN;
+        }
+        
+        if (o->mss > 0) {
+            int i = dict_find(model->mss_values, model->mss_count, o->mss);
+            if (i >= 0) set_bit(code, FEAT_MSS + i);
+            else        code->rare |= RARE_MSS;
+        }
+        
+        if (o->window_scale >= 0 && o->window_scale < FEAT_WSCALE_N)
+            set_bit(code, FEAT_WSCALE + o->window_scale);
+        else if (o->window_scale >= 0)
+            code->rare |= RARE_WSCALE;
+        
+        set_bit(code, FEAT_SACK_TS + (o->has_sack ? 1 : 0) + (o->has_timestamp ? 2 : 0));
+    }
+    
+    /* Remember which words have bits so scoring can skip the rest */
+    for (int w = 0; w < FEAT_WORDS; w++) {
+        if (code->bits[w])
+            code->words[code->nwords++] = w;
+    }
+}
+
+
+/*
+ * Score the parts that couldn't be encoded.
+ */
+static int rare_score(const ScoreModel *model, int index, const ScanCode *code)
+{
+    const Fingerprint *fp = model->fps[index];
+    const ScanResult *scan = code->scan;
+    OSType os = model->os[index];
+    int score = 0;
+    
+    if (code->rare & RARE_TTL)
+        score += score_ttl(fp, os, scan->ttl);
+    if (code->rare & RARE_WINDOW)
+        score += score_window(fp, os, scan->window);
+    if (code->rare & RARE_DF)
+        score += score_df(fp, scan->df_flag);
+    
+    for (int p = PROBE_T4; p <= PROBE_T7; p++) {
+        if (code->rare & (RARE_T4 << (p - PROBE_T4))) {
+            const ProbeReply *r = &scan->reply[p];
+            score += score_probe(fp, p, r->responded, r->flags, r->df_flag);
+        }
+    }
+    
+    if (code->rare & RARE_IPL)
+        score += score_ipl(fp, scan->unreach.ipl);
+    
+    if (fp->options) {
+        if (code->rare & RARE_PATTERN)
+            score += score_pattern(fp, scan->opts.pattern);
+        if (code->rare & RARE_MSS)
+            score += score_mss(fp, scan->opts.mss);
+        if (code->rare & RARE_WSCALE)
+            score += score_wscale(fp, scan->opts.window_scale);
+    }
+    
+    return score;
+}
+
+
+/*
+ * Score one database entry.
+ * On x86 we also build a copy using the popcnt instruction, picked
+ * at startup if the CPU has it.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+__attribute__((target_clones("popcnt", "default")))
+#endif
+int model_score(const ScoreModel *model, int index, const ScanCode *code)
+{
+    const FpCode *fc = &model->codes[index];
+    int units = 0;
+    
+    for (int k = 0; k < code->nwords; k++) {
+        int w = code->words[k];
+        uint64_t bits = code->bits[w];
+        
+        for (int j = 0; j < SCORE_PLANES; j++)
+            units += __builtin_popcountll(fc->plane[w][j] & bits) << j;
+    }
+    
+    int score = (units - code->offset) * SCORE_UNIT;
+    
+    if (code->rare)
+        score += rare_score(model, index, code);
+    
+    return score;
+}
+
+
+/*
+ * Upper bound for a whole family: the best weight any of its
+ * entries has for each bit of the scan, added up.
+ */
+int partition_bound(const ScoreModel *model, OSType os, const ScanCode *code)
+{
+    if (code->rare)
+        return INT_MAX;
+    
+    const unsigned char *max = model->part_max[os];
+    int units = 0;
+    
+    for (int k = 0; k < code->nwords; k++) {
+        int w = code->words[k];
+        uint64_t bits = code->bits[w];
+        
+        while (bits) {
+            int b = __builtin_ctzll(bits);
+            units += max[w * 64 + b];
+            bits &= bits - 1;
+        }
+    }
+    
+    return (units - code->offset) * SCORE_UNIT;
+}
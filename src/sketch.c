@@ -0,0 +1,212 @@
+/*
+ * sketch.c - HyperLogLog and count-min with heavy hitters
+ * 
+ * Every row of the count-min sketch needs its own hash of the key;
+ * they are made from two halves of one 64-bit hash, h1 + i * h2,
+ * which is as good as independent hashes for this (Kirsch and
+ * Mitzenmacher).
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include "../include/sketch.h"
+
+
+/* The murmur3 finalizer: every input bit changes about half the output bits */
+uint64_t sketch_hash64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+
+/* FNV-1a over the bytes, then finalized, since FNV's low bits are weak */
+uint64_t sketch_hash(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return sketch_hash64(h);
+}
+
+
+/*
+ * HyperLogLog
+ */
+
+void hll_add(Hll *h, uint64_t hash)
+{
+    /* The top bits pick the register, the rest give the rank: leading zeros + 1 */
+    uint32_t index = hash >> (64 - HLL_BITS);
+    uint64_t rest = hash << HLL_BITS;
+    uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - HLL_BITS + 1;
+    
+    if (rank > h->regs[index])
+        h->regs[index] = rank;
+}
+
+
+double hll_count(const Hll *h)
+{
+    double m = HLL_REGS;
+    double sum = 0;
+    int zeros = 0;
+    
+    for (int i = 0; i < HLL_REGS; i++) {
+        sum += ldexp(1.0, -h->regs[i]);
+        if (h->regs[i] == 0) zeros++;
+    }
+    
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    
+    /* Few items: count the empty registers instead (linear counting) */
+    if (estimate <= 2.5 * m && zeros)
+        estimate = m * log(m / zeros);
+    return estimate;
+}
+
+
+void hll_merge(Hll *dst, const Hll *src)
+{
+    for (int i = 0; i < HLL_REGS; i++) {
+        if (src->regs[i] > dst->regs[i])
+            dst->regs[i] = src->regs[i];
+    }
+}
+
+
+/*
+ * Count-min and heavy hitters
+ */
+
+static uint64_t key_hash(const char *key)
+{
+    return sketch_hash(key, strlen(key));
+}
+
+
+static uint64_t estimate_hash(const FreqSketch *f, uint64_t hash)
+{
+    uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32);
+    uint64_t best = UINT64_MAX;
+    
+    for (uint32_t i = 0; i < CMS_DEPTH; i++) {
+        uint64_t c = f->cells[i][(h1 + i * h2) % CMS_WIDTH];
+        if (c < best) best = c;
+    }
+    return best;
+}
+
+
+uint64_t freq_estimate(const FreqSketch *f, const char *key)
+{
+    return estimate_hash(f, key_hash(key));
+}
+
+
+/*
+ * Put an item's new estimate in the table, if it's among the highest.
+ * Items are told apart by the hash of the whole name, since the
+ * stored name is cut to SKETCH_KEY - 1 bytes.
+ */
+static void offer_top(FreqSketch *f, const char *key, uint64_t hash, uint64_t count)
+{
+    int at = -1;
+    for (uint32_t i = 0; i < f->top_count; i++) {
+        if (f->top[i].hash == hash) {
+            at = i;
+            break;
+        }
+    }
+    
+    if (at < 0) {
+        if (f->top_count < SKETCH_TOP) {
+            at = f->top_count++;
+        } else if (count > f->top[SKETCH_TOP - 1].count) {
+            at = SKETCH_TOP - 1;
+        } else {
+            return;
+        }
+        f->top[at].hash = hash;
+        strncpy(f->top[at].key, key, SKETCH_KEY - 1);
+        f->top[at].key[SKETCH_KEY - 1] = '\0';
+    }
+    f->top[at].count = count;
+    
+    /* Estimates only go up, so the entry can only move towards the front */
+    while (at > 0 && f->top[at - 1].count < f->top[at].count) {
+        HeavyHitter tmp = f->top[at - 1];
+        f->top[at - 1] = f->top[at];
+        f->top[at] = tmp;
+        at--;
+    }
+}
+
+
+void freq_add(FreqSketch *f, const char *key, uint64_t n)
+{
+    uint64_t hash = key_hash(key);
+    uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32);
+    
+    for (uint32_t i = 0; i < CMS_DEPTH; i++)
+        f->cells[i][(h1 + i * h2) % CMS_WIDTH] += n;
+    f->total += n;
+    
+    offer_top(f, key, hash, estimate_hash(f, hash));
+}
+
+
+void freq_merge(FreqSketch *dst, const FreqSketch *src)
+{
+    for (int i = 0; i < CMS_DEPTH; i++) {
+        for (int j = 0; j < CMS_WIDTH; j++)
+            dst->cells[i][j] += src->cells[i][j];
+    }
+    dst->total += src->total;
+    
+    /*
+     * The heavy hitters of the sum are among those of either side;
+     * all of them get their estimates from the added counters.
+     */
+    HeavyHitter candidates[2 * SKETCH_TOP];
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < dst->top_count; i++)
+        candidates[count++] = dst->top[i];
+    for (uint32_t i = 0; i < src->top_count; i++)
+        candidates[count++] = src->top[i];
+    
+    dst->top_count = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t estimate = estimate_hash(dst, candidates[i].hash);
+        
+        /* offer_top() expects rising counts; rebuild by insertion instead */
+        int dup = 0;
+        for (uint32_t j = 0; j < dst->top_count && !dup; j++)
+            dup = dst->top[j].hash == candidates[i].hash;
+        if (dup)
+            continue;
+        
+        uint32_t at = dst->top_count;
+        if (at == SKETCH_TOP) {
+            if (estimate <= dst->top[SKETCH_TOP - 1].count)
+                continue;
+            at = SKETCH_TOP - 1;
+        } else {
+            dst->top_count++;
+        }
+        
+        while (at > 0 && dst->top[at - 1].count < estimate) {
+            dst->top[at] = dst->top[at - 1];
+            at--;
+        }
+        dst->top[at] = candidates[i];
+        dst->top[at].count = estimate;
+    }
+}
@@ -0,0 +1,399 @@
+/*
+ * targets.c - Stream batch targets without building a list
+ * 
+ * The random order comes from the multiplicative group modulo a
+ * prime p just above the number of addresses n. For a generator g,
+ * x, x*g, x*g^2, ... visits every value 1..p-1 exactly once before
+ * coming back to x, so taking x-1 and skipping the values >= n
+ * gives a permutation of 0..n-1. All it needs to remember is x.
+ * 
+ * Shard i of n starts at x*g^i and steps by g^n.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#include "../include/targets.h"
+
+
+/* More than this many addresses at once is surely a mistake */
+#define MAX_ADDRESSES (1ULL << 40)
+
+
+/* One address range, first address in host order */
+typedef struct {
+    uint32_t base;
+    uint64_t size;
+    uint64_t first;     /* Index of 'base' in the whole permutation */
+} Range;
+
+/* A walk through a permutation of 0..n-1 */
+typedef struct {
+    uint64_t n;
+    uint64_t prime;
+    uint64_t step;
+    uint64_t x;
+    uint64_t left;      /* Steps left for this shard */
+} Perm;
+
+struct TargetGen {
+    /* Command line ranges, walked as one permutation */
+    Range *ranges;
+    int range_count;
+    uint64_t total;
+    Perm perm;
+    
+    /* Target file, read a line at a time */
+    FILE *file;
+    Range line;         /* Range of the current line */
+    Perm line_perm;
+    uint64_t file_index;
+    
+    int shard;
+    int shards;
+    uint64_t rng;
+};
+
+
+/* splitmix64 - turns the seed into as many random numbers as we need */
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+static uint64_t mul_mod(uint64_t a, uint64_t b, uint64_t m)
+{
+    return (uint64_t)((unsigned __int128)a * b % m);
+}
+
+static uint64_t pow_mod(uint64_t base, uint64_t exp, uint64_t m)
+{
+    uint64_t result = 1 % m;
+    base %= m;
+    
+    while (exp) {
+        if (exp & 1) result = mul_mod(result, base, m);
+        base = mul_mod(base, base, m);
+        exp >>= 1;
+    }
+    return result;
+}
+
+
+static int is_prime(uint64_t n)
+{
+    if (n < 2) return 0;
+    if (n % 2 == 0) return n == 2;
+    
+    for (uint64_t d = 3; d * d <= n; d += 2) {
+        if (n % d == 0) return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * A random generator of the group modulo p: g is one if
+ * g^((p-1)/q) != 1 for every prime q dividing p-1.
+ */
+static uint64_t find_generator(uint64_t p, uint64_t *rng)
+{
+    if (p <= 2)
+        return 1;
+    
+    uint64_t factors[64];
+    int count = 0;
+    uint64_t rest = p - 1;
+    
+    for (uint64_t d = 2; d * d <= rest; d++) {
+        if (rest % d == 0) {
+            factors[count++] = d;
+            while (rest % d == 0) rest /= d;
+        }
+    }
+    if (rest > 1)
+        factors[count++] = rest;
+    
+    while (1) {
+        uint64_t g = 2 + next_random(rng) % (p - 2);
+        int ok = 1;
+        
+        for (int i = 0; i < count && ok; i++) {
+            if (pow_mod(g, (p - 1) / factors[i], p) == 1)
+                ok = 0;
+        }
+        if (ok)
+            return g;
+    }
+}
+
+
+/* Start a random walk over 0..n-1, only the steps of one shard */
+static void perm_init(Perm *perm, uint64_t n, int shard, int shards, uint64_t *rng)
+{
+    memset(perm, 0, sizeof(*perm));
+    perm->n = n;
+    if (n == 0)
+        return;
+    
+    uint64_t p = n + 1;
+    while (!is_prime(p)) p++;
+    
+    uint64_t g = find_generator(p, rng);
+    uint64_t start = 1 + next_random(rng) % (p - 1);
+    
+    perm->prime = p;
+    perm->step = pow_mod(g, shards, p);
+    perm->x = mul_mod(start, pow_mod(g, shard, p), p);
+    
+    /* The cycle has p-1 steps; this shard takes those = shard mod shards */
+    perm->left = (p - 1 > (uint64_t)shard) ? (p - 2 - shard) / shards + 1 : 0;
+}
+
+
+/* Next index of the walk. Returns 0, or -1 when it is over. */
+static int perm_next(Perm *perm, uint64_t *index)
+{
+    while (perm->left > 0) {
+        uint64_t value = perm->x - 1;
+        perm->x = mul_mod(perm->x, perm->step, perm->prime);
+        perm->left--;
+        
+        if (value < perm->n) {
+            *index = value;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * Parse "a.b.c.d" or "a.b.c.d/len".
+ * Returns 0, or -1 if it isn't either.
+ */
+static int parse_range(const char *spec, Range *range)
+{
+    char text[64];
+    size_t len = strlen(spec);
+    if (len == 0 || len >= sizeof(text))
+        return -1;
+    memcpy(text, spec, len + 1);
+    
+    int prefix = 32;
+    char *slash = strchr(text, '/');
+    if (slash) {
+        char *end;
+        *slash = '\0';
+        prefix = (int)strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end || prefix < 0 || prefix > 32)
+            return -1;
+    }
+    
+    struct in_addr addr;
+    if (inet_pton(AF_INET, text, &addr) != 1)
+        return -1;
+    
+    uint32_t mask = prefix ? 0xffffffffu << (32 - prefix) : 0;
+    range->base = ntohl(addr.s_addr) & mask;
+    range->size = 1ULL << (32 - prefix);
+    range->first = 0;
+    return 0;
+}
+
+
+TargetGen *targets_open(char **specs, int count, const char *file,
+                        int shard, int shards, uint64_t seed)
+{
+    if (shards < 1 || shard < 0 || shard >= shards) {
+        printf("Error: Bad shard %d/%d.\n", shard, shards);
+        return NULL;
+    }
+    
+    TargetGen *gen = calloc(1, sizeof(TargetGen));
+    if (!gen) return NULL;
+    
+    gen->shard = shard;
+    gen->shards = shards;
+    gen->rng = seed;
+    
+    gen->ranges = malloc(sizeof(Range) * (count + 1));
+    if (!gen->ranges) {
+        free(gen);
+        return NULL;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        Range *r = &gen->ranges[gen->range_count];
+        if (parse_range(specs[i], r) < 0) {
+            printf("Error: Bad target: %s\n", specs[i]);
+            targets_close(gen);
+            return NULL;
+        }
+        r->first = gen->total;
+        gen->total += r->size;
+        gen->range_count++;
+    }
+    
+    if (gen->total > MAX_ADDRESSES) {
+        printf("Error: Too many targets (%llu).\n", (unsigned long long)gen->total);
+        targets_close(gen);
+        return NULL;
+    }
+    
+    if (file) {
+        gen->file = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+        if (!gen->file) {
+            perror(file);
+            targets_close(gen);
+            return NULL;
+        }
+    }
+    
+    perm_init(&gen->perm, gen->total, shard, shards, &gen->rng);
+    return gen;
+}
+
+
+/* Address number 'index' of the command line ranges */
+static in_addr_t range_address(const TargetGen *gen, uint64_t index)
+{
+    int lo = 0, hi = gen->range_count - 1;
+    
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (gen->ranges[mid].first <= index) lo = mid;
+        else hi = mid - 1;
+    }
+    
+    const Range *r = &gen->ranges[lo];
+    return htonl(r->base + (uint32_t)(index - r->first));
+}
+
+
+/* Next address from the file, before sharding */
+static int next_file_address(TargetGen *gen, in_addr_t *addr)
+{
+    uint64_t index;
+    char line[256];
+    
+    while (1) {
+        /* Still inside a range from the last line? */
+        if (perm_next(&gen->line_perm, &index) == 0) {
+            *addr = htonl(gen->line.base + (uint32_t)index);
+            return 0;
+        }
+        
+        if (!fgets(line, sizeof(line), gen->file))
+            return -1;
+        
+        /* Trim it, and skip blank lines and comments */
+        char *p = line;
+        while (isspace((unsigned char)*p)) p++;
+        size_t len = strcspn(p, " \t\r\n#");
+        p[len] = '\0';
+        if (len == 0)
+            continue;
+        
+        if (parse_range(p, &gen->line) < 0) {
+            printf("Error: Bad target: %s (skipped)\n", p);
+            continue;
+        }
+        perm_init(&gen->line_perm, gen->line.size, 0, 1, &gen->rng);
+    }
+}
+
+
+int targets_next(TargetGen *gen, in_addr_t *addr)
+{
+    uint64_t index;
+    
+    if (perm_next(&gen->perm, &index) == 0) {
+        *addr = range_address(gen, index);
+        return 0;
+    }
+    
+    if (!gen->file)
+        return -1;
+    
+    /* File targets are sharded by their position in the file */
+    while (next_file_address(gen, addr) == 0) {
+        if (gen->file_index++ % gen->shards == (uint64_t)gen->shard)
+            return 0;
+    }
+    return -1;
+}
+
+
+uint64_t targets_total(const TargetGen *gen)
+{
+    return gen->total;
+}
+
+
+int targets_save(const TargetGen *gen, TargetState *state)
+{
+    memset(state, 0, sizeof(*state));
+    if (gen->file == stdin)
+        return -1;
+    
+    long offset = gen->file ? ftell(gen->file) : 0;
+    if (offset < 0)
+        return -1;
+    
+    state->x = gen->perm.x;
+    state->left = gen->perm.left;
+    state->file_offset = (uint64_t)offset;
+    state->file_index = gen->file_index;
+    state->rng = gen->rng;
+    state->line_base = gen->line.base;
+    state->line_size = gen->line.size;
+    state->line_prime = gen->line_perm.prime;
+    state->line_step = gen->line_perm.step;
+    state->line_x = gen->line_perm.x;
+    state->line_left = gen->line_perm.left;
+    return 0;
+}
+
+
+int targets_restore(TargetGen *gen, const TargetState *state)
+{
+    if (gen->file == stdin)
+        return -1;
+    if (gen->file && fseek(gen->file, (long)state->file_offset, SEEK_SET) < 0)
+        return -1;
+    
+    /* The range walk's prime and step come from the seed, as before */
+    gen->perm.x = state->x;
+    gen->perm.left = state->left;
+    gen->file_index = state->file_index;
+    gen->rng = state->rng;
+    
+    gen->line.base = state->line_base;
+    gen->line.size = state->line_size;
+    gen->line.first = 0;
+    gen->line_perm.n = state->line_size;
+    gen->line_perm.prime = state->line_prime;
+    gen->line_perm.step = state->line_step;
+    gen->line_perm.x = state->line_x;
+    gen->line_perm.left = state->line_left;
+    return 0;
+}
+
+
+void targets_close(TargetGen *gen)
+{
+    if (!gen) return;
+    
+    if (gen->file && gen->file != stdin)
+        fclose(gen->file);
+    free(gen->ranges);
+    free(gen);
+}
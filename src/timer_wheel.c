@@ -0,0 +1,177 @@
+/*
+ * timer_wheel.c - Hierarchical timing wheel
+ * 
+ * A timer due in d ms goes on the lowest level whose span covers d,
+ * in the bucket for its expiry time at that level. Level 0 buckets
+ * hold the timers of exactly one millisecond, so emptying one is
+ * expiring all of them at once.
+ */
+
+#include <stddef.h>
+
+#include "../include/timer_wheel.h"
+
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+
+
+void wheel_init(TimerWheel *w, uint64_t now)
+{
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        w->occupied[l] = 0;
+        for (int s = 0; s < WHEEL_SLOTS; s++)
+            w->buckets[l][s] = NULL;
+    }
+    w->now = now;
+    w->pending = 0;
+}
+
+
+/* Put a timer in the bucket its expiry time belongs to */
+static void place(TimerWheel *w, Timer *t)
+{
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+    
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+        level++;
+    
+    /* Too far out for the top level: park it at the far end */
+    if (delta >= (1ULL << (WHEEL_BITS * WHEEL_LEVELS)))
+        t->expires = w->now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    
+    int slot = (t->expires >> (WHEEL_BITS * level)) & SLOT_MASK;
+    Timer **head = &w->buckets[level][slot];
+    
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+    w->occupied[level] |= 1ULL << slot;
+}
+
+
+/* Unlink a timer; clears the bucket's bit if it was the last one */
+static void unlink_timer(TimerWheel *w, Timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    
+    /* An emptied bucket: find it from the pointer and clear its bit */
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        Timer **first = &w->buckets[l][0];
+        if (t->pprev >= first && t->pprev < first + WHEEL_SLOTS) {
+            if (!*t->pprev)
+                w->occupied[l] &= ~(1ULL << (t->pprev - first));
+            break;
+        }
+    }
+    
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+
+void wheel_add(TimerWheel *w, Timer *t, uint64_t expires)
+{
+    if (t->pprev)
+        wheel_cancel(w, t);
+    
+    t->expires = expires > w->now ? expires : w->now + 1;
+    place(w, t);
+    w->pending++;
+}
+
+
+void wheel_cancel(TimerWheel *w, Timer *t)
+{
+    if (!t->pprev)
+        return;
+    unlink_timer(w, t);
+    w->pending--;
+}
+
+
+/* Take a whole bucket and spread its timers over the levels below */
+static void cascade(TimerWheel *w, int level, int slot)
+{
+    Timer *t = w->buckets[level][slot];
+    w->buckets[level][slot] = NULL;
+    w->occupied[level] &= ~(1ULL << slot);
+    
+    while (t) {
+        Timer *next = t->next;
+        place(w, t);
+        t = next;
+    }
+}
+
+
+/* The tick after 'now' where something can happen on level 0 */
+static uint64_t next_event(const TimerWheel *w)
+{
+    uint64_t wrap = (w->now | SLOT_MASK) + 1;
+    
+    /* Buckets of level 0 after the current tick, up to the wrap */
+    int from = (w->now & SLOT_MASK) + 1;
+    uint64_t ahead = from < WHEEL_SLOTS ? w->occupied[0] >> from << from : 0;
+    
+    if (ahead)
+        return (w->now & ~(uint64_t)SLOT_MASK) + __builtin_ctzll(ahead);
+    return wrap;
+}
+
+
+Timer *wheel_expire(TimerWheel *w, uint64_t now)
+{
+    Timer *expired = NULL;
+    
+    while (w->now < now) {
+        uint64_t tick = next_event(w);
+        if (tick > now) {
+            w->now = now;
+            break;
+        }
+        w->now = tick;
+        
+        /* Level 0 wrapped: bring down the next bucket of each level above */
+        if ((tick & SLOT_MASK) == 0) {
+            for (int l = 1; l < WHEEL_LEVELS; l++) {
+                int slot = (tick >> (WHEEL_BITS * l)) & SLOT_MASK;
+                cascade(w, l, slot);
+                if (slot != 0)
+                    break;
+            }
+        }
+        
+        /* Everything due this tick, in one go */
+        int slot = tick & SLOT_MASK;
+        Timer *t = w->buckets[0][slot];
+        if (!t)
+            continue;
+        
+        w->buckets[0][slot] = NULL;
+        w->occupied[0] &= ~(1ULL << slot);
+        
+        Timer *last = t;
+        for (Timer *p = t; p; p = p->next) {
+            p->pprev = NULL;
+            w->pending--;
+            last = p;
+        }
+        last->next = expired;
+        expired = t;
+    }
+    
+    return expired;
+}
+
+
+long wheel_next(const TimerWheel *w)
+{
+    if (w->pending == 0)
+        return -1;
+    
+    /* Level 0 knows exactly; anything higher comes down at the wrap */
+    return (long)(next_event(w) - w->now);
+}
@@ -0,0 +1,330 @@
+/*
+ * triage.c - Load, save and walk the SYN-ACK decision tree
+ * 
+ * The tree itself is built by osfp_tree (src/build_tree.c). The file
+ * is a header followed by flat tables, so loading it is a read() and
+ * a few checks; nothing in it depends on the database being loaded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "../include/triage.h"
+#include "../include/matcher.h"
+#include "../include/utils.h"
+
+
+#define TRIAGE_VERSION 1
+
+
+/* Where each table starts in the file */
+typedef struct {
+    size_t nodes, leaves, cands, patterns, name_os, names, size;
+} TreeLayout;
+
+static void tree_layout(const TriageHeader *h, TreeLayout *l)
+{
+    size_t off = sizeof(TriageHeader);
+    
+    l->nodes = off;    off += ALIGN8((size_t)h->node_count * sizeof(TriageNode));
+    l->leaves = off;   off += ALIGN8((size_t)h->leaf_count * sizeof(TriageLeaf));
+    l->cands = off;    off += ALIGN8((size_t)h->cand_count * sizeof(TriageCand));
+    l->patterns = off; off += ALIGN8((size_t)h->pattern_count * 32);
+    l->name_os = off;  off += ALIGN8(h->name_count);
+    l->names = off;    off += ALIGN8(h->names_size);
+    l->size = off;
+}
+
+
+static char *tree_path(const char *db_path)
+{
+    size_t len = strlen(db_path) + sizeof(TRIAGE_SUFFIX);
+    char *path = malloc(len);
+    if (path)
+        snprintf(path, len, "%s%s", db_path, TRIAGE_SUFFIX);
+    return path;
+}
+
+
+void triage_free(TriageTree *tree)
+{
+    if (!tree) return;
+    free(tree->nodes);
+    free(tree->leaves);
+    free(tree->cands);
+    free(tree->patterns);
+    free(tree->names);
+    free(tree->name_os);
+    free(tree->name_data);
+    free(tree);
+}
+
+
+/* Copy one table out of the file */
+static void *copy_table(const char *data, size_t off, size_t len)
+{
+    void *p = malloc(len ? len : 1);
+    if (p) memcpy(p, data + off, len);
+    return p;
+}
+
+
+/*
+ * Every child, leaf and candidate has to point inside its table,
+ * and the names have to be NUL-terminated, or a damaged file could
+ * send classification anywhere.
+ */
+static int check_tree(const TriageTree *t)
+{
+    if (t->node_count == 0)
+        return -1;
+    
+    for (int i = 0; i < t->node_count; i++) {
+        const TriageNode *n = &t->nodes[i];
+        if (n->feature == TRIAGE_LEAF) {
+            if (n->value < 0 || n->value >= t->leaf_count) return -1;
+        } else if (n->feature >= TRIAGE_FEATURES ||
+                   n->yes >= (uint32_t)t->node_count || n->no >= (uint32_t)t->node_count ||
+                   n->yes <= (uint32_t)i || n->no <= (uint32_t)i) {
+            /* Children come after their parent, so there are no loops */
+            return -1;
+        }
+    }
+    
+    for (int i = 0; i < t->leaf_count; i++) {
+        const TriageLeaf *l = &t->leaves[i];
+        if (l->os >= OS_TYPES || l->count > TRIAGE_SHORTLIST ||
+            l->first + l->count > (uint32_t)t->cand_count)
+            return -1;
+    }
+    
+    for (int i = 0; i < t->cand_count; i++) {
+        if (t->cands[i].name >= (uint32_t)t->name_count) return -1;
+    }
+    
+    for (int i = 0; i < t->pattern_count; i++) {
+        if (!memchr(t->patterns[i], '\0', 32)) return -1;
+    }
+    
+    if (t->name_count > 0 && (t->names_size == 0 || t->name_data[t->names_size - 1] != '\0'))
+        return -1;
+    return 0;
+}
+
+
+/* Point the name table into the block of names */
+static int index_names(TriageTree *t)
+{
+    size_t n = t->name_count > 0 ? (size_t)t->name_count : 1;
+    t->names = malloc(sizeof(char *) * n);
+    if (!t->names) return -1;
+    
+    char *p = t->name_data, *end = t->name_data + t->names_size;
+    for (int i = 0; i < t->name_count; i++) {
+        if (p >= end) return -1;
+        t->names[i] = p;
+        p += strlen(p) + 1;
+    }
+    return 0;
+}
+
+
+TriageTree *triage_load(const char *db_path)
+{
+    char *path = tree_path(db_path);
+    if (!path) return NULL;
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: No decision tree at %s (build it with osfp_tree %s).\n",
+               path, db_path);
+        free(path);
+        return NULL;
+    }
+    
+    struct stat st;
+    st.st_size = 0;
+    char *data = NULL;
+    ssize_t got = -1;
+    
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(TriageHeader) &&
+        (data = malloc(st.st_size)) != NULL)
+        got = read(fd, data, st.st_size);
+    close(fd);
+    
+    TriageHeader h;
+    TreeLayout l;
+    TriageTree *t = NULL;
+    
+    if (got == st.st_size) {
+        memcpy(&h, data, sizeof(h));
+        if (memcmp(h.magic, TRIAGE_MAGIC, 8) == 0 && h.version == TRIAGE_VERSION &&
+            h.pattern_count <= TRIAGE_PATTERNS) {
+            tree_layout(&h, &l);
+            if (l.size == (size_t)st.st_size)
+                t = calloc(1, sizeof(TriageTree));
+        }
+    }
+    
+    if (t) {
+        t->node_count = h.node_count;
+        t->leaf_count = h.leaf_count;
+        t->cand_count = h.cand_count;
+        t->pattern_count = h.pattern_count;
+        t->name_count = h.name_count;
+        t->names_size = h.names_size;
+        t->db_size = h.db_size;
+        t->db_mtime = h.db_mtime;
+        
+        t->nodes = copy_table(data, l.nodes, h.node_count * sizeof(TriageNode));
+        t->leaves = copy_table(data, l.leaves, h.leaf_count * sizeof(TriageLeaf));
+        t->cands = copy_table(data, l.cands, h.cand_count * sizeof(TriageCand));
+        t->patterns = copy_table(data, l.patterns, (size_t)h.pattern_count * 32);
+        t->name_os = copy_table(data, l.name_os, h.name_count);
+        t->name_data = copy_table(data, l.names, h.names_size);
+        
+        if (!t->nodes || !t->leaves || !t->cands || !t->patterns || !t->name_os ||
+            !t->name_data || check_tree(t) < 0 || index_names(t) < 0) {
+            triage_free(t);
+            t = NULL;
+        }
+    }
+    free(data);
+    
+    if (!t) {
+        printf("Error: %s is not a decision tree this version can read.\n", path);
+        free(path);
+        return NULL;
+    }
+    
+    /* Built from a different database? It still works, but may be off */
+    if (stat(db_path, &st) == 0 &&
+        ((uint64_t)st.st_size != t->db_size || (int64_t)st.st_mtime != t->db_mtime))
+        printf("Warning: %s has changed since %s was built; run osfp_tree again.\n",
+               db_path, path);
+    
+    free(path);
+    return t;
+}
+
+
+/*
+ * The file is written under a temporary name and renamed over the
+ * old one, so a scan starting meanwhile sees the old tree or the
+ * new one, never half of one.
+ */
+int triage_save(const TriageTree *t, const char *db_path)
+{
+    TriageHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRIAGE_MAGIC, 8);
+    h.version = TRIAGE_VERSION;
+    h.node_count = t->node_count;
+    h.leaf_count = t->leaf_count;
+    h.cand_count = t->cand_count;
+    h.pattern_count = t->pattern_count;
+    h.name_count = t->name_count;
+    h.names_size = t->names_size;
+    h.db_size = t->db_size;
+    h.db_mtime = t->db_mtime;
+    
+    TreeLayout l;
+    tree_layout(&h, &l);
+    
+    char *data = calloc(1, l.size);
+    char *path = tree_path(db_path);
+    char *tmp = path ? malloc(strlen(path) + 5) : NULL;
+    
+    if (!data || !tmp) {
+        printf("Error: Out of memory.\n");
+        free(data);
+        free(path);
+        return -1;
+    }
+    
+    memcpy(data, &h, sizeof(h));
+    memcpy(data + l.nodes, t->nodes, h.node_count * sizeof(TriageNode));
+    memcpy(data + l.leaves, t->leaves, h.leaf_count * sizeof(TriageLeaf));
+    memcpy(data + l.cands, t->cands, h.cand_count * sizeof(TriageCand));
+    memcpy(data + l.patterns, t->patterns, (size_t)h.pattern_count * 32);
+    memcpy(data + l.name_os, t->name_os, h.name_count);
+    memcpy(data + l.names, t->name_data, h.names_size);
+    
+    sprintf(tmp, "%s.tmp", path);
+    int rc = -1;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    
+    if (fd >= 0) {
+        rc = write_all(fd, data, l.size);
+        if (close(fd) < 0) rc = -1;
+        if (rc == 0) rc = rename(tmp, path);
+        if (rc < 0) unlink(tmp);
+    }
+    if (rc < 0)
+        perror(path);
+    
+    free(tmp);
+    free(path);
+    free(data);
+    return rc;
+}
+
+
+void triage_features(const TriageTree *t, const ScanResult *scan, int *f)
+{
+    const char *pattern = "";
+    
+    f[TRIAGE_MSS] = 0;
+    f[TRIAGE_WSCALE] = -1;
+    
+    /* Options the scorer ignores aren't tested either */
+    if (scan_has_options(scan)) {
+        pattern = scan->opts.pattern;
+        f[TRIAGE_MSS] = scan->opts.mss;
+        f[TRIAGE_WSCALE] = scan->opts.window_scale;
+    }
+    
+    f[TRIAGE_PATTERN] = -1;
+    for (int i = 0; i < t->pattern_count; i++) {
+        if (strcmp(t->patterns[i], pattern) == 0) {
+            f[TRIAGE_PATTERN] = i;
+            break;
+        }
+    }
+    
+    f[TRIAGE_TTL] = scan->ttl;
+    f[TRIAGE_WINDOW] = scan->window;
+    f[TRIAGE_DF] = scan->df_flag == 'Y';
+}
+
+
+void triage_classify(const TriageTree *t, const ScanResult *scan, TriageResult *out)
+{
+    int f[TRIAGE_FEATURES];
+    triage_features(t, scan, f);
+    
+    const TriageNode *n = &t->nodes[0];
+    out->comparisons = 0;
+    
+    while (n->feature != TRIAGE_LEAF) {
+        int v = f[n->feature];
+        int yes = n->feature == TRIAGE_PATTERN ? v == n->value : v <= n->value;
+        n = &t->nodes[yes ? n->yes : n->no];
+        out->comparisons++;
+    }
+    
+    const TriageLeaf *leaf = &t->leaves[n->value];
+    out->os = leaf->os;
+    out->count = leaf->count;
+    
+    for (int i = 0; i < leaf->count; i++) {
+        const TriageCand *c = &t->cands[leaf->first + i];
+        out->names[i] = t->names[c->name];
+        out->share[i] = c->share;
+    }
+}
@@ -0,0 +1,488 @@
+/*
+ * uring.c - io_uring probe engine
+ * 
+ * Same job as the raw socket engine in network.c, with fewer system
+ * calls:
+ * 
+ *   - Both sockets are registered with the ring (fixed files).
+ *   - One multishot RECVMSG stays armed for the whole scan. The
+ *     kernel picks a buffer for each packet from a buffer ring we
+ *     registered, and we hand it back once the packet is copied out.
+ *   - Queued probes go out as SENDMSG SQEs in a single io_uring_enter().
+ *   - Waiting uses a TIMEOUT SQE at the absolute deadline instead of
+ *     SO_RCVTIMEO. (Linked timeouts only apply to one-shot requests,
+ *     and the receive here never completes, so the timeout stands
+ *     alone; it is only re-armed when the deadline changes.)
+ * 
+ * No liburing - the few ring operations we need are done by hand.
+ * Needs Linux 6.0 or later for multishot RECVMSG.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <linux/io_uring.h>
+
+#include "../include/defs.h"
+#include "../include/network.h"
+#include "../include/engine.h"
+
+
+#define RING_ENTRIES    64
+#define RECV_BUFFERS    32          /* Power of two */
+#define RECV_BUF_SIZE   4096
+#define CONTROL_SIZE    64
+#define BUF_GROUP       1
+
+/* Registered file indexes */
+enum { FILE_SENDER, FILE_LISTENER };
+
+/* user_data of our requests; timeouts count up from UD_TIMEOUT */
+enum { UD_RECV = 1, UD_SEND = 2, UD_REMOVE = 3, UD_TIMEOUT = 16 };
+
+
+typedef struct {
+    Engine base;
+    int ring_fd;
+    int sender;
+    int listener;
+    
+    /* Submission queue */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned to_submit;
+    
+    /* Completion queue */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    
+    void *ring_mem;
+    size_t ring_size;
+    size_t sqes_size;
+    
+    /* Receive buffers */
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+    unsigned short buf_tail;
+    struct msghdr recv_msg;     /* Template for the multishot receive */
+    int recv_armed;
+    
+    /* Pending timeout */
+    struct __kernel_timespec timeout;
+    unsigned long long timeout_id;
+    int timeout_armed;
+    
+    /* Queued sends - must stay put until submitted */
+    int queued;
+    struct sockaddr_in addr[ENGINE_QUEUE];
+    struct iovec iov[ENGINE_QUEUE];
+    struct msghdr msg[ENGINE_QUEUE];
+    char packet[ENGINE_QUEUE][128];
+} UringEngine;
+
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(UringEngine *e, unsigned submit, unsigned wait)
+{
+    e->base.stats.syscalls++;
+    return (int)syscall(__NR_io_uring_enter, e->ring_fd, submit, wait,
+                        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned n)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+
+/* A zeroed SQE at the tail of the submission queue */
+static struct io_uring_sqe *get_sqe(UringEngine *e)
+{
+    unsigned tail = *e->sq_tail;
+    if (tail - __atomic_load_n(e->sq_head, __ATOMIC_ACQUIRE) >= e->sq_entries)
+        return NULL;
+    
+    unsigned idx = tail & *e->sq_mask;
+    struct io_uring_sqe *sqe = &e->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    
+    e->sq_array[idx] = idx;
+    __atomic_store_n(e->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    e->to_submit++;
+    return sqe;
+}
+
+
+/* Give receive buffer 'bid' back to the kernel */
+static void recycle_buffer(UringEngine *e, int bid)
+{
+    struct io_uring_buf *buf = &e->buf_ring->bufs[e->buf_tail & (RECV_BUFFERS - 1)];
+    buf->addr = (unsigned long)(e->buffers + bid * RECV_BUF_SIZE);
+    buf->len = RECV_BUF_SIZE;
+    buf->bid = bid;
+    e->buf_tail++;
+    __atomic_store_n(&e->buf_ring->tail, e->buf_tail, __ATOMIC_RELEASE);
+}
+
+
+/* Queue the multishot receive */
+static int arm_recv(UringEngine *e)
+{
+    struct io_uring_sqe *sqe = get_sqe(e);
+    if (!sqe) return -1;
+    
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = FILE_LISTENER;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->addr = (unsigned long)&e->recv_msg;
+    sqe->len = 1;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = UD_RECV;
+    
+    e->recv_armed = 1;
+    return 0;
+}
+
+
+/* Queue a timeout at 'deadline', replacing the old one if it differs */
+static int arm_timeout(UringEngine *e, const struct timespec *deadline)
+{
+    if (e->timeout_armed && e->timeout.tv_sec == deadline->tv_sec &&
+        e->timeout.tv_nsec == deadline->tv_nsec)
+        return 0;
+    
+    if (e->timeout_armed) {
+        struct io_uring_sqe *sqe = get_sqe(e);
+        if (!sqe) return -1;
+        sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+        sqe->addr = e->timeout_id;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = UD_REMOVE;
+    }
+    
+    struct io_uring_sqe *sqe = get_sqe(e);
+    if (!sqe) return -1;
+    
+    e->timeout.tv_sec = deadline->tv_sec;
+    e->timeout.tv_nsec = deadline->tv_nsec;
+    e->timeout_id++;
+    
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long)&e->timeout;
+    sqe->len = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    sqe->user_data = e->timeout_id;
+    
+    e->timeout_armed = 1;
+    return 0;
+}
+
+
+/* Map the rings and register sockets and buffers */
+static int setup_ring(UringEngine *e)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    
+    e->ring_fd = sys_setup(RING_ENTRIES, &p);
+    if (e->ring_fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        printf("Error: io_uring is too old on this kernel.\n");
+        return -1;
+    }
+    
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    e->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    e->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    
+    e->ring_mem = mmap(NULL, e->ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_SQ_RING);
+    e->sqes = mmap(NULL, e->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_SQES);
+    if (e->ring_mem == MAP_FAILED || e->sqes == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    
+    char *ring = e->ring_mem;
+    e->sq_head = (unsigned *)(ring + p.sq_off.head);
+    e->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    e->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    e->sq_array = (unsigned *)(ring + p.sq_off.array);
+    e->sq_entries = p.sq_entries;
+    e->cq_head = (unsigned *)(ring + p.cq_off.head);
+    e->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    e->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    e->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    
+    int fds[2] = {e->sender, e->listener};
+    if (sys_register(e->ring_fd, IORING_REGISTER_FILES, fds, 2) < 0) {
+        perror("IORING_REGISTER_FILES");
+        return -1;
+    }
+    
+    /* The buffer ring and the buffers it points to */
+    e->buf_ring = mmap(NULL, RECV_BUFFERS * sizeof(struct io_uring_buf),
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    e->buffers = malloc(RECV_BUFFERS * RECV_BUF_SIZE);
+    if (e->buf_ring == MAP_FAILED || !e->buffers) {
+        printf("Error: Out of memory.\n");
+        return -1;
+    }
+    
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)e->buf_ring;
+    reg.ring_entries = RECV_BUFFERS;
+    reg.bgid = BUF_GROUP;
+    if (sys_register(e->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("IORING_REGISTER_PBUF_RING");
+        return -1;
+    }
+    
+    for (int i = 0; i < RECV_BUFFERS; i++)
+        recycle_buffer(e, i);
+    
+    /* Every packet lands as: header, source address, cmsgs, data */
+    e->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    e->recv_msg.msg_controllen = CONTROL_SIZE;
+    
+    /* Start receiving before anything is sent */
+    if (arm_recv(e) < 0 || sys_enter(e, e->to_submit, 0) < 0) {
+        perror("io_uring_enter");
+        return -1;
+    }
+    e->to_submit = 0;
+    e->base.stats.syscalls = 0;
+    
+    return 0;
+}
+
+
+static void uring_close(Engine *base)
+{
+    UringEngine *e = (UringEngine *)base;
+    
+    /* Closing the ring cancels whatever is still pending */
+    if (e->ring_fd >= 0) close(e->ring_fd);
+    if (e->ring_mem && e->ring_mem != MAP_FAILED) munmap(e->ring_mem, e->ring_size);
+    if (e->sqes && e->sqes != MAP_FAILED) munmap(e->sqes, e->sqes_size);
+    if (e->buf_ring && e->buf_ring != MAP_FAILED)
+        munmap(e->buf_ring, RECV_BUFFERS * sizeof(struct io_uring_buf));
+    free(e->buffers);
+    
+    if (e->sender >= 0) close(e->sender);
+    if (e->listener >= 0) close(e->listener);
+    free(e);
+}
+
+
+static Engine *uring_open(void)
+{
+    UringEngine *e = calloc(1, sizeof(UringEngine));
+    if (!e) return NULL;
+    
+    e->base.ops = &uring_engine;
+    e->ring_fd = -1;
+    e->timeout_id = UD_TIMEOUT;
+    e->listener = open_listener();
+    e->sender = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+    if (e->sender < 0) perror("socket");
+    
+    if (e->listener < 0 || e->sender < 0 || setup_ring(e) < 0) {
+        uring_close(&e->base);
+        return NULL;
+    }
+    
+    return &e->base;
+}
+
+
+static int uring_send(Engine *base, in_addr_t dst, const char *packet, int len)
+{
+    UringEngine *e = (UringEngine *)base;
+    int i = e->queued;
+    
+    if (i == ENGINE_QUEUE || len > (int)sizeof(e->packet[0]))
+        return -1;
+    
+    memcpy(e->packet[i], packet, len);
+    
+    memset(&e->addr[i], 0, sizeof(e->addr[i]));
+    e->addr[i].sin_family = AF_INET;
+    e->addr[i].sin_port = ((const struct tcphdr *)packet)->dest;
+    e->addr[i].sin_addr.s_addr = dst;
+    
+    e->iov[i].iov_base = e->packet[i];
+    e->iov[i].iov_len = len;
+    
+    memset(&e->msg[i], 0, sizeof(e->msg[i]));
+    e->msg[i].msg_name = &e->addr[i];
+    e->msg[i].msg_namelen = sizeof(e->addr[i]);
+    e->msg[i].msg_iov = &e->iov[i];
+    e->msg[i].msg_iovlen = 1;
+    
+    e->queued++;
+    return 0;
+}
+
+
+/*
+ * All queued probes in one io_uring_enter(), or more if the submission
+ * queue fills up. Probes that still get no SQE are dropped, with a zero
+ * time in sent[], and -1 is returned. If an io_uring_enter() fails, its
+ * SQEs stay in the ring for the next one and aren't counted as sent.
+ */
+static int uring_flush(Engine *base, struct timespec *sent)
+{
+    UringEngine *e = (UringEngine *)base;
+    int prepared = 0, submitted = 0;
+    
+    while (prepared < e->queued) {
+        struct io_uring_sqe *sqe = get_sqe(e);
+        if (!sqe) {
+            /* Full: submit what's in the ring and go on */
+            if (e->to_submit == 0 || sys_enter(e, e->to_submit, 0) < 0)
+                break;
+            e->to_submit = 0;
+            submitted = prepared;
+            continue;
+        }
+        
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = FILE_SENDER;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_CQE_SKIP_SUCCESS;
+        sqe->addr = (unsigned long)&e->msg[prepared];
+        sqe->len = 1;
+        sqe->user_data = UD_SEND;
+        prepared++;
+    }
+    
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (int i = 0; sent && i < e->queued; i++) {
+        sent[i] = now;
+        if (i >= prepared)
+            sent[i].tv_sec = sent[i].tv_nsec = 0;
+    }
+    
+    if (submitted < prepared && sys_enter(e, e->to_submit, 0) >= 0) {
+        e->to_submit = 0;
+        submitted = prepared;
+    }
+    e->base.stats.sent += submitted;
+    
+    int done = submitted == e->queued;
+    e->queued = 0;
+    return done ? 0 : -1;
+}
+
+
+/*
+ * Copy a received packet out of its ring buffer.
+ * The buffer holds an io_uring_recvmsg_out, then the space we asked
+ * for the address and control messages, then the packet.
+ */
+static int take_packet(UringEngine *e, const struct io_uring_cqe *cqe,
+                       char *buffer, int size, struct timespec *received)
+{
+    int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    char *buf = e->buffers + bid * RECV_BUF_SIZE;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+    
+    char *control = buf + sizeof(*out) + e->recv_msg.msg_namelen;
+    char *payload = control + e->recv_msg.msg_controllen;
+    
+    if (received) {
+        clock_gettime(CLOCK_REALTIME, received);
+        
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = out->controllen;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS)
+                memcpy(received, CMSG_DATA(cm), sizeof(*received));
+        }
+    }
+    
+    int len = out->payloadlen;
+    if (len > size) len = size;
+    memcpy(buffer, payload, len);
+    
+    recycle_buffer(e, bid);
+    return len;
+}
+
+
+static int uring_recv(Engine *base, const struct timespec *deadline, char *buffer,
+                      int size, struct timespec *received)
+{
+    UringEngine *e = (UringEngine *)base;
+    
+    while (1) {
+        unsigned head = *e->cq_head;
+        
+        /* Nothing waiting - sleep until a packet or the deadline */
+        if (head == __atomic_load_n(e->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (!e->recv_armed) arm_recv(e);
+            arm_timeout(e, deadline);
+            
+            if (sys_enter(e, e->to_submit, 1) < 0 && errno != EINTR && errno != ETIME)
+                return -1;
+            e->to_submit = 0;
+            continue;
+        }
+        
+        struct io_uring_cqe cqe = e->cqes[head & *e->cq_mask];
+        __atomic_store_n(e->cq_head, head + 1, __ATOMIC_RELEASE);
+        
+        if (cqe.user_data == UD_RECV) {
+            /* The receive stops on errors (like running out of buffers) */
+            if (!(cqe.flags & IORING_CQE_F_MORE))
+                e->recv_armed = 0;
+            if (cqe.res < 0 || !(cqe.flags & IORING_CQE_F_BUFFER))
+                continue;
+            
+            e->base.stats.received++;
+            return take_packet(e, &cqe, buffer, size, received);
+        }
+        
+        /* Our current timeout went off */
+        if (cqe.user_data == e->timeout_id && e->timeout_armed) {
+            e->timeout_armed = 0;
+            return -1;
+        }
+        
+        /* Successful sends leave no CQE, so this one failed */
+        if (cqe.user_data == UD_SEND) {
+            e->base.stats.sent--;
+            e->base.stats.send_errors++;
+        }
+        
+        /* Anything else is an old timeout, or removing one that went off */
+    }
+}
+
+
+const EngineOps uring_engine = {
+    "uring", uring_open, uring_send, uring_flush, uring_recv, uring_close
+};
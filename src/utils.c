@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -42,27 +43,30 @@ unsigned short checksum(void *data, int len)
 
 
 /*
- * Figure out our local IP address.
+ * Figure out our local IP address for a target.
  * We do this by creating a dummy connection to the target.
+ * This is the slow path; route.c answers from its cache first.
  */
-void get_local_ip(char *buffer, const char *target)
+in_addr_t get_local_addr(in_addr_t target)
 {
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        return 0;
     
     struct sockaddr_in addr = {0};
     addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = inet_addr(target);
+    addr.sin_addr.s_addr = target;
     addr.sin_port = htons(53);
     
     /* This doesn't actually send anything, just sets up routing */
     connect(sock, (struct sockaddr *)&addr, sizeof(addr));
     
-    struct sockaddr_in local;
+    struct sockaddr_in local = {0};
     socklen_t len = sizeof(local);
     getsockname(sock, (struct sockaddr *)&local, &len);
     
-    strcpy(buffer, inet_ntoa(local.sin_addr));
     close(sock);
+    return local.sin_addr.s_addr;
 }
 
 
@@ -130,6 +134,76 @@ void parse_range(const char *line, const char *key, int *min, int *max)
 }
 
 
+/*
+ * TCP flag letters in the order nmap writes them.
+ * E = ECN echo, U = URG, A = ACK, P = PSH, R = RST, S = SYN, F = FIN
+ */
+static const struct {
+    char letter;
+    int flag;
+} flag_letters[] = {
+    {'E', 0x40}, {'U', TH_URG}, {'A', TH_ACK}, {'P', TH_PUSH},
+    {'R', TH_RST}, {'S', TH_SYN}, {'F', TH_FIN},
+};
+
+#define NUM_FLAG_LETTERS (int)(sizeof(flag_letters) / sizeof(flag_letters[0]))
+
+
+/*
+ * Parse a flags string like "AR" into TH_* bits.
+ */
+int parse_flags(const char *str)
+{
+    int flags = 0;
+    
+    for (; *str; str++) {
+        for (int i = 0; i < NUM_FLAG_LETTERS; i++) {
+            if (*str == flag_letters[i].letter)
+                flags |= flag_letters[i].flag;
+        }
+    }
+    
+    return flags;
+}
+
+
+/*
+ * Write TH_* bits the way nmap does, like "AR".
+ */
+void format_flags(int flags, char *out)
+{
+    for (int i = 0; i < NUM_FLAG_LETTERS; i++) {
+        if (flags & flag_letters[i].flag)
+            *out++ = flag_letters[i].letter;
+    }
+    *out = '\0';
+}
+
+
+/*
+ * The letters nmap-os-db uses for how the echo replies treat the
+ * DF bit and the ICMP code.
+ */
+char dfi_letter(int dfi)
+{
+    switch (dfi) {
+        case DFI_N: return 'N';
+        case DFI_S: return 'S';
+        case DFI_Y: return 'Y';
+        default:    return 'O';
+    }
+}
+
+char cd_letter(int cd)
+{
+    switch (cd) {
+        case CD_Z: return 'Z';
+        case CD_S: return 'S';
+        default:   return 'O';
+    }
+}
+
+
 /*
  * Parse an nmap-style options string like "M5B4NW8ST11".
  * 
@@ -246,4 +320,21 @@ const char *os_type_name(OSType type)
         case OS_OTHER:   return "Other";
         default:         return "Unknown";
     }
+}
+
+
+int write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,869 @@
+/*
+ * xdp.c - AF_XDP probe engine
+ * 
+ * For the fastest scan boxes, where raw sockets are the limit: probes
+ * and their replies skip the kernel's IP stack.
+ * 
+ *   - One UMEM (a packet buffer area shared with the kernel) holds
+ *     every frame. Half of it is lent to the kernel for receiving, on
+ *     the fill ring; the other half is ours for sending, and frames
+ *     come back on the completion ring once they're on the wire.
+ *   - A small XDP program, assembled here by hand, redirects a TCP
+ *     packet to our socket only if it comes from the address we're
+ *     probing from one of our source ports. It reads which ports those
+ *     are from an array we share with it by mmap(), so sending a probe
+ *     costs no extra system call. Everything else goes on to the kernel.
+ *   - We write the Ethernet and IP headers ourselves, with the next
+ *     hop's MAC address from the kernel's neighbour table.
+ * 
+ * The socket is set up on the first flush, once we know where the
+ * probes go: the route for the first destination gives the interface
+ * and next hop, used for everything after. "xdp" tries native XDP and
+ * zero-copy first and falls back to generic (SKB) mode and copying;
+ * "xdp-generic" goes straight to the fallback, which works on any
+ * interface, a veth pair for instance.
+ * 
+ * Only queue 0 is bound. On a NIC with several receive queues, use one
+ * (ethtool -L <dev> combined 1) or steer the replies to queue 0 with a
+ * flow rule (ethtool -N); replies on other queues go to the kernel and
+ * are missed.
+ * 
+ * The kernel never sees the SYN-ACKs, so it doesn't answer them with
+ * resets either. Receive times are taken when we pick a packet up, not
+ * by the kernel.
+ * 
+ * No libbpf or libxdp. Needs Linux 5.9 or later (XDP links).
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <linux/if_ether.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "../include/defs.h"
+#include "../include/engine.h"
+#include "../include/route.h"
+#include "../include/utils.h"
+
+
+#define FRAME_SIZE      2048
+#define FRAMES          1024
+#define RX_FRAMES       512         /* The rest are for sending */
+#define TX_FRAMES       (FRAMES - RX_FRAMES)
+#define RING_SIZE       512         /* Entries in each ring; power of two */
+#define RING_MASK       (RING_SIZE - 1)
+#define PORTS           65536
+#define XDP_QUEUE       0
+#define NEIGH_WAIT_MS   1000        /* For the next hop's MAC address */
+#define VERIFIER_LOG    16384       /* Bytes of verifier output shown */
+
+
+/* A ports array element; the kernel lays array values out 8 bytes apart */
+typedef struct {
+    in_addr_t addr;             /* The address probed from this port, 0 if none */
+    uint32_t unused;
+} PortSlot;
+
+/* One of the four rings shared with the kernel */
+typedef struct {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;                /* uint64_t addresses or struct xdp_desc */
+    void *map;
+    size_t map_size;
+} XskRing;
+
+typedef struct {
+    Engine base;
+    int generic;                /* Only try generic XDP and copying */
+    int xsk;
+    char *umem;
+    XskRing fill, comp, rx, tx;
+    uint64_t free_frames[TX_FRAMES];    /* Send frames not in flight */
+    int free_count;
+    
+    int ports_map;
+    int xsks_map;
+    int prog;
+    int link;
+    PortSlot *ports;            /* By our source port */
+    
+    int bound;                  /* 1 once set up on an interface, -1 if that failed */
+    int ifindex;
+    unsigned char src_mac[ETH_ALEN];
+    unsigned char dst_mac[ETH_ALEN];
+    in_addr_t src;
+    uint16_t ip_id;
+    
+    int queued;
+    in_addr_t dst[ENGINE_QUEUE];
+    int len[ENGINE_QUEUE];
+    char packet[ENGINE_QUEUE][128];
+} XdpEngine;
+
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+
+/*
+ * The XDP program
+ */
+
+#define INSN(c, d, s, o, i) \
+    ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+#define MOV_REG(d, s)       INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV_IMM(d, i)       INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD_REG(d, s)       INSN(BPF_ALU64 | BPF_ADD | BPF_X, d, s, 0, 0)
+#define ADD_IMM(d, i)       INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define AND_IMM(d, i)       INSN(BPF_ALU64 | BPF_AND | BPF_K, d, 0, 0, i)
+#define LSH_IMM(d, i)       INSN(BPF_ALU64 | BPF_LSH | BPF_K, d, 0, 0, i)
+#define TO_HOST16(d)        INSN(BPF_ALU | BPF_END | BPF_TO_BE, d, 0, 0, 16)
+#define LOAD(size, d, s, o) INSN(BPF_LDX | BPF_MEM | (size), d, s, o, 0)
+#define STORE(size, d, s, o) INSN(BPF_STX | BPF_MEM | (size), d, s, o, 0)
+#define LOAD_MAP(d, fd)     INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), \
+                            INSN(0, 0, 0, 0, 0)
+#define CALL(f)             INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()              INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/* Every conditional jump goes to "pass", the last two instructions */
+#define PASS_IF(op, d, s)   INSN(BPF_JMP | (op) | BPF_X, d, s, 0, 0)
+#define PASS_IF_IMM(op, d, i) INSN(BPF_JMP | (op) | BPF_K, d, 0, 0, i)
+
+
+static int load_program(XdpEngine *e)
+{
+    struct bpf_insn prog[] = {
+        MOV_REG(6, 1),                                      /* r6 = ctx */
+        LOAD(BPF_W, 2, 6, offsetof(struct xdp_md, data)),
+        LOAD(BPF_W, 3, 6, offsetof(struct xdp_md, data_end)),
+        
+        /* Ethernet and a minimal IP header */
+        MOV_REG(4, 2),
+        ADD_IMM(4, ETH_HLEN + 20),
+        PASS_IF(BPF_JGT, 4, 3),
+        LOAD(BPF_H, 5, 2, offsetof(struct ethhdr, h_proto)),
+        PASS_IF_IMM(BPF_JNE, 5, htons(ETH_P_IP)),
+        LOAD(BPF_B, 5, 2, ETH_HLEN + offsetof(struct iphdr, protocol)),
+        PASS_IF_IMM(BPF_JNE, 5, IPPROTO_TCP),
+        LOAD(BPF_W, 7, 2, ETH_HLEN + offsetof(struct iphdr, saddr)),  /* r7 = saddr */
+        
+        /* Skip the IP header and its options, then read the destination port */
+        LOAD(BPF_B, 5, 2, ETH_HLEN),
+        AND_IMM(5, 0x0f),
+        LSH_IMM(5, 2),
+        PASS_IF_IMM(BPF_JLT, 5, 20),
+        ADD_REG(2, 5),
+        ADD_IMM(2, ETH_HLEN),
+        MOV_REG(4, 2),
+        ADD_IMM(4, 4),
+        PASS_IF(BPF_JGT, 4, 3),
+        LOAD(BPF_H, 5, 2, offsetof(struct tcphdr, dest)),
+        TO_HOST16(5),
+        
+        /* Is it a port of ours, and from the address it probed? */
+        STORE(BPF_W, 10, 5, -4),
+        LOAD_MAP(1, e->ports_map),
+        MOV_REG(2, 10),
+        ADD_IMM(2, -4),
+        CALL(BPF_FUNC_map_lookup_elem),
+        PASS_IF_IMM(BPF_JEQ, 0, 0),
+        LOAD(BPF_W, 1, 0, offsetof(PortSlot, addr)),
+        PASS_IF(BPF_JNE, 1, 7),
+        
+        /* To our socket; if none is bound on this queue, to the kernel */
+        LOAD_MAP(1, e->xsks_map),
+        LOAD(BPF_W, 2, 6, offsetof(struct xdp_md, rx_queue_index)),
+        MOV_IMM(3, XDP_PASS),
+        CALL(BPF_FUNC_redirect_map),
+        EXIT(),
+        
+        /* pass: */
+        MOV_IMM(0, XDP_PASS),
+        EXIT(),
+    };
+    int count = sizeof(prog) / sizeof(prog[0]);
+    
+    for (int i = 0; i < count; i++) {
+        int op = BPF_OP(prog[i].code);
+        if (BPF_CLASS(prog[i].code) == BPF_JMP && op != BPF_CALL && op != BPF_EXIT)
+            prog[i].off = count - 2 - (i + 1);
+    }
+    
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t)(unsigned long)prog;
+    attr.insn_cnt = count;
+    attr.license = (uint64_t)(unsigned long)"GPL";
+    
+    e->prog = sys_bpf(BPF_PROG_LOAD, &attr);
+    if (e->prog >= 0)
+        return 0;
+    perror("BPF_PROG_LOAD");
+    
+    /* Load it again to get the verifier's reasons */
+    char *log = calloc(1, VERIFIER_LOG);
+    if (!log) return -1;
+    attr.log_buf = (uint64_t)(unsigned long)log;
+    attr.log_size = VERIFIER_LOG;
+    attr.log_level = 1;
+    if (sys_bpf(BPF_PROG_LOAD, &attr) < 0 && log[0])
+        printf("%s", log);
+    free(log);
+    return -1;
+}
+
+
+static int create_map(int type, int value_size, int entries, int flags)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = 4;
+    attr.value_size = value_size;
+    attr.max_entries = entries;
+    attr.map_flags = flags;
+    return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+
+static int setup_maps(XdpEngine *e)
+{
+    e->xsks_map = create_map(BPF_MAP_TYPE_XSKMAP, sizeof(int), XDP_QUEUE + 1, 0);
+    e->ports_map = create_map(BPF_MAP_TYPE_ARRAY, sizeof(PortSlot), PORTS, BPF_F_MMAPABLE);
+    if (e->xsks_map < 0 || e->ports_map < 0) {
+        perror("BPF_MAP_CREATE");
+        return -1;
+    }
+    
+    e->ports = mmap(NULL, PORTS * sizeof(PortSlot), PROT_READ | PROT_WRITE, MAP_SHARED,
+                    e->ports_map, 0);
+    if (e->ports == MAP_FAILED) {
+        e->ports = NULL;
+        perror("mmap");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * The socket and its rings
+ */
+
+static int map_ring(XdpEngine *e, XskRing *r, const struct xdp_ring_offset *off,
+                    size_t desc_size, off_t pgoff)
+{
+    r->map_size = off->desc + RING_SIZE * desc_size;
+    r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  e->xsk, pgoff);
+    if (r->map == MAP_FAILED) {
+        r->map = NULL;
+        perror("mmap");
+        return -1;
+    }
+    
+    r->producer = (uint32_t *)((char *)r->map + off->producer);
+    r->consumer = (uint32_t *)((char *)r->map + off->consumer);
+    r->flags = (uint32_t *)((char *)r->map + off->flags);
+    r->descs = (char *)r->map + off->desc;
+    return 0;
+}
+
+
+static void close_socket(XdpEngine *e)
+{
+    XskRing *rings[] = {&e->fill, &e->comp, &e->rx, &e->tx};
+    for (int i = 0; i < 4; i++) {
+        if (rings[i]->map) munmap(rings[i]->map, rings[i]->map_size);
+        rings[i]->map = NULL;
+    }
+    if (e->xsk >= 0) close(e->xsk);
+    if (e->umem) munmap(e->umem, (size_t)FRAMES * FRAME_SIZE);
+    e->xsk = -1;
+    e->umem = NULL;
+}
+
+
+static int setup_socket(XdpEngine *e)
+{
+    e->xsk = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (e->xsk < 0) {
+        perror("socket(AF_XDP)");
+        return -1;
+    }
+    
+    e->umem = mmap(NULL, (size_t)FRAMES * FRAME_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (e->umem == MAP_FAILED) {
+        e->umem = NULL;
+        perror("mmap");
+        return -1;
+    }
+    
+    struct xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uint64_t)(unsigned long)e->umem;
+    reg.len = (uint64_t)FRAMES * FRAME_SIZE;
+    reg.chunk_size = FRAME_SIZE;
+    
+    int size = RING_SIZE;
+    if (setsockopt(e->xsk, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(e->xsk, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(e->xsk, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(e->xsk, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) < 0 ||
+        setsockopt(e->xsk, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) < 0) {
+        perror("setsockopt(SOL_XDP)");
+        return -1;
+    }
+    
+    struct xdp_mmap_offsets off;
+    socklen_t len = sizeof(off);
+    if (getsockopt(e->xsk, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) < 0) {
+        perror("XDP_MMAP_OFFSETS");
+        return -1;
+    }
+    
+    if (map_ring(e, &e->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+        map_ring(e, &e->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0 ||
+        map_ring(e, &e->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0 ||
+        map_ring(e, &e->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0)
+        return -1;
+    
+    /* The first frames receive, the rest send */
+    uint64_t *fill = e->fill.descs;
+    for (int i = 0; i < RX_FRAMES; i++)
+        fill[i & RING_MASK] = (uint64_t)i * FRAME_SIZE;
+    __atomic_store_n(e->fill.producer, RX_FRAMES, __ATOMIC_RELEASE);
+    
+    for (int i = 0; i < TX_FRAMES; i++)
+        e->free_frames[i] = (uint64_t)(RX_FRAMES + i) * FRAME_SIZE;
+    e->free_count = TX_FRAMES;
+    return 0;
+}
+
+
+/*
+ * Where the probes go: interface, addresses and next hop
+ */
+
+/* Send a request and feed every reply to 'handle'. Returns 0, or -1 with errno set. */
+static int nl_request(struct nlmsghdr *req, void (*handle)(struct nlmsghdr *, void *),
+                      void *arg)
+{
+    int sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock < 0)
+        return -1;
+    
+    struct sockaddr_nl kernel = {0};
+    kernel.nl_family = AF_NETLINK;
+    req->nlmsg_seq = 1;
+    
+    if (sendto(sock, req, req->nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0) {
+        close(sock);
+        return -1;
+    }
+    
+    long buf[4096];
+    int result = -1, done = 0;
+    while (!done) {
+        int len = recv(sock, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        
+        for (struct nlmsghdr *nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (unsigned)len);
+             nh = NLMSG_NEXT(nh, len)) {
+            if (nh->nlmsg_type == NLMSG_DONE) {
+                result = 0;
+                done = 1;
+                break;
+            }
+            if (nh->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr *err = NLMSG_DATA(nh);
+                errno = -err->error;
+                result = err->error ? -1 : 0;
+                done = 1;
+                break;
+            }
+            handle(nh, arg);
+            
+            /* A plain request has one reply; a dump ends with NLMSG_DONE */
+            if (!(nh->nlmsg_flags & NLM_F_MULTI)) {
+                result = 0;
+                done = 1;
+            }
+        }
+    }
+    
+    close(sock);
+    return result;
+}
+
+
+static void add_attr(struct nlmsghdr *nh, int type, const void *data, int len)
+{
+    struct rtattr *rta = (struct rtattr *)((char *)nh + NLMSG_ALIGN(nh->nlmsg_len));
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+
+typedef struct {
+    int found;
+    int type;
+    int ifindex;
+    in_addr_t gateway;
+} RouteReply;
+
+static void handle_route(struct nlmsghdr *nh, void *arg)
+{
+    RouteReply *r = arg;
+    if (nh->nlmsg_type != RTM_NEWROUTE)
+        return;
+    
+    struct rtmsg *rt = NLMSG_DATA(nh);
+    int len = RTM_PAYLOAD(nh);
+    r->found = 1;
+    r->type = rt->rtm_type;
+    
+    for (struct rtattr *rta = RTM_RTA(rt); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == RTA_OIF)
+            memcpy(&r->ifindex, RTA_DATA(rta), sizeof(int));
+        else if (rta->rta_type == RTA_GATEWAY)
+            memcpy(&r->gateway, RTA_DATA(rta), sizeof(in_addr_t));
+    }
+}
+
+
+typedef struct {
+    int ifindex;
+    in_addr_t addr;
+    int found;
+    unsigned char mac[ETH_ALEN];
+} NeighReply;
+
+static void handle_neigh(struct nlmsghdr *nh, void *arg)
+{
+    NeighReply *n = arg;
+    if (nh->nlmsg_type != RTM_NEWNEIGH)
+        return;
+    
+    struct ndmsg *nd = NLMSG_DATA(nh);
+    int len = RTM_PAYLOAD(nh);
+    if (nd->ndm_ifindex != n->ifindex ||
+        !(nd->ndm_state & (NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE | NUD_PERMANENT)))
+        return;
+    
+    in_addr_t addr = 0;
+    const unsigned char *mac = NULL;
+    for (struct rtattr *rta = RTM_RTA(nd); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == NDA_DST && RTA_PAYLOAD(rta) == sizeof(in_addr_t))
+            memcpy(&addr, RTA_DATA(rta), sizeof(addr));
+        else if (rta->rta_type == NDA_LLADDR && RTA_PAYLOAD(rta) == ETH_ALEN)
+            mac = RTA_DATA(rta);
+    }
+    
+    if (addr == n->addr && mac) {
+        memcpy(n->mac, mac, ETH_ALEN);
+        n->found = 1;
+    }
+}
+
+
+/* The MAC address of 'hop', asking the kernel to resolve it if it hasn't */
+static int find_neighbour(int ifindex, in_addr_t hop, in_addr_t dst, unsigned char *mac)
+{
+    for (int waited = 0; waited <= NEIGH_WAIT_MS; waited += 10) {
+        struct {
+            struct nlmsghdr nh;
+            struct ndmsg nd;
+        } req;
+        memset(&req, 0, sizeof(req));
+        req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ndmsg));
+        req.nh.nlmsg_type = RTM_GETNEIGH;
+        req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+        req.nd.ndm_family = AF_INET;
+        
+        NeighReply n = { .ifindex = ifindex, .addr = hop };
+        if (nl_request(&req.nh, handle_neigh, &n) < 0)
+            return -1;
+        if (n.found) {
+            memcpy(mac, n.mac, ETH_ALEN);
+            return 0;
+        }
+        
+        /* Not known yet: an empty datagram towards dst makes the kernel ARP for it */
+        if (waited == 0) {
+            int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            struct sockaddr_in to = { .sin_family = AF_INET, .sin_port = htons(9) };
+            to.sin_addr.s_addr = dst;
+            if (sock >= 0) {
+                sendto(sock, "", 0, MSG_DONTWAIT, (struct sockaddr *)&to, sizeof(to));
+                close(sock);
+            }
+        }
+        usleep(10000);
+    }
+    
+    errno = EHOSTUNREACH;
+    return -1;
+}
+
+
+static int find_path(XdpEngine *e, in_addr_t dst)
+{
+    struct {
+        struct nlmsghdr nh;
+        struct rtmsg rt;
+        char attrs[64];
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+    req.nh.nlmsg_type = RTM_GETROUTE;
+    req.nh.nlmsg_flags = NLM_F_REQUEST;
+    req.rt.rtm_family = AF_INET;
+    req.rt.rtm_dst_len = 32;
+    add_attr(&req.nh, RTA_DST, &dst, sizeof(dst));
+    
+    RouteReply route = {0};
+    if (nl_request(&req.nh, handle_route, &route) < 0 || !route.found || !route.ifindex) {
+        printf("Error: No route to %s.\n", inet_ntoa(*(struct in_addr *)&dst));
+        return -1;
+    }
+    if (route.type != RTN_UNICAST) {
+        printf("Error: The xdp engine can only probe hosts on the network, "
+               "not %s.\n", inet_ntoa(*(struct in_addr *)&dst));
+        return -1;
+    }
+    e->ifindex = route.ifindex;
+    e->src = source_address(dst);
+    
+    /* Our own MAC address, which also says whether this is Ethernet */
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    int ok = sock >= 0 && if_indextoname(e->ifindex, ifr.ifr_name) &&
+             ioctl(sock, SIOCGIFHWADDR, &ifr) == 0;
+    if (sock >= 0) close(sock);
+    if (!ok) {
+        perror("SIOCGIFHWADDR");
+        return -1;
+    }
+    if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+        printf("Error: %s is not an Ethernet interface.\n", ifr.ifr_name);
+        return -1;
+    }
+    memcpy(e->src_mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+    
+    in_addr_t hop = route.gateway ? route.gateway : dst;
+    if (find_neighbour(e->ifindex, hop, dst, e->dst_mac) < 0) {
+        printf("Error: No MAC address for %s on %s.\n",
+               inet_ntoa(*(struct in_addr *)&hop), ifr.ifr_name);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Bind the socket to queue 0 and put the program on the interface */
+static int attach(XdpEngine *e)
+{
+    static const unsigned bind_modes[] = {XDP_ZEROCOPY, XDP_COPY};
+    static const unsigned xdp_modes[] = {XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE};
+    int ok = 0;
+    
+    for (int i = e->generic; i < 2 && !ok; i++) {
+        /* A socket whose bind failed can't be bound again; start over */
+        if (i > e->generic) {
+            close_socket(e);
+            if (setup_socket(e) < 0)
+                return -1;
+        }
+        
+        struct sockaddr_xdp addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sxdp_family = AF_XDP;
+        addr.sxdp_ifindex = e->ifindex;
+        addr.sxdp_queue_id = XDP_QUEUE;
+        addr.sxdp_flags = bind_modes[i] | XDP_USE_NEED_WAKEUP;
+        ok = bind(e->xsk, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    }
+    if (!ok) {
+        perror("bind(AF_XDP)");
+        return -1;
+    }
+    
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    uint32_t key = XDP_QUEUE, fd = e->xsk;
+    attr.map_fd = e->xsks_map;
+    attr.key = (uint64_t)(unsigned long)&key;
+    attr.value = (uint64_t)(unsigned long)&fd;
+    if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+        perror("BPF_MAP_UPDATE_ELEM");
+        return -1;
+    }
+    
+    /* A link detaches the program by itself when we close it, or exit */
+    for (int i = e->generic; i < 2 && e->link < 0; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = e->prog;
+        attr.link_create.target_ifindex = e->ifindex;
+        attr.link_create.attach_type = BPF_XDP;
+        attr.link_create.flags = xdp_modes[i];
+        e->link = sys_bpf(BPF_LINK_CREATE, &attr);
+    }
+    if (e->link < 0) {
+        perror("BPF_LINK_CREATE");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * The engine
+ */
+
+static void xdp_close(Engine *base)
+{
+    XdpEngine *e = (XdpEngine *)base;
+    
+    if (e->link >= 0) close(e->link);
+    if (e->prog >= 0) close(e->prog);
+    if (e->ports) munmap(e->ports, PORTS * sizeof(PortSlot));
+    if (e->ports_map >= 0) close(e->ports_map);
+    if (e->xsks_map >= 0) close(e->xsks_map);
+    close_socket(e);
+    free(e);
+}
+
+
+static Engine *open_engine(const EngineOps *ops, int generic)
+{
+    XdpEngine *e = calloc(1, sizeof(XdpEngine));
+    if (!e) return NULL;
+    
+    e->base.ops = ops;
+    e->generic = generic;
+    e->xsk = e->prog = e->link = e->ports_map = e->xsks_map = -1;
+    e->ip_id = rand();
+    
+    if (setup_socket(e) < 0 || setup_maps(e) < 0 || load_program(e) < 0) {
+        xdp_close(&e->base);
+        return NULL;
+    }
+    return &e->base;
+}
+
+static Engine *xdp_open(void)
+{
+    return open_engine(&xdp_engine, 0);
+}
+
+static Engine *xdp_generic_open(void)
+{
+    return open_engine(&xdp_generic_engine, 1);
+}
+
+
+static int xdp_send(Engine *base, in_addr_t dst, const char *packet, int len)
+{
+    XdpEngine *e = (XdpEngine *)base;
+    
+    if (e->queued == ENGINE_QUEUE || len > (int)sizeof(e->packet[0]))
+        return -1;
+    
+    e->dst[e->queued] = dst;
+    e->len[e->queued] = len;
+    memcpy(e->packet[e->queued], packet, len);
+    e->queued++;
+    
+    /* Let the program pass this port's replies from dst to us */
+    const struct tcphdr *tcp = (const struct tcphdr *)packet;
+    if (e->ports) e->ports[ntohs(tcp->source)].addr = dst;
+    return 0;
+}
+
+
+/* Frames the kernel has finished sending are ours again */
+static void reclaim_frames(XdpEngine *e)
+{
+    uint64_t *addrs = e->comp.descs;
+    uint32_t cons = *e->comp.consumer;
+    uint32_t prod = __atomic_load_n(e->comp.producer, __ATOMIC_ACQUIRE);
+    
+    while (cons != prod && e->free_count < TX_FRAMES)
+        e->free_frames[e->free_count++] = addrs[cons++ & RING_MASK];
+    __atomic_store_n(e->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+
+/* Ethernet and IP headers in front of a queued TCP packet; returns the frame length */
+static int build_frame(XdpEngine *e, char *frame, int i)
+{
+    struct ethhdr *eth = (struct ethhdr *)frame;
+    memcpy(eth->h_dest, e->dst_mac, ETH_ALEN);
+    memcpy(eth->h_source, e->src_mac, ETH_ALEN);
+    eth->h_proto = htons(ETH_P_IP);
+    
+    struct iphdr *ip = (struct iphdr *)(frame + ETH_HLEN);
+    memset(ip, 0, sizeof(*ip));
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->tot_len = htons(sizeof(*ip) + e->len[i]);
+    ip->id = htons(e->ip_id++);
+    ip->frag_off = htons(IP_DF);
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_TCP;
+    ip->saddr = e->src;
+    ip->daddr = e->dst[i];
+    ip->check = checksum(ip, sizeof(*ip));
+    
+    memcpy(ip + 1, e->packet[i], e->len[i]);
+    return ETH_HLEN + sizeof(*ip) + e->len[i];
+}
+
+
+static int xdp_flush(Engine *base, struct timespec *sent)
+{
+    XdpEngine *e = (XdpEngine *)base;
+    
+    if (e->queued && !e->bound)
+        e->bound = find_path(e, e->dst[0]) == 0 && attach(e) == 0 ? 1 : -1;
+    
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (int i = 0; sent && i < e->queued; i++)
+        sent[i] = now;
+    
+    if (e->bound < 0) {
+        e->queued = 0;
+        return -1;
+    }
+    
+    reclaim_frames(e);
+    
+    struct xdp_desc *descs = e->tx.descs;
+    uint32_t prod = *e->tx.producer;
+    uint32_t cons = __atomic_load_n(e->tx.consumer, __ATOMIC_ACQUIRE);
+    int count = 0;
+    
+    for (int i = 0; i < e->queued; i++) {
+        /* No free frame or ring slot: the probe is lost, like a full socket buffer */
+        if (!e->free_count || prod - cons == RING_SIZE)
+            break;
+        
+        uint64_t addr = e->free_frames[--e->free_count];
+        descs[prod & RING_MASK].addr = addr;
+        descs[prod & RING_MASK].len = build_frame(e, e->umem + addr, i);
+        descs[prod & RING_MASK].options = 0;
+        prod++;
+        count++;
+    }
+    __atomic_store_n(e->tx.producer, prod, __ATOMIC_RELEASE);
+    e->queued = 0;
+    
+    /* In copy mode, and when the driver is idle, sending needs a kick */
+    if (count && (__atomic_load_n(e->tx.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)) {
+        sendto(e->xsk, NULL, 0, MSG_DONTWAIT, NULL, 0);
+        e->base.stats.syscalls++;
+    }
+    e->base.stats.sent += count;
+    return 0;
+}
+
+
+/* Milliseconds until the deadline, rounded up; 0 once it has passed */
+static int ms_until(const struct timespec *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ns = (deadline->tv_sec - now.tv_sec) * 1000000000LL +
+                   (deadline->tv_nsec - now.tv_nsec);
+    return ns > 0 ? (int)((ns + 999999) / 1000000) : 0;
+}
+
+
+static int xdp_recv(Engine *base, const struct timespec *deadline, char *buffer,
+                    int size, struct timespec *received)
+{
+    XdpEngine *e = (XdpEngine *)base;
+    
+    if (e->bound <= 0)
+        return -1;
+    
+    while (1) {
+        uint32_t cons = *e->rx.consumer;
+        
+        /* Nothing waiting - sleep until a packet or the deadline */
+        if (cons == __atomic_load_n(e->rx.producer, __ATOMIC_ACQUIRE)) {
+            int ms = ms_until(deadline);
+            if (ms == 0)
+                return -1;
+            
+            struct pollfd p = { .fd = e->xsk, .events = POLLIN };
+            e->base.stats.syscalls++;
+            if (poll(&p, 1, ms) < 0 && errno != EINTR)
+                return -1;
+            continue;
+        }
+        
+        struct xdp_desc desc = ((struct xdp_desc *)e->rx.descs)[cons & RING_MASK];
+        __atomic_store_n(e->rx.consumer, cons + 1, __ATOMIC_RELEASE);
+        clock_gettime(CLOCK_REALTIME, received);
+        
+        int len = (int)desc.len - ETH_HLEN;
+        if (len > size) len = size;
+        if (len > 0)
+            memcpy(buffer, e->umem + desc.addr + ETH_HLEN, len);
+        
+        /* The frame goes straight back on the fill ring (addresses may point past its start) */
+        uint64_t *fill = e->fill.descs;
+        uint32_t prod = *e->fill.producer;
+        fill[prod & RING_MASK] = desc.addr & ~(uint64_t)(FRAME_SIZE - 1);
+        __atomic_store_n(e->fill.producer, prod + 1, __ATOMIC_RELEASE);
+        
+        if (len <= 0)
+            continue;
+        e->base.stats.received++;
+        return len;
+    }
+}
+
+
+const EngineOps xdp_engine = {
+    "xdp", xdp_open, xdp_send, xdp_flush, xdp_recv, xdp_close
+};
+
+const EngineOps xdp_generic_engine = {
+    "xdp-generic", xdp_generic_open, xdp_send, xdp_flush, xdp_recv, xdp_close
+};
@@ -0,0 +1,152 @@
+/*
+ * fuzz_tcp_options.c - Differential fuzzing of decode_tcp_options()
+ * 
+ * Every input is parsed by read_tcp_options() and by the old parser
+ * (old_options.c), and the values have to agree: MSS, window scale,
+ * SACK, timestamp and option order. The strings differ on purpose
+ * (timestamps are two digits now, and End of Options shows as L), so
+ * they aren't compared. Instead the bytes are decoded again into
+ * buffers of every size from 1 byte up, and each has to hold the
+ * start of the full string, terminated; ASan catches anything written
+ * past the end.
+ * 
+ * Built with -DLIBFUZZER and -fsanitize=fuzzer, this is a libFuzzer
+ * target. Otherwise main() runs random cases, mostly built from real
+ * option kinds and lengths so they get past the first few bytes:
+ * 
+ *   fuzz_tcp_options [cases] [seed]
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../include/network.h"
+#include "old_options.h"
+
+
+static void fail(const char *what, const uint8_t *data, size_t len,
+                 const char *old_str, const char *new_str)
+{
+    printf("FAIL: %s\n  options:", what);
+    for (size_t i = 0; i < len; i++)
+        printf(" %02x", data[i]);
+    printf("\n  old: %s\n  new: %s\n", old_str, new_str);
+    fflush(stdout);
+    abort();
+}
+
+
+static void check_case(const uint8_t *data, size_t len)
+{
+    if (len > 40) len = 40;
+    
+    /* A TCP header with these options, padded with zeros (End of Options) */
+    unsigned char packet[60];
+    memset(packet, 0, sizeof(packet));
+    struct tcphdr *tcp = (struct tcphdr *)packet;
+    tcp->doff = (20 + len + 3) / 4;
+    memcpy(packet + 20, data, len);
+    
+    char old_str[512], new_str[64];
+    TCPOpts old_opts, new_opts;
+    old_read_tcp_options(tcp, old_str, &old_opts);
+    read_tcp_options(tcp, new_str, sizeof(new_str), &new_opts);
+    
+    if (old_opts.mss != new_opts.mss)
+        fail("MSS", data, len, old_str, new_str);
+    if (old_opts.window_scale != new_opts.window_scale)
+        fail("window scale", data, len, old_str, new_str);
+    if (old_opts.has_sack != new_opts.has_sack)
+        fail("SACK", data, len, old_str, new_str);
+    if (old_opts.has_timestamp != new_opts.has_timestamp)
+        fail("timestamp", data, len, old_str, new_str);
+    if (strcmp(old_opts.pattern, new_opts.pattern) != 0)
+        fail("option order", data, len, old_opts.pattern, new_opts.pattern);
+    
+    /* The exact bytes (any length, not just whole words) into every buffer size */
+    TCPOptRecord rec;
+    char full[256];
+    int full_len = decode_tcp_options(data, len, &rec, full, sizeof(full));
+    if (full_len != (int)strlen(full))
+        fail("returned length", data, len, "", full);
+    
+    for (int size = 1; size <= full_len + 1; size++) {
+        char *buf = malloc(size);
+        int n = decode_tcp_options(data, len, &rec, buf, size);
+        if (n != (int)strlen(buf) || n > size - 1 || strncmp(buf, full, n) != 0 ||
+            (size == full_len + 1 && n != full_len))
+            fail("short buffer", data, len, full, buf);
+        free(buf);
+    }
+}
+
+
+#ifdef LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    check_case(data, size);
+    return 0;
+}
+
+#else
+
+static uint64_t rng_state;
+
+static uint32_t next_random(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)rng_state;
+}
+
+
+/* Up to 40 option bytes, mostly well-formed */
+static size_t random_options(uint8_t *out)
+{
+    static const uint8_t kinds[] = {0, 1, 2, 3, 4, 8, 5, 30};
+    static const uint8_t lengths[] = {1, 1, 4, 3, 2, 10, 10, 4};
+    size_t max = next_random() % 41;
+    size_t len = 0;
+    
+    while (len < max) {
+        int pick = next_random() % sizeof(kinds);
+        uint8_t kind = next_random() % 8 ? kinds[pick] : (uint8_t)next_random();
+        uint8_t opt_len = next_random() % 8 ? lengths[pick] : (uint8_t)(next_random() % 12);
+        
+        out[len++] = kind;
+        if (lengths[pick] == 1 && kind == kinds[pick])
+            continue;
+        if (len < max) out[len++] = opt_len;
+        for (int i = 2; i < opt_len && len < max; i++)
+            out[len++] = next_random() % 4 ? (uint8_t)next_random() : 0;
+    }
+    
+    /* Now and then, some damage */
+    if (len && next_random() % 4 == 0)
+        out[next_random() % len] = (uint8_t)next_random();
+    return len;
+}
+
+
+int main(int argc, char **argv)
+{
+    long cases = argc > 1 ? atol(argv[1]) : 1000000;
+    uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 0) : (uint64_t)time(NULL);
+    rng_state = seed ? seed : 1;
+    
+    uint8_t options[40];
+    for (long i = 0; i < cases; i++)
+        check_case(options, random_options(options));
+    
+    printf("%ld cases, no differences (seed %llu)\n", cases, (unsigned long long)seed);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * old_options.c - read_tcp_options() as it was before decode_tcp_options()
+ * 
+ * Unchanged except for the MSS and timestamp reads, which go through
+ * memcpy() so the sanitizers don't stop at the misaligned loads.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "old_options.h"
+
+
+void old_read_tcp_options(struct tcphdr *tcp, char *out_str, TCPOpts *opts)
+{
+    out_str[0] = '\0';
+    memset(opts, 0, sizeof(TCPOpts));
+    opts->mss = -1;
+    opts->window_scale = -1;
+    
+    /* Options start after the fixed TCP header (20 bytes) */
+    int opt_len = (tcp->doff * 4) - 20;
+    if (opt_len <= 0) return;
+    
+    unsigned char *p = (unsigned char *)tcp + 20;
+    unsigned char *end = p + opt_len;
+    char tmp[32];
+    int idx = 0;
+    
+    while (p < end) {
+        unsigned char kind = *p;
+        
+        /* End of options */
+        if (kind == 0) break;
+        
+        /* NOP - single byte padding */
+        if (kind == 1) {
+            strcat(out_str, "N");
+            if (idx < 31) opts->pattern[idx++] = 'N';
+            p++;
+            continue;
+        }
+        
+        /* All other options have a length byte */
+        if (p + 1 >= end) break;
+        int len = p[1];
+        if (len < 2 || p + len > end) break;
+        
+        uint16_t mss;
+        uint32_t ts;
+        
+        switch (kind) {
+            case 2:  /* MSS */
+                if (len >= 4) {
+                    memcpy(&mss, p + 2, sizeof(mss));
+                    opts->mss = ntohs(mss);
+                    sprintf(tmp, "M%X", opts->mss);
+                    strcat(out_str, tmp);
+                    if (idx < 31) opts->pattern[idx++] = 'M';
+                }
+                break;
+            
+            case 3:  /* Window Scale */
+                if (len >= 3) {
+                    opts->window_scale = p[2];
+                    sprintf(tmp, "W%X", opts->window_scale);
+                    strcat(out_str, tmp);
+                    if (idx < 31) opts->pattern[idx++] = 'W';
+                }
+                break;
+            
+            case 4:  /* SACK Permitted */
+                opts->has_sack = 1;
+                strcat(out_str, "S");
+                if (idx < 31) opts->pattern[idx++] = 'S';
+                break;
+            
+            case 8:  /* Timestamp */
+                opts->has_timestamp = 1;
+                if (len >= 10) {
+                    memcpy(&ts, p + 2, sizeof(ts));
+                    ts = ntohl(ts);
+                    sprintf(tmp, "T%X", ts ? 1 : 0);
+                    strcat(out_str, tmp);
+                }
+                if (idx < 31) opts->pattern[idx++] = 'T';
+                break;
+        }
+        
+        p += len;
+    }
+    
+    opts->pattern[idx] = '\0';
+}
@@ -0,0 +1,16 @@
+/*
+ * old_options.h - The strcat/sprintf option parser decode_tcp_options()
+ * replaced, kept for the fuzz and benchmark programs to compare against
+ */
+
+#ifndef OLD_OPTIONS_H
+#define OLD_OPTIONS_H
+
+#include <netinet/tcp.h>
+
+#include "../include/defs.h"
+
+/* out_str needs room for every option: 512 bytes is always enough */
+void old_read_tcp_options(struct tcphdr *tcp, char *out_str, TCPOpts *opts);
+
+#endif